@@ -0,0 +1,374 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Console output in kernel mode.
+ *
+ * F<p2v.service> sends stdout to the journal and the console, which
+ * is often a serial port running at 115200 baud or less.  Writing the
+ * output of virt-v2v there directly from the thread reading the
+ * control connection would stall that thread, and in turn the remote
+ * side, whenever the console falls behind.
+ *
+ * Instead the output is queued and written to stdout by a separate
+ * thread (see C<start_console_writer>), so C<console_write> never
+ * blocks.  When more than C<CONSOLE_BEHIND> bytes are waiting, the
+ * progress bar redraws (text overwritten after a carriage return) are
+ * dropped and only the newest status line is kept.  If the queue
+ * still grows beyond C<CONSOLE_MAX> bytes, the oldest output is
+ * discarded and a note saying how much was lost is printed in its
+ * place.  The full output is always available in the remote log
+ * directory.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+#define CONSOLE_BEHIND 4096
+#define CONSOLE_MAX    65536
+#define CONSOLE_CHUNK  4096     /* most bytes taken by the writer at once */
+
+struct entry {
+  struct entry *next;
+  int type;                     /* CONSOLE_OUTPUT or CONSOLE_STATUS */
+  size_t len;
+  char *data;
+};
+
+static pthread_mutex_t console_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t console_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t console_drained = PTHREAD_COND_INITIALIZER;
+static bool started;
+static bool writing;            /* the writer thread holds an entry */
+static struct entry *head, *tail;
+static size_t queued;           /* bytes in the queue */
+static size_t dropped;          /* bytes discarded, not yet reported */
+static size_t added;            /* bytes queued since the last collapse */
+
+static void *console_thread (void *arg);
+static void write_all (const char *data, size_t len);
+static void collapse_queue (void);
+static size_t collapse_progress (char *data, size_t len);
+static void trim_queue (void);
+
+/**
+ * Start the thread writing the console output.  Until this is called,
+ * C<console_write> writes to stdout directly.
+ */
+void
+start_console_writer (void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  int err;
+
+  /* Anything printed so far must appear before the queued output. */
+  fflush (stdout);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attr, console_thread, NULL);
+  pthread_attr_destroy (&attr);
+  if (err != 0) {
+    /* Not fatal: the output is just written synchronously. */
+#if DEBUG_STDERR
+    fprintf (stderr, "pthread_create: console writer: %s\n", strerror (err));
+#endif
+    return;
+  }
+
+  pthread_mutex_lock (&console_lock);
+  started = true;
+  pthread_mutex_unlock (&console_lock);
+
+  atexit (flush_console);
+}
+
+/**
+ * Queue C<data> for writing to the console.  C<type> is
+ * C<CONSOLE_OUTPUT> for output copied from the conversion server,
+ * which may contain progress bars, or C<CONSOLE_STATUS> for a
+ * complete status line.
+ */
+void
+console_write (int type, const char *data)
+{
+  const size_t len = strlen (data);
+  struct entry *e;
+  int err;
+
+  if (len == 0)
+    return;
+
+  pthread_mutex_lock (&console_lock);
+
+  if (!started) {
+    pthread_mutex_unlock (&console_lock);
+    fputs (data, stdout);
+    fflush (stdout);
+    return;
+  }
+
+  /* Output is appended to the previous output, so that a progress bar
+   * split across several reads can be collapsed.
+   */
+  if (type == CONSOLE_OUTPUT && tail && tail->type == CONSOLE_OUTPUT) {
+    char *p = realloc (tail->data, tail->len + len);
+    if (p == NULL)
+      goto error_realloc;
+    memcpy (p + tail->len, data, len);
+    tail->data = p;
+    tail->len += len;
+  }
+  else {
+    e = malloc (sizeof *e);
+    if (e == NULL)
+      goto error_malloc;
+    e->data = malloc (len);
+    if (e->data == NULL)
+      goto error_malloc;
+    memcpy (e->data, data, len);
+    e->len = len;
+    e->type = type;
+    e->next = NULL;
+    if (tail)
+      tail->next = e;
+    else
+      head = e;
+    tail = e;
+  }
+  queued += len;
+  added += len;
+
+  /* Collapsing scans the whole queue, so don't do it on every call. */
+  if (queued > CONSOLE_BEHIND && added >= CONSOLE_BEHIND) {
+    collapse_queue ();
+    added = 0;
+  }
+  if (queued > CONSOLE_MAX)
+    trim_queue ();
+
+  pthread_cond_signal (&console_queued);
+  pthread_mutex_unlock (&console_lock);
+  return;
+
+  /* exit(3) runs flush_console, which takes console_lock, so it must
+   * be released before calling error.
+   */
+ error_realloc:
+  err = errno;
+  pthread_mutex_unlock (&console_lock);
+  error (EXIT_FAILURE, err, "realloc");
+ error_malloc:
+  err = errno;
+  pthread_mutex_unlock (&console_lock);
+  error (EXIT_FAILURE, err, "malloc");
+}
+
+/**
+ * Wait until everything queued has been written to the console.
+ * This must be called before writing to stdout in any other way.
+ */
+void
+flush_console (void)
+{
+  pthread_mutex_lock (&console_lock);
+  while (started && (head || dropped || writing))
+    pthread_cond_wait (&console_drained, &console_lock);
+  pthread_mutex_unlock (&console_lock);
+  fflush (stdout);
+}
+
+static void *
+console_thread (void *arg)
+{
+  struct entry *e;
+  size_t len, n;
+  char buf[CONSOLE_CHUNK];
+  char note[128];
+
+  for (;;) {
+    pthread_mutex_lock (&console_lock);
+    while (head == NULL && dropped == 0) {
+      writing = false;
+      pthread_cond_broadcast (&console_drained);
+      pthread_cond_wait (&console_queued, &console_lock);
+    }
+    /* Only take a chunk, so that the rest can still be collapsed. */
+    len = 0;
+    e = head;
+    if (e) {
+      len = e->len < CONSOLE_CHUNK ? e->len : CONSOLE_CHUNK;
+      memcpy (buf, e->data, len);
+      if (len < e->len) {
+        memmove (e->data, e->data + len, e->len - len);
+        e->len -= len;
+      }
+      else {
+        head = e->next;
+        if (head == NULL)
+          tail = NULL;
+        free (e->data);
+        free (e);
+      }
+      queued -= len;
+    }
+    n = dropped;
+    dropped = 0;
+    writing = true;
+    pthread_mutex_unlock (&console_lock);
+
+    if (n > 0) {
+      snprintf (note, sizeof note,
+                "\n%s: [%zu bytes of output not shown on the console]\n",
+                g_get_prgname (), n);
+      write_all (note, strlen (note));
+    }
+    write_all (buf, len);
+  }
+
+  /*NOTREACHED*/
+  return NULL;
+}
+
+static void
+write_all (const char *data, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (STDOUT_FILENO, data, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      /* There is nowhere to report the error. */
+      return;
+    }
+    data += r;
+    len -= r;
+  }
+}
+
+/**
+ * Called with the lock held when the console has fallen behind.
+ * Collapse the progress bars in the queued output and drop all but
+ * the newest status line.
+ */
+static void
+collapse_queue (void)
+{
+  struct entry *e, *prev, *next, *newest = NULL;
+
+  for (e = head; e; e = e->next)
+    if (e->type == CONSOLE_STATUS)
+      newest = e;
+
+  for (prev = NULL, e = head; e; e = next) {
+    next = e->next;
+
+    if (e->type == CONSOLE_OUTPUT) {
+      const size_t len = collapse_progress (e->data, e->len);
+      queued -= e->len - len;
+      e->len = len;
+    }
+    else if (e != newest) {
+      if (prev)
+        prev->next = next;
+      else
+        head = next;
+      if (tail == e)
+        tail = prev;
+      queued -= e->len;
+      free (e->data);
+      free (e);
+      continue;
+    }
+
+    prev = e;
+  }
+}
+
+/**
+ * Remove the text which would be overwritten on the terminal because
+ * it is followed by a carriage return on the same line.  The carriage
+ * return of a C<\r\n> line ending (as sent by the pty) is not a
+ * redraw.  Returns the new length.
+ */
+static size_t
+collapse_progress (char *data, size_t len)
+{
+  size_t i, out = 0, line = 0;
+
+  for (i = 0; i < len; ++i) {
+    /* A carriage return at the very end may be the first half of a
+     * line ending split across two reads, so it is left alone.
+     */
+    if (data[i] == '\r' && i+1 < len && data[i+1] != '\n')
+      out = line;               /* discard this line so far */
+
+    data[out++] = data[i];
+    if (data[i] == '\n')
+      line = out;
+  }
+
+  return out;
+}
+
+/**
+ * Called with the lock held when the queue is still too long after
+ * collapsing.  Discard the oldest output.
+ */
+static void
+trim_queue (void)
+{
+  struct entry *e;
+  size_t n;
+
+  while (queued > CONSOLE_MAX && head) {
+    e = head;
+    n = queued - CONSOLE_MAX;
+    if (n < e->len) {
+      /* Cut at a line boundary if possible. */
+      const char *nl = memchr (e->data + n, '\n', e->len - n);
+      if (nl && nl+1 < e->data + e->len)
+        n = nl+1 - e->data;
+      memmove (e->data, e->data + n, e->len - n);
+      e->len -= n;
+    }
+    else {
+      n = e->len;
+      head = e->next;
+      if (head == NULL)
+        tail = NULL;
+      free (e->data);
+      free (e);
+    }
+    queued -= n;
+    dropped += n;
+  }
+}
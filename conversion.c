@@ -31,6 +31,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
@@ -55,12 +56,60 @@
 #include "p2v.h"
 
 static void cleanup_data_conns (struct data_conn *data_conns, size_t nr);
-static void generate_name (struct config *, const char *filename);
-static void generate_wrapper_script (struct config *, const char *remote_dir, const char *filename);
-static void generate_system_data (const char *dmesg_file, const char *lscpu_file, const char *lspci_file, const char *lsscsi_file, const char *lsusb_file);
-static void generate_p2v_version_file (const char *p2v_version_file);
+static size_t claim_warm_data_conns (const struct config *, struct data_conn *data_conns);
+static void generate_name (const struct config *, const char *filename);
+static void generate_decompressor (const char *filename);
+static void generate_wrapper_script (const struct config *, const char *remote_dir, const char *filename);
+static void *upload_system_data_thread (void *data);
+static void *disk_reader_thread (void *data);
 static void print_quoted (FILE *fp, const char *s);
 
+struct upload_system_data_args {
+  const struct config *config;
+  const char *remote_dir;
+};
+
+struct disk_reader_args {
+  const struct config *config;
+  const char *tmpdir;
+  const char *remote_dir;
+  char *error;                  /* why a segment was not uploaded */
+};
+
+/* Set to stop disk_reader_thread early. */
+static volatile bool disk_reader_stop;
+
+/* How often the disk watcher samples each NBD server (milliseconds). */
+#define DISK_WATCH_INTERVAL_MS 100
+
+/* How often the CPU usage and throughput metrics are updated, and how
+ * often they are sent to the conversion server (in units of
+ * DISK_WATCH_INTERVAL_MS).
+ */
+#define METRICS_SAMPLE_TICKS 10
+#define METRICS_SEND_TICKS 100
+
+struct disk_progress {
+  pid_t nbd_pid;
+  uint64_t base;                /* bytes read before conversion started */
+  uint64_t bytes;               /* bytes read since */
+  double first, last;           /* time of first and last byte, or 0 */
+};
+
+struct disk_watcher {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+  bool any_read;                /* has any disk been read yet? */
+  size_t nr_disks;
+  struct disk_progress *disks;
+  struct data_conn *data_conns; /* for the ssh PIDs */
+};
+
+static void start_disk_watcher (struct disk_watcher *w, struct data_conn *data_conns, size_t nr);
+static void stop_disk_watcher (struct disk_watcher *w, const struct config *config);
+
 static char *conversion_error;
 
 static void set_conversion_error (const char *fs, ...)
@@ -83,6 +132,7 @@ set_conversion_error (const char *fs, ...)
 
   free (conversion_error);
   conversion_error = msg;
+  count_metrics_error ();
 }
 
 const char *
@@ -140,6 +190,43 @@ set_cancel_requested (int r)
   pthread_mutex_unlock (&cancel_requested_mutex);
 }
 
+/* Is what the conversion server receives verified?  See verify_disk
+ * in the wrapper script.  The bulk pass of a warm migration is never
+ * verified, since the disks are still in use.
+ */
+static bool
+is_verifying (const struct config *config)
+{
+  return config->precopy != PRECOPY_BULK && config->verify != VERIFY_NONE;
+}
+
+/* Do the data connections need the p2v-decompress helper on the
+ * conversion server (p2v.compress or p2v.dedup)?
+ */
+static bool
+is_framed (const struct config *config)
+{
+  return config->compress || config->dedup;
+}
+
+/* Tell the user how much of C<disk> is sent as zeroes, and why. */
+static void
+report_skipped (void (*notify_ui) (int type, const char *data),
+                const char *disk, uint64_t bytes, const char *what)
+{
+  const double mb = (double) bytes / 1024 / 1024;
+  CLEANUP_FREE char *msg = NULL;
+
+  timeline_mark ("%s: not copying %" PRIu64 " bytes of %s", disk, bytes, what);
+  if (notify_ui == NULL)
+    return;
+  if (asprintf (&msg, _("%s: not copying %.1f %s of %s"),
+                disk, mb >= 1024 ? mb / 1024 : mb, mb >= 1024 ? "GB" : "MB",
+                what) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  notify_ui (NOTIFY_STATUS, msg);
+}
+
 static void
 set_control_h (mexp_h *new_h)
 {
@@ -148,11 +235,54 @@ set_control_h (mexp_h *new_h)
   pthread_mutex_unlock (&cancel_requested_mutex);
 }
 
+/**
+ * Send a record (a line starting with C<# p2v->) to the wrapper
+ * script over the control connection.  See the list of records in
+ * C<generate_wrapper_script>.  Nothing is sent once the conversion
+ * has been cancelled.
+ */
+static int
+send_control_record (const char *fs, ...)
+{
+  va_list args;
+  CLEANUP_FREE char *record = NULL;
+  int r;
+
+  va_start (args, fs);
+  r = vasprintf (&record, fs, args);
+  va_end (args);
+  if (r == -1)
+    error (EXIT_FAILURE, errno, "vasprintf");
+
+  pthread_mutex_lock (&cancel_requested_mutex);
+  if (control_h && !cancel_requested)
+    r = mexp_printf (control_h, "%s\n", record);
+  else
+    r = -1;
+  pthread_mutex_unlock (&cancel_requested_mutex);
+  return r;
+}
+
+/**
+ * Tell the wrapper script the remote NBD port of disk C<i>, as soon
+ * as its data connection is up.
+ */
+static int
+announce_disk (size_t i, const struct data_conn *data_conn)
+{
+  if (send_control_record ("# p2v-disk %zu %d",
+                           i, data_conn->nbd_remote_port) == -1) {
+    set_conversion_error ("mexp_printf: virt-v2v: %m");
+    return -1;
+  }
+  return 0;
+}
+
 #if defined(__GNUC__) && !defined(__clang__)
 #pragma GCC diagnostic ignored "-Wsuggest-attribute=noreturn"
 #endif
 int
-start_conversion (struct config *config,
+start_conversion (const struct config *config,
                   void (*notify_ui) (int type, const char *data))
 {
   int ret = -1;
@@ -167,13 +297,18 @@ start_conversion (struct config *config,
   char name_file[]        = "/tmp/p2v.XXXXXX/name";
   char physical_xml_file[] = "/tmp/p2v.XXXXXX/physical.xml";
   char wrapper_script[]   = "/tmp/p2v.XXXXXX/virt-v2v-wrapper.sh";
-  char dmesg_file[]       = "/tmp/p2v.XXXXXX/dmesg";
-  char lscpu_file[]       = "/tmp/p2v.XXXXXX/lscpu";
-  char lspci_file[]       = "/tmp/p2v.XXXXXX/lspci";
-  char lsscsi_file[]      = "/tmp/p2v.XXXXXX/lsscsi";
-  char lsusb_file[]       = "/tmp/p2v.XXXXXX/lsusb";
-  char p2v_version_file[] = "/tmp/p2v.XXXXXX/p2v-version";
+  char decompress_file[]  = "/tmp/p2v.XXXXXX/p2v-decompress";
   int inhibit_fd = -1;
+  struct upload_system_data_args upload_args;
+  pthread_t upload_thread;
+  bool upload_thread_started = false;
+  struct disk_reader_args reader_args = { .error = NULL };
+  pthread_t reader_thread;
+  bool reader_thread_started = false;
+  struct disk_watcher disk_watcher = { .disks = NULL };
+  bool remote_dir_created = false;
+  char trace_file[]       = "/tmp/p2v.XXXXXX/p2v-trace.json";
+  size_t phase, disk_phase;
 
 #if DEBUG_STDERR
   print_config (config, stderr);
@@ -198,13 +333,129 @@ start_conversion (struct config *config,
     data_conns[i].h = NULL;
     data_conns[i].nbd_pid = 0;
     data_conns[i].nbd_remote_port = -1;
+    data_conns[i].skipped = 0;
+    data_conns[i].excluded = 0;
   }
 
+  /* Create a remote directory name which will be used for libvirt
+   * XML, log files and other stuff.  We don't delete this directory
+   * after the run because (a) it's useful for debugging and (b) it
+   * only contains small files.
+   *
+   * NB: This path MUST NOT require shell quoting.
+   */
+  time (&now);
+  gmtime_r (&now, &tm);
+  if (asprintf (&remote_dir,
+                "/tmp/virt-p2v-%04d%02d%02d-XXXXXXXX",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) == -1) {
+    perror ("asprintf");
+    cleanup_data_conns (data_conns, nr_disks);
+    exit (EXIT_FAILURE);
+  }
+  len = strlen (remote_dir);
+  guestfs_int_random_string (&remote_dir[len-8], 8);
+  if (notify_ui)
+    notify_ui (NOTIFY_LOG_DIR, remote_dir);
+
+  /* Generate the local temporary directory. */
+  if (mkdtemp (tmpdir) == NULL) {
+    perror ("mkdtemp");
+    cleanup_data_conns (data_conns, nr_disks);
+    exit (EXIT_FAILURE);
+  }
+  memcpy (name_file, tmpdir, strlen (tmpdir));
+  memcpy (physical_xml_file, tmpdir, strlen (tmpdir));
+  memcpy (wrapper_script, tmpdir, strlen (tmpdir));
+  memcpy (decompress_file, tmpdir, strlen (tmpdir));
+  memcpy (trace_file, tmpdir, strlen (tmpdir));
+
+  /* Generate the static files.  physical.xml contains the NBD ports,
+   * so it is generated once the data connections are up.
+   */
+  generate_name (config, name_file);
+  generate_wrapper_script (config, remote_dir, wrapper_script);
+  if (is_framed (config))
+    generate_decompressor (decompress_file);
+
+  /* Open the control connection first.  This also creates
+   * remote_dir.
+   */
+  if (notify_ui)
+    notify_ui (NOTIFY_STATUS, _("Setting up the control connection ..."));
+
+  set_metrics_stage ("control connection");
+  phase = timeline_begin ("control connection");
+  set_control_h (start_remote_connection (config, remote_dir));
+  timeline_end (phase);
+  if (control_h == NULL) {
+    set_conversion_error ("could not open control connection over SSH to the conversion server: %s",
+                          get_ssh_error ());
+    goto out;
+  }
+  remote_dir_created = true;
+
+  /* Copy the static files to the remote dir. */
+
+  /* These files must not fail, so check for errors here. */
+  set_metrics_stage ("copying files");
+  phase = timeline_begin ("scp static files");
+  if (scp_file (config, remote_dir, name_file, wrapper_script,
+                is_framed (config) ? decompress_file : NULL, NULL) == -1) {
+    set_conversion_error ("scp: %s: %s",
+                          remote_dir, get_ssh_error ());
+    goto out;
+  }
+  timeline_end (phase);
+
+  /* Start the wrapper script straight away, so that the conversion
+   * server can get ready while the data connections are set up.  It
+   * waits for each disk to be announced, and then for all of them to
+   * be ready, before it runs virt-v2v.  This runs until virt-v2v
+   * exits.
+   */
+  if (mexp_printf (control_h,
+                   /* To simplify things in the wrapper script, it
+                    * writes virt-v2v's exit status to
+                    * /remote_dir/status, and here we read that and
+                    * exit the ssh shell with the same status.
+                    */
+                   "%s/virt-v2v-wrapper.sh; "
+                   "exit $(< %s/status)\n",
+                   remote_dir, remote_dir) == -1) {
+    set_conversion_error ("mexp_printf: virt-v2v: %m");
+    goto out;
+  }
+  timeline_mark ("wrapper started");
+
+  /* Reuse any data connections which were started speculatively
+   * while the user was filling in the conversion dialog.
+   */
+  claim_warm_data_conns (config, data_conns);
+
   /* Start the data connections and NBD server processes, one per disk. */
+  set_metrics_disks (config->disks);
+  set_metrics_stage ("data connections");
+  phase = timeline_begin ("data connections");
   for (i = 0; config->disks[i] != NULL; ++i) {
     int nbd_local_port;
     CLEANUP_FREE char *device = NULL;
 
+    if (data_conns[i].h != NULL) {
+      if (notify_ui) {
+        CLEANUP_FREE char *msg;
+        if (asprintf (&msg,
+                      _("Reusing data connection for %s ..."),
+                      config->disks[i]) == -1)
+          error (EXIT_FAILURE, errno, "asprintf");
+        notify_ui (NOTIFY_STATUS, msg);
+      }
+      timeline_mark ("reusing data connection %s", config->disks[i]);
+      if (announce_disk (i, &data_conns[i]) == -1)
+        goto out;
+      continue;
+    }
+
     if (config->disks[i][0] == '/') {
       device = strdup (config->disks[i]);
       if (!device) {
@@ -229,7 +480,11 @@ start_conversion (struct config *config,
     }
 
     /* Start NBD server listening on the given port number. */
-    data_conns[i].nbd_pid = start_nbd_server (&nbd_local_port, device);
+    disk_phase = timeline_begin ("start NBD server %s", config->disks[i]);
+    data_conns[i].nbd_pid = start_nbd_server (config, &nbd_local_port, device,
+                                              &data_conns[i].skipped,
+                                              &data_conns[i].excluded);
+    timeline_end (disk_phase);
     if (data_conns[i].nbd_pid == 0) {
       set_conversion_error ("NBD server error: %s", get_nbd_error ());
       goto out;
@@ -247,8 +502,10 @@ start_conversion (struct config *config,
     /* Open the SSH data connection, with reverse port forwarding
      * back to the NBD server.
      */
+    disk_phase = timeline_begin ("data connection %s", config->disks[i]);
     data_conns[i].h = open_data_connection (config, nbd_local_port,
                                             &data_conns[i].nbd_remote_port);
+    timeline_end (disk_phase);
     if (data_conns[i].h == NULL) {
       const char *err = get_ssh_error ();
 
@@ -263,95 +520,78 @@ start_conversion (struct config *config,
              data_conns[i].nbd_remote_port,
              nbd_local_port);
 #endif
+
+    if (announce_disk (i, &data_conns[i]) == -1)
+      goto out;
   }
+  timeline_end (phase);
 
-  /* Create a remote directory name which will be used for libvirt
-   * XML, log files and other stuff.  We don't delete this directory
-   * after the run because (a) it's useful for debugging and (b) it
-   * only contains small files.
-   *
-   * NB: This path MUST NOT require shell quoting.
+  /* Report the excluded partitions, and the swap, page and
+   * hibernation files, which are sent as zeroes (see skip.c).
    */
-  time (&now);
-  gmtime_r (&now, &tm);
-  if (asprintf (&remote_dir,
-                "/tmp/virt-p2v-%04d%02d%02d-XXXXXXXX",
-                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) == -1) {
-    perror ("asprintf");
-    cleanup_data_conns (data_conns, nr_disks);
-    exit (EXIT_FAILURE);
+  for (i = 0; config->disks[i] != NULL; ++i) {
+    const uint64_t excluded = data_conns[i].excluded;
+    const uint64_t swap = data_conns[i].skipped - excluded;
+
+    if (excluded > 0)
+      report_skipped (notify_ui, config->disks[i], excluded,
+                      _("excluded partitions"));
+    if (swap > 0)
+      report_skipped (notify_ui, config->disks[i], swap,
+                      _("swap, page and hibernation files"));
   }
-  len = strlen (remote_dir);
-  guestfs_int_random_string (&remote_dir[len-8], 8);
-  if (notify_ui)
-    notify_ui (NOTIFY_LOG_DIR, remote_dir);
 
-  /* Generate the local temporary directory. */
-  if (mkdtemp (tmpdir) == NULL) {
-    perror ("mkdtemp");
-    cleanup_data_conns (data_conns, nr_disks);
-    exit (EXIT_FAILURE);
-  }
-  memcpy (name_file, tmpdir, strlen (tmpdir));
-  memcpy (physical_xml_file, tmpdir, strlen (tmpdir));
-  memcpy (wrapper_script, tmpdir, strlen (tmpdir));
-  memcpy (dmesg_file, tmpdir, strlen (tmpdir));
-  memcpy (lscpu_file, tmpdir, strlen (tmpdir));
-  memcpy (lspci_file, tmpdir, strlen (tmpdir));
-  memcpy (lsscsi_file, tmpdir, strlen (tmpdir));
-  memcpy (lsusb_file, tmpdir, strlen (tmpdir));
-  memcpy (p2v_version_file, tmpdir, strlen (tmpdir));
-
-  /* Generate the static files. */
-  generate_name (config, name_file);
   generate_physical_xml (config, data_conns, physical_xml_file);
-  generate_wrapper_script (config, remote_dir, wrapper_script);
-  generate_system_data (dmesg_file,
-                        lscpu_file, lspci_file, lsscsi_file, lsusb_file);
-  generate_p2v_version_file (p2v_version_file);
-
-  /* Open the control connection.  This also creates remote_dir. */
-  if (notify_ui)
-    notify_ui (NOTIFY_STATUS, _("Setting up the control connection ..."));
-
-  set_control_h (start_remote_connection (config, remote_dir));
-  if (control_h == NULL) {
-    set_conversion_error ("could not open control connection over SSH to the conversion server: %s",
-                          get_ssh_error ());
-    goto out;
-  }
-
-  /* Copy the static files to the remote dir. */
 
-  /* These three files must not fail, so check for errors here. */
-  if (scp_file (config, remote_dir,
-                name_file, physical_xml_file, wrapper_script, NULL) == -1) {
+  /* Copy the files which depend on the data connections. */
+  set_metrics_stage ("copying files");
+  phase = timeline_begin ("scp disk files");
+  if (scp_file (config, remote_dir, physical_xml_file, NULL) == -1) {
     set_conversion_error ("scp: %s: %s",
                           remote_dir, get_ssh_error ());
     goto out;
   }
+  timeline_end (phase);
 
-  /* It's not essential that these files are copied, so ignore errors. */
-  ignore_value (scp_file (config, remote_dir,
-                          dmesg_file, lscpu_file, lspci_file, lsscsi_file,
-                          lsusb_file, p2v_version_file, NULL));
+  /* In the final pass of a warm migration, and for p2v.verify, read
+   * the disks in the background while they are copied.  The wrapper
+   * script waits for each segment of the block maps, and for the
+   * extent sums, as it needs them.
+   */
+  if (config->precopy == PRECOPY_FINAL || is_verifying (config)) {
+    reader_args.config = config;
+    reader_args.tmpdir = tmpdir;
+    reader_args.remote_dir = remote_dir;
+    disk_reader_stop = false;
+    if (pthread_create (&reader_thread, NULL,
+                        disk_reader_thread, &reader_args) != 0) {
+      set_conversion_error ("pthread_create: %m");
+      goto out;
+    }
+    reader_thread_started = true;
+  }
 
-  /* Do the conversion.  This runs until virt-v2v exits. */
+  /* Do the conversion.  The wrapper script starts virt-v2v now. */
   if (notify_ui)
     notify_ui (NOTIFY_STATUS, _("Doing conversion ..."));
 
-  if (mexp_printf (control_h,
-                   /* To simplify things in the wrapper script, it
-                    * writes virt-v2v's exit status to
-                    * /remote_dir/status, and here we read that and
-                    * exit the ssh shell with the same status.
-                    */
-                   "%s/virt-v2v-wrapper.sh; "
-                   "exit $(< %s/status)\n",
-                   remote_dir, remote_dir) == -1) {
+  if (send_control_record ("# p2v-disks-ready") == -1) {
     set_conversion_error ("mexp_printf: virt-v2v: %m");
     goto out;
   }
+  timeline_mark ("virt-v2v started");
+  set_metrics_stage ("conversion");
+  phase = timeline_begin ("conversion");
+  start_disk_watcher (&disk_watcher, data_conns, nr_disks);
+
+  /* Now that virt-v2v has started, copy the system data (dmesg etc)
+   * to the remote dir in the background.  See sysdata.c.
+   */
+  upload_args.config = config;
+  upload_args.remote_dir = remote_dir;
+  if (pthread_create (&upload_thread, NULL,
+                      upload_system_data_thread, &upload_args) == 0)
+    upload_thread_started = true;
 
   /* Read output from the virt-v2v process and echo it through the
    * notify function, until virt-v2v closes the connection.
@@ -382,11 +622,29 @@ start_conversion (struct config *config,
     goto out;
   }
 
+  timeline_end (phase);
   if (notify_ui)
     notify_ui (NOTIFY_STATUS, _("Control connection closed by remote."));
 
   ret = 0;
  out:
+  stop_disk_watcher (&disk_watcher, config);
+  set_metrics_stage (ret == 0 ? "finished" :
+                     is_cancel_requested () ? "cancelled" : "failed");
+  if (upload_thread_started)
+    pthread_join (upload_thread, NULL);
+  if (reader_thread_started) {
+    disk_reader_stop = true;
+    pthread_join (reader_thread, NULL);
+    free (reader_args.error);
+  }
+
+  /* Copy the trace of this conversion to the remote dir, next to the
+   * virt-v2v log.  Errors are ignored since it is only for diagnosis.
+   */
+  if (remote_dir_created && write_timeline_trace (trace_file) == 0)
+    ignore_value (scp_file (config, remote_dir, trace_file, NULL));
+
   if (control_h) {
     mexp_h *h = control_h;
     set_control_h (NULL);
@@ -449,11 +707,392 @@ cleanup_data_conns (struct data_conn *data_conns, size_t nr)
   }
 }
 
+/**
+ * In GUI mode, the data connections (NBD server plus C<ssh -R>
+ * tunnel, one per disk) can be started speculatively in the
+ * background while the user is still filling in the conversion
+ * dialog, so that they are already up when C<start_conversion> is
+ * called.  We call these "warm" connections.
+ *
+ * A single long-lived thread owns the warm connections.  It has to
+ * live for the rest of the program because nbdkit is started with
+ * I<--exit-with-parent>, which ties the lifetime of nbdkit to the
+ * thread that forked it.  The thread periodically checks that the
+ * connections are still alive and restarts any that have died.
+ *
+ * C<start_conversion> claims the warm connections that match the
+ * final disk selection and discards the rest.
+ */
+
+/* How often the warm connections are health-checked (seconds). */
+#define WARM_CHECK_INTERVAL 5
+
+struct warm_conn {
+  char *disk;                   /* disk name, eg. "sda" */
+  char *key;                    /* connection parameters, see warm_key */
+  struct data_conn conn;
+};
+
+static pthread_mutex_t warm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warm_cond = PTHREAD_COND_INITIALIZER;
+static int warm_thread_started = 0;
+static const struct config *warm_request = NULL; /* new request for the thread */
+static unsigned warm_generation = 0; /* incremented to invalidate requests */
+static struct warm_conn *warm_conns = NULL;
+static size_t nr_warm_conns = 0;
+
+static void *warm_up_thread (void *data);
+
+/**
+ * Identify the remote end of a data connection.  Warm connections
+ * are only reused if this has not changed.
+ */
+static char *
+warm_key (const struct config *config)
+{
+  CLEANUP_FREE char *exclude = NULL;
+  char *key;
+
+  if (config->exclude_partitions) {
+    exclude = guestfs_int_join_strings (",", config->exclude_partitions);
+    if (exclude == NULL)
+      error (EXIT_FAILURE, errno, "guestfs_int_join_strings");
+  }
+  if (asprintf (&key, "%s@%s:%d nbd_server=%d compress=%d dedup=%d "
+                "copy_swap=%d exclude=%s",
+                config->auth.username ? config->auth.username : "root",
+                config->remote.server, config->remote.port,
+                (int) config->nbd_server, (int) config->compress,
+                (int) config->dedup, (int) config->copy_swap,
+                exclude ? exclude : "") == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  return key;
+}
+
+/**
+ * Check if a child process is still running, without reaping it.
+ */
+static int
+process_is_alive (pid_t pid)
+{
+  siginfo_t info;
+
+  memset (&info, 0, sizeof info);
+  if (waitid (P_PID, pid, &info, WEXITED|WNOHANG|WNOWAIT) == -1)
+    return 0;
+  return info.si_pid == 0;
+}
+
+static int
+warm_conn_is_alive (const struct warm_conn *wc)
+{
+  return process_is_alive (wc->conn.nbd_pid) &&
+    process_is_alive (mexp_get_pid (wc->conn.h));
+}
+
+static void
+free_warm_conn (struct warm_conn *wc)
+{
+  cleanup_data_conns (&wc->conn, 1);
+  free (wc->disk);
+  free (wc->key);
+}
+
+/**
+ * Remove warm connections from the list if C<pred> returns true,
+ * and close them.
+ */
+static void
+remove_warm_conns (int (*pred) (const struct warm_conn *, const void *),
+                   const void *opaque)
+{
+  CLEANUP_FREE struct warm_conn *removed = NULL;
+  size_t i, j, nr_removed = 0;
+
+  pthread_mutex_lock (&warm_mutex);
+  removed = malloc (sizeof (struct warm_conn) * (nr_warm_conns + 1));
+  if (removed == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  for (i = j = 0; i < nr_warm_conns; ++i) {
+    if (pred (&warm_conns[i], opaque))
+      removed[nr_removed++] = warm_conns[i];
+    else
+      warm_conns[j++] = warm_conns[i];
+  }
+  nr_warm_conns = j;
+  pthread_mutex_unlock (&warm_mutex);
+
+  /* Closing the connections can take a while, so don't hold the lock. */
+  for (i = 0; i < nr_removed; ++i)
+    free_warm_conn (&removed[i]);
+}
+
+static int
+is_dead_or_stale (const struct warm_conn *wc, const void *key)
+{
+  return STRNEQ (wc->key, key) || !warm_conn_is_alive (wc);
+}
+
+static int
+always (const struct warm_conn *wc, const void *opaque)
+{
+  return 1;
+}
+
+static int
+have_warm_conn (const char *disk)
+{
+  size_t i;
+  int r = 0;
+
+  pthread_mutex_lock (&warm_mutex);
+  for (i = 0; i < nr_warm_conns; ++i) {
+    if (STREQ (warm_conns[i].disk, disk)) {
+      r = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&warm_mutex);
+  return r;
+}
+
+/**
+ * Start the NBD server and data connection for a single disk.
+ */
+static int
+open_warm_conn (const struct config *config, const char *disk,
+                struct data_conn *conn)
+{
+  CLEANUP_FREE char *device = NULL;
+  int nbd_local_port;
+
+  conn->h = NULL;
+  conn->nbd_remote_port = -1;
+
+  if (disk[0] == '/')
+    device = strdup (disk);
+  else if (asprintf (&device, "/dev/%s", disk) == -1)
+    device = NULL;
+  if (device == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  conn->nbd_pid = start_nbd_server (config, &nbd_local_port, device,
+                                    &conn->skipped, &conn->excluded);
+  if (conn->nbd_pid <= 0) {
+    conn->nbd_pid = 0;
+#if DEBUG_STDERR
+    fprintf (stderr, "%s: warm-up: %s: NBD server error: %s\n",
+             g_get_prgname (), disk, get_nbd_error ());
+#endif
+    return -1;
+  }
+
+  conn->h = open_data_connection (config, nbd_local_port,
+                                  &conn->nbd_remote_port);
+  if (conn->h == NULL) {
+#if DEBUG_STDERR
+    fprintf (stderr, "%s: warm-up: %s: data connection error: %s\n",
+             g_get_prgname (), disk, get_ssh_error ());
+#endif
+    cleanup_data_conns (conn, 1);
+    return -1;
+  }
+
+#if DEBUG_STDERR
+  fprintf (stderr,
+           "%s: warm-up: data connection for %s: SSH remote port %d, local port %d\n",
+           g_get_prgname (), device, conn->nbd_remote_port, nbd_local_port);
+#endif
+
+  return 0;
+}
+
+/**
+ * Ask the background thread to start data connections for the disks
+ * in C<config-E<gt>disks>, and to keep them alive until they are
+ * claimed by C<start_conversion> or discarded by
+ * C<discard_warm_data_conns>.
+ *
+ * C<config> must be a snapshot made by C<snapshot_config>.  The
+ * background thread takes a reference to it, so the caller can share
+ * it with other threads.  This returns immediately.
+ */
+void
+warm_up_data_conns (const struct config *config)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+  int err;
+
+  pthread_mutex_lock (&warm_mutex);
+  if (warm_request)
+    unref_config (warm_request);
+  warm_request = ref_config (config);
+  warm_generation++;
+
+  if (!warm_thread_started) {
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create (&tid, &attr, warm_up_thread, NULL);
+    if (err != 0)
+      error (EXIT_FAILURE, err, "pthread_create");
+    pthread_attr_destroy (&attr);
+    warm_thread_started = 1;
+  }
+
+  pthread_cond_signal (&warm_cond);
+  pthread_mutex_unlock (&warm_mutex);
+}
+
+/**
+ * Close all warm connections and cancel any outstanding request.
+ */
+void
+discard_warm_data_conns (void)
+{
+  pthread_mutex_lock (&warm_mutex);
+  if (warm_request)
+    unref_config (warm_request);
+  warm_request = NULL;
+  warm_generation++;
+  pthread_cond_signal (&warm_cond);
+  pthread_mutex_unlock (&warm_mutex);
+
+  remove_warm_conns (always, NULL);
+}
+
+/**
+ * Called from C<start_conversion>.  Move the live warm connections
+ * for the disks in C<config-E<gt>disks> into C<data_conns> (which
+ * must already be initialized), and discard the rest.
+ *
+ * Returns the number of connections claimed.
+ */
+static size_t
+claim_warm_data_conns (const struct config *config, struct data_conn *data_conns)
+{
+  CLEANUP_FREE char *key = warm_key (config);
+  size_t i, j, n = 0;
+
+  pthread_mutex_lock (&warm_mutex);
+  /* Stop the background thread from starting any more connections. */
+  if (warm_request)
+    unref_config (warm_request);
+  warm_request = NULL;
+  warm_generation++;
+  pthread_cond_signal (&warm_cond);
+
+  for (i = 0; config->disks[i] != NULL; ++i) {
+    for (j = 0; j < nr_warm_conns; ++j) {
+      struct warm_conn *wc = &warm_conns[j];
+
+      if (STREQ (wc->disk, config->disks[i]) && STREQ (wc->key, key) &&
+          warm_conn_is_alive (wc)) {
+        data_conns[i] = wc->conn;
+        free (wc->disk);
+        free (wc->key);
+        warm_conns[j] = warm_conns[--nr_warm_conns];
+        n++;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock (&warm_mutex);
+
+  /* Anything left over is for a disk which was deselected. */
+  remove_warm_conns (always, NULL);
+
+  return n;
+}
+
+static void *
+warm_up_thread (void *data)
+{
+  const struct config *config = NULL;
+  unsigned generation = 0;
+  struct timespec deadline;
+
+  pthread_mutex_lock (&warm_mutex);
+  for (;;) {
+    if (warm_request) {
+      if (config)
+        unref_config (config);
+      config = warm_request;
+      warm_request = NULL;
+      generation = warm_generation;
+    }
+    else if (config && generation != warm_generation) {
+      unref_config (config);
+      config = NULL;
+    }
+
+    if (config) {
+      CLEANUP_FREE char *key = warm_key (config);
+      size_t i;
+
+      pthread_mutex_unlock (&warm_mutex);
+
+      /* Health check: drop connections which have died or which go
+       * to a different server.  They are restarted below.
+       */
+      remove_warm_conns (is_dead_or_stale, key);
+
+      for (i = 0; config->disks && config->disks[i] != NULL; ++i) {
+        struct warm_conn wc;
+
+        if (have_warm_conn (config->disks[i]))
+          continue;
+        if (open_warm_conn (config, config->disks[i], &wc.conn) == -1)
+          continue;
+        wc.disk = strdup (config->disks[i]);
+        wc.key = strdup (key);
+        if (wc.disk == NULL || wc.key == NULL)
+          error (EXIT_FAILURE, errno, "strdup");
+
+        pthread_mutex_lock (&warm_mutex);
+        if (generation == warm_generation) {
+          warm_conns = realloc (warm_conns,
+                                sizeof (struct warm_conn) * (nr_warm_conns + 1));
+          if (warm_conns == NULL)
+            error (EXIT_FAILURE, errno, "realloc");
+          warm_conns[nr_warm_conns++] = wc;
+          wc.disk = NULL;
+        }
+        pthread_mutex_unlock (&warm_mutex);
+
+        /* The request was cancelled while we were connecting. */
+        if (wc.disk != NULL) {
+          free_warm_conn (&wc);
+          break;
+        }
+      }
+
+      pthread_mutex_lock (&warm_mutex);
+    }
+
+    /* Wait for a new request, or until the next health check. */
+    if (config == NULL) {
+      while (warm_request == NULL)
+        pthread_cond_wait (&warm_cond, &warm_mutex);
+    }
+    else {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += WARM_CHECK_INTERVAL;
+      while (warm_request == NULL && generation == warm_generation &&
+             pthread_cond_timedwait (&warm_cond, &warm_mutex, &deadline) == 0)
+        ;
+    }
+  }
+
+  /*NOTREACHED*/
+  return NULL;
+}
+
 /**
  * Write the guest name into C<filename>.
  */
 static void
-generate_name (struct config *config, const char *filename)
+generate_name (const struct config *config, const char *filename)
 {
   FILE *fp;
 
@@ -464,18 +1103,368 @@ generate_name (struct config *config, const char *filename)
   fclose (fp);
 }
 
+/**
+ * Write the F<p2v-decompress> helper into C<filename>.  With
+ * C<p2v.compress> or C<p2v.dedup> the wrapper script runs it on the
+ * conversion server, for each data connection, to decompress what the
+ * built-in NBD server sends, and to look up and fill the block cache
+ * (see F<nbd-server.c>).
+ */
+static void
+generate_decompressor (const char *filename)
+{
+  FILE *fp;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "fopen: %s", filename);
+  fputs (
+         "#!/usr/bin/env python3\n"
+         "# Generated by virt-p2v.  With p2v.compress or p2v.dedup the built-in\n"
+         "# NBD server in virt-p2v wraps everything it sends in frames: a 4 byte\n"
+         "# length, with the top bit set if the payload is compressed with zlib,\n"
+         "# a 4 byte uncompressed length, then the payload.  This listens on a\n"
+         "# free port (which it prints), and for each connection to it connects\n"
+         "# to the data connection on PORT, unwrapping the frames, so that\n"
+         "# virt-v2v sees plain NBD.\n"
+         "#\n"
+         "# With p2v.dedup (--cache DIR), reads are answered with the hashes of\n"
+         "# the chunks of the data instead.  Chunks found in the block cache in\n"
+         "# DIR are read from there, and the others are read from virt-p2v over\n"
+         "# another connection, and added to the cache.  Chunks are named after\n"
+         "# their SHA-256, which is computed here from the data received, and\n"
+         "# checked again whenever a chunk is taken from the cache, since the\n"
+         "# cache is shared by all the conversions on this server.  See\n"
+         "# nbd-server.c.\n"
+         "#\n"
+         "# Usage: p2v-decompress [--cache DIR] PORT\n"
+         "\n"
+         "import hashlib\n"
+         "import os\n"
+         "import socket\n"
+         "import struct\n"
+         "import sys\n"
+         "import threading\n"
+         "import zlib\n"
+         "\n"
+         "NBD_IHAVEOPT = 0x49484156454f5054\n"
+         "NBD_OPT_EXPORT_NAME = 1\n"
+         "NBD_REQUEST_MAGIC = 0x25609513\n"
+         "NBD_SIMPLE_REPLY_MAGIC = 0x67446698\n"
+         "NBD_STRUCTURED_REPLY_MAGIC = 0x668e33ef\n"
+         "NBD_REPLY_FLAG_DONE = 1\n"
+         "NBD_REPLY_TYPE_ERROR = 32769\n"
+         "NBD_CMD_READ = 0\n"
+         "P2V_DEDUP_MAGIC = 0x70326464\n"
+         "P2V_CMD_FLAG_DATA = 1 << 15\n"
+         "DEDUP_REPLY = struct.Struct(\">IIQQII\")\n"
+         "DEDUP_REPLY_MAGIC = struct.pack(\">I\", P2V_DEDUP_MAGIC)\n"
+         "DEDUP_HASH_SIZE = 32\n"
+         "\n"
+         "\n"
+         "def recv_full(sock, n):\n"
+         "    buf = bytearray()\n"
+         "    while len(buf) < n:\n"
+         "        data = sock.recv(n - len(buf))\n"
+         "        if not data:\n"
+         "            raise EOFError\n"
+         "        buf += data\n"
+         "    return bytes(buf)\n"
+         "\n"
+         "\n"
+         "def recv_frame(sock):\n"
+         "    length, size = struct.unpack(\">II\", recv_full(sock, 8))\n"
+         "    data = recv_full(sock, length & 0x7fffffff)\n"
+         "    if length & 0x80000000:\n"
+         "        data = zlib.decompress(data, bufsize=size)\n"
+         "    return data\n"
+         "\n"
+         "\n"
+         "def shutdown(sock):\n"
+         "    try:\n"
+         "        sock.shutdown(socket.SHUT_RDWR)\n"
+         "    except OSError:\n"
+         "        pass\n"
+         "\n"
+         "\n"
+         "class Cache:\n"
+         "    def __init__(self, path):\n"
+         "        self.path = path\n"
+         "\n"
+         "    def chunk_path(self, h):\n"
+         "        return os.path.join(self.path, h[:2], h)\n"
+         "\n"
+         "    # Anyone who can write to the cache could have put anything in a\n"
+         "    # chunk, so it is only used if it still has the right hash.\n"
+         "    def get(self, h, size):\n"
+         "        try:\n"
+         "            with open(self.chunk_path(h), \"rb\") as f:\n"
+         "                data = f.read(size + 1)\n"
+         "        except OSError:\n"
+         "            return None\n"
+         "        if len(data) != size or hashlib.sha256(data).hexdigest() != h:\n"
+         "            return None\n"
+         "        return data\n"
+         "\n"
+         "    # The subdirectories get the same permissions as the cache, which\n"
+         "    # may be shared by several users.\n"
+         "    def make_dir(self, path):\n"
+         "        try:\n"
+         "            os.mkdir(path)\n"
+         "        except FileExistsError:\n"
+         "            return\n"
+         "        os.chmod(path, os.stat(self.path).st_mode & 0o7777)\n"
+         "\n"
+         "    def put(self, h, data):\n"
+         "        path = self.chunk_path(h)\n"
+         "        tmp = \"%s.%d.%d\" % (path, os.getpid(), threading.get_ident())\n"
+         "        try:\n"
+         "            self.make_dir(os.path.dirname(path))\n"
+         "            with open(tmp, \"wb\") as f:\n"
+         "                f.write(data)\n"
+         "            os.replace(tmp, path)\n"
+         "        except OSError as e:\n"
+         "            print(\"p2v-decompress: %s: %s\" % (path, e), file=sys.stderr)\n"
+         "            try:\n"
+         "                os.unlink(tmp)\n"
+         "            except OSError:\n"
+         "                pass\n"
+         "\n"
+         "\n"
+         "class Read:\n"
+         "    # A read from virt-v2v, waiting for the chunks which are not in\n"
+         "    # the cache.  Each chunk is [offset, length, hash, data].\n"
+         "    def __init__(self, header, handle, chunks):\n"
+         "        self.header = header\n"
+         "        self.handle = handle\n"
+         "        self.chunks = chunks\n"
+         "        self.waiting = 0\n"
+         "\n"
+         "    def reply(self):\n"
+         "        return self.header + b\"\".join(c[3] for c in self.chunks)\n"
+         "\n"
+         "    def error_reply(self, error):\n"
+         "        magic, = struct.unpack_from(\">I\", self.header)\n"
+         "        if magic == NBD_STRUCTURED_REPLY_MAGIC:\n"
+         "            return struct.pack(\">IHHQIIH\", NBD_STRUCTURED_REPLY_MAGIC,\n"
+         "                               NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,\n"
+         "                               self.handle, 6, error, 0)\n"
+         "        return struct.pack(\">IIQ\", NBD_SIMPLE_REPLY_MAGIC, error,\n"
+         "                           self.handle)\n"
+         "\n"
+         "\n"
+         "def parse_dedup_reply(msg):\n"
+         "    magic, hdrlen, handle, offset, count, chunk_size = \\\n"
+         "        DEDUP_REPLY.unpack_from(msg)\n"
+         "    pos = DEDUP_REPLY.size\n"
+         "    header = msg[pos:pos + hdrlen]\n"
+         "    pos += hdrlen\n"
+         "    chunks = []\n"
+         "    end = offset + count\n"
+         "    while offset < end:\n"
+         "        n = min(end, (offset // chunk_size + 1) * chunk_size) - offset\n"
+         "        chunks.append([offset, n, msg[pos:pos + DEDUP_HASH_SIZE].hex(), None])\n"
+         "        pos += DEDUP_HASH_SIZE\n"
+         "        offset += n\n"
+         "    return header, handle, chunks, msg[pos:]\n"
+         "\n"
+         "\n"
+         "class Connection:\n"
+         "    def __init__(self, client, server, port, cache):\n"
+         "        self.client = client\n"
+         "        self.server = server\n"
+         "        self.port = port\n"
+         "        self.cache = cache\n"
+         "        self.client_lock = threading.Lock()\n"
+         "        self.fetch = None\n"
+         "        self.fetch_lock = threading.Lock()\n"
+         "        self.pending = {}\n"
+         "        self.next_handle = 0\n"
+         "        self.cached = 0\n"
+         "        self.copied = 0\n"
+         "\n"
+         "    def send_client(self, data):\n"
+         "        with self.client_lock:\n"
+         "            self.client.sendall(data)\n"
+         "\n"
+         "    # The reads of chunks which are not in the cache go over another\n"
+         "    # connection, so that they do not get mixed up with the requests\n"
+         "    # from virt-v2v.\n"
+         "    def open_fetch(self):\n"
+         "        sock = socket.create_connection((\"localhost\", self.port))\n"
+         "        recv_frame(sock)\n"
+         "        sock.sendall(struct.pack(\">I\", 3))\n"
+         "        sock.sendall(struct.pack(\">QII\", NBD_IHAVEOPT, NBD_OPT_EXPORT_NAME, 0))\n"
+         "        recv_frame(sock)\n"
+         "        threading.Thread(target=self.fetch_replies, args=(sock,),\n"
+         "                         daemon=True).start()\n"
+         "        return sock\n"
+         "\n"
+         "    def dedup_reply(self, msg):\n"
+         "        header, handle, chunks, _ = parse_dedup_reply(msg)\n"
+         "        read = Read(header, handle, chunks)\n"
+         "        runs = []\n"
+         "        prev = None\n"
+         "        for c in chunks:\n"
+         "            c[3] = self.cache.get(c[2], c[1])\n"
+         "            if c[3] is not None:\n"
+         "                self.cached += c[1]\n"
+         "            elif runs and runs[-1][-1] is prev:\n"
+         "                runs[-1].append(c)\n"
+         "            else:\n"
+         "                runs.append([c])\n"
+         "            prev = c\n"
+         "        if not runs:\n"
+         "            self.send_client(read.reply())\n"
+         "            return\n"
+         "        with self.fetch_lock:\n"
+         "            if self.fetch is None:\n"
+         "                self.fetch = self.open_fetch()\n"
+         "            read.waiting = len(runs)\n"
+         "            for run in runs:\n"
+         "                h = self.next_handle\n"
+         "                self.next_handle += 1\n"
+         "                self.pending[h] = (read, run)\n"
+         "                self.fetch.sendall(struct.pack(\n"
+         "                    \">IHHQQI\", NBD_REQUEST_MAGIC, P2V_CMD_FLAG_DATA,\n"
+         "                    NBD_CMD_READ, h, run[0][0], sum(c[1] for c in run)))\n"
+         "\n"
+         "    def fetch_replies(self, sock):\n"
+         "        try:\n"
+         "            while True:\n"
+         "                msg = recv_frame(sock)\n"
+         "                magic, error, h = struct.unpack_from(\">IIQ\", msg)\n"
+         "                with self.fetch_lock:\n"
+         "                    read, run = self.pending.pop(h)\n"
+         "                if magic != P2V_DEDUP_MAGIC:\n"
+         "                    if read.waiting > 0:\n"
+         "                        read.waiting = 0\n"
+         "                        self.send_client(read.error_reply(error))\n"
+         "                    continue\n"
+         "                # The data is filed under its own hash, computed here,\n"
+         "                # and not under the hash which was sent with it, which\n"
+         "                # is also why a change to the disk since the chunk was\n"
+         "                # first read does no harm.\n"
+         "                _, _, _, data = parse_dedup_reply(msg)\n"
+         "                pos = 0\n"
+         "                for c in run:\n"
+         "                    c[3] = data[pos:pos + c[1]]\n"
+         "                    c[2] = hashlib.sha256(c[3]).hexdigest()\n"
+         "                    pos += c[1]\n"
+         "                    self.cache.put(c[2], c[3])\n"
+         "                    self.copied += c[1]\n"
+         "                if read.waiting > 0:\n"
+         "                    read.waiting -= 1\n"
+         "                    if read.waiting == 0:\n"
+         "                        self.send_client(read.reply())\n"
+         "        except (OSError, EOFError, KeyError, zlib.error, struct.error):\n"
+         "            pass\n"
+         "        shutdown(self.client)\n"
+         "        shutdown(self.server)\n"
+         "\n"
+         "    def replies(self):\n"
+         "        try:\n"
+         "            while True:\n"
+         "                msg = recv_frame(self.server)\n"
+         "                if self.cache is not None and msg[:4] == DEDUP_REPLY_MAGIC:\n"
+         "                    self.dedup_reply(msg)\n"
+         "                else:\n"
+         "                    self.send_client(msg)\n"
+         "        except (OSError, EOFError, zlib.error, struct.error):\n"
+         "            pass\n"
+         "\n"
+         "\n"
+         "def requests(client, server):\n"
+         "    try:\n"
+         "        while True:\n"
+         "            data = client.recv(65536)\n"
+         "            if not data:\n"
+         "                break\n"
+         "            server.sendall(data)\n"
+         "    except OSError:\n"
+         "        pass\n"
+         "    try:\n"
+         "        server.shutdown(socket.SHUT_WR)\n"
+         "    except OSError:\n"
+         "        pass\n"
+         "\n"
+         "\n"
+         "def serve(client, port, cache):\n"
+         "    try:\n"
+         "        server = socket.create_connection((\"localhost\", port))\n"
+         "    except OSError as e:\n"
+         "        print(\"p2v-decompress: port %d: %s\" % (port, e), file=sys.stderr)\n"
+         "        client.close()\n"
+         "        return\n"
+         "    conn = Connection(client, server, port, cache)\n"
+         "    t = threading.Thread(target=requests, args=(client, server), daemon=True)\n"
+         "    t.start()\n"
+         "    conn.replies()\n"
+         "    for sock in (client, server, conn.fetch):\n"
+         "        if sock:\n"
+         "            shutdown(sock)\n"
+         "    t.join()\n"
+         "    if cache is not None:\n"
+         "        print(\"p2v-decompress: port %d: %d bytes from the block cache, \"\n"
+         "              \"%d bytes copied\" % (port, conn.cached, conn.copied),\n"
+         "              file=sys.stderr)\n"
+         "    client.close()\n"
+         "    server.close()\n"
+         "\n"
+         "\n"
+         "def main():\n"
+         "    args = sys.argv[1:]\n"
+         "    cache = None\n"
+         "    if args[0] == \"--cache\":\n"
+         "        cache = Cache(args[1])\n"
+         "        args = args[2:]\n"
+         "    port = int(args[0])\n"
+         "    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)\n"
+         "    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)\n"
+         "    listener.bind((\"localhost\", 0))\n"
+         "    listener.listen(16)\n"
+         "    print(listener.getsockname()[1], flush=True)\n"
+         "    while True:\n"
+         "        client, _ = listener.accept()\n"
+         "        threading.Thread(target=serve, args=(client, port, cache),\n"
+         "                         daemon=True).start()\n"
+         "\n"
+         "\n"
+         "main()\n",
+         fp);
+  fclose (fp);
+}
+
+/**
+ * Print the port on the conversion server where disk C<i> can be
+ * read, as a word in the wrapper script.  The port is only known once
+ * the data connection has been announced (see C<announce_disk>).
+ */
+static void
+print_nbd_port (FILE *fp, size_t i)
+{
+  fprintf (fp, "$(nbd_port %zu)", i);
+}
+
 /**
  * Construct the virt-v2v wrapper script.
  *
  * This will be sent to the remote server, and is easier than trying
  * to "type" a long and complex single command line into the ssh
  * connection when we start the conversion.
+ *
+ * The script is started as soon as the control connection is open,
+ * before the data connections, so it doesn't contain the NBD ports.
+ * It waits for virt-p2v to announce each disk over the control
+ * connection, and then for all of them to be ready (see
+ * C<start_conversion>).
  */
 static void
-generate_wrapper_script (struct config *config, const char *remote_dir,
-                         const char *filename)
+generate_wrapper_script (const struct config *config,
+                         const char *remote_dir, const char *filename)
 {
   FILE *fp;
+  size_t i;
 
   fp = fopen (filename, "w");
   if (fp == NULL)
@@ -527,8 +1516,6 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   }
 
   if (config->output.misc) { /* -oo */
-    size_t i;
-
     for (i = 0; config->output.misc[i]; ++i) {
       fprintf (fp, " -oo ");
       print_quoted (fp, config->output.misc[i]);
@@ -545,6 +1532,328 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp, "}\n");
   fprintf (fp, "\n");
 
+  if (config->precopy != PRECOPY_NONE) {
+    CLEANUP_FREE char *precopy_dir = get_precopy_dir (config);
+
+    /* Warm migration, see precopy.c.  This must run in the remote
+     * directory, where the block maps were uploaded.
+     */
+    fprintf (fp, "precopy_dir=%s\n", precopy_dir);
+    fprintf (fp, "\n");
+    if (config->precopy == PRECOPY_FINAL) {
+      fprintf (fp,
+               "# In the final pass, virt-p2v sends the block maps in\n"
+               "# segments of this many blocks while it reads the disks.\n");
+      fprintf (fp, "map_segment_blocks=%d\n",
+               PRECOPY_SEGMENT_SIZE / PRECOPY_BLOCK_SIZE);
+      fprintf (fp, "\n");
+      fprintf (fp,
+               "# Wait for segment K of the block map of a disk:\n"
+               "# wait_for_map NAME K\n"
+               "wait_for_map ()\n"
+               "{\n"
+               "    while [ ! -e disks/map-$1.$2 ]; do\n"
+               "        if [ -e disks/read-failed ]; then\n"
+               "            echo \"virt-p2v could not read the disks: $(< disks/read-failed)\"\n"
+               "            return 1\n"
+               "        fi\n"
+               "        kill -0 $metrics_pid 2>/dev/null || return 1\n"
+               "        sleep 0.1\n"
+               "    done\n"
+               "}\n"
+               "\n");
+      fprintf (fp,
+               "# The number of segments of the block map of a disk,\n"
+               "# from the header in the first one: map_segments NAME\n"
+               "map_segments ()\n"
+               "{\n"
+               "    local size bs n\n"
+               "    read -r _ _ _ size bs < $1.map.0\n"
+               "    n=$(( ((size + bs - 1) / bs + map_segment_blocks - 1) / map_segment_blocks ))\n"
+               "    echo $(( n > 0 ? n : 1 ))\n"
+               "}\n"
+               "\n");
+      fprintf (fp,
+               "# Wait for all the segments of the block map of a disk\n"
+               "# and join them into NAME.map: collect_map NAME\n"
+               "collect_map ()\n"
+               "{\n"
+               "    local k n\n"
+               "    wait_for_map $1 0 || return\n"
+               "    n=$(map_segments $1)\n"
+               "    : > $1.map\n"
+               "    for k in $(seq 0 $(( n - 1 ))); do\n"
+               "        wait_for_map $1 $k && cat $1.map.$k >> $1.map || return\n"
+               "    done\n"
+               "}\n"
+               "\n");
+    }
+    if (config->precopy == PRECOPY_BULK) {
+      fprintf (fp,
+               "# Write the block map of the copy of a disk on this\n"
+               "# server into NAME.map.  The disk is in use while it is\n"
+               "# copied, so a map made on the physical machine before\n"
+               "# the copy could record a block which was changed, and\n"
+               "# changed back, while nbdcopy read it.  Hashing the copy\n"
+               "# records what this server really has: map_image NAME\n"
+               "map_image ()\n"
+               "{\n"
+               "    local img=\"$precopy_dir/$1.img\" size k n\n"
+               "    xxhsum -H1 /dev/null >/dev/null 2>&1 || return\n"
+               "    size=$(stat -c %%s \"$img\") || return\n"
+               "    n=$(( (size + %d - 1) / %d ))\n"
+               "    seq 0 $(( n - 1 )) |\n"
+               "    xargs -P \"$(nproc)\" -I{} sh -c \\\n"
+               "        'dd if=\"$0\" bs=%d skip={} count=1 iflag=fullblock status=none | split -b %d --filter=\"xxhsum -H1\" | cut -d\" \" -f1 > $1.{}' \\\n"
+               "        \"$img\" $1.part || return\n"
+               "    echo \"p2v-block-map 1 xxh64 $size %d\" > $1.map\n"
+               "    for k in $(seq 0 $(( n - 1 ))); do\n"
+               "        cat $1.part.$k >> $1.map || return\n"
+               "    done\n"
+               "    rm -f $1.part.*\n"
+               "    # One line for the header and one for each block.\n"
+               "    [ $(wc -l < $1.map) -eq $(( 1 + (size + %d - 1) / %d )) ]\n"
+               "}\n"
+               "\n",
+               PRECOPY_EXTENT_SIZE, PRECOPY_EXTENT_SIZE,
+               PRECOPY_EXTENT_SIZE, PRECOPY_BLOCK_SIZE, PRECOPY_BLOCK_SIZE,
+               PRECOPY_BLOCK_SIZE, PRECOPY_BLOCK_SIZE);
+    }
+    fprintf (fp,
+             "# Copy the whole of a disk: copy_disk NAME PORT\n"
+             "copy_disk ()\n"
+             "{\n"
+             "    echo \"Copying $1 to the conversion server ...\"\n"
+             "    rm -f \"$precopy_dir/$1.map\"\n"
+             "    nbdcopy nbd://localhost:$2 \"$precopy_dir/$1.img.tmp\" &&\n"
+             "    mv \"$precopy_dir/$1.img.tmp\" \"$precopy_dir/$1.img\" || return\n");
+    if (config->precopy == PRECOPY_FINAL)
+      fprintf (fp,
+               "    collect_map $1 &&\n"
+               "    mv $1.map \"$precopy_dir/$1.map\"\n");
+    else
+      fprintf (fp,
+               "    if map_image $1; then\n"
+               "        mv $1.map \"$precopy_dir/$1.map\"\n"
+               "    else\n"
+               "        echo \"Could not hash the copy of $1 (is xxhsum installed?), so the final pass will copy the whole disk again\"\n"
+               "    fi\n");
+    fprintf (fp,
+             "}\n"
+             "\n");
+    fprintf (fp,
+             "# Copy only the extents of a disk listed (as OFFSET LENGTH\n"
+             "# lines) in a file.  Every other block looks like a hole\n"
+             "# through nbdkit-extentlist-filter, so that nbdcopy\n"
+             "# --destination-is-zero skips it: copy_extents NAME PORT FILE\n"
+             "copy_extents ()\n"
+             "{\n"
+             "    [ -s $3 ] || return 0\n"
+             "    nbdcopy --destination-is-zero -- \\\n"
+             "        [ nbdkit -r --filter=extentlist nbd hostname=localhost port=$2 extentlist=$PWD/$3 ] \\\n"
+             "        [ nbdkit file \"$precopy_dir/$1.img\" ]\n"
+             "}\n"
+             "\n");
+    fprintf (fp,
+             "# Copy only the blocks of a disk which changed since it\n"
+             "# was last copied, by comparing the old block map with\n"
+             "# the new one.  The segments of the new map are compared\n"
+             "# and copied in batches, as many as have arrived, while\n"
+             "# virt-p2v reads the rest of the disk: update_disk NAME PORT\n"
+             "update_disk ()\n"
+             "{\n"
+             "    local size bs k j n total=0\n"
+             "    wait_for_map $1 0 || return\n"
+             "    if [ ! -f \"$precopy_dir/$1.img\" ] ||\n"
+             "       [ ! -f \"$precopy_dir/$1.map\" ] ||\n"
+             "       [ \"$(head -1 \"$precopy_dir/$1.map\")\" != \"$(head -1 $1.map.0)\" ]; then\n"
+             "        copy_disk \"$@\"\n"
+             "        return\n"
+             "    fi\n"
+             "    echo \"Copying the blocks of $1 which changed since the bulk copy ...\"\n"
+             "    read -r _ _ _ size bs < $1.map.0\n"
+             "    n=$(map_segments $1)\n"
+             "    tail -n +2 \"$precopy_dir/$1.map\" |\n"
+             "    split -d -a 8 -l $map_segment_blocks - $1.old. || return\n"
+             "    : > $1.map\n"
+             "    k=0\n"
+             "    while [ $k -lt $n ]; do\n"
+             "        wait_for_map $1 $k || return\n"
+             "        : > $1.old\n"
+             "        : > $1.new\n"
+             "        for (( j = k; j < n; j++ )); do\n"
+             "            [ -e disks/map-$1.$j ] || break\n"
+             "            cat $1.map.$j >> $1.map\n"
+             "            cat $(printf '%%s.old.%%08d' $1 $j) >> $1.old 2>/dev/null\n"
+             "            if [ $j -eq 0 ]; then\n"
+             "                tail -n +2 $1.map.0 >> $1.new\n"
+             "            else\n"
+             "                cat $1.map.$j >> $1.new\n"
+             "            fi\n"
+             "        done\n"
+             "        paste -d' ' $1.old $1.new |\n"
+             "        awk -v first=$(( k * map_segment_blocks )) -v size=$size -v bs=$bs \\\n"
+             "            -v changed=$1.changed '\n"
+             "            function flush() {\n"
+             "                if (end > start) {\n"
+             "                    len = (end - start) * bs\n"
+             "                    if (start * bs + len > size)\n"
+             "                        len = size - start * bs\n"
+             "                    printf \"%%.0f %%.0f\\n\", start * bs, len\n"
+             "                    total += len\n"
+             "                }\n"
+             "            }\n"
+             "            BEGIN { start = end = first }\n"
+             "            # Compare as strings, not numbers.\n"
+             "            $1 \"\" != $2 \"\" { b = first + NR - 1; if (b != end) { flush(); start = b }; end = b + 1 }\n"
+             "            END { flush(); printf \"%%.0f\\n\", total > changed }\n"
+             "        ' > $1.extents || return\n"
+             "        total=$(( total + $(< $1.changed) ))\n"
+             "        copy_extents $1 $2 $1.extents || return\n"
+             "        k=$j\n"
+             "    done\n"
+             "    echo \"Copied $total bytes of $1 which changed since the bulk copy\"\n"
+             "    mv $1.map \"$precopy_dir/$1.map\"\n"
+             "}\n"
+             "\n");
+    fprintf (fp, "precopy ()\n");
+    fprintf (fp, "{\n");
+    fprintf (fp, "mkdir -p \"$precopy_dir\"");
+    for (i = 0; config->disks[i] != NULL; ++i) {
+      CLEANUP_FREE char *name = get_precopy_disk_name (config->disks[i]);
+
+      fprintf (fp, " &&\n%s %s ",
+               config->precopy == PRECOPY_BULK ? "copy_disk" : "update_disk",
+               name);
+      print_nbd_port (fp, i);
+    }
+    for (i = 0; is_verifying (config) && config->disks[i] != NULL; ++i) {
+      CLEANUP_FREE char *name = get_precopy_disk_name (config->disks[i]);
+
+      fprintf (fp, " &&\nverify_disk %s ", name);
+      print_nbd_port (fp, i);
+    }
+    fprintf (fp, "\n");
+    fprintf (fp,
+             "# Save the exit code of the copy into the 'status' file.\n");
+    fprintf (fp, "echo $? > status\n");
+    fprintf (fp, "}\n");
+    fprintf (fp, "\n");
+  }
+
+  if (is_verifying (config)) {
+    fprintf (fp,
+             "# Wait for virt-p2v to upload the extent sums, which it\n"
+             "# computes while the disks are copied: wait_for_sums\n"
+             "wait_for_sums ()\n"
+             "{\n"
+             "    while [ ! -e disks/sums-ready ]; do\n"
+             "        if [ -e disks/read-failed ]; then\n"
+             "            echo \"virt-p2v could not compute the extent sums: $(< disks/read-failed)\"\n"
+             "            return 1\n"
+             "        fi\n"
+             "        kill -0 $metrics_pid 2>/dev/null || return 1\n"
+             "        sleep 1\n"
+             "    done\n"
+             "}\n"
+             "\n");
+    fprintf (fp,
+             "# Print the index and hash of each extent of what this\n"
+             "# server has of a disk, using all the cores for a copy:\n"
+             "# hash_extents NAME PORT\n"
+             "hash_extents ()\n"
+             "{\n"
+             "    local size esize n\n"
+             "    read -r _ _ _ size esize < $1.sums\n");
+    if (config->precopy == PRECOPY_FINAL)
+      fprintf (fp,
+               "    n=$(( (size + esize - 1) / esize ))\n"
+               "    seq 0 $(( n - 1 )) |\n"
+               "    xargs -P \"$(nproc)\" -I{} sh -c \\\n"
+               "        'echo {} $(dd if=\"$0\" bs=$1 skip={} count=1 iflag=fullblock status=none | xxhsum -H1 | cut -d\" \" -f1)' \\\n"
+               "        \"$precopy_dir/$1.img\" $esize\n");
+    else
+      fprintf (fp,
+               "    # Read the disk the same way as virt-v2v does.\n"
+               "    nbdcopy nbd://localhost:$2 - |\n"
+               "    split -b $esize --filter='xxhsum -H1 | cut -d\" \" -f1' |\n"
+               "    awk '{ print NR - 1, $1 }'\n");
+    fprintf (fp,
+             "}\n"
+             "\n");
+    fprintf (fp,
+             "# Compare the hash of each extent of a disk on this server\n"
+             "# with the sums computed on the physical machine, and list\n"
+             "# the extents which differ in NAME.mismatches:\n"
+             "# check_disk NAME PORT\n"
+             "check_disk ()\n"
+             "{\n"
+             "    local size esize n\n"
+             "    read -r _ _ _ size esize < $1.sums\n"
+             "    n=$(( (size + esize - 1) / esize ))\n"
+             "    hash_extents $1 $2 > $1.sums.server || return\n"
+             "    awk -v n=$n -v size=$size -v esize=$esize '\n"
+             "        NR == FNR { if (FNR > 1) want[FNR - 2] = $1; next }\n"
+             "        { got[$1] = $2 }\n"
+             "        END {\n"
+             "            for (i = 0; i < n; i++) {\n"
+             "                if (got[i] == \"\" || got[i] \"\" != want[i] \"\") {\n"
+             "                    len = size - i * esize\n"
+             "                    if (len > esize) len = esize\n"
+             "                    printf \"%%.0f %%.0f\\n\", i * esize, len\n"
+             "                }\n"
+             "            }\n"
+             "        }' $1.sums $1.sums.server > $1.mismatches || return\n"
+             "    while read -r off len; do\n"
+             "        echo \"The copy of $1 differs at offset $off, length $len\"\n"
+             "    done < $1.mismatches\n"
+             "    [ ! -s $1.mismatches ]\n"
+             "}\n"
+             "\n");
+    fprintf (fp,
+             "# Verify the copy of a disk: verify_disk NAME PORT\n"
+             "verify_disk ()\n"
+             "{\n"
+             "    if ! xxhsum -H1 /dev/null >/dev/null 2>&1; then\n"
+             "        echo \"xxhsum is not installed, so the copy of $1 cannot be verified\"\n"
+             "        return 1\n"
+             "    fi\n"
+             "    wait_for_sums || return\n"
+             "    echo \"Verifying the copy of $1 ...\"\n"
+             "    check_disk $1 $2 && return\n");
+    if (config->precopy == PRECOPY_FINAL) {
+      if (config->verify == VERIFY_RESEND)
+        fprintf (fp,
+                 "    echo \"Copying the extents of $1 which differ again ...\"\n"
+                 "    copy_extents $1 $2 $1.mismatches && check_disk $1 $2 && return\n");
+      fprintf (fp,
+               "    # Make the next final pass copy the whole disk.\n"
+               "    rm -f \"$precopy_dir/$1.map\"\n");
+    }
+    fprintf (fp,
+             "    return 1\n"
+             "}\n"
+             "\n");
+  }
+
+  if (config->precopy == PRECOPY_NONE && is_verifying (config)) {
+    fprintf (fp, "verify ()\n");
+    fprintf (fp, "{\n");
+    for (i = 0; config->disks[i] != NULL; ++i) {
+      CLEANUP_FREE char *name = get_precopy_disk_name (config->disks[i]);
+
+      fprintf (fp, "%sverify_disk %s ", i > 0 ? " &&\n" : "", name);
+      print_nbd_port (fp, i);
+    }
+    fprintf (fp, "\n");
+    fprintf (fp,
+             "# Save the exit code of the verification into the\n"
+             "# 'verify-status' file.\n");
+    fprintf (fp, "echo $? > verify-status\n");
+    fprintf (fp, "}\n");
+    fprintf (fp, "\n");
+  }
+
   fprintf (fp,
            "# Write a pre-emptive error status, in case the virt-v2v\n"
            "# command doesn't get to run at all.  This will be\n"
@@ -561,6 +1870,191 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp, "printenv > environment\n");
   fprintf (fp, "\n");
 
+  if (is_framed (config)) {
+    fprintf (fp,
+             "# The data connections are compressed or deduplicated\n"
+             "# (p2v.compress, p2v.dedup).  A decompressor is started\n"
+             "# for each one as soon as it is announced, listening on\n"
+             "# another port, and virt-v2v is pointed at that instead.\n");
+    fprintf (fp, "decompress_args=()\n");
+    if (config->dedup) {
+      fprintf (fp, "dedup_cache=");
+      print_quoted (fp, config->remote.dedup_cache ?
+                    config->remote.dedup_cache : "/var/tmp/virt-p2v-dedup");
+      fprintf (fp, "\n");
+      fprintf (fp, "mkdir -p \"$dedup_cache\"");
+      if (!config->remote.dedup_cache)
+        fprintf (fp, " && chmod 1777 \"$dedup_cache\" 2>/dev/null");
+      fprintf (fp, "\n");
+      fprintf (fp, "decompress_args=(--cache \"$dedup_cache\")\n");
+    }
+    fprintf (fp,
+             "# start_decompressor PORT\n"
+             "start_decompressor ()\n"
+             "{\n"
+             "    python3 p2v-decompress \"${decompress_args[@]}\" $1 > decompress.$1 2>> $log &\n"
+             "    echo $! >> decompress.pids\n"
+             "}\n");
+    fprintf (fp,
+             "# Point virt-v2v at the decompressor of disk N: use_decompressor N\n"
+             "use_decompressor ()\n"
+             "{\n"
+             "    local i port=$(< disks/$1)\n"
+             "    for i in $(seq 1 100); do\n"
+             "        [ -s decompress.$port ] && break\n"
+             "        sleep 0.1\n"
+             "    done\n"
+             "    if [ ! -s decompress.$port ]; then\n"
+             "        echo \"python3 is needed on the conversion server to use p2v.compress and p2v.dedup\"\n"
+             "        return 1\n"
+             "    fi\n"
+             "    sed -i \"s/port=\\\"$port\\\"/port=\\\"$(< decompress.$port)\\\"/\" physical.xml\n"
+             "}\n");
+  }
+  fprintf (fp,
+           "# The port where virt-v2v can read disk N: nbd_port N\n"
+           "nbd_port ()\n"
+           "{\n"
+           "    local port=$(< disks/$1)\n");
+  if (is_framed (config))
+    fprintf (fp, "    cat decompress.$port 2>/dev/null || echo $port\n");
+  else
+    fprintf (fp, "    echo $port\n");
+  fprintf (fp, "}\n");
+  fprintf (fp, "\n");
+
+  fprintf (fp,
+           "# virt-p2v sends records over this connection as lines\n"
+           "# starting with '# p2v-' (so they are harmless if the shell\n"
+           "# reads them):\n"
+           "#   '# p2v-disk N PORT': the data connection for disk N is\n"
+           "#     up, and the disk can be read on PORT.\n"
+           "#   '# p2v-disks-ready': all the disks have been announced\n"
+           "#     and physical.xml has been uploaded.\n"
+           "#   '# p2v-map NAME K': segment K of the block map of\n"
+           "#     disk NAME has been uploaded (final pass only).\n"
+           "#   '# p2v-sums-ready': the extent sums for p2v.verify\n"
+           "#     have been uploaded.\n"
+           "#   '# p2v-read-failed MESSAGE': virt-p2v could not read\n"
+           "#     the disks for the block maps or the extent sums.\n"
+           "#   '# p2v-metrics JSON': sent while the conversion runs.\n"
+           "#     Keep the latest one in p2v-metrics.json and all of\n"
+           "#     them in p2v-metrics.log.\n");
+  fprintf (fp, "stty -echo 2>/dev/null\n");
+  fprintf (fp, "exec 3<&0\n");
+  fprintf (fp, "mkdir -p disks\n");
+  fprintf (fp,
+           "while read -r line <&3; do\n"
+           "    case \"$line\" in\n"
+           "    \"# p2v-disk \"*)\n"
+           "        set -- ${line#\\# p2v-disk }\n"
+           "        echo $2 > disks/$1\n");
+  if (is_framed (config))
+    fprintf (fp,
+           "        start_decompressor $2\n");
+  fprintf (fp,
+           "        ;;\n"
+           "    \"# p2v-disks-ready\")\n"
+           "        : > disks/ready\n"
+           "        ;;\n"
+           "    \"# p2v-sums-ready\")\n"
+           "        : > disks/sums-ready\n"
+           "        ;;\n"
+           "    \"# p2v-map \"*)\n"
+           "        set -- ${line#\\# p2v-map }\n"
+           "        : > disks/map-$1.$2\n"
+           "        ;;\n"
+           "    \"# p2v-read-failed \"*)\n"
+           "        echo \"${line#\\# p2v-read-failed }\" > disks/read-failed\n"
+           "        ;;\n"
+           "    \"# p2v-metrics \"*)\n"
+           "        line=\"${line#\\# p2v-metrics }\"\n"
+           "        echo \"$line\" >> p2v-metrics.log\n"
+           "        echo \"$line\" > p2v-metrics.json.tmp\n"
+           "        mv p2v-metrics.json.tmp p2v-metrics.json\n"
+           "        ;;\n"
+           "    esac\n"
+           "done &\n");
+  fprintf (fp, "metrics_pid=$!\n");
+  fprintf (fp, "\n");
+
+  if (config->remote.slots > 0) {
+    fprintf (fp,
+             "# Wait for one of the %d conversion slots on this server.\n"
+             "# A slot is taken by holding a flock(1) lock on one of the\n"
+             "# slot files, so it is released whenever this script (and\n"
+             "# virt-v2v) exits, even if it is killed.  Waiting clients\n"
+             "# are served in order from the tickets in the queue\n"
+             "# directory, each named after its arrival time.  Each\n"
+             "# client holds a lock on its ticket (fd 5) while it waits,\n"
+             "# so a ticket left behind by a client which was killed, or\n"
+             "# by a reboot, is not locked and is skipped.\n",
+             config->remote.slots);
+    fprintf (fp, "slots=%d\n", config->remote.slots);
+    fprintf (fp, "slot_dir=/var/tmp/virt-p2v-slots\n");
+    fprintf (fp,
+             "mkdir -p $slot_dir/queue 2>/dev/null &&\n"
+             "    chmod 1777 $slot_dir $slot_dir/queue 2>/dev/null\n");
+    fprintf (fp, "ticket=$slot_dir/queue/$(date +%%s%%N).$$\n");
+    fprintf (fp,
+             "# Lock the ticket before it appears in the queue, so that\n"
+             "# no other client can take it for a stale one.\n"
+             "t=$(mktemp $slot_dir/ticket.XXXXXX) &&\n"
+             "    chmod 0644 $t && exec 5< $t && flock 5 && mv $t $ticket\n");
+    fprintf (fp, "trap 'rm -f $ticket' EXIT\n");
+    fprintf (fp, "trap 'exit 130' INT TERM HUP\n");
+    fprintf (fp,
+             "queue_position ()\n"
+             "{\n"
+             "    local t pos=0\n"
+             "    for t in $slot_dir/queue/*; do\n"
+             "        if [ \"$t\" != \"$ticket\" ]; then\n"
+             "            { exec 6< $t; } 2>/dev/null || continue\n"
+             "            if flock -n 6; then\n"
+             "                # Nobody is waiting with this ticket.\n"
+             "                exec 6<&-\n"
+             "                rm -f $t 2>/dev/null\n"
+             "                continue\n"
+             "            fi\n"
+             "            exec 6<&-\n"
+             "        fi\n"
+             "        pos=$((pos+1))\n"
+             "        [ \"$t\" = \"$ticket\" ] && break\n"
+             "    done\n"
+             "    echo $pos\n"
+             "}\n");
+    fprintf (fp,
+             "take_slot ()\n"
+             "{\n"
+             "    local i f\n"
+             "    for i in $(seq 1 $slots); do\n"
+             "        f=$slot_dir/slot$i\n"
+             "        [ -e $f ] || { : > $f && chmod 0666 $f; } 2>/dev/null\n"
+             "        { exec 4< $f; } 2>/dev/null || continue\n"
+             "        if flock -n 4; then\n"
+             "            echo $i > slot\n"
+             "            return 0\n"
+             "        fi\n"
+             "        exec 4<&-\n"
+             "    done\n"
+             "    return 1\n"
+             "}\n");
+    fprintf (fp,
+             "last=\n"
+             "while :; do\n"
+             "    pos=$(queue_position)\n"
+             "    [ \"$pos\" -le 1 ] && take_slot && break\n"
+             "    if [ \"$pos\" != \"$last\" ]; then\n"
+             "        echo \"Waiting for one of the $slots conversion slots on $(hostname): position $pos in the queue ...\"\n"
+             "        last=$pos\n"
+             "    fi\n"
+             "    sleep 2\n"
+             "done\n"
+             "rm -f $ticket\n"
+             "exec 5<&-\n");
+    fprintf (fp, "\n");
+  }
+
   fprintf (fp,
            "# Log the version of virt-v2v (for information only).\n");
   if (config->auth.sudo)
@@ -568,10 +2062,84 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp, "virt-v2v --version > v2v-version\n");
   fprintf (fp, "\n");
 
+  if (config->precopy != PRECOPY_BULK) {
+    fprintf (fp,
+             "# While virt-p2v sets up the data connections, make sure\n"
+             "# the libguestfs appliance which virt-v2v boots is built\n"
+             "# and cached, and its files are in the page cache.  It\n"
+             "# must not hold the conversion slot (fd 4), and it is\n"
+             "# killed if this script exits first.\n");
+    if (config->auth.sudo)
+      fprintf (fp, "sudo -n ");
+    fprintf (fp,
+             "guestfish --ro -a /dev/null run"
+             " </dev/null > appliance-warmup.log 2>&1 4<&- &\n");
+    fprintf (fp, "warmup_pid=$!\n");
+    fprintf (fp, "trap '%skill $warmup_pid 2>/dev/null' EXIT\n",
+             config->remote.slots > 0 ? "rm -f $ticket; " : "");
+    fprintf (fp, "\n");
+  }
+
+  fprintf (fp,
+           "# Wait until virt-p2v has announced all the disks.  If the\n"
+           "# control connection is closed first, give up.\n");
+  fprintf (fp,
+           "while [ ! -e disks/ready ]; do\n"
+           "    kill -0 $metrics_pid 2>/dev/null || exit 1\n"
+           "    sleep 0.1\n"
+           "done\n");
+  fprintf (fp, "\n");
+
   fprintf (fp,
            "# Run virt-v2v.  Send stdout back to virt-p2v.  Send stdout\n"
            "# and stderr (debugging info) to the log file.\n");
-  fprintf (fp, "v2v 2>> $log | tee -a $log\n");
+  if (is_framed (config)) {
+    fprintf (fp, "if ");
+    for (i = 0; config->disks[i] != NULL; ++i)
+      fprintf (fp, "%suse_decompressor %zu", i > 0 ? " &&\n   " : "", i);
+    fprintf (fp, "; then\n");
+  }
+  switch (config->precopy) {
+  case PRECOPY_NONE:
+    if (is_verifying (config)) {
+      fprintf (fp,
+               "# Verify the disks through the data connections while\n"
+               "# virt-v2v converts them.\n");
+      fprintf (fp, "{ verify 2>> $log | tee -a $log; } 4<&- &\n");
+      fprintf (fp, "verify_pid=$!\n");
+    }
+    fprintf (fp, "v2v 2>> $log | tee -a $log\n");
+    if (is_verifying (config))
+      fprintf (fp,
+               "if [ \"$(< status)\" -eq 0 ]; then\n"
+               "    wait $verify_pid\n"
+               "    [ \"$(cat verify-status 2>/dev/null)\" = 0 ] || echo 1 > status\n"
+               "fi\n");
+    break;
+  case PRECOPY_BULK:
+    fprintf (fp,
+             "# Warm migration, bulk pass: only copy the disks.\n");
+    fprintf (fp, "precopy 2>> $log | tee -a $log\n");
+    break;
+  case PRECOPY_FINAL:
+    fprintf (fp,
+             "# Warm migration, final pass: copy the changed blocks,\n"
+             "# then convert the copies.\n");
+    fprintf (fp, "precopy 2>> $log | tee -a $log\n");
+    fprintf (fp,
+             "if [ \"$(< status)\" -eq 0 ]; then\n"
+             "    v2v 2>> $log | tee -a $log\n"
+             "fi\n");
+    break;
+  default:
+    abort ();
+  }
+  if (is_framed (config)) {
+    fprintf (fp, "fi\n");
+    fprintf (fp, "kill $metrics_pid $(cat decompress.pids 2>/dev/null) 2>/dev/null\n");
+  }
+  else
+    fprintf (fp, "kill $metrics_pid 2>/dev/null\n");
   fprintf (fp, "\n");
 
   fprintf (fp,
@@ -621,49 +2189,295 @@ print_quoted (FILE *fp, const char *s)
   fprintf (fp, "\"");
 }
 
+static void *
+upload_system_data_thread (void *data)
+{
+  struct upload_system_data_args *args = data;
+
+  upload_system_data (args->config, args->remote_dir);
+  return NULL;
+}
+
+static int
+is_disk_reader_cancelled (void)
+{
+  return disk_reader_stop || is_cancel_requested ();
+}
+
+/* Upload segment C<k> of the block map of disk C<i> as soon as it has
+ * been written, and tell the wrapper script (see update_disk in the
+ * wrapper script).
+ */
+static int
+upload_map_segment (size_t i, uint64_t k, const char *filename, void *argsv)
+{
+  struct disk_reader_args *args = argsv;
+  CLEANUP_FREE char *name = get_precopy_disk_name (args->config->disks[i]);
+
+  if (scp_file (args->config, args->remote_dir, filename, NULL) == -1) {
+    if (asprintf (&args->error, "scp: %s", get_ssh_error ()) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    return -1;
+  }
+  return send_control_record ("# p2v-map %s %" PRIu64, name, k);
+}
+
+/* Read the disks while they are copied: write and upload the block
+ * maps in segments in the final pass of a warm migration, and the
+ * extent sums for p2v.verify.  Tell the wrapper script if that
+ * failed.
+ */
+static void *
+disk_reader_thread (void *data)
+{
+  struct disk_reader_args *args = data;
+  const struct config *config = args->config;
+  const bool sums = is_verifying (config);
+  const size_t phase = timeline_begin ("read disks");
+  size_t i;
+  int r;
+
+  if (config->precopy == PRECOPY_FINAL)
+    r = stream_block_maps (config, args->tmpdir, sums,
+                           upload_map_segment, args,
+                           is_disk_reader_cancelled);
+  else
+    r = write_extent_sums (config, args->tmpdir, is_disk_reader_cancelled);
+  if (r == -1) {
+    ignore_value (send_control_record ("# p2v-read-failed %s",
+                                       args->error ? args->error :
+                                       get_precopy_error ()));
+    goto out;
+  }
+
+  for (i = 0; sums && config->disks[i] != NULL; ++i) {
+    CLEANUP_FREE char *name = get_precopy_disk_name (config->disks[i]);
+    CLEANUP_FREE char *sums_file = NULL;
+
+    if (asprintf (&sums_file, "%s/%s.sums", args->tmpdir, name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (scp_file (config, args->remote_dir, sums_file, NULL) == -1) {
+      ignore_value (send_control_record ("# p2v-read-failed scp: %s",
+                                         get_ssh_error ()));
+      goto out;
+    }
+  }
+  if (sums)
+    ignore_value (send_control_record ("# p2v-sums-ready"));
+
+ out:
+  timeline_end (phase);
+  return NULL;
+}
+
 /**
- * Collect data about the system running virt-p2v such as the dmesg
- * output and lists of PCI devices.  This is useful for diagnosis when
- * things go wrong.
- *
- * If any command fails, this is non-fatal.
+ * Read the number of bytes that process C<pid> has read, from
+ * F</proc/PID/io>.  For nbdkit this is the amount of data read from
+ * the disk.  Returns C<0> if it cannot be read.
+ */
+static uint64_t
+get_proc_rchar (pid_t pid)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  char path[64];
+  uint64_t rchar = 0;
+
+  snprintf (path, sizeof path, "/proc/%d/io", (int) pid);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return 0;
+  if (fscanf (fp, "rchar: %" SCNu64, &rchar) != 1)
+    return 0;
+  return rchar;
+}
+
+/**
+ * Read the CPU time (user + system) used so far by process C<pid>,
+ * from F</proc/PID/stat>.  Returns C<0> if it cannot be read.
+ */
+static double
+get_proc_cpu_seconds (pid_t pid)
+{
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0;
+  char path[64];
+  FILE *fp;
+  const char *p;
+  unsigned long utime, stime;
+  int r;
+
+  snprintf (path, sizeof path, "/proc/%d/stat", (int) pid);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return 0;
+  r = getline (&line, &len, fp);
+  fclose (fp);
+  if (r == -1)
+    return 0;
+
+  /* The command name can contain spaces, so start after it. */
+  p = strrchr (line, ')');
+  if (p == NULL ||
+      sscanf (p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+              &utime, &stime) != 2)
+    return 0;
+  return (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+}
+
+/**
+ * Update the CPU usage of nbdkit and ssh in the metrics.
  */
 static void
-generate_system_data (const char *dmesg_file,
-                      const char *lscpu_file,
-                      const char *lspci_file,
-                      const char *lsscsi_file,
-                      const char *lsusb_file)
-{
-  CLEANUP_FREE char *cmd = NULL;
-
-  if (asprintf (&cmd,
-                "dmesg >%s 2>&1; "
-                "lscpu >%s 2>&1; "
-                "lspci -vvv >%s 2>&1; "
-                "lsscsi -v >%s 2>&1; "
-                "lsusb -v >%s 2>&1",
-                dmesg_file, lscpu_file, lspci_file, lsscsi_file, lsusb_file)
-      == -1)
-    error (EXIT_FAILURE, errno, "asprintf");
+sample_metrics (struct disk_watcher *w)
+{
+  double nbdkit_cpu = 0, ssh_cpu = 0;
+  size_t i;
 
-  ignore_value (system (cmd));
+  for (i = 0; i < w->nr_disks; ++i) {
+    if (w->disks[i].nbd_pid > 0)
+      nbdkit_cpu += get_proc_cpu_seconds (w->disks[i].nbd_pid);
+    if (w->data_conns[i].h)
+      ssh_cpu += get_proc_cpu_seconds (mexp_get_pid (w->data_conns[i].h));
+  }
+  pthread_mutex_lock (&cancel_requested_mutex);
+  if (control_h)
+    ssh_cpu += get_proc_cpu_seconds (mexp_get_pid (control_h));
+  pthread_mutex_unlock (&cancel_requested_mutex);
+
+  update_metrics_sample (nbdkit_cpu, ssh_cpu);
 }
 
 /**
- * Generate a file containing the version of virt-p2v.
- *
- * The version of virt-v2v is contained in the conversion log.
+ * Send a metrics record over the control connection.  The wrapper
+ * script saves it in the remote directory.
  */
 static void
-generate_p2v_version_file (const char *p2v_version_file)
+send_metrics_record (void)
+{
+  CLEANUP_FREE char *record = format_metrics_record ();
+
+  ignore_value (send_control_record ("# p2v-metrics %s", record));
+}
+
+/**
+ * Thread which periodically samples how much each NBD server has
+ * read, to find when the first and last bytes of each disk were
+ * transferred, and to keep the metrics up to date.
+ */
+static void *
+disk_watcher_thread (void *data)
 {
-  FILE *fp = fopen (p2v_version_file, "w");
-  if (fp == NULL) {
-    perror (p2v_version_file);
-    return;                     /* non-fatal */
+  struct disk_watcher *w = data;
+  unsigned ticks = 0;
+  size_t i;
+
+  pthread_mutex_lock (&w->lock);
+  while (!w->stop) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += DISK_WATCH_INTERVAL_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait (&w->cond, &w->lock, &ts);
+
+    for (i = 0; i < w->nr_disks; ++i) {
+      struct disk_progress *d = &w->disks[i];
+      uint64_t rchar;
+
+      if (d->nbd_pid <= 0)
+        continue;
+      rchar = get_proc_rchar (d->nbd_pid);
+      if (rchar > d->base + d->bytes) {
+        d->last = timeline_now ();
+        if (d->first == 0)
+          d->first = d->last;
+        if (!w->any_read) {
+          /* This is the end of startup as far as the conversion
+           * server is concerned.
+           */
+          timeline_mark ("first NBD read");
+          w->any_read = true;
+        }
+        d->bytes = rchar - d->base;
+        update_metrics_disk (i, d->bytes);
+      }
+    }
+
+    ticks++;
+    if (ticks % METRICS_SAMPLE_TICKS == 0)
+      sample_metrics (w);
+    if (ticks % METRICS_SEND_TICKS == 0)
+      send_metrics_record ();
   }
-  fprintf (fp, "%s %s\n",
-           g_get_prgname (), PACKAGE_VERSION_FULL);
-  fclose (fp);
+  pthread_mutex_unlock (&w->lock);
+
+  return NULL;
+}
+
+static void
+start_disk_watcher (struct disk_watcher *w,
+                    struct data_conn *data_conns, size_t nr)
+{
+  size_t i;
+  int err;
+
+  w->disks = calloc (nr, sizeof (struct disk_progress));
+  if (w->disks == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  w->nr_disks = nr;
+  w->data_conns = data_conns;
+  w->stop = false;
+  w->any_read = false;
+  for (i = 0; i < nr; ++i) {
+    w->disks[i].nbd_pid = data_conns[i].nbd_pid;
+    if (w->disks[i].nbd_pid > 0)
+      w->disks[i].base = get_proc_rchar (w->disks[i].nbd_pid);
+  }
+
+  pthread_mutex_init (&w->lock, NULL);
+  pthread_cond_init (&w->cond, NULL);
+  err = pthread_create (&w->thread, NULL, disk_watcher_thread, w);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    pthread_mutex_destroy (&w->lock);
+    pthread_cond_destroy (&w->cond);
+    free (w->disks);
+    w->disks = NULL;
+  }
+}
+
+/**
+ * Stop the disk watcher (if it was started) and add the time taken to
+ * transfer each disk to the timeline.
+ */
+static void
+stop_disk_watcher (struct disk_watcher *w, const struct config *config)
+{
+  size_t i;
+
+  if (w->disks == NULL)
+    return;
+
+  pthread_mutex_lock (&w->lock);
+  w->stop = true;
+  pthread_cond_signal (&w->cond);
+  pthread_mutex_unlock (&w->lock);
+  pthread_join (w->thread, NULL);
+  pthread_mutex_destroy (&w->lock);
+  pthread_cond_destroy (&w->cond);
+
+  for (i = 0; i < w->nr_disks; ++i) {
+    const struct disk_progress *d = &w->disks[i];
+
+    if (d->first > 0)
+      timeline_add (d->first, d->last, "transfer %s (%" PRIu64 " bytes)",
+                    config->disks[i], d->bytes);
+  }
+
+  free (w->disks);
+  w->disks = NULL;
 }
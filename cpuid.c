@@ -18,7 +18,10 @@
 /**
  * Find CPU vendor, topology and some CPU flags.
  *
- * lscpu (from util-linux) provides CPU vendor, topology and flags.
+ * The vendor and flags are read from F</proc/cpuinfo>, and the
+ * topology (sockets, cores, threads, NUMA nodes, caches and hybrid
+ * core types) from F</sys/devices/system>.  This is done once and
+ * cached, since the topology is needed several times.
  *
  * ACPI can be read by seeing if F</sys/firmware/acpi> exists.
  *
@@ -33,13 +36,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <errno.h>
 #include <error.h>
 #include <libintl.h>
 
-#include "ignore-value.h"
+#include <pthread.h>
 
 #include "p2v.h"
 
@@ -53,95 +59,345 @@ free_cpu_config (struct cpu_config *cpu)
   memset (cpu, 0, sizeof *cpu);
 }
 
+#define SYS_CPU "/sys/devices/system/cpu"
+#define SYS_NODE "/sys/devices/system/node"
+
+/* Everything we know about the host CPUs, computed once. */
+static pthread_once_t cpu_info_once = PTHREAD_ONCE_INIT;
+static char *cpuinfo_vendor;    /* "vendor_id" field, or NULL */
+static char *cpuinfo_flags;     /* "flags" field, or NULL */
+static struct cpu_topo cpu_info_topo;
+
+/**
+ * Read an unsigned integer from a sysfs file.  Returns C<-1> if the
+ * file doesn't exist or can't be parsed.
+ */
+static int
+read_sysfs_uint (const char *path, unsigned *ret)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return -1;
+  if (fscanf (fp, "%u", ret) != 1)
+    return -1;
+  return 0;
+}
+
+/**
+ * Count the CPUs in a cpulist file such as
+ * F</sys/devices/cpu_core/cpus>, which contains something like
+ * C<0-15,32-47>.  Returns 0 if the file does not exist.
+ */
+static unsigned
+count_cpulist (const char *path)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  unsigned first, last, count = 0;
+  int c;
+
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return 0;
+
+  for (;;) {
+    if (fscanf (fp, "%u", &first) != 1)
+      break;
+    last = first;
+    c = getc (fp);
+    if (c == '-') {
+      if (fscanf (fp, "%u", &last) != 1)
+        break;
+      c = getc (fp);
+    }
+    if (last >= first)
+      count += last - first + 1;
+    if (c != ',')
+      break;
+  }
+
+  return count;
+}
+
 /**
- * Get the output of lscpu as a list of (key, value) pairs (as a
- * flattened list of strings).
+ * Parse the fields we need from F</proc/cpuinfo>.  Only the first
+ * processor is examined, since they are all the same (except on
+ * hybrid CPUs, where the differences don't matter here).
  */
-static char **
-get_lscpu (void)
+static void
+parse_proc_cpuinfo (void)
 {
-  const char *cmd;
-  CLEANUP_PCLOSE FILE *fp = NULL;
+  CLEANUP_FCLOSE FILE *fp = NULL;
   CLEANUP_FREE char *line = NULL;
-  ssize_t len;
   size_t buflen = 0;
-  char **ret = NULL;
-  size_t ret_size = 0;
-
-  cmd = "lscpu";
+  ssize_t len;
 
-  fp = popen (cmd, "re");
+  fp = fopen ("/proc/cpuinfo", "re");
   if (fp == NULL) {
-    perror (cmd);
-    return NULL;
+    perror ("/proc/cpuinfo");
+    return;
   }
 
-  ret = malloc (sizeof (char *));
-  if (ret == NULL) error (EXIT_FAILURE, errno, "malloc");
-  ret[0] = NULL;
-
-  while (errno = 0, (len = getline (&line, &buflen, fp)) != -1) {
-    char *p;
-    char *key, *value;
+  while ((len = getline (&line, &buflen, fp)) != -1) {
+    char *p, *end;
 
     if (len > 0 && line[len-1] == '\n')
-      line[len-1] = '\0';
+      line[--len] = '\0';
 
-    /* Split the line at the first ':' character. */
+    /* A blank line separates processors. */
+    if (len == 0)
+      break;
+
+    /* Lines are "key<tab>: value". */
     p = strchr (line, ':');
     if (p == NULL)
       continue;
-
-    *p = '\0';
-    key = strdup (line);
-    /* Skip leading whitespace in the value. */
+    for (end = p; end > line && g_ascii_isspace (end[-1]); --end)
+      ;
+    *end = '\0';
     for (++p; *p && g_ascii_isspace (*p); ++p)
       ;
-    value = strdup (p);
-
-    /* Add key and value to the list, and trailing NULL pointer. */
-    ret_size += 2;
-    ret = realloc (ret, (ret_size + 1) * sizeof (char *));
-    if (ret == NULL) error (EXIT_FAILURE, errno, "realloc");
-    ret[ret_size-2] = key;
-    ret[ret_size-1] = value;
-    ret[ret_size] = NULL;
+
+    if (cpuinfo_vendor == NULL && STREQ (line, "vendor_id")) {
+      cpuinfo_vendor = strdup (p);
+      if (cpuinfo_vendor == NULL)
+        error (EXIT_FAILURE, errno, "strdup");
+    }
+    else if (cpuinfo_flags == NULL && STREQ (line, "flags")) {
+      cpuinfo_flags = strdup (p);
+      if (cpuinfo_flags == NULL)
+        error (EXIT_FAILURE, errno, "strdup");
+    }
+  }
+}
+
+static int
+compare_uint64 (const void *vp1, const void *vp2)
+{
+  const uint64_t v1 = *(const uint64_t *) vp1;
+  const uint64_t v2 = *(const uint64_t *) vp2;
+
+  return v1 < v2 ? -1 : v1 > v2 ? 1 : 0;
+}
+
+/* Count the distinct values in a sorted array. */
+static unsigned
+count_distinct (const uint64_t *v, size_t n)
+{
+  unsigned count = 0;
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    if (i == 0 || v[i] != v[i-1])
+      count++;
+  return count;
+}
+
+/**
+ * Work out the number of sockets, cores per socket and threads per
+ * core from the topology directories of the online CPUs, the same way
+ * that L<lscpu(1)> does.
+ */
+static void
+parse_sys_topology (struct cpu_topo *topo)
+{
+  DIR *dir;
+  struct dirent *d;
+  uint64_t *packages = NULL, *cores = NULL;
+  size_t n = 0, alloc = 0;
+  unsigned nr_sockets, nr_cores;
+
+  dir = opendir (SYS_CPU);
+  if (dir == NULL) {
+    perror (SYS_CPU);
+    return;
   }
 
-  if (errno) {
-    perror (cmd);
-    guestfs_int_free_string_list (ret);
-    return NULL;
+  while ((d = readdir (dir)) != NULL) {
+    CLEANUP_FREE char *path = NULL;
+    unsigned package, core;
+
+    if (!STRPREFIX (d->d_name, "cpu") ||
+        !g_ascii_isdigit (d->d_name[3]))
+      continue;
+
+    /* Offline CPUs have no topology directory. */
+    if (asprintf (&path, SYS_CPU "/%s/topology/physical_package_id",
+                  d->d_name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (read_sysfs_uint (path, &package) == -1)
+      continue;
+    free (path);
+    if (asprintf (&path, SYS_CPU "/%s/topology/core_id", d->d_name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (read_sysfs_uint (path, &core) == -1)
+      continue;
+
+    if (n >= alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      packages = realloc (packages, alloc * sizeof (uint64_t));
+      cores = realloc (cores, alloc * sizeof (uint64_t));
+      if (packages == NULL || cores == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+    }
+    packages[n] = package;
+    cores[n] = (uint64_t) package << 32 | core;
+    n++;
+  }
+  closedir (dir);
+
+  if (n > 0) {
+    qsort (packages, n, sizeof (uint64_t), compare_uint64);
+    qsort (cores, n, sizeof (uint64_t), compare_uint64);
+    nr_sockets = count_distinct (packages, n);
+    nr_cores = count_distinct (cores, n);
+
+    topo->nr_cpus = n;
+    topo->sockets = nr_sockets;
+    topo->cores = nr_cores / nr_sockets;
+    topo->threads = n / nr_cores;
   }
 
-  return ret;
+  free (packages);
+  free (cores);
 }
 
 /**
- * Read a single field from lscpu output.
- *
- * If the field does not exist, returns C<NULL>.
+ * Read the sizes of the caches of the first CPU.
  */
-static const char *
-get_field (char **lscpu, const char *key)
+static void
+parse_sys_caches (struct cpu_topo *topo)
 {
   size_t i;
 
-  for (i = 0; lscpu[i] != NULL; i += 2) {
-    if (STREQ (lscpu[i], key))
-      return lscpu[i+1];
+  for (i = 0; ; ++i) {
+    CLEANUP_FREE char *path = NULL;
+    CLEANUP_FREE char *type = NULL;
+    CLEANUP_FREE char *size = NULL;
+    unsigned level, kb;
+    char unit = 'K';
+
+    if (asprintf (&path, SYS_CPU "/cpu0/cache/index%zu/level", i) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (read_sysfs_uint (path, &level) == -1)
+      break;
+
+    free (path);
+    if (asprintf (&path, SYS_CPU "/cpu0/cache/index%zu/type", i) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (!g_file_get_contents (path, &type, NULL, NULL))
+      continue;
+
+    /* Size is something like "48K" or "30M". */
+    free (path);
+    if (asprintf (&path, SYS_CPU "/cpu0/cache/index%zu/size", i) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (!g_file_get_contents (path, &size, NULL, NULL) ||
+        sscanf (size, "%u%c", &kb, &unit) < 1)
+      continue;
+    if (unit == 'M')
+      kb *= 1024;
+
+    if (level == 1 && STRPREFIX (type, "Data"))
+      topo->l1d_kb = kb;
+    else if (level == 1 && STRPREFIX (type, "Instruction"))
+      topo->l1i_kb = kb;
+    else if (level == 2)
+      topo->l2_kb = kb;
+    else if (level == 3)
+      topo->l3_kb = kb;
+  }
+}
+
+/**
+ * Count the NUMA nodes.
+ */
+static void
+parse_sys_numa (struct cpu_topo *topo)
+{
+  DIR *dir;
+  struct dirent *d;
+
+  topo->numa_nodes = 1;
+
+  dir = opendir (SYS_NODE);
+  if (dir == NULL)
+    return;                     /* kernel without NUMA */
+
+  topo->numa_nodes = 0;
+  while ((d = readdir (dir)) != NULL) {
+    if (STRPREFIX (d->d_name, "node") && g_ascii_isdigit (d->d_name[4]))
+      topo->numa_nodes++;
   }
+  closedir (dir);
+
+  if (topo->numa_nodes == 0)
+    topo->numa_nodes = 1;
+}
+
+static void
+init_cpu_info (void)
+{
+  struct cpu_topo *topo = &cpu_info_topo;
+
+  parse_proc_cpuinfo ();
+
+  topo->sockets = topo->cores = topo->threads = topo->nr_cpus = 1;
+  parse_sys_topology (topo);
+  parse_sys_caches (topo);
+  parse_sys_numa (topo);
+
+  /* Intel hybrid CPUs (eg. Alder Lake) have separate PMUs for the
+   * performance and efficiency cores.
+   */
+  topo->performance_cpus = count_cpulist ("/sys/devices/cpu_core/cpus");
+  topo->efficiency_cpus = count_cpulist ("/sys/devices/cpu_atom/cpus");
+
+#if DEBUG_STDERR
+  fprintf (stderr,
+           "%s: cpu: %s, %u CPUs: %u sockets, %u cores, %u threads, "
+           "%u NUMA nodes, L1d %uK L1i %uK L2 %uK L3 %uK",
+           g_get_prgname (),
+           cpuinfo_vendor ? cpuinfo_vendor : "unknown vendor",
+           topo->nr_cpus, topo->sockets, topo->cores, topo->threads,
+           topo->numa_nodes,
+           topo->l1d_kb, topo->l1i_kb, topo->l2_kb, topo->l3_kb);
+  if (topo->performance_cpus || topo->efficiency_cpus)
+    fprintf (stderr, ", hybrid %u P + %u E",
+             topo->performance_cpus, topo->efficiency_cpus);
+  fprintf (stderr, "\n");
+#endif
+}
 
-  return NULL;
+/**
+ * Is C<flag> one of the space-separated flags from F</proc/cpuinfo>?
+ */
+static bool
+has_flag (const char *flag)
+{
+  const size_t len = strlen (flag);
+  const char *p = cpuinfo_flags;
+
+  if (p == NULL)
+    return false;
+
+  while ((p = strstr (p, flag)) != NULL) {
+    if ((p == cpuinfo_flags || p[-1] == ' ') &&
+        (p[len] == '\0' || p[len] == ' '))
+      return true;
+    p += len;
+  }
+  return false;
 }
 
 /**
- * Read the CPU vendor from lscpu output.
+ * Read the CPU vendor.
  */
 static void
-get_vendor (char **lscpu, struct cpu_config *cpu)
+get_vendor (struct cpu_config *cpu)
 {
-  const char *vendor = get_field (lscpu, "Vendor ID");
+  const char *vendor = cpuinfo_vendor;
 
   if (vendor) {
     /* Note this mapping comes from /usr/share/libvirt/cpu_map.xml */
@@ -149,57 +405,32 @@ get_vendor (char **lscpu, struct cpu_config *cpu)
       cpu->vendor = strdup ("Intel");
     else if (STREQ (vendor, "AuthenticAMD"))
       cpu->vendor = strdup ("AMD");
-    /* Currently aarch64 lscpu has no Vendor ID XXX. */
+    /* aarch64 /proc/cpuinfo has no vendor_id field XXX. */
   }
 }
 
 /**
- * Read the CPU topology from a separate lscpu invocation.
+ * Return the CPU topology.
  */
 void
 get_cpu_topology (struct cpu_topo *topo)
 {
-
-  CLEANUP_FREE_STRING_LIST char **lscpu = NULL;
-
-  lscpu = get_lscpu ();
-
-  if (lscpu != NULL) {
-    const char *sockets, *cores, *threads;
-
-    sockets = get_field (lscpu, "Socket(s)");
-    cores = get_field (lscpu, "Core(s) per socket");
-    threads = get_field (lscpu, "Thread(s) per core");
-    if (sockets && cores && threads) {
-      ignore_value (sscanf (sockets, "%u", &topo->sockets));
-      ignore_value (sscanf (cores, "%u", &topo->cores));
-      ignore_value (sscanf (threads, "%u", &topo->threads));
-      return;
-    }
-  }
-  topo->sockets = 1;
-  topo->cores = 1;
-  topo->threads = 1;
+  pthread_once (&cpu_info_once, init_cpu_info);
+  *topo = cpu_info_topo;
 }
 
 /**
- * Read some important flags from lscpu output.
+ * Read some important flags.
  */
 static void
-get_flags (char **lscpu, struct cpu_config *cpu)
+get_flags (struct cpu_config *cpu)
 {
-  const char *flags;
+  cpu->apic = has_flag ("apic");
+  cpu->pae = has_flag ("pae");
 
-  flags = get_field (lscpu, "Flags");
-  if (flags) {
-    cpu->apic = strstr (flags, " apic ") != NULL;
-    cpu->pae = strstr (flags, " pae ") != NULL;
-
-    /* aarch64 /proc/cpuinfo has a "Features" field, but lscpu does
-     * not expose it.  However aarch64 Features does not contain any
-     * of the interesting flags above.
-     */
-  }
+  /* aarch64 /proc/cpuinfo has a "Features" field instead, but it
+   * does not contain any of the interesting flags above.
+   */
 }
 
 /**
@@ -214,15 +445,10 @@ get_acpi (struct cpu_config *cpu)
 void
 get_cpu_config (struct cpu_config *cpu)
 {
-  CLEANUP_FREE_STRING_LIST char **lscpu = NULL;
-
   free_cpu_config (cpu);
 
-  lscpu = get_lscpu ();
-  if (lscpu != NULL) {
-    get_vendor (lscpu, cpu);
-    get_flags (lscpu, cpu);
-  }
-
+  pthread_once (&cpu_info_once, init_cpu_info);
+  get_vendor (cpu);
+  get_flags (cpu);
   get_acpi (cpu);
 }
@@ -10,6 +10,12 @@ dnl   ARCHLINUX=1    Arch Linux
 dnl   SUSE=1         SUSE, OpenSUSE
 dnl   OPENMANDRIVA=1 OpenMandriva
 dnl
+dnl HEADLESS=1 may also be defined, for the minimal image flavour
+dnl (virt-p2v-make-disk --headless) which only runs virt-p2v in
+dnl kernel command line mode.  This leaves out X11 and everything
+dnl which is only used by the GUI.  The Gtk libraries are still
+dnl needed because the virt-p2v binary is linked with them.
+dnl
 dnl NB 1: Must be one package name per line.  Blank lines are ignored.
 dnl
 dnl NB 2: This works differently from appliance/packagelist.in
@@ -33,6 +39,7 @@ ifelse(REDHAT,1,
   nbdkit-server
   nbdkit-file-plugin
   which
+  /usr/sbin/dmsetup
 
   dnl Generally useful tools to use within xterm
   vim-minimal
@@ -40,6 +47,11 @@ ifelse(REDHAT,1,
   dnl Useful disk and diagnostic utilities.
   iscsi-initiator-utils
 
+  NetworkManager
+  dnl sysadmins prefer ifconfig
+  net-tools
+
+  ifelse(HEADLESS,1,,
   dnl X11 environment
   /usr/bin/xinit
   /usr/bin/Xorg
@@ -50,13 +62,11 @@ ifelse(REDHAT,1,
   mesa-dri-drivers
   metacity
 
-  NetworkManager
   nm-connection-editor
   network-manager-applet
   dnl dbus is required by nm-applet, but not a dependency in Fedora
   dbus-x11
-  dnl sysadmins prefer ifconfig
-  net-tools
+  )
 
   dnl RHBZ#1157679
   @hardware-support
@@ -75,16 +85,19 @@ ifelse(DEBIAN,1,
   openssh-client
   nbdkit
   debianutils
+  dmsetup
   vim-tiny
   open-iscsi
+  network-manager
+  net-tools
+  ifelse(HEADLESS,1,,
   xorg
   xserver-xorg-video-all
   fonts-dejavu
   metacity
-  network-manager
   network-manager-gnome
   dbus-x11
-  net-tools
+  )
 )
 
 ifelse(ARCHLINUX,1,
@@ -96,18 +109,21 @@ ifelse(ARCHLINUX,1,
   openssh
   nbdkit
   which
+  device-mapper
   vim-tiny
   open-iscsi
+  NetworkManager
+  net-tools
+  ifelse(HEADLESS,1,,
   xorg-xinit
   xorg-server
   xf86-video-*
   ttf-dejavu
   metacity
-  NetworkManager
   nm-connection-editor
   network-manager-applet
   dbus-x11
-  net-tools
+  )
 )
 
 ifelse(SUSE,1,
@@ -119,20 +135,23 @@ ifelse(SUSE,1,
   nbdkit-server
   nbdkit-file-plugin
   openssh
+  device-mapper
   dnl /usr/bin/which is in util-linux on SUSE
   vim
   open-iscsi
+  NetworkManager
+  SuSEfirewall2
+  ifelse(HEADLESS,1,,
   xinit
   xorg-x11-server
   xf86-video-*
   dejavu-fonts
-  NetworkManager
   xf86-input-*
   icewm-lite
   dbus-1-x11
   yast2-network
   libyui-qt
-  SuSEfirewall2
+  )
 )
 
 ifelse(OPENMANDRIVA,1,
@@ -148,10 +167,16 @@ ifelse(OPENMANDRIVA,1,
   nbdkit-server
   nbdkit-file-plugin
   which
+  /usr/sbin/dmsetup
 
   dnl Generally useful tools to use within xterm
   vim-enhanced
 
+  NetworkManager
+  dnl sysadmins prefer ifconfig
+  net-tools
+
+  ifelse(HEADLESS,1,,
   dnl X11 environment
   /usr/bin/xinit
   /usr/bin/Xorg
@@ -162,13 +187,11 @@ ifelse(OPENMANDRIVA,1,
   mesa-dri-drivers
   kwin_x11
 
-  NetworkManager
   nm-connection-editor
   network-manager-applet
   dnl dbus is required by nm-applet, but not a dependency in Fedora
   dbus-x11
-  dnl sysadmins prefer ifconfig
-  net-tools
+  )
 )
 
 dnl Run as external programs by the p2v binary.
@@ -179,7 +202,7 @@ lsscsi
 pciutils
 usbutils
 util-linux
-xterm
+ifelse(HEADLESS,1,,xterm)
 
 dnl Generally useful tools to use within xterm
 less
@@ -22,6 +22,9 @@
 #include <error.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +40,10 @@
 
 #include "p2v.h"
 
+/* The mirrors found by the last call to find_all_disks. */
+static struct disk_mirror *mirrors;
+static size_t nr_mirrors;
+
 /**
  * Get parent device of a partition.
  *
@@ -155,9 +162,629 @@ device_contains (const char *dev, dev_t root_device)
   return 0;
 }
 
+/**
+ * Decide if the named device in F</sys/block> (eg. C<"sda">, or
+ * C<"cciss!c0d0">) is a fixed hard disk which can be converted, a
+ * removable media drive, or something else which we ignore.
+ */
+enum disk_type
+get_disk_type (const char *name)
+{
+  dev_t root_device = 0;
+  struct stat statbuf;
+
+  if (STRPREFIX (name, "cciss!") ||
+      STRPREFIX (name, "hd") ||
+      STRPREFIX (name, "nvme") ||
+      STRPREFIX (name, "sd") ||
+      STRPREFIX (name, "ubd") ||
+      STRPREFIX (name, "vd")) {
+    /* Skip SCSI disk drives with removable media that have no media inserted
+     * -- effectively, empty floppy drives. Note that SCSI CD-ROMs are named
+     * C<sr*> and thus handled on the other branch.
+     */
+    if (device_has_no_media (name))
+      return DISK_TYPE_OTHER;
+
+    /* Skip the device containing the root filesystem. */
+    if (stat ("/", &statbuf) == 0)
+      root_device = statbuf.st_dev;
+    if (device_contains (name, root_device))
+      return DISK_TYPE_OTHER;
+
+    return DISK_TYPE_FIXED;
+  }
+  else if (STRPREFIX (name, "sr"))
+    return DISK_TYPE_REMOVABLE;
+
+  return DISK_TYPE_OTHER;
+}
+
+static char *read_sysfs_line (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+
+/* Read the first line of a file in sysfs, without the newline.
+ * Returns C<NULL> if the file cannot be read.
+ */
+static char *
+read_sysfs_line (const char *fs, ...)
+{
+  va_list args;
+  CLEANUP_FREE char *path = NULL;
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t r;
+
+  va_start (args, fs);
+  if (vasprintf (&path, fs, args) == -1)
+    error (EXIT_FAILURE, errno, "vasprintf");
+  va_end (args);
+
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return NULL;
+  r = getline (&line, &len, fp);
+  if (r == -1) {
+    free (line);
+    return NULL;
+  }
+  if (r > 0 && line[r-1] == '\n')
+    line[r-1] = '\0';
+  return line;
+}
+
+/* Return the size of a block device in F</sys/block> (in sectors),
+ * where C<name> is a path relative to F</sys/block>, or C<0> if it
+ * is not known.
+ */
+static uint64_t
+get_sysfs_size (const char *name)
+{
+  CLEANUP_FREE char *size = read_sysfs_line ("/sys/block/%s/size", name);
+
+  return size ? strtoull (size, NULL, 10) : 0;
+}
+
+/* Return the names of the devices in a F<holders> or F<slaves>
+ * directory in sysfs, or C<NULL> if there are none.
+ */
+static char **
+list_sysfs_dir (const char *name, const char *subdir)
+{
+  CLEANUP_FREE char *path = NULL;
+  DIR *dir;
+  struct dirent *d;
+  char **ret = NULL;
+  size_t n = 0;
+
+  if (asprintf (&path, "/sys/block/%s/%s", name, subdir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  dir = opendir (path);
+  if (dir == NULL)
+    return NULL;
+  while ((d = readdir (dir)) != NULL) {
+    if (d->d_name[0] == '.')
+      continue;
+    ret = realloc (ret, sizeof (char *) * (n + 2));
+    if (ret == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    ret[n] = strdup (d->d_name);
+    if (ret[n] == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    ret[++n] = NULL;
+  }
+  closedir (dir);
+  return ret;
+}
+
+/* Is C<top>, an LVM logical volume, a RAID1 or mirror LV?  Its
+ * images (the legs of the mirror) are the same size as the LV, unlike
+ * RAID 4/5/6/10 where they are smaller.
+ */
+static bool
+is_lvm_mirror (const char *top)
+{
+  CLEANUP_FREE_STRING_LIST char **slaves = list_sysfs_dir (top, "slaves");
+  const uint64_t size = get_sysfs_size (top);
+  size_t i, nr_images = 0;
+
+  for (i = 0; slaves && slaves[i] != NULL; ++i) {
+    CLEANUP_FREE char *name =
+      read_sysfs_line ("/sys/block/%s/dm/name", slaves[i]);
+
+    if (name && (strstr (name, "_rimage_") || strstr (name, "_mimage_"))) {
+      if (get_sysfs_size (slaves[i]) != size)
+        return false;
+      nr_images++;
+    }
+  }
+  return nr_images >= 2;
+}
+
+/* Is C<flag> one of the comma separated flags in C<flags>? */
+static bool
+has_flag (const char *flags, const char *flag)
+{
+  const size_t len = strlen (flag);
+  const char *p = flags;
+
+  while ((p = strstr (p, flag)) != NULL) {
+    if ((p == flags || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+      return true;
+    p += len;
+  }
+  return false;
+}
+
+/* Is C<slot>, a member of the Linux software RAID array C<holder>,
+ * in sync?  Failed and spare members, and members which are still
+ * being rebuilt, do not have a good copy of the data.
+ */
+static bool
+md_member_in_sync (const char *holder, const char *slot)
+{
+  const char *base = strrchr (slot, '/');
+  CLEANUP_FREE char *state = NULL;
+
+  base = base ? base + 1 : slot;
+  state = read_sysfs_line ("/sys/block/%s/md/dev-%s/state", holder, base);
+  return state && has_flag (state, "in_sync") && !has_flag (state, "faulty");
+}
+
+/* Is the device-mapper device C<image> (its name), an image or the
+ * metadata of the LVM RAID1 or mirror LV C<top> (in F</sys/block>),
+ * in sync?  This reads the health characters from the status of
+ * C<top>, where C<A> means that the image is alive (and for RAID1,
+ * in sync).  For the older mirror target, all the regions must also
+ * be in sync.
+ */
+static bool
+lvm_image_in_sync (const char *top, const char *image)
+{
+  CLEANUP_FREE char *dev = read_sysfs_line ("/sys/block/%s/dev", top);
+  CLEANUP_FREE char *cmd = NULL;
+  CLEANUP_PCLOSE FILE *fp = NULL;
+  CLEANUP_FREE char *line = NULL;
+  CLEANUP_FREE_STRING_LIST char **fields = NULL;
+  const char *p, *health, *ratio;
+  size_t len = 0, nr_fields, index;
+  unsigned major, minor;
+  uint64_t synced, total;
+
+  /* The mirror log does not hold a copy of the data. */
+  if (strstr (image, "_mlog"))
+    return true;
+
+  p = strrchr (image, '_');
+  if (p == NULL || sscanf (p + 1, "%zu", &index) != 1)
+    return false;
+
+  if (dev == NULL || sscanf (dev, "%u:%u", &major, &minor) != 2)
+    return false;
+  if (asprintf (&cmd, "dmsetup status -j %u -m %u 2>/dev/null",
+                major, minor) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  fp = popen (cmd, "r");
+  if (fp == NULL)
+    return false;
+  if (getline (&line, &len, fp) == -1)
+    return false;
+  line[strcspn (line, "\n")] = '\0';
+  fields = guestfs_int_split_string (' ', line);
+  if (fields == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  nr_fields = guestfs_int_count_strings (fields);
+
+  /* START LENGTH raid raid1 #DEVS HEALTH SYNCED/TOTAL ...
+   * START LENGTH mirror #DEVS DEVS... SYNCED/TOTAL #ARGS HEALTH ...
+   */
+  if (nr_fields >= 7 && STREQ (fields[2], "raid")) {
+    health = fields[5];
+    ratio = NULL;
+  }
+  else if (nr_fields >= 4 && STREQ (fields[2], "mirror")) {
+    const size_t n = strtoul (fields[3], NULL, 10);
+
+    if (nr_fields < n + 7)
+      return false;
+    ratio = fields[n + 4];
+    health = fields[n + 6];
+  }
+  else
+    return false;
+
+  if (index >= strlen (health) || health[index] != 'A')
+    return false;
+  if (ratio &&
+      (sscanf (ratio, "%" SCNu64 "/%" SCNu64, &synced, &total) != 2 ||
+       synced != total))
+    return false;
+  return true;
+}
+
+/* If C<holder>, a device in F</sys/block> which holds the partition
+ * or disk C<slot>, keeps a complete copy of the data on C<slot> on
+ * other disks, return the name of the array, or else C<NULL>.  The
+ * copy on C<slot> must itself be in sync.
+ */
+static char *
+get_mirror_array (const char *holder, const char *slot)
+{
+  CLEANUP_FREE char *level = NULL, *uuid = NULL, *name = NULL;
+  char *ret;
+
+  /* Linux software RAID (md). */
+  level = read_sysfs_line ("/sys/block/%s/md/level", holder);
+  if (level) {
+    if (STRNEQ (level, "raid1") || !md_member_in_sync (holder, slot))
+      return NULL;
+    ret = strdup (holder);
+    goto out;
+  }
+
+  uuid = read_sysfs_line ("/sys/block/%s/dm/uuid", holder);
+  name = read_sysfs_line ("/sys/block/%s/dm/name", holder);
+  if (uuid == NULL || name == NULL)
+    return NULL;
+
+  /* Each path of a multipath device sees all of the data. */
+  if (STRPREFIX (uuid, "mpath-")) {
+    ret = strdup (name);
+    goto out;
+  }
+
+  /* BIOS RAID (dmraid).  A mirror is no bigger than its members,
+   * unlike a stripe.
+   */
+  if (STRPREFIX (uuid, "DMRAID-")) {
+    if (get_sysfs_size (holder) > get_sysfs_size (slot))
+      return NULL;
+    ret = strdup (name);
+    goto out;
+  }
+
+  /* The images and metadata of an LVM RAID1 or mirror LV, which are
+   * held by the LV itself.
+   */
+  if (STRPREFIX (uuid, "LVM-") &&
+      (strstr (name, "_rimage_") || strstr (name, "_rmeta_") ||
+       strstr (name, "_mimage_") || strstr (name, "_mlog"))) {
+    CLEANUP_FREE_STRING_LIST char **tops = list_sysfs_dir (holder, "holders");
+    CLEANUP_FREE char *top_name = NULL;
+
+    if (tops == NULL || tops[1] != NULL || !is_lvm_mirror (tops[0]) ||
+        !lvm_image_in_sync (tops[0], name))
+      return NULL;
+    top_name = read_sysfs_line ("/sys/block/%s/dm/name", tops[0]);
+    if (top_name == NULL)
+      return NULL;
+    ret = strdup (top_name);
+    goto out;
+  }
+
+  return NULL;
+
+ out:
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  return ret;
+}
+
+/* Return the mirrored arrays which hold all of the data on the disk
+ * C<disk> (the name in F</sys/block>), as a sorted list, or C<NULL>
+ * if any of it is not mirrored, in which case the disk must be
+ * copied.  The disk itself may be a member of the array, or else
+ * every partition must be.
+ */
+static char **
+get_mirror_arrays (const char *disk)
+{
+  CLEANUP_FREE char *path = NULL;
+  CLEANUP_FREE_STRING_LIST char **slots = NULL;
+  char **ret = NULL;
+  size_t nr_slots = 0, nr_arrays = 0, i, j;
+  DIR *dir;
+  struct dirent *d;
+
+  /* The partitions are the subdirectories with a "partition" file. */
+  if (asprintf (&path, "/sys/block/%s", disk) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  dir = opendir (path);
+  if (dir == NULL)
+    return NULL;
+  while ((d = readdir (dir)) != NULL) {
+    CLEANUP_FREE char *partition = NULL;
+
+    if (d->d_name[0] == '.')
+      continue;
+    partition = read_sysfs_line ("/sys/block/%s/%s/partition",
+                                 disk, d->d_name);
+    if (partition == NULL)
+      continue;
+    slots = realloc (slots, sizeof (char *) * (nr_slots + 2));
+    if (slots == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    if (asprintf (&slots[nr_slots], "%s/%s", disk, d->d_name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    slots[++nr_slots] = NULL;
+  }
+  closedir (dir);
+  if (nr_slots == 0) {
+    slots = malloc (sizeof (char *) * 2);
+    if (slots == NULL)
+      error (EXIT_FAILURE, errno, "malloc");
+    slots[0] = strdup (disk);
+    if (slots[0] == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    slots[1] = NULL;
+  }
+
+  for (i = 0; slots[i] != NULL; ++i) {
+    CLEANUP_FREE_STRING_LIST char **holders = NULL;
+
+    /* Skip extended partitions, which only contain the partition
+     * table of the logical partitions.
+     */
+    if (get_sysfs_size (slots[i]) <= 2)
+      continue;
+
+    holders = list_sysfs_dir (slots[i], "holders");
+    if (holders == NULL)
+      goto not_mirrored;
+    for (j = 0; holders[j] != NULL; ++j) {
+      char *array = get_mirror_array (holders[j], slots[i]);
+      size_t k;
+
+      if (array == NULL)
+        goto not_mirrored;
+      for (k = 0; k < nr_arrays; ++k)
+        if (STREQ (ret[k], array))
+          break;
+      if (k < nr_arrays) {
+        free (array);
+        continue;
+      }
+      ret = realloc (ret, sizeof (char *) * (nr_arrays + 2));
+      if (ret == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+      ret[nr_arrays] = array;
+      ret[++nr_arrays] = NULL;
+    }
+  }
+
+  if (ret)
+    qsort (ret, nr_arrays, sizeof (char *), compare_strings);
+  return ret;
+
+ not_mirrored:
+  guestfs_int_free_string_list (ret);
+  return NULL;
+}
+
+static void
+free_mirrors (void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_mirrors; ++i) {
+    guestfs_int_free_string_list (mirrors[i].members);
+    free (mirrors[i].arrays);
+  }
+  free (mirrors);
+  mirrors = NULL;
+  nr_mirrors = 0;
+}
+
+/* Find the disks which are mirrors of each other: all of their data
+ * is in the same mirrored arrays.  Only the first member of each
+ * group is left in C<disks>, and the groups are saved for
+ * C<get_disk_mirror>.
+ */
+static void
+find_mirrors (char **disks)
+{
+  const size_t nr_disks = guestfs_int_count_strings (disks);
+  CLEANUP_FREE char **arrays = NULL;
+  size_t i, j, k;
+
+  free_mirrors ();
+
+  arrays = calloc (nr_disks, sizeof (char *));
+  if (arrays == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < nr_disks; ++i) {
+    CLEANUP_FREE char *sys_name = strdup (disks[i]);
+    CLEANUP_FREE_STRING_LIST char **list = NULL;
+    char *p;
+
+    if (sys_name == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    p = strchr (sys_name, '/');
+    if (p) *p = '!';
+    list = get_mirror_arrays (sys_name);
+    if (list)
+      arrays[i] = guestfs_int_join_strings (" ", list);
+  }
+
+  for (i = 0; i < nr_disks; ++i) {
+    struct disk_mirror *mirror;
+    size_t nr_members = 1;
+
+    if (arrays[i] == NULL)
+      continue;
+    for (j = i + 1; j < nr_disks; ++j)
+      if (arrays[j] && STREQ (arrays[i], arrays[j]))
+        nr_members++;
+    if (nr_members == 1) {
+      free (arrays[i]);
+      arrays[i] = NULL;
+      continue;
+    }
+
+    mirrors = realloc (mirrors, sizeof (struct disk_mirror) * (nr_mirrors + 1));
+    if (mirrors == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    mirror = &mirrors[nr_mirrors++];
+    mirror->arrays = arrays[i];
+    mirror->members = malloc (sizeof (char *) * (nr_members + 1));
+    if (mirror->members == NULL)
+      error (EXIT_FAILURE, errno, "malloc");
+    mirror->members[0] = strdup (disks[i]);
+    if (mirror->members[0] == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    for (j = i + 1, k = 1; j < nr_disks; ++j) {
+      if (arrays[j] && STREQ (mirror->arrays, arrays[j])) {
+        mirror->members[k++] = disks[j];
+        disks[j] = NULL;        /* removed below */
+        free (arrays[j]);
+        arrays[j] = NULL;
+      }
+    }
+    mirror->members[k] = NULL;
+    arrays[i] = NULL;
+
+#if DEBUG_STDERR
+    fprintf (stderr, "%s: disks mirrored in %s: only %s is converted\n",
+             g_get_prgname (), mirror->arrays, mirror->members[0]);
+#endif
+  }
+
+  for (i = j = 0; i < nr_disks; ++i)
+    if (disks[i] != NULL)
+      disks[j++] = disks[i];
+  disks[j] = NULL;
+}
+
+/**
+ * If the disk C<disk> (eg. C<"sda">) was found to be one of a group
+ * of disks which mirror each other (Linux software RAID1, an LVM
+ * RAID1 or mirror volume, BIOS RAID1 or multipath), return the group,
+ * else C<NULL>.  The first member is the one which is converted by
+ * default.  The group is valid until C<find_all_disks> is called
+ * again.
+ */
+const struct disk_mirror *
+get_disk_mirror (const char *disk)
+{
+  size_t i, j;
+
+  for (i = 0; i < nr_mirrors; ++i)
+    for (j = 0; mirrors[i].members[j] != NULL; ++j)
+      if (STREQ (mirrors[i].members[j], disk))
+        return &mirrors[i];
+  return NULL;
+}
+
+struct partition {
+  unsigned nr;
+  char *name;
+};
+
+static int
+compare_partitions (const void *vp1, const void *vp2)
+{
+  const struct partition *p1 = vp1, *p2 = vp2;
+
+  return p1->nr < p2->nr ? -1 : p1->nr > p2->nr;
+}
+
+/**
+ * Return the partitions of the disk C<disk> (eg. C<"sda">) which can
+ * be left out of the copy (see C<p2v.exclude_partitions>), in the
+ * order of their partition numbers, or C<NULL> if it has none.
+ * Extended partitions, which only hold the partition table of the
+ * logical partitions, are not returned.
+ */
+char **
+get_disk_partitions (const char *disk)
+{
+  CLEANUP_FREE char *sys_name = strdup (disk);
+  CLEANUP_FREE char *path = NULL;
+  struct partition *parts = NULL;
+  size_t nr_parts = 0, i;
+  char **ret;
+  DIR *dir;
+  struct dirent *d;
+  char *p;
+
+  /* cciss device /dev/cciss/c0d0 will be /sys/block/cciss!c0d0 */
+  if (sys_name == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  p = strchr (sys_name, '/');
+  if (p) *p = '!';
+
+  if (asprintf (&path, "/sys/block/%s", sys_name) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  dir = opendir (path);
+  if (dir == NULL)
+    return NULL;
+  while ((d = readdir (dir)) != NULL) {
+    CLEANUP_FREE char *partition = NULL;
+    CLEANUP_FREE char *slot = NULL;
+
+    if (d->d_name[0] == '.')
+      continue;
+    partition = read_sysfs_line ("/sys/block/%s/%s/partition",
+                                 sys_name, d->d_name);
+    if (partition == NULL)
+      continue;
+    if (asprintf (&slot, "%s/%s", sys_name, d->d_name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (get_sysfs_size (slot) <= 2)
+      continue;
+    parts = realloc (parts, sizeof (struct partition) * (nr_parts + 1));
+    if (parts == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    parts[nr_parts].nr = strtoul (partition, NULL, 10);
+    parts[nr_parts].name = strdup (d->d_name);
+    if (parts[nr_parts].name == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    p = strchr (parts[nr_parts].name, '!');
+    if (p) *p = '/';
+    nr_parts++;
+  }
+  closedir (dir);
+  if (nr_parts == 0)
+    return NULL;
+
+  qsort (parts, nr_parts, sizeof (struct partition), compare_partitions);
+  ret = malloc (sizeof (char *) * (nr_parts + 1));
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  for (i = 0; i < nr_parts; ++i)
+    ret[i] = parts[i].name;
+  ret[nr_parts] = NULL;
+  free (parts);
+  return ret;
+}
+
+/**
+ * Return the size in bytes of the partition C<partition> (eg.
+ * C<"sda3">), or C<0> if it is not known.
+ */
+uint64_t
+get_partition_size (const char *partition)
+{
+  CLEANUP_FREE char *sys_name = strdup (partition);
+  CLEANUP_FREE char *size = NULL;
+  char *p;
+
+  if (sys_name == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  p = strchr (sys_name, '/');
+  if (p) *p = '!';
+  size = read_sysfs_line ("/sys/class/block/%s/size", sys_name);
+  return size ? strtoull (size, NULL, 10) * 512 : 0;
+}
+
 /**
  * Enumerate all disks in F</sys/block> and return them in the C<disks> and
  * C<removable> arrays.
+ *
+ * If several disks mirror each other, only the first is returned in
+ * C<disks>, since it has all of the data.  Use C<get_disk_mirror> to
+ * find the others.
  */
 void
 find_all_disks (char ***disks, char ***removable)
@@ -166,11 +793,6 @@ find_all_disks (char ***disks, char ***removable)
   struct dirent *d;
   size_t nr_disks = 0, nr_removable = 0;
   char **ret_disks = NULL, **ret_removable = NULL;
-  dev_t root_device = 0;
-  struct stat statbuf;
-
-  if (stat ("/", &statbuf) == 0)
-    root_device = statbuf.st_dev;
 
   /* The default list of disks is everything in /sys/block which
    * matches the common patterns for disk names.
@@ -184,23 +806,9 @@ find_all_disks (char ***disks, char ***removable)
     d = readdir (dir);
     if (!d) break;
 
-    if (STRPREFIX (d->d_name, "cciss!") ||
-        STRPREFIX (d->d_name, "hd") ||
-        STRPREFIX (d->d_name, "nvme") ||
-        STRPREFIX (d->d_name, "sd") ||
-        STRPREFIX (d->d_name, "ubd") ||
-        STRPREFIX (d->d_name, "vd")) {
+    switch (get_disk_type (d->d_name)) {
+    case DISK_TYPE_FIXED: {
       char *p;
-      /* Skip SCSI disk drives with removable media that have no media inserted
-       * -- effectively, empty floppy drives. Note that SCSI CD-ROMs are named
-       * C<sr*> and thus handled on the other branch.
-       */
-      if (device_has_no_media (d->d_name))
-        continue;
-
-      /* Skip the device containing the root filesystem. */
-      if (device_contains (d->d_name, root_device))
-        continue;
 
       nr_disks++;
       ret_disks = realloc (ret_disks, sizeof (char *) * (nr_disks + 1));
@@ -214,8 +822,10 @@ find_all_disks (char ***disks, char ***removable)
       if (p) *p = '/';
 
       ret_disks[nr_disks] = NULL;
+      break;
     }
-    else if (STRPREFIX (d->d_name, "sr")) {
+
+    case DISK_TYPE_REMOVABLE:
       nr_removable++;
       ret_removable = realloc (ret_removable,
                                sizeof (char *) * (nr_removable + 1));
@@ -223,6 +833,10 @@ find_all_disks (char ***disks, char ***removable)
         error (EXIT_FAILURE, errno, "realloc");
       ret_removable[nr_removable-1] = strdup (d->d_name);
       ret_removable[nr_removable] = NULL;
+      break;
+
+    case DISK_TYPE_OTHER:
+      break;
     }
   }
 
@@ -234,8 +848,12 @@ find_all_disks (char ***disks, char ***removable)
   if (closedir (dir) == -1)
     error (EXIT_FAILURE, errno, "closedir: %s", "/sys/block");
 
-  if (ret_disks)
+  if (ret_disks) {
     qsort (ret_disks, nr_disks, sizeof (char *), compare_strings);
+    find_mirrors (ret_disks);
+  }
+  else
+    free_mirrors ();
   if (ret_removable)
     qsort (ret_removable, nr_removable, sizeof (char *), compare_strings);
 
@@ -82,6 +82,20 @@ my @enums = (
     ["OUTPUT_ALLOCATION_SPARSE",       "sparse",       "sparse"],
     ["OUTPUT_ALLOCATION_PREALLOCATED", "preallocated", "preallocated"],
   )],
+  ["precopy", (
+    ["PRECOPY_NONE",  "none",  "copy and convert in one pass"],
+    ["PRECOPY_BULK",  "bulk",  "copy the disks while the machine runs"],
+    ["PRECOPY_FINAL", "final", "copy the changed blocks and convert"],
+  )],
+  ["verify", (
+    ["VERIFY_NONE",   "none",   "do not verify the copies"],
+    ["VERIFY_REPORT", "report", "report differences and stop"],
+    ["VERIFY_RESEND", "resend", "copy differing extents again"],
+  )],
+  ["nbd_server", (
+    ["NBD_SERVER_NBDKIT",  "nbdkit",  "run nbdkit for each disk"],
+    ["NBD_SERVER_BUILTIN", "builtin", "use the built-in NBD server"],
+  )],
 );
 
 # Configuration fields.
@@ -91,6 +105,8 @@ my @fields = [
     elements => [
       ConfigString->new(name => 'server'),
       ConfigInt->new(name => 'port', value => 22),
+      ConfigInt->new(name => 'slots', value => 0),
+      ConfigString->new(name => 'dedup_cache'),
     ],
   ),
   ConfigSection->new(
@@ -102,8 +118,6 @@ my @fields = [
         name => 'identity',
         elements => [
           ConfigString->new(name => 'url'),
-          ConfigString->new(name => 'file'),
-          ConfigBool->new(name => 'file_needs_update'),
         ],
       ),
       ConfigBool->new(name => 'sudo'),
@@ -136,9 +150,16 @@ my @fields = [
     ],
   ),
   ConfigStringList->new(name => 'disks'),
+  ConfigStringList->new(name => 'exclude_partitions'),
   ConfigStringList->new(name => 'removable'),
   ConfigStringList->new(name => 'interfaces'),
   ConfigStringList->new(name => 'network_map'),
+  ConfigEnum->new(name => 'precopy', enum => 'precopy'),
+  ConfigEnum->new(name => 'verify', enum => 'verify'),
+  ConfigEnum->new(name => 'nbd_server', enum => 'nbd_server'),
+  ConfigBool->new(name => 'compress'),
+  ConfigBool->new(name => 'dedup'),
+  ConfigBool->new(name => 'copy_swap'),
   ConfigSection->new(
     name => 'output',
     elements => [
@@ -154,10 +175,12 @@ my @fields = [
 
 # Some /proc/cmdline p2v.* options were renamed when we introduced
 # the generator.  This map creates backwards compatibility mappings
-# for these.
+# for these, and shorter names for a few newer options.
 my @cmdline_aliases = (
   ["p2v.remote.server",     "p2v.server"],
   ["p2v.remote.port",       "p2v.port"],
+  ["p2v.remote.slots",      "p2v.server_slots"],
+  ["p2v.remote.dedup_cache", "p2v.dedup_cache"],
   ["p2v.auth.username",     "p2v.username"],
   ["p2v.auth.password",     "p2v.password"],
   ["p2v.auth.identity.url", "p2v.identity"],
@@ -174,8 +197,6 @@ my @cmdline_aliases = (
 
 # Some config entries are not exposed on the kernel command line.
 my @cmdline_ignore = (
-  "p2v.auth.identity.file",
-  "p2v.auth.identity.file_needs_update",
 );
 
 # Man page snippets for each kernel command line setting.
@@ -193,6 +214,23 @@ then it switches to the GUI (interactive) configuration method.",
     shortopt => "PORT",
     description => "
 The SSH port number on the conversion server (default: C<22>).",
+  ),
+  "p2v.remote.slots" => manual_entry->new(
+    shortopt => "N",
+    description => "
+The maximum number of conversions which may run at the same time on
+the conversion server.  If this many virt-p2v clients are already
+converting, this conversion waits on the server until one of them
+finishes, and its position in the queue is shown.  See
+L</HOW VIRT-P2V WORKS> below.
+
+The default is C<0>, which means no limit.",
+  ),
+  "p2v.remote.dedup_cache" => manual_entry->new(
+    shortopt => "DIR",
+    description => "
+The directory on the conversion server where the block cache used by
+C<p2v.dedup> is kept.  The default is F</var/tmp/virt-p2v-dedup>.",
   ),
   "p2v.auth.username" => manual_entry->new(
     shortopt => "USERNAME",
@@ -311,7 +349,26 @@ A list of physical hard disks to convert, for example:
 
  p2v.disks=sda,sdc
 
-The default is to convert all local hard disks that are found.",
+The default is to convert all local hard disks that are found,
+except that where several disks are mirrors of each other (for
+example the members of a software RAID 1 array), only the first of
+them is converted.",
+  ),
+  "p2v.exclude_partitions" => manual_entry->new(
+    shortopt => "sda3,sdb1,...",
+    description => "
+A list of partitions of the disks being converted whose contents are
+not copied, for example a large scratch partition next to the
+operating system:
+
+ p2v.exclude_partitions=sda3
+
+The partition table is copied as usual, and the partitions keep
+their size, but they are sent as zeroes, so their data never crosses
+the network.  The converted guest sees an empty partition, which
+should be removed from its F</etc/fstab> or reformatted.  Extended
+partitions cannot be excluded, but the logical partitions inside them
+can.",
   ),
   "p2v.removable" => manual_entry->new(
     shortopt => "sra,srb,...",
@@ -353,6 +410,94 @@ See L<virt-v2v(1)/OPTIONS>.
 
 If not specified, the default is C<local>, and the converted guest is
 written to F</var/tmp>.",
+  ),
+  "p2v.precopy" => manual_entry->new(
+    shortopt => "", # ignored for enums
+    description => "
+Use warm migration, where the disks are copied in two passes, so that
+the physical machine only has to be offline for the second pass.  See
+L</WARM MIGRATION> below.
+
+C<p2v.precopy=bulk> copies the whole of each disk to the conversion
+server, while the physical machine is still running its usual
+operating system.  C<p2v.precopy=final> copies only the blocks which
+have changed since then, and converts the guest.  The default is
+C<none>, which copies and converts in one pass.",
+  ),
+  "p2v.verify" => manual_entry->new(
+    shortopt => "", # ignored for enums
+    description => "
+Check that what the conversion server received of each disk is the
+same as the disk, by comparing a hash of each 64 MB extent.  The
+physical machine computes its hashes by reading the disks in the
+background while they are copied, and the conversion server hashes
+what it has using L<xxhsum(1)>.
+
+In the final pass of a warm migration (C<p2v.precopy=final>) the
+hashes come from the same reads which find the changed blocks, and
+the copies on the conversion server are checked before they are
+converted.  C<p2v.verify=report> lists the extents which differ, and
+stops without converting.  C<p2v.verify=resend> copies the extents
+which differ again, and checks once more.
+
+Otherwise, the conversion server reads each disk through its data
+connection with L<nbdcopy(1)> at the same time as virt-v2v converts
+it, which roughly doubles the network traffic unless C<p2v.dedup> is
+used.  Any extents which differ are listed, and the conversion fails,
+for both C<report> and C<resend>.
+
+The default is C<none>.  This setting is ignored if
+C<p2v.precopy=bulk>.",
+  ),
+  "p2v.nbd_server" => manual_entry->new(
+    shortopt => "", # ignored for enums
+    description => "
+Choose the NBD server which serves the disks to the conversion
+server.  C<p2v.nbd_server=nbdkit> (the default) runs L<nbdkit(1)>
+for each disk.  C<p2v.nbd_server=builtin> uses a read-only NBD
+server built into virt-p2v, which does not need nbdkit.  The
+built-in server is also used if nbdkit is not installed, and for
+disks with swap or partitions which are not copied (see
+C<p2v.copy_swap> and C<p2v.exclude_partitions>).",
+  ),
+  "p2v.compress" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Compress the disk data sent over the data connections, which helps
+on slow networks.  The data is compressed with zlib by the built-in
+NBD server (see C<p2v.nbd_server>, which is implied), on all the
+CPUs, and the compression level is adjusted while the disks are
+copied, compressing harder while the network is the bottleneck and
+less while the CPUs are.  It is decompressed on the conversion
+server by a small helper, which needs L<python3(1)>.",
+  ),
+  "p2v.dedup" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Only send the blocks of the disks which the conversion server does
+not have already.  The conversion server keeps every block it
+receives in a cache (see C<p2v.remote.dedup_cache>), and the built-in
+NBD server (see C<p2v.nbd_server>, which is implied) sends the hashes
+of the blocks first, so when many similar machines are converted,
+blocks which they have in common are only sent once.  This needs
+L<python3(1)> on the conversion server, and can be used together with
+C<p2v.compress>.
+
+Blocks are named after their SHA-256 hash, which the conversion
+server computes itself from the data it receives, and checks again
+whenever it takes a block from the cache, so a block which does not
+match its name is never used.",
+  ),
+  "p2v.copy_swap" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Copy the contents of swap partitions, swap LVs, Linux swap files
+(F</swapfile>, F</swap.img>) and the Windows F<pagefile.sys>,
+F<hiberfil.sys> and F<swapfile.sys>.  By default they are found
+from the partition tables and filesystem metadata, and sent as
+zeroes, except for the first 64 KB which holds the swap signature
+or the hibernation header.  The number of bytes which are not
+copied is reported for each disk.",
   ),
   "p2v.output.allocation" => manual_entry->new(
     shortopt => "", # ignored for enums
@@ -484,9 +629,11 @@ EOF
 
   print $fh <<'EOF';
 extern struct config *new_config (void);
-extern struct config *copy_config (struct config *);
 extern void free_config (struct config *);
-extern void print_config (struct config *, FILE *);
+extern const struct config *snapshot_config (const struct config *);
+extern const struct config *ref_config (const struct config *);
+extern void unref_config (const struct config *);
+extern void print_config (const struct config *, FILE *);
 
 #endif /* GUESTFS_P2V_CONFIG_H */
 EOF
@@ -507,25 +654,35 @@ sub generate_field_initialization {
   }
 }
 
-sub generate_field_copy {
+sub generate_field_count {
   my ($fh, $v, $fields) = @_;
   foreach my $field (@$fields) {
     my $type = ref($field);
     if ($type eq 'ConfigSection') {
       my $lv = $v . $field->name . '.';
-      generate_field_copy($fh, $lv, $field->elements);
+      generate_field_count($fh, $lv, $field->elements);
     } elsif ($type eq 'ConfigString') {
-      printf $fh "  if (%s%s) {\n", $v, $field->name;
-      printf $fh "    %s%s = strdup (%s%s);\n", $v, $field->name, $v, $field->name;
-      printf $fh "    if (%s%s == NULL)\n", $v, $field->name;
-      printf $fh "      error (EXIT_FAILURE, errno, \"strdup: %%s\", \"%s\");\n", $field->name;
-      printf $fh "  }\n";
+      printf $fh "  count_string (&nr_bytes, %s%s);\n", $v, $field->name;
     } elsif ($type eq 'ConfigStringList') {
-      printf $fh "  if (%s%s) {\n", $v, $field->name;
-      printf $fh "    %s%s = guestfs_int_copy_string_list (%s%s);\n", $v, $field->name, $v, $field->name;
-      printf $fh "    if (%s%s == NULL)\n", $v, $field->name;
-      printf $fh "      error (EXIT_FAILURE, errno, \"copy string list: %%s\", \"%s\");\n", $field->name;
-      printf $fh "  }\n";
+      printf $fh "  count_string_list (&nr_ptrs, &nr_bytes, %s%s);\n", $v, $field->name;
+    }
+  }
+}
+
+sub generate_field_snapshot {
+  my ($fh, $v, $old, $fields) = @_;
+  foreach my $field (@$fields) {
+    my $type = ref($field);
+    if ($type eq 'ConfigSection') {
+      my $lv = $v . $field->name . '.';
+      my $lold = $old . $field->name . '.';
+      generate_field_snapshot($fh, $lv, $lold, $field->elements);
+    } elsif ($type eq 'ConfigString') {
+      printf $fh "  %s%s = arena_strdup (&a, %s%s);\n",
+                 $v, $field->name, $old, $field->name;
+    } elsif ($type eq 'ConfigStringList') {
+      printf $fh "  %s%s = arena_copy_string_list (&a, %s%s);\n",
+                 $v, $field->name, $old, $field->name;
     }
   }
 }
@@ -604,6 +761,8 @@ sub generate_p2v_config_c {
 #include <errno.h>
 #include <error.h>
 
+#include <pthread.h>
+
 #include "p2v.h"
 #include "p2v-config.h"
 
@@ -629,39 +788,160 @@ EOF
 }
 
 /**
- * Copy a config struct.
+ * Free a config struct.
  */
-struct config *
-copy_config (struct config *old)
+void
+free_config (struct config *c)
 {
-  struct config *c = new_config ();
+  if (c == NULL)
+    return;
+
+EOF
 
-  memcpy (c, old, sizeof *c);
+  generate_field_free($fh, "c->", @fields);
+
+  print $fh <<"EOF";
+  free (c);
+}
+
+/**
+ * A read-only snapshot of a config struct, see C<snapshot_config>.
+ * The string lists and then the strings follow the struct in the
+ * same allocation.
+ */
+struct config_snapshot {
+  struct config config;         /* must be first */
+  unsigned refs;
+  char *ptrs[];
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct arena {
+  char **ptrs;                  /* next free string list slot */
+  char *bytes;                  /* next free string byte */
+};
+
+static void
+count_string (size_t *nr_bytes, const char *str)
+{
+  if (str)
+    *nr_bytes += strlen (str) + 1;
+}
+
+static void
+count_string_list (size_t *nr_ptrs, size_t *nr_bytes, char **strs)
+{
+  size_t i;
+
+  if (strs == NULL)
+    return;
+  for (i = 0; strs[i] != NULL; ++i)
+    count_string (nr_bytes, strs[i]);
+  *nr_ptrs += i + 1;
+}
+
+static char *
+arena_strdup (struct arena *a, const char *str)
+{
+  size_t len;
+  char *ret;
+
+  if (str == NULL)
+    return NULL;
+  len = strlen (str) + 1;
+  ret = memcpy (a->bytes, str, len);
+  a->bytes += len;
+  return ret;
+}
+
+static char **
+arena_copy_string_list (struct arena *a, char **strs)
+{
+  char **ret = a->ptrs;
+  size_t i;
+
+  if (strs == NULL)
+    return NULL;
+  for (i = 0; strs[i] != NULL; ++i)
+    ret[i] = arena_strdup (a, strs[i]);
+  ret[i] = NULL;
+  a->ptrs += i + 1;
+  return ret;
+}
+
+/**
+ * Take a snapshot of a config struct, for the background threads.
+ *
+ * The snapshot, with all its strings and string lists, is a single
+ * allocation.  It must not be modified, so that any number of threads
+ * can share it, which is why it is returned as a C<const> pointer.
+ * It starts with one reference: use C<ref_config> to add one for each
+ * other thread, and C<unref_config> (never C<free_config>) to drop
+ * one.
+ */
+const struct config *
+snapshot_config (const struct config *old)
+{
+  struct config_snapshot *s;
+  struct arena a;
+  size_t nr_ptrs = 0, nr_bytes = 0;
 
-  /* Need to deep copy strings and string lists. */
 EOF
 
-  generate_field_copy($fh, "c->", @fields);
+  generate_field_count($fh, "old->", @fields);
 
   print $fh <<"EOF";
 
+  s = malloc (sizeof *s + nr_ptrs * sizeof (char *) + nr_bytes);
+  if (s == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  memcpy (&s->config, old, sizeof *old);
+  s->refs = 1;
+  a.ptrs = s->ptrs;
+  a.bytes = (char *) &s->ptrs[nr_ptrs];
+
+EOF
+
+  generate_field_snapshot($fh, "s->config.", "old->", @fields);
+
+  print $fh <<"EOF";
+
+  return &s->config;
+}
+
+/**
+ * Add a reference to a snapshot made by C<snapshot_config>.
+ */
+const struct config *
+ref_config (const struct config *c)
+{
+  struct config_snapshot *s = (struct config_snapshot *) c;
+
+  pthread_mutex_lock (&snapshot_lock);
+  s->refs++;
+  pthread_mutex_unlock (&snapshot_lock);
   return c;
 }
 
 /**
- * Free a config struct.
+ * Drop a reference to a snapshot made by C<snapshot_config>, freeing
+ * it when it was the last one.
  */
 void
-free_config (struct config *c)
+unref_config (const struct config *c)
 {
+  struct config_snapshot *s = (struct config_snapshot *) c;
+  unsigned refs;
+
   if (c == NULL)
     return;
 
-EOF
-
-  generate_field_free($fh, "c->", @fields);
-
-  print $fh <<"EOF";
+  pthread_mutex_lock (&snapshot_lock);
+  refs = --s->refs;
+  pthread_mutex_unlock (&snapshot_lock);
+  if (refs == 0)
+    free (s);
 }
 
 EOF
@@ -688,7 +968,7 @@ EOF
  * Print the conversion parameters and other important information.
  */
 void
-print_config (struct config *c, FILE *fp)
+print_config (const struct config *c, FILE *fp)
 {
   size_t i;
 
@@ -717,9 +997,9 @@ sub find_alias {
 sub find_enum {
   my $name = shift;
   foreach my $enum (@enums) {
-    my $n = shift @$enum;
+    my ($n, @choices) = @$enum;
     if ($n eq $name) {
-      return @$enum;
+      return @choices;
     }
   }
   return;
@@ -836,9 +1116,6 @@ EOF
   generate_field_config($fh, "p2v", "c->", @fields);
 
   print $fh <<"EOF";
-  if (c->auth.identity.url != NULL)
-    c->auth.identity.file_needs_update = 1;
-
   /* Undocumented command line parameter used for testing command line
    * parsing.
    */
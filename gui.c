@@ -97,12 +97,15 @@ static void create_connection_dialog (struct config *);
 static void create_conversion_dialog (struct config *config,
                                       const char * const *disks,
                                       const char * const *removable);
+static void start_hotplug_watch (void);
+static gboolean gui_ready (gpointer data);
 static void create_running_dialog (void);
 static void show_connection_dialog (void);
 static void show_conversion_dialog (void);
 static void show_running_dialog (void);
 
 static void set_info_label (void);
+static void set_disks_from_ui (struct config *);
 
 /* The connection dialog. */
 static GtkWidget *conn_dlg,
@@ -117,7 +120,7 @@ static GtkWidget *conv_dlg,
   *guestname_entry, *vcpu_topo, *vcpus_entry, *memory_entry,
   *vcpus_warning, *memory_warning, *target_warning_label,
   *o_combo, *oc_entry, *os_entry, *of_entry, *oa_combo, *oo_entry,
-  *info_label,
+  *info_label, *measure_label, *measure_button,
   *disks_list, *removable_list, *interfaces_list;
 static int vcpus_entry_when_last_sensitive;
 
@@ -129,6 +132,11 @@ static GtkWidget *run_dlg,
 /* Colour tags used in the v2v_output GtkTextBuffer. */
 static GtkTextTag *v2v_output_tags[16];
 
+/* False if disks should not be added or removed by hotplug events
+ * (ie. when using --test-disk).
+ */
+static bool disk_hotplug;
+
 /**
  * The entry point from the main program.
  *
@@ -137,19 +145,41 @@ static GtkTextTag *v2v_output_tags[16];
 void
 gui_conversion (struct config *config,
                 const char * const *disks,
-                const char * const *removable)
+                const char * const *removable,
+                bool disk_hotplug_p)
 {
+  size_t phase;
+
+  disk_hotplug = disk_hotplug_p;
+
   /* Create the dialogs. */
+  phase = timeline_begin ("create dialogs");
   create_connection_dialog (config);
   create_conversion_dialog (config, disks, removable);
   create_running_dialog ();
+  timeline_end (phase);
+
+  /* Keep the lists of disks and network interfaces up to date as
+   * devices appear and disappear.
+   */
+  start_hotplug_watch ();
 
   /* Start by displaying the connection dialog. */
   show_connection_dialog ();
 
+  /* Record when the main loop is first idle, ie. the user can act. */
+  g_idle_add (gui_ready, NULL);
+
   gtk_main ();
 }
 
+static gboolean
+gui_ready (gpointer data)
+{
+  timeline_mark ("GUI ready");
+  return FALSE;
+}
+
 /**
  * Trivial helper (shorthand) function for duplicating the contents of a
  * GTK_ENTRY.
@@ -345,7 +375,7 @@ create_connection_dialog (struct config *config)
   g_signal_connect (G_OBJECT (about), "clicked",
                     G_CALLBACK (about_button_clicked), NULL);
   g_signal_connect (G_OBJECT (next_button), "clicked",
-                    G_CALLBACK (connection_next_clicked), NULL);
+                    G_CALLBACK (connection_next_clicked), config);
   g_signal_connect (G_OBJECT (username_entry), "changed",
                     G_CALLBACK (username_changed_callback), NULL);
   g_signal_connect (G_OBJECT (password_entry), "changed",
@@ -436,7 +466,7 @@ test_connection_clicked (GtkWidget *w, gpointer data)
   const gchar *port_str;
   const gchar *identity_str;
   size_t errors = 0;
-  struct config *copy;
+  const struct config *copy;
   int err;
   pthread_t tid;
   pthread_attr_t attr;
@@ -480,22 +510,22 @@ test_connection_clicked (GtkWidget *w, gpointer data)
     config->auth.identity.url = strdup (identity_str);
   else
     config->auth.identity.url = NULL;
-  config->auth.identity.file_needs_update = 1;
+  forget_ssh_identity ();
 
   config->auth.sudo = tgl_btn_is_act (sudo_button);
 
   if (errors)
     return;
 
-  /* Give the testing thread its own copy of the config in case we
+  /* Give the testing thread a snapshot of the config in case we
    * update the config in the main thread.
    */
-  copy = copy_config (config);
+  copy = snapshot_config (config);
 
   /* No errors so far, so test the connection in a background thread. */
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-  err = pthread_create (&tid, &attr, test_connection_thread, copy);
+  err = pthread_create (&tid, &attr, test_connection_thread, (void *) copy);
   if (err != 0)
     error (EXIT_FAILURE, err, "pthread_create");
   pthread_attr_destroy (&attr);
@@ -511,19 +541,20 @@ test_connection_clicked (GtkWidget *w, gpointer data)
 static void *
 test_connection_thread (void *data)
 {
-  struct config *copy = data;
+  const struct config *copy = data;
   int r;
 
   g_idle_add (start_spinner, NULL);
 
   wait_network_online (copy);
   r = test_connection (copy);
-  free_config (copy);
+  unref_config (copy);
 
   g_idle_add (stop_spinner, NULL);
 
   if (r == -1)
-    g_idle_add (test_connection_error, NULL);
+    /* The ssh error is per-thread, so pass a copy to the main thread. */
+    g_idle_add (test_connection_error, strdup (get_ssh_error ()));
   else
     g_idle_add (test_connection_ok, NULL);
 
@@ -561,11 +592,14 @@ stop_spinner (gpointer user_data)
  * Idle task called from C<test_connection_thread> (but run on the
  * main thread) when there is an error.  Display the error message and
  * disable the C<Next> button so the user is forced to correct it.
+ *
+ * B<NB:> This frees the error message (C<user_data> pointer) which
+ * was strdup'd in C<test_connection_thread>.
  */
 static gboolean
 test_connection_error (gpointer user_data)
 {
-  const char *err = get_ssh_error ();
+  CLEANUP_FREE const char *err = user_data;
 
   gtk_label_set_text (GTK_LABEL (spinner_message), err);
   /* Disable the Next button. */
@@ -658,22 +692,46 @@ about_button_clicked (GtkWidget *w, gpointer data)
 static void
 connection_next_clicked (GtkWidget *w, gpointer data)
 {
+  struct config *config = data;
+  const struct config *copy;
+
   /* Switch to the conversion dialog. */
   show_conversion_dialog ();
+
+  /* The connection works and we know which disks are selected, so
+   * start the data connections in the background while the user
+   * fills in the conversion dialog.  If the selection changes they
+   * are discarded when the conversion starts.
+   */
+  set_disks_from_ui (config);
+  if (config->disks != NULL) {
+    copy = snapshot_config (config);
+    warm_up_data_conns (copy);
+    unref_config (copy);
+  }
 }
 
 /*----------------------------------------------------------------------*/
 /* Conversion dialog. */
 
-static void populate_disks_store (GtkListStore *disks_store,
-                                  const char * const *disks);
+static void populate_disks_store (GtkTreeStore *disks_store,
+                                  const char * const *disks,
+                                  char * const *exclude_partitions);
 static void populate_disks (GtkTreeView *disks_list_p,
-                            const char * const *disks);
+                            const char * const *disks,
+                            char * const *exclude_partitions);
 static void populate_removable_store (GtkListStore *removable_store,
                                       const char * const *removable);
 static void populate_removable (GtkTreeView *removable_list_p,
                                 const char * const *removable);
 static void populate_interfaces (GtkTreeView *interfaces_list_p);
+static void add_disk_to_store (GtkTreeStore *disks_store, const char *disk,
+                               char * const *exclude_partitions);
+static void add_removable_to_store (GtkListStore *removable_store,
+                                    const char *removable);
+static void add_interface_to_store (GtkListStore *interfaces_store,
+                                    const char *if_name, gboolean convert,
+                                    const char *network);
 static void populate_misc_opts (GtkEntry *entry, char * const *misc);
 static void toggled (GtkCellRendererToggle *cell,
                      gchar *path_str,
@@ -685,11 +743,15 @@ static void network_edited_callback (GtkCellRendererToggle *cell,
 static gboolean maybe_identify_click (GtkWidget *interfaces_list_p,
                                       GdkEventButton *event,
                                       gpointer data);
-static void set_disks_from_ui (struct config *);
 static void set_removable_from_ui (struct config *);
 static void set_interfaces_from_ui (struct config *);
 static void conversion_back_clicked (GtkWidget *w, gpointer data);
 static void refresh_disks_clicked (GtkWidget *w, gpointer data);
+static void measure_clicked (GtkWidget *w, gpointer data);
+static void *measure_thread (void *data);
+static void measure_notify_callback (int type, const char *data);
+static gboolean set_measure_label (gpointer msg);
+static gboolean measure_finished (gpointer report);
 static void start_conversion_clicked (GtkWidget *w, gpointer data);
 static void vcpu_topo_toggled (GtkWidget *w, gpointer data);
 static void vcpus_or_memory_check_callback (GtkWidget *w, gpointer data);
@@ -715,6 +777,10 @@ enum {
   INTERFACES_COL_CONVERT = 0,
   INTERFACES_COL_DEVICE,
   INTERFACES_COL_NETWORK,
+  /* The hidden column must come last because maybe_identify_click
+   * compares view column indexes with INTERFACES_COL_DEVICE.
+   */
+  INTERFACES_COL_HW_NAME,
   NUM_INTERFACES_COLS,
 };
 
@@ -735,7 +801,7 @@ create_conversion_dialog (struct config *config,
   GtkWidget *guestname_label, *vcpus_label, *memory_label;
   GtkWidget *output_frame, *output_vbox, *output_tbl;
   GtkWidget *o_label, *oa_label, *oc_label, *of_label, *os_label, *oo_label;
-  GtkWidget *info_frame;
+  GtkWidget *info_frame, *info_vbox;
   GtkWidget *disks_frame, *disks_sw;
   GtkWidget *removable_frame, *removable_sw;
   GtkWidget *interfaces_frame, *interfaces_sw;
@@ -957,10 +1023,16 @@ create_conversion_dialog (struct config *config,
 
   info_frame = gtk_frame_new (_("Information"));
   gtk_container_set_border_width (GTK_CONTAINER (info_frame), 4);
+  vbox_new (info_vbox, FALSE, 1);
   info_label = gtk_label_new (NULL);
   set_alignment (info_label, 0.1, 0.5);
   set_info_label ();
-  gtk_container_add (GTK_CONTAINER (info_frame), info_label);
+  gtk_box_pack_start (GTK_BOX (info_vbox), info_label, TRUE, TRUE, 0);
+  measure_label = gtk_label_new (NULL);
+  set_alignment (measure_label, 0.1, 0.5);
+  gtk_label_set_line_wrap (GTK_LABEL (measure_label), TRUE);
+  gtk_box_pack_start (GTK_BOX (info_vbox), measure_label, TRUE, TRUE, 0);
+  gtk_container_add (GTK_CONTAINER (info_frame), info_vbox);
 
   /* The right column: select devices to be converted. */
   disks_frame = gtk_frame_new (_("Fixed hard disks"));
@@ -970,7 +1042,8 @@ create_conversion_dialog (struct config *config,
   gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (disks_sw),
                                   GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
   disks_list = gtk_tree_view_new ();
-  populate_disks (GTK_TREE_VIEW (disks_list), disks);
+  populate_disks (GTK_TREE_VIEW (disks_list), disks,
+                  config->exclude_partitions);
   scrolled_window_add_with_viewport (disks_sw, disks_list);
   gtk_container_add (GTK_CONTAINER (disks_frame), disks_sw);
 
@@ -1021,11 +1094,17 @@ create_conversion_dialog (struct config *config,
   gtk_dialog_add_buttons (GTK_DIALOG (conv_dlg),
                           _("_Back"), 1,
                           _("_Refresh disks (will reset selection)"), 2,
+                          _("_Measure"), 4,
                           _("Start _conversion"), 3,
                           NULL);
   back = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 1);
   refresh_disks = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 2);
   start_button = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 3);
+  measure_button = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 4);
+  gtk_widget_set_tooltip_markup (measure_button,
+                                 _("Measure the selected disks and the link "
+                                   "to the conversion server, and estimate "
+                                   "how long the conversion will take."));
 
   /* Disable disk refreshing in case --test-disk was passed. */
   if (disks != NULL &&
@@ -1041,6 +1120,8 @@ create_conversion_dialog (struct config *config,
                     G_CALLBACK (conversion_back_clicked), NULL);
   g_signal_connect (G_OBJECT (refresh_disks), "clicked",
                     G_CALLBACK (refresh_disks_clicked), NULL);
+  g_signal_connect (G_OBJECT (measure_button), "clicked",
+                    G_CALLBACK (measure_clicked), config);
   g_signal_connect (G_OBJECT (start_button), "clicked",
                     G_CALLBACK (start_conversion_clicked), config);
   g_signal_connect (G_OBJECT (vcpu_topo), "toggled",
@@ -1151,63 +1232,239 @@ repopulate_output_combo (struct config *config)
   }
 }
 
+/**
+ * Find the row of C<model> whose C<hw_col> column is C<name>.  For a
+ * tree, only the top level rows are searched.
+ *
+ * Returns true and sets C<iter> if found.
+ */
+static gboolean
+find_in_store (GtkTreeModel *model, gint hw_col, const char *name,
+               GtkTreeIter *iter)
+{
+  gboolean b;
+
+  b = gtk_tree_model_get_iter_first (model, iter);
+  while (b) {
+    CLEANUP_FREE gchar *hw_name = NULL;
+
+    gtk_tree_model_get (model, iter, hw_col, &hw_name, -1);
+    if (hw_name && STREQ (hw_name, name))
+      return TRUE;
+    b = gtk_tree_model_iter_next (model, iter);
+  }
+
+  return FALSE;
+}
+
+/**
+ * Add a new row to C<model> (a C<GtkListStore>, or the top level of
+ * a C<GtkTreeStore>), keeping the rows sorted by the C<hw_col>
+ * column.  The new row is returned in C<iter>.
+ */
+static void
+insert_sorted (GtkTreeModel *model, gint hw_col, const char *name,
+               GtkTreeIter *iter)
+{
+  GtkTreeIter sibling;
+  gboolean b;
+
+  b = gtk_tree_model_get_iter_first (model, &sibling);
+  while (b) {
+    CLEANUP_FREE gchar *hw_name = NULL;
+
+    gtk_tree_model_get (model, &sibling, hw_col, &hw_name, -1);
+    if (hw_name && strcmp (hw_name, name) > 0)
+      break;
+    b = gtk_tree_model_iter_next (model, &sibling);
+  }
+
+  if (GTK_IS_TREE_STORE (model))
+    gtk_tree_store_insert_before (GTK_TREE_STORE (model), iter, NULL,
+                                  b ? &sibling : NULL);
+  else
+    gtk_list_store_insert_before (GTK_LIST_STORE (model), iter,
+                                  b ? &sibling : NULL);
+}
+
+/**
+ * Remove the row of C<model> whose C<hw_col> column is C<name>, if
+ * there is one.
+ */
+static void
+remove_from_store (GtkTreeModel *model, gint hw_col, const char *name)
+{
+  GtkTreeIter iter;
+
+  if (!find_in_store (model, hw_col, name, &iter))
+    return;
+  if (GTK_IS_TREE_STORE (model))
+    gtk_tree_store_remove (GTK_TREE_STORE (model), &iter);
+  else
+    gtk_list_store_remove (GTK_LIST_STORE (model), &iter);
+}
+
+/**
+ * Add a partition of a disk to the C<Fixed hard disks> treeview,
+ * under the disk at C<disk_iter>.  Partitions which are unchecked
+ * are sent as zeroes (see C<p2v.exclude_partitions>).
+ */
+static void
+add_partition_to_store (GtkTreeStore *disks_store, GtkTreeIter *disk_iter,
+                        const char *partition, gboolean copy)
+{
+  const uint64_t size = get_partition_size (partition);
+  CLEANUP_FREE char *device_descr = NULL;
+  GtkTreeIter iter;
+
+  if (asprintf (&device_descr,
+                "<b>%s</b>\n"
+                "<small>"
+                "%" PRIu64 "%s"
+                "</small>",
+                partition,
+                size >= 1024 * 1024 * 1024 ?
+                size / 1024 / 1024 / 1024 : size / 1024 / 1024,
+                size >= 1024 * 1024 * 1024 ? "G" : "M") == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  gtk_tree_store_append (disks_store, &iter, disk_iter);
+  gtk_tree_store_set (disks_store, &iter,
+                      DISKS_COL_CONVERT, copy,
+                      DISKS_COL_HW_NAME, partition,
+                      DISKS_COL_DEVICE, device_descr,
+                      -1);
+}
+
+/**
+ * Add a single disk to the C<Fixed hard disks> treeview, with its
+ * partitions under it.  The partitions in C<exclude_partitions>
+ * (which may be C<NULL>) are unchecked.
+ */
+static void
+add_disk_to_store (GtkTreeStore *disks_store, const char *disk,
+                   char * const *exclude_partitions)
+{
+  uint64_t size;
+  CLEANUP_FREE char *size_gb = NULL;
+  CLEANUP_FREE char *model = NULL;
+  CLEANUP_FREE char *serial = NULL;
+  CLEANUP_FREE char *device_descr = NULL;
+  CLEANUP_FREE char *mirror_descr = NULL;
+  const struct disk_mirror *mirror;
+  bool convert = true;
+  GtkTreeIter iter;
+
+  if (find_in_store (GTK_TREE_MODEL (disks_store), DISKS_COL_HW_NAME, disk,
+                     &iter))
+    return;
+
+  /* Show disks which mirror each other together.  Only the first one
+   * is converted by default, since it has all the data.
+   */
+  mirror = get_disk_mirror (disk);
+  if (mirror && STREQ (mirror->members[0], disk)) {
+    CLEANUP_FREE char *others =
+      guestfs_int_join_strings (" ", &mirror->members[1]);
+
+    if (asprintf (&mirror_descr, _("\nmirrored on %s (%s)"),
+                  others, mirror->arrays) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else if (mirror) {
+    if (asprintf (&mirror_descr, _("\nmirror of %s (%s), not needed"),
+                  mirror->members[0], mirror->arrays) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    convert = false;
+  }
+
+  if (disk[0] != '/') { /* not using --test-disk */
+    size = inventory_disk_size (disk);
+    if (asprintf (&size_gb, "%" PRIu64 "G", size) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    model = inventory_disk_model (disk);
+    serial = inventory_disk_serial (disk);
+  }
+
+  if (asprintf (&device_descr,
+                "<b>%s</b>\n"
+                "<small>"
+                "%s %s\n"
+                "%s%s%s"
+                "</small>",
+                disk,
+                size_gb ? size_gb : "", model ? model : "",
+                serial ? "s/n " : "", serial ? serial : "",
+                mirror_descr ? mirror_descr : "") == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  insert_sorted (GTK_TREE_MODEL (disks_store), DISKS_COL_HW_NAME, disk, &iter);
+  gtk_tree_store_set (disks_store, &iter,
+                      DISKS_COL_CONVERT, convert,
+                      DISKS_COL_HW_NAME, disk,
+                      DISKS_COL_DEVICE, device_descr,
+                      -1);
+
+  if (disk[0] != '/') { /* not using --test-disk */
+    CLEANUP_FREE_STRING_LIST char **partitions = get_disk_partitions (disk);
+    size_t i, j;
+
+    for (i = 0; partitions && partitions[i] != NULL; ++i) {
+      bool excluded = false;
+
+      for (j = 0; exclude_partitions && exclude_partitions[j] != NULL; ++j)
+        if (STREQ (exclude_partitions[j], partitions[i]))
+          excluded = true;
+      add_partition_to_store (disks_store, &iter, partitions[i], !excluded);
+    }
+  }
+}
+
 /**
  * Populate the C<Fixed hard disks> treeview.
  */
 static void
-populate_disks_store (GtkListStore *disks_store, const char * const *disks)
+populate_disks_store (GtkTreeStore *disks_store, const char * const *disks,
+                      char * const *exclude_partitions)
 {
   size_t i;
 
   if (disks == NULL)
     return;
 
+  /* Read any disks we don't know about yet in parallel. */
+  update_inventory (disks, NULL);
+
   for (i = 0; disks[i] != NULL; ++i) {
-    uint64_t size;
-    CLEANUP_FREE char *size_gb = NULL;
-    CLEANUP_FREE char *model = NULL;
-    CLEANUP_FREE char *serial = NULL;
-    CLEANUP_FREE char *device_descr = NULL;
-    GtkTreeIter iter;
+    const struct disk_mirror *mirror = get_disk_mirror (disks[i]);
 
-    if (disks[i][0] != '/') { /* not using --test-disk */
-      size = get_blockdev_size (disks[i]);
-      if (asprintf (&size_gb, "%" PRIu64 "G", size) == -1)
-        error (EXIT_FAILURE, errno, "asprintf");
-      model = get_blockdev_model (disks[i]);
-      serial = get_blockdev_serial (disks[i]);
-    }
+    add_disk_to_store (disks_store, disks[i], exclude_partitions);
 
-    if (asprintf (&device_descr,
-                  "<b>%s</b>\n"
-                  "<small>"
-                  "%s %s\n"
-                  "%s%s"
-                  "</small>",
-                  disks[i],
-                  size_gb ? size_gb : "", model ? model : "",
-                  serial ? "s/n " : "", serial ? serial : "") == -1)
-      error (EXIT_FAILURE, errno, "asprintf");
+    /* find_all_disks only returns the first disk of a mirror, but
+     * list the others too so they can be chosen instead.
+     */
+    if (mirror) {
+      size_t j;
 
-    gtk_list_store_append (disks_store, &iter);
-    gtk_list_store_set (disks_store, &iter,
-                        DISKS_COL_CONVERT, TRUE,
-                        DISKS_COL_HW_NAME, disks[i],
-                        DISKS_COL_DEVICE, device_descr,
-                        -1);
+      update_inventory ((const char * const *) &mirror->members[1], NULL);
+      for (j = 1; mirror->members[j] != NULL; ++j)
+        add_disk_to_store (disks_store, mirror->members[j],
+                           exclude_partitions);
+    }
   }
 }
 
 static void
-populate_disks (GtkTreeView *disks_list_p, const char * const *disks)
+populate_disks (GtkTreeView *disks_list_p, const char * const *disks,
+                char * const *exclude_partitions)
 {
-  GtkListStore *disks_store;
+  GtkTreeStore *disks_store;
   GtkCellRenderer *disks_col_convert, *disks_col_device;
 
-  disks_store = gtk_list_store_new (NUM_DISKS_COLS,
+  disks_store = gtk_tree_store_new (NUM_DISKS_COLS,
                                     G_TYPE_BOOLEAN, G_TYPE_STRING,
                                     G_TYPE_STRING);
-  populate_disks_store (disks_store, disks);
+  populate_disks_store (disks_store, disks, exclude_partitions);
   gtk_tree_view_set_model (disks_list_p,
                            GTK_TREE_MODEL (disks_store));
   gtk_tree_view_set_headers_visible (disks_list_p, TRUE);
@@ -1227,11 +1484,39 @@ populate_disks (GtkTreeView *disks_list_p, const char * const *disks)
                                                "markup", DISKS_COL_DEVICE,
                                                NULL);
   gtk_cell_renderer_set_alignment (disks_col_device, 0.0, 0.0);
+  /* The partitions are shown under each disk, in the Device column. */
+  gtk_tree_view_set_expander_column (disks_list_p,
+                                     gtk_tree_view_get_column (disks_list_p, 1));
 
   g_signal_connect (disks_col_convert, "toggled",
                     G_CALLBACK (toggled), disks_store);
 }
 
+/**
+ * Add a single drive to the C<Removable media> treeview.
+ */
+static void
+add_removable_to_store (GtkListStore *removable_store, const char *removable)
+{
+  CLEANUP_FREE char *device_descr = NULL;
+  GtkTreeIter iter;
+
+  if (find_in_store (GTK_TREE_MODEL (removable_store), REMOVABLE_COL_HW_NAME,
+                     removable, &iter))
+    return;
+
+  if (asprintf (&device_descr, "<b>%s</b>\n", removable) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  insert_sorted (GTK_TREE_MODEL (removable_store), REMOVABLE_COL_HW_NAME,
+                 removable, &iter);
+  gtk_list_store_set (removable_store, &iter,
+                      REMOVABLE_COL_CONVERT, TRUE,
+                      REMOVABLE_COL_HW_NAME, removable,
+                      REMOVABLE_COL_DEVICE, device_descr,
+                      -1);
+}
+
 /**
  * Populate the C<Removable media> treeview.
  */
@@ -1244,20 +1529,8 @@ populate_removable_store (GtkListStore *removable_store,
   if (removable == NULL)
     return;
 
-  for (i = 0; removable[i] != NULL; ++i) {
-    CLEANUP_FREE char *device_descr = NULL;
-    GtkTreeIter iter;
-
-    if (asprintf (&device_descr, "<b>%s</b>\n", removable[i]) == -1)
-      error (EXIT_FAILURE, errno, "asprintf");
-
-    gtk_list_store_append (removable_store, &iter);
-    gtk_list_store_set (removable_store, &iter,
-                        REMOVABLE_COL_CONVERT, TRUE,
-                        REMOVABLE_COL_HW_NAME, removable[i],
-                        REMOVABLE_COL_DEVICE, device_descr,
-                        -1);
-  }
+  for (i = 0; removable[i] != NULL; ++i)
+    add_removable_to_store (removable_store, removable[i]);
 }
 
 static void
@@ -1295,6 +1568,54 @@ populate_removable (GtkTreeView *removable_list_p,
                     G_CALLBACK (toggled), removable_store);
 }
 
+/**
+ * Add a single network interface to the C<Network interfaces>
+ * treeview.  C<network> is the target network, or C<NULL> for
+ * C<default>.
+ */
+static void
+add_interface_to_store (GtkListStore *interfaces_store, const char *if_name,
+                        gboolean convert, const char *network)
+{
+  CLEANUP_FREE char *device_descr = NULL;
+  CLEANUP_FREE char *if_addr = NULL;
+  CLEANUP_FREE char *if_vendor = NULL;
+  CLEANUP_FREE char *if_device = NULL;
+  GtkTreeIter iter;
+
+  if (find_in_store (GTK_TREE_MODEL (interfaces_store), INTERFACES_COL_HW_NAME,
+                     if_name, &iter))
+    return;
+
+  if_addr = inventory_if_addr (if_name);
+  if_vendor = inventory_if_vendor (if_name, 40);
+  if_device = inventory_if_device (if_name, 40);
+
+  if (asprintf (&device_descr,
+                "<b>%s</b>\n"
+                "<small>"
+                "%s\n"
+                "%s%s%s"
+                "</small>\n"
+                "<small><u><span foreground=\"blue\">"
+                "Identify interface"
+                "</span></u></small>",
+                if_name,
+                if_addr ? : _("Unknown"),
+                if_vendor ? : _("Unknown"),
+                if_device ? "\n" : "", if_device ? : "") == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  insert_sorted (GTK_TREE_MODEL (interfaces_store), INTERFACES_COL_HW_NAME,
+                 if_name, &iter);
+  gtk_list_store_set (interfaces_store, &iter,
+                      INTERFACES_COL_CONVERT, convert,
+                      INTERFACES_COL_DEVICE, device_descr,
+                      INTERFACES_COL_NETWORK, network ? : "default",
+                      INTERFACES_COL_HW_NAME, if_name,
+                      -1);
+}
+
 /**
  * Populate the C<Network interfaces> treeview.
  */
@@ -1304,44 +1625,18 @@ populate_interfaces (GtkTreeView *interfaces_list_p)
   GtkListStore *interfaces_store;
   GtkCellRenderer *interfaces_col_convert, *interfaces_col_device,
     *interfaces_col_network;
-  GtkTreeIter iter;
   size_t i;
 
   interfaces_store = gtk_list_store_new (NUM_INTERFACES_COLS,
                                          G_TYPE_BOOLEAN, G_TYPE_STRING,
-                                         G_TYPE_STRING);
+                                         G_TYPE_STRING, G_TYPE_STRING);
   if (all_interfaces) {
-    for (i = 0; all_interfaces[i] != NULL; ++i) {
-      const char *if_name = all_interfaces[i];
-      CLEANUP_FREE char *device_descr = NULL;
-      CLEANUP_FREE char *if_addr = get_if_addr (if_name);
-      CLEANUP_FREE char *if_vendor = get_if_vendor (if_name, 40);
-
-      if (asprintf (&device_descr,
-                    "<b>%s</b>\n"
-                    "<small>"
-                    "%s\n"
-                    "%s"
-                    "</small>\n"
-                    "<small><u><span foreground=\"blue\">"
-                    "Identify interface"
-                    "</span></u></small>",
-                    if_name,
-                    if_addr ? : _("Unknown"),
-                    if_vendor ? : _("Unknown")) == -1)
-        error (EXIT_FAILURE, errno, "asprintf");
-
-      gtk_list_store_append (interfaces_store, &iter);
-      gtk_list_store_set (interfaces_store, &iter,
-                          /* Only convert the first interface.  As
-                           * they are sorted, this is usually the
-                           * physical interface.
-                           */
-                          INTERFACES_COL_CONVERT, i == 0,
-                          INTERFACES_COL_DEVICE, device_descr,
-                          INTERFACES_COL_NETWORK, "default",
-                          -1);
-    }
+    for (i = 0; all_interfaces[i] != NULL; ++i)
+      /* Only convert the first interface.  As they are sorted, this
+       * is usually the physical interface.
+       */
+      add_interface_to_store (interfaces_store, all_interfaces[i], i == 0,
+                              NULL);
   }
   gtk_tree_view_set_model (interfaces_list_p,
                            GTK_TREE_MODEL (interfaces_store));
@@ -1409,7 +1704,10 @@ toggled (GtkCellRendererToggle *cell, gchar *path_str, gpointer data)
   gtk_tree_model_get_iter (model, &iter, path);
   gtk_tree_model_get (model, &iter, 0 /* CONVERT */, &v, -1);
   v ^= 1;
-  gtk_list_store_set (GTK_LIST_STORE (model), &iter, 0 /* CONVERT */, v, -1);
+  if (GTK_IS_TREE_STORE (model))
+    gtk_tree_store_set (GTK_TREE_STORE (model), &iter, 0 /* CONVERT */, v, -1);
+  else
+    gtk_list_store_set (GTK_LIST_STORE (model), &iter, 0 /* CONVERT */, v, -1);
   gtk_tree_path_free (path);
 }
 
@@ -1469,17 +1767,18 @@ maybe_identify_click (GtkWidget *interfaces_list_p, GdkEventButton *event,
       g_list_free (cols);
 
       if (column_index == INTERFACES_COL_DEVICE) {
-        const gint *indices;
-        gint row_index;
-        const char *if_name;
+        GtkTreeModel *model;
+        GtkTreeIter iter;
+        CLEANUP_FREE gchar *if_name = NULL;
         char *cmd;
 
-        /* Get the row index. */
-        indices = gtk_tree_path_get_indices (path);
-        row_index = indices[0];
-
-        /* And the interface name. */
-        if_name = all_interfaces[row_index];
+        /* Get the interface name from the row. */
+        model = gtk_tree_view_get_model (GTK_TREE_VIEW (interfaces_list_p));
+        if (!gtk_tree_model_get_iter (model, &iter, path)) {
+          gtk_tree_path_free (path);
+          return FALSE;
+        }
+        gtk_tree_model_get (model, &iter, INTERFACES_COL_HW_NAME, &if_name, -1);
 
         /* Issue the ethtool command in the background. */
         if (asprintf (&cmd, "ethtool --identify '%s' 10 &", if_name) == -1)
@@ -1560,10 +1859,41 @@ set_from_ui_generic (char ***ret, GtkTreeView *list)
   } /* "mode" loop */
 }
 
+/* Set the disks to convert, and the partitions of them which were
+ * unchecked (see C<add_partition_to_store>).
+ */
 static void
 set_disks_from_ui (struct config *config)
 {
+  GtkTreeModel *model = gtk_tree_view_get_model (GTK_TREE_VIEW (disks_list));
+  GtkTreeIter disk, partition;
+  gboolean b, c, active;
+  size_t n = 0;
+
   set_from_ui_generic (&config->disks, GTK_TREE_VIEW (disks_list));
+
+  guestfs_int_free_string_list (config->exclude_partitions);
+  config->exclude_partitions = NULL;
+  for (b = gtk_tree_model_get_iter_first (model, &disk); b;
+       b = gtk_tree_model_iter_next (model, &disk)) {
+    gtk_tree_model_get (model, &disk, DISKS_COL_CONVERT, &active, -1);
+    if (!active)
+      continue;
+    for (c = gtk_tree_model_iter_children (model, &partition, &disk); c;
+         c = gtk_tree_model_iter_next (model, &partition)) {
+      gtk_tree_model_get (model, &partition, DISKS_COL_CONVERT, &active, -1);
+      if (active)
+        continue;
+      config->exclude_partitions =
+        realloc (config->exclude_partitions, sizeof (char *) * (n + 2));
+      if (config->exclude_partitions == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+      /* gtk_tree_model_get() outputs a deep copy. */
+      gtk_tree_model_get (model, &partition, DISKS_COL_HW_NAME,
+                          &config->exclude_partitions[n], -1);
+      config->exclude_partitions[++n] = NULL;
+    }
+  }
 }
 
 static void
@@ -1578,32 +1908,32 @@ set_interfaces_from_ui (struct config *config)
   GtkTreeModel *model;
   GtkTreeIter iter;
   gboolean b, v;
-  size_t i, j;
+  gint n;
+  size_t j;
 
   guestfs_int_free_string_list (config->interfaces);
-  if (all_interfaces == NULL) {
-    config->interfaces = NULL;
-    return;
-  }
+  config->interfaces = NULL;
 
   model = gtk_tree_view_get_model (GTK_TREE_VIEW (interfaces_list));
+  n = gtk_tree_model_iter_n_children (model, NULL);
+  if (n == 0)
+    return;
 
-  config->interfaces = malloc ((1 +
-                                guestfs_int_count_strings (all_interfaces)) *
-                               sizeof (char *));
+  config->interfaces = malloc ((1 + n) * sizeof (char *));
   if (config->interfaces == NULL)
     error (EXIT_FAILURE, errno, "malloc");
-  i = j = 0;
+  j = 0;
 
   b = gtk_tree_model_get_iter_first (model, &iter);
   while (b) {
     gtk_tree_model_get (model, &iter, INTERFACES_COL_CONVERT, &v, -1);
     if (v) {
-      assert (all_interfaces[i] != NULL);
-      config->interfaces[j++] = strdup (all_interfaces[i]);
+      /* gtk_tree_model_get returns a copy of the string. */
+      gtk_tree_model_get (model, &iter,
+                          INTERFACES_COL_HW_NAME, &config->interfaces[j], -1);
+      ++j;
     }
     b = gtk_tree_model_iter_next (model, &iter);
-    ++i;
   }
 
   config->interfaces[j] = NULL;
@@ -1616,38 +1946,37 @@ set_network_map_from_ui (struct config *config)
   GtkTreeModel *model;
   GtkTreeIter iter;
   gboolean b;
-  const char *s;
-  size_t i, j;
+  gint n;
+  size_t j;
 
-  if (all_interfaces == NULL) {
-    guestfs_int_free_string_list (config->network_map);
-    config->network_map = NULL;
-    return;
-  }
+  guestfs_int_free_string_list (config->network_map);
+  config->network_map = NULL;
 
   list = GTK_TREE_VIEW (interfaces_list);
   model = gtk_tree_view_get_model (list);
+  n = gtk_tree_model_iter_n_children (model, NULL);
+  if (n == 0)
+    return;
 
-  guestfs_int_free_string_list (config->network_map);
-  config->network_map =
-    malloc ((1 + guestfs_int_count_strings (all_interfaces))
-            * sizeof (char *));
+  config->network_map = malloc ((1 + n) * sizeof (char *));
   if (config->network_map == NULL)
     error (EXIT_FAILURE, errno, "malloc");
-  i = j = 0;
+  j = 0;
 
   b = gtk_tree_model_get_iter_first (model, &iter);
   while (b) {
-    gtk_tree_model_get (model, &iter, INTERFACES_COL_NETWORK, &s, -1);
+    CLEANUP_FREE gchar *if_name = NULL;
+    CLEANUP_FREE gchar *s = NULL;
+
+    gtk_tree_model_get (model, &iter,
+                        INTERFACES_COL_HW_NAME, &if_name,
+                        INTERFACES_COL_NETWORK, &s, -1);
     if (s) {
-      assert (all_interfaces[i] != NULL);
-      if (asprintf (&config->network_map[j], "%s:%s",
-                    all_interfaces[i], s) == -1)
+      if (asprintf (&config->network_map[j], "%s:%s", if_name, s) == -1)
         error (EXIT_FAILURE, errno, "asprintf");
       ++j;
     }
     b = gtk_tree_model_iter_next (model, &iter);
-    ++i;
   }
 
   config->network_map[j] = NULL;
@@ -1659,6 +1988,11 @@ set_network_map_from_ui (struct config *config)
 static void
 conversion_back_clicked (GtkWidget *w, gpointer data)
 {
+  /* The connection details may be changed, so close any data
+   * connections started by connection_next_clicked.
+   */
+  discard_warm_data_conns ();
+
   /* Switch to the connection dialog. */
   show_connection_dialog ();
 
@@ -1672,26 +2006,241 @@ static void
 refresh_disks_clicked (GtkWidget *w, gpointer data)
 {
   GtkTreeModel *model;
-  GtkListStore *disks_store, *removable_store;
+  GtkTreeStore *disks_store;
+  GtkListStore *removable_store;
   char **disks, **removable;
 
   model = gtk_tree_view_get_model (GTK_TREE_VIEW (disks_list));
-  disks_store = GTK_LIST_STORE (model);
+  disks_store = GTK_TREE_STORE (model);
 
   model = gtk_tree_view_get_model (GTK_TREE_VIEW (removable_list));
   removable_store = GTK_LIST_STORE (model);
 
-  gtk_list_store_clear (disks_store);
+  gtk_tree_store_clear (disks_store);
   gtk_list_store_clear (removable_store);
 
   find_all_disks (&disks, &removable);
-  populate_disks_store (disks_store, (const char **)disks);
+  populate_disks_store (disks_store, (const char **)disks, NULL);
   populate_removable_store (removable_store, (const char **)removable);
 
   guestfs_int_free_string_list (removable);
   guestfs_int_free_string_list (disks);
 }
 
+/**
+ * Called from the main loop when there are hotplug events waiting on
+ * the uevent socket (see F<uevent.c>).  Disks and network interfaces
+ * are added to or removed from the conversion dialog.
+ */
+static gboolean
+uevent_callback (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  const int fd = g_io_channel_unix_get_fd (source);
+  struct uevent ev;
+  int r;
+  GtkTreeModel *disks_model, *removable_model, *interfaces_model;
+  GtkTreeStore *disks_store;
+  GtkListStore *removable_store, *interfaces_store;
+
+  disks_model = gtk_tree_view_get_model (GTK_TREE_VIEW (disks_list));
+  removable_model = gtk_tree_view_get_model (GTK_TREE_VIEW (removable_list));
+  interfaces_model = gtk_tree_view_get_model (GTK_TREE_VIEW (interfaces_list));
+  disks_store = GTK_TREE_STORE (disks_model);
+  removable_store = GTK_LIST_STORE (removable_model);
+  interfaces_store = GTK_LIST_STORE (interfaces_model);
+
+  while ((r = read_uevent (fd, &ev)) == 1) {
+    if (disk_hotplug &&
+        STREQ (ev.subsystem, "block") && STREQ (ev.devtype, "disk")) {
+      if (STREQ (ev.action, "add")) {
+        /* cciss device /dev/cciss/c0d0 will be /sys/block/cciss!c0d0 */
+        CLEANUP_FREE char *sys_name = strdup (ev.name);
+        char *p;
+
+        if (sys_name == NULL)
+          error (EXIT_FAILURE, errno, "strdup");
+        p = strchr (sys_name, '/');
+        if (p) *p = '!';
+
+        switch (get_disk_type (sys_name)) {
+        case DISK_TYPE_FIXED:
+          add_disk_to_store (disks_store, ev.name, NULL);
+          break;
+        case DISK_TYPE_REMOVABLE:
+          add_removable_to_store (removable_store, ev.name);
+          break;
+        case DISK_TYPE_OTHER:
+          break;
+        }
+      }
+      else if (STREQ (ev.action, "remove")) {
+        forget_inventory_device (ev.name);
+        remove_from_store (disks_model, DISKS_COL_HW_NAME, ev.name);
+        remove_from_store (removable_model, REMOVABLE_COL_HW_NAME, ev.name);
+      }
+    }
+    else if (STREQ (ev.subsystem, "net")) {
+      if (STREQ (ev.action, "add")) {
+        const gboolean first =
+          gtk_tree_model_iter_n_children (interfaces_model, NULL) == 0;
+
+        if (is_network_interface (ev.name))
+          add_interface_to_store (interfaces_store, ev.name, first, NULL);
+      }
+      else if (STREQ (ev.action, "remove")) {
+        forget_inventory_device (ev.name);
+        remove_from_store (interfaces_model, INTERFACES_COL_HW_NAME, ev.name);
+      }
+      else if (STREQ (ev.action, "move")) {
+        /* Renamed, usually by udev from "ethN" to a predictable name.
+         * The row is replaced, keeping whatever the user chose for
+         * the old name.
+         */
+        GtkTreeIter iter;
+        gboolean convert;
+        CLEANUP_FREE gchar *network = NULL;
+
+        if (ev.old_name[0] &&
+            find_in_store (interfaces_model, INTERFACES_COL_HW_NAME,
+                           ev.old_name, &iter)) {
+          gtk_tree_model_get (interfaces_model, &iter,
+                              INTERFACES_COL_CONVERT, &convert,
+                              INTERFACES_COL_NETWORK, &network, -1);
+          gtk_list_store_remove (interfaces_store, &iter);
+        }
+        else
+          convert =
+            gtk_tree_model_iter_n_children (interfaces_model, NULL) == 0;
+        if (ev.old_name[0])
+          forget_inventory_device (ev.old_name);
+
+        if (is_network_interface (ev.name))
+          add_interface_to_store (interfaces_store, ev.name, convert, network);
+      }
+    }
+  }
+
+  if (r == -1) {
+    perror ("recvmsg: uevent");
+    return FALSE;               /* Stop watching. */
+  }
+
+  return TRUE;
+}
+
+/**
+ * Start listening for hotplug events.  If this isn't possible the
+ * user can still use the C<Refresh disks> button.
+ */
+static void
+start_hotplug_watch (void)
+{
+  int fd;
+  GIOChannel *channel;
+
+  fd = open_uevent_socket ();
+  if (fd == -1)
+    return;
+
+  channel = g_io_channel_unix_new (fd);
+  g_io_channel_set_close_on_unref (channel, TRUE);
+  g_io_add_watch (channel, G_IO_IN, uevent_callback, NULL);
+  g_io_channel_unref (channel);
+}
+
+/**
+ * Callback from the C<Measure> button.
+ *
+ * This measures the read throughput of the selected disks and the
+ * link to the conversion server in a background thread (see
+ * C<measure_thread>), and displays an estimate of how long the
+ * conversion will take in the C<Information> section.
+ */
+static void
+measure_clicked (GtkWidget *w, gpointer data)
+{
+  struct config *config = data;
+  const struct config *copy;
+  int err;
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  set_disks_from_ui (config);
+  if (config->disks == NULL || guestfs_int_count_strings (config->disks) == 0) {
+    gtk_label_set_text (GTK_LABEL (measure_label),
+                        _("No disks were selected for conversion."));
+    return;
+  }
+
+  gtk_widget_set_sensitive (measure_button, FALSE);
+
+  copy = snapshot_config (config);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&tid, &attr, measure_thread, (void *) copy);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+  pthread_attr_destroy (&attr);
+}
+
+/**
+ * Run C<measure_conversion> (in a detached background thread).
+ */
+static void *
+measure_thread (void *data)
+{
+  const struct config *copy = data;
+  char *report;
+
+  report = measure_conversion (copy, measure_notify_callback);
+  if (report == NULL &&
+      asprintf (&report, _("Could not estimate the conversion time: %s"),
+                get_measure_error ()) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  unref_config (copy);
+
+  g_idle_add (measure_finished, report);
+
+  /* Thread is detached anyway, so no one is waiting for the status. */
+  return NULL;
+}
+
+static void
+measure_notify_callback (int type, const char *data)
+{
+  if (type == NOTIFY_STATUS)
+    g_idle_add (set_measure_label, strdup (data));
+}
+
+/**
+ * Display the measurement progress or result.
+ *
+ * B<NB:> This frees the message (C<user_data> pointer).
+ */
+static gboolean
+set_measure_label (gpointer user_data)
+{
+  CLEANUP_FREE const char *msg = user_data;
+
+  gtk_label_set_text (GTK_LABEL (measure_label), msg);
+
+  return FALSE;
+}
+
+/**
+ * Idle task called from C<measure_thread> (but run on the main
+ * thread) when the measurement has finished.
+ */
+static gboolean
+measure_finished (gpointer user_data)
+{
+  set_measure_label (user_data);
+  gtk_widget_set_sensitive (measure_button, TRUE);
+
+  return FALSE;
+}
+
 static char *concat_warning (char *warning, const char *fs, ...)
   __attribute__((format (printf,2,3)));
 
@@ -2154,7 +2703,7 @@ start_conversion_clicked (GtkWidget *w, gpointer data)
   const char *str;
   char *str2;
   GtkWidget *dlg;
-  struct config *copy;
+  const struct config *copy;
   int err;
   pthread_t tid;
   pthread_attr_t attr;
@@ -2250,14 +2799,20 @@ start_conversion_clicked (GtkWidget *w, gpointer data)
 
   /* Do the conversion, in a background thread. */
 
-  /* Give the conversion (background) thread its own copy of the
+  /* Give the conversion (background) thread a snapshot of the
    * config in case we update the config in the main thread.
+   *
+   * The warm-up thread shares the same snapshot, so that it starts
+   * data connections for any disks selected since the connection
+   * dialog while the conversion thread is still opening the control
+   * connection.  start_conversion then claims them.
    */
-  copy = copy_config (config);
+  copy = snapshot_config (config);
+  warm_up_data_conns (copy);
 
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-  err = pthread_create (&tid, &attr, start_conversion_thread, copy);
+  err = pthread_create (&tid, &attr, start_conversion_thread, (void *) copy);
   if (err != 0)
     error (EXIT_FAILURE, err, "pthread_create");
   pthread_attr_destroy (&attr);
@@ -2269,11 +2824,11 @@ start_conversion_clicked (GtkWidget *w, gpointer data)
 static void *
 start_conversion_thread (void *data)
 {
-  struct config *copy = data;
+  const struct config *copy = data;
   int r;
 
   r = start_conversion (copy, notify_ui_callback);
-  free_config (copy);
+  unref_config (copy);
 
   if (r == -1)
     g_idle_add (conversion_error, NULL);
@@ -0,0 +1,231 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A fast, non-cryptographic hash of disk blocks.
+ *
+ * This is the XXH64 algorithm from L<https://github.com/Cyan4973/xxHash>,
+ * so hashes computed here are the same as C<xxhsum -H1> on the
+ * conversion server.  It runs at several GB/s per core, which is much
+ * faster than the disks it is used on.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "p2v.h"
+
+#define PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+
+static inline uint64_t
+rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+/* Unaligned little endian reads.  The compiler turns the memcpy into
+ * a single load.
+ */
+static inline uint64_t
+read64 (const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy (&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64 (v);
+#endif
+  return v;
+}
+
+static inline uint32_t
+read32 (const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32 (v);
+#endif
+  return v;
+}
+
+static inline uint64_t
+round64 (uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64 (acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t
+merge_round64 (uint64_t acc, uint64_t val)
+{
+  acc ^= round64 (0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Mix in the last (less than 32) bytes, and avalanche. */
+static uint64_t
+finalize (uint64_t h, const unsigned char *p, size_t len)
+{
+  const unsigned char *const end = p + len;
+
+  while (p + 8 <= end) {
+    h ^= round64 (0, read64 (p));
+    h = rotl64 (h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32 (p) * PRIME64_1;
+    h = rotl64 (h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= *p * PRIME64_5;
+    h = rotl64 (h, 11) * PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t
+merge_accumulators (const uint64_t v[4])
+{
+  uint64_t h;
+
+  h = rotl64 (v[0], 1) + rotl64 (v[1], 7) + rotl64 (v[2], 12) + rotl64 (v[3], 18);
+  h = merge_round64 (h, v[0]);
+  h = merge_round64 (h, v[1]);
+  h = merge_round64 (h, v[2]);
+  h = merge_round64 (h, v[3]);
+  return h;
+}
+
+/**
+ * Return the XXH64 hash of C<len> bytes at C<data>.
+ */
+uint64_t
+xxh64 (const void *data, size_t len, uint64_t seed)
+{
+  const unsigned char *p = data;
+  const unsigned char *const end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    const unsigned char *const limit = end - 32;
+    uint64_t v[4] = {
+      seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1
+    };
+
+    do {
+      v[0] = round64 (v[0], read64 (p));
+      v[1] = round64 (v[1], read64 (p+8));
+      v[2] = round64 (v[2], read64 (p+16));
+      v[3] = round64 (v[3], read64 (p+24));
+      p += 32;
+    } while (p <= limit);
+
+    h = merge_accumulators (v);
+  }
+  else
+    h = seed + PRIME64_5;
+
+  h += (uint64_t) len;
+  return finalize (h, p, end - p);
+}
+
+/**
+ * Start hashing data which arrives in pieces, such as an extent of
+ * a disk which is read one block at a time.  Call C<xxh64_update>
+ * for each piece, then C<xxh64_digest>.  The result is the same as
+ * calling C<xxh64> on all of the data at once.
+ */
+void
+xxh64_init (struct xxh64_state *state, uint64_t seed)
+{
+  memset (state, 0, sizeof *state);
+  state->seed = seed;
+  state->v[0] = seed + PRIME64_1 + PRIME64_2;
+  state->v[1] = seed + PRIME64_2;
+  state->v[2] = seed;
+  state->v[3] = seed - PRIME64_1;
+}
+
+void
+xxh64_update (struct xxh64_state *state, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  const unsigned char *const end = p + len;
+
+  state->total_len += len;
+
+  /* Top up a partial stripe left over from last time. */
+  if (state->memsize + len < 32) {
+    memcpy (state->mem + state->memsize, p, len);
+    state->memsize += len;
+    return;
+  }
+  if (state->memsize > 0) {
+    const size_t n = 32 - state->memsize;
+
+    memcpy (state->mem + state->memsize, p, n);
+    state->v[0] = round64 (state->v[0], read64 (state->mem));
+    state->v[1] = round64 (state->v[1], read64 (state->mem+8));
+    state->v[2] = round64 (state->v[2], read64 (state->mem+16));
+    state->v[3] = round64 (state->v[3], read64 (state->mem+24));
+    p += n;
+    state->memsize = 0;
+  }
+
+  while (p + 32 <= end) {
+    state->v[0] = round64 (state->v[0], read64 (p));
+    state->v[1] = round64 (state->v[1], read64 (p+8));
+    state->v[2] = round64 (state->v[2], read64 (p+16));
+    state->v[3] = round64 (state->v[3], read64 (p+24));
+    p += 32;
+  }
+
+  memcpy (state->mem, p, end - p);
+  state->memsize = end - p;
+}
+
+uint64_t
+xxh64_digest (const struct xxh64_state *state)
+{
+  uint64_t h;
+
+  if (state->total_len >= 32)
+    h = merge_accumulators (state->v);
+  else
+    h = state->seed + PRIME64_5;
+
+  h += state->total_len;
+  return finalize (h, state->mem, state->memsize);
+}
@@ -0,0 +1,594 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The device inventory.
+ *
+ * This caches the attributes of disks (size, model, serial number)
+ * and network interfaces (MAC address, vendor, device) which are displayed in
+ * the GUI and written to the physical machine XML.  Reading these
+ * from sysfs and L<lsblk(8)> is slow when there are hundreds of LUNs,
+ * so the attributes of each device are read once, by several threads
+ * in parallel, and afterwards only devices which have appeared since
+ * the last update are read.
+ *
+ * The records are kept in two flat arrays sorted by device name.  All
+ * functions are thread safe.  The C<inventory_*> getters return
+ * copies of the cached strings which the caller must free.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+/* Maximum number of threads used to read device attributes. */
+#define MAX_INVENTORY_THREADS 16
+
+struct disk_record {
+  char *name;                   /* eg. "sda", or a path if --test-disk */
+  uint64_t size;                /* in GB */
+  char *model;                  /* may be NULL */
+  char *serial;                 /* may be NULL */
+};
+
+struct nic_record {
+  char *name;                   /* eg. "eth0" */
+  char *addr;                   /* MAC address, may be NULL */
+  char *vendor;                 /* untruncated, may be NULL */
+  char *device;                 /* untruncated, may be NULL */
+};
+
+static pthread_mutex_t inventory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct disk_record *disk_records;
+static size_t nr_disk_records;
+static struct nic_record *nic_records;
+static size_t nr_nic_records;
+
+static void
+read_disk_record (struct disk_record *r)
+{
+  if (r->name[0] == '/')        /* --test-disk */
+    return;
+
+  r->size = get_blockdev_size (r->name);
+  r->model = get_blockdev_model (r->name);
+  r->serial = get_blockdev_serial (r->name);
+}
+
+static void
+read_nic_record (struct nic_record *r)
+{
+  r->addr = get_if_addr (r->name);
+  r->vendor = get_if_vendor (r->name, 0);
+  r->device = get_if_device (r->name, 0);
+}
+
+static void
+free_disk_record (struct disk_record *r)
+{
+  free (r->name);
+  free (r->model);
+  free (r->serial);
+}
+
+static void
+free_nic_record (struct nic_record *r)
+{
+  free (r->name);
+  free (r->addr);
+  free (r->vendor);
+  free (r->device);
+}
+
+static int
+compare_disk_records (const void *vp1, const void *vp2)
+{
+  const struct disk_record *r1 = vp1;
+  const struct disk_record *r2 = vp2;
+  return strcmp (r1->name, r2->name);
+}
+
+static int
+compare_nic_records (const void *vp1, const void *vp2)
+{
+  const struct nic_record *r1 = vp1;
+  const struct nic_record *r2 = vp2;
+  return strcmp (r1->name, r2->name);
+}
+
+/* Caller must hold inventory_mutex. */
+static struct disk_record *
+find_disk_record (const char *name)
+{
+  const struct disk_record key = { .name = (char *) name };
+
+  if (nr_disk_records == 0)
+    return NULL;
+  return bsearch (&key, disk_records, nr_disk_records,
+                  sizeof (struct disk_record), compare_disk_records);
+}
+
+/* Caller must hold inventory_mutex. */
+static struct nic_record *
+find_nic_record (const char *name)
+{
+  const struct nic_record key = { .name = (char *) name };
+
+  if (nr_nic_records == 0)
+    return NULL;
+  return bsearch (&key, nic_records, nr_nic_records,
+                  sizeof (struct nic_record), compare_nic_records);
+}
+
+/**
+ * A batch of new records to be read in parallel.  Each worker thread
+ * takes the next unread record until there are none left.
+ */
+struct batch {
+  pthread_mutex_t lock;
+  size_t next;
+  struct disk_record *disks;
+  size_t nr_disks;
+  struct nic_record *nics;
+  size_t nr_nics;
+};
+
+static void *
+read_records_thread (void *vp)
+{
+  struct batch *batch = vp;
+
+  for (;;) {
+    size_t i;
+
+    pthread_mutex_lock (&batch->lock);
+    i = batch->next++;
+    pthread_mutex_unlock (&batch->lock);
+
+    if (i < batch->nr_disks)
+      read_disk_record (&batch->disks[i]);
+    else if (i < batch->nr_disks + batch->nr_nics)
+      read_nic_record (&batch->nics[i - batch->nr_disks]);
+    else
+      break;
+  }
+
+  return NULL;
+}
+
+static void
+read_batch (struct batch *batch)
+{
+  const size_t total = batch->nr_disks + batch->nr_nics;
+  pthread_t threads[MAX_INVENTORY_THREADS];
+  size_t i, nr_threads;
+  int err;
+
+  batch->next = 0;
+  pthread_mutex_init (&batch->lock, NULL);
+
+  nr_threads = total < MAX_INVENTORY_THREADS ? total : MAX_INVENTORY_THREADS;
+  for (i = 0; i < nr_threads; ++i) {
+    err = pthread_create (&threads[i], NULL, read_records_thread, batch);
+    if (err != 0)
+      break;
+  }
+  nr_threads = i;
+
+  /* If no threads could be started, read everything in this thread. */
+  if (nr_threads == 0)
+    read_records_thread (batch);
+
+  for (i = 0; i < nr_threads; ++i)
+    pthread_join (threads[i], NULL);
+
+  pthread_mutex_destroy (&batch->lock);
+}
+
+/* Sort a batch of unread records by name and remove duplicate names.
+ * Returns the new number of records.
+ */
+static size_t
+sort_disk_batch (struct disk_record *records, size_t n)
+{
+  size_t i, j;
+
+  if (n == 0)
+    return 0;
+  qsort (records, n, sizeof (struct disk_record), compare_disk_records);
+  for (i = j = 1; i < n; ++i) {
+    if (STREQ (records[i].name, records[j-1].name))
+      free (records[i].name);
+    else
+      records[j++] = records[i];
+  }
+  return j;
+}
+
+static size_t
+sort_nic_batch (struct nic_record *records, size_t n)
+{
+  size_t i, j;
+
+  if (n == 0)
+    return 0;
+  qsort (records, n, sizeof (struct nic_record), compare_nic_records);
+  for (i = j = 1; i < n; ++i) {
+    if (STREQ (records[i].name, records[j-1].name))
+      free (records[i].name);
+    else
+      records[j++] = records[i];
+  }
+  return j;
+}
+
+/* Is name in the NULL-terminated list? */
+static bool
+in_list (const char * const *list, const char *name)
+{
+  size_t i;
+
+  for (i = 0; list[i] != NULL; ++i)
+    if (STREQ (list[i], name))
+      return true;
+  return false;
+}
+
+/**
+ * Update the inventory so that it contains exactly the disks in
+ * C<disks> and the network interfaces in C<interfaces>.
+ *
+ * Devices which are already in the inventory keep their cached
+ * attributes, devices which have gone are forgotten, and the
+ * attributes of new devices are read in parallel.
+ *
+ * Either list may be C<NULL>, meaning that the corresponding part
+ * of the inventory is not changed.
+ */
+void
+update_inventory (const char * const *disks, const char * const *interfaces)
+{
+  struct batch batch = { 0 };
+  size_t i, j;
+
+  /* Work out which devices are new. */
+  pthread_mutex_lock (&inventory_mutex);
+  if (disks) {
+    batch.disks = calloc (guestfs_int_count_strings ((char **) disks),
+                          sizeof (struct disk_record));
+    if (batch.disks == NULL && disks[0] != NULL)
+      error (EXIT_FAILURE, errno, "calloc");
+    for (i = 0; disks[i] != NULL; ++i) {
+      if (find_disk_record (disks[i]) != NULL)
+        continue;
+      batch.disks[batch.nr_disks].name = strdup (disks[i]);
+      if (batch.disks[batch.nr_disks].name == NULL)
+        error (EXIT_FAILURE, errno, "strdup");
+      batch.nr_disks++;
+    }
+    batch.nr_disks = sort_disk_batch (batch.disks, batch.nr_disks);
+  }
+  if (interfaces) {
+    batch.nics = calloc (guestfs_int_count_strings ((char **) interfaces),
+                         sizeof (struct nic_record));
+    if (batch.nics == NULL && interfaces[0] != NULL)
+      error (EXIT_FAILURE, errno, "calloc");
+    for (i = 0; interfaces[i] != NULL; ++i) {
+      if (find_nic_record (interfaces[i]) != NULL)
+        continue;
+      batch.nics[batch.nr_nics].name = strdup (interfaces[i]);
+      if (batch.nics[batch.nr_nics].name == NULL)
+        error (EXIT_FAILURE, errno, "strdup");
+      batch.nr_nics++;
+    }
+    batch.nr_nics = sort_nic_batch (batch.nics, batch.nr_nics);
+  }
+  pthread_mutex_unlock (&inventory_mutex);
+
+  /* Read the new devices without holding the lock, so that lookups of
+   * other devices are not blocked.
+   */
+  if (batch.nr_disks + batch.nr_nics > 0)
+    read_batch (&batch);
+
+  pthread_mutex_lock (&inventory_mutex);
+
+  if (disks) {
+    /* Drop records for disks which have gone away. */
+    for (i = j = 0; i < nr_disk_records; ++i) {
+      if (in_list (disks, disk_records[i].name))
+        disk_records[j++] = disk_records[i];
+      else
+        free_disk_record (&disk_records[i]);
+    }
+    nr_disk_records = j;
+
+    /* Add the new ones.  Another thread may have added the same disk
+     * while we were reading it.  The new records are appended after
+     * the existing ones, so find_disk_record only searches the sorted
+     * existing records, and then everything is sorted once.
+     */
+    disk_records = realloc (disk_records,
+                            (nr_disk_records + batch.nr_disks) *
+                            sizeof (struct disk_record));
+    if (disk_records == NULL && nr_disk_records + batch.nr_disks > 0)
+      error (EXIT_FAILURE, errno, "realloc");
+    for (i = 0, j = nr_disk_records; i < batch.nr_disks; ++i) {
+      if (find_disk_record (batch.disks[i].name) != NULL)
+        free_disk_record (&batch.disks[i]);
+      else
+        disk_records[j++] = batch.disks[i];
+    }
+    if (j > nr_disk_records) {
+      nr_disk_records = j;
+      qsort (disk_records, nr_disk_records, sizeof (struct disk_record),
+             compare_disk_records);
+    }
+  }
+
+  if (interfaces) {
+    for (i = j = 0; i < nr_nic_records; ++i) {
+      if (in_list (interfaces, nic_records[i].name))
+        nic_records[j++] = nic_records[i];
+      else
+        free_nic_record (&nic_records[i]);
+    }
+    nr_nic_records = j;
+
+    nic_records = realloc (nic_records,
+                           (nr_nic_records + batch.nr_nics) *
+                           sizeof (struct nic_record));
+    if (nic_records == NULL && nr_nic_records + batch.nr_nics > 0)
+      error (EXIT_FAILURE, errno, "realloc");
+    for (i = 0, j = nr_nic_records; i < batch.nr_nics; ++i) {
+      if (find_nic_record (batch.nics[i].name) != NULL)
+        free_nic_record (&batch.nics[i]);
+      else
+        nic_records[j++] = batch.nics[i];
+    }
+    if (j > nr_nic_records) {
+      nr_nic_records = j;
+      qsort (nic_records, nr_nic_records, sizeof (struct nic_record),
+             compare_nic_records);
+    }
+  }
+
+  pthread_mutex_unlock (&inventory_mutex);
+
+  free (batch.disks);
+  free (batch.nics);
+}
+
+/**
+ * Forget a device which has been unplugged, so that if a different
+ * device appears later with the same name its attributes are read
+ * again.
+ */
+void
+forget_inventory_device (const char *name)
+{
+  struct disk_record *dr;
+  struct nic_record *nr;
+
+  pthread_mutex_lock (&inventory_mutex);
+
+  dr = find_disk_record (name);
+  if (dr) {
+    free_disk_record (dr);
+    memmove (dr, dr + 1,
+             (disk_records + nr_disk_records - (dr + 1)) * sizeof *dr);
+    nr_disk_records--;
+  }
+
+  nr = find_nic_record (name);
+  if (nr) {
+    free_nic_record (nr);
+    memmove (nr, nr + 1,
+             (nic_records + nr_nic_records - (nr + 1)) * sizeof *nr);
+    nr_nic_records--;
+  }
+
+  pthread_mutex_unlock (&inventory_mutex);
+}
+
+/* Look up a disk, adding it to the inventory first if it is not
+ * there.  On return the inventory_mutex is held.
+ */
+static struct disk_record *
+lock_disk_record (const char *name)
+{
+  struct disk_record *r;
+
+  pthread_mutex_lock (&inventory_mutex);
+  r = find_disk_record (name);
+  if (r == NULL) {
+    struct disk_record new_r = { 0 };
+
+    pthread_mutex_unlock (&inventory_mutex);
+
+    new_r.name = strdup (name);
+    if (new_r.name == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    read_disk_record (&new_r);
+
+    pthread_mutex_lock (&inventory_mutex);
+    r = find_disk_record (name);
+    if (r != NULL)
+      free_disk_record (&new_r);
+    else {
+      disk_records = realloc (disk_records,
+                              (nr_disk_records + 1) *
+                              sizeof (struct disk_record));
+      if (disk_records == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+      disk_records[nr_disk_records++] = new_r;
+      qsort (disk_records, nr_disk_records, sizeof (struct disk_record),
+             compare_disk_records);
+      r = find_disk_record (name);
+    }
+  }
+
+  return r;
+}
+
+static struct nic_record *
+lock_nic_record (const char *name)
+{
+  struct nic_record *r;
+
+  pthread_mutex_lock (&inventory_mutex);
+  r = find_nic_record (name);
+  if (r == NULL) {
+    struct nic_record new_r = { 0 };
+
+    pthread_mutex_unlock (&inventory_mutex);
+
+    new_r.name = strdup (name);
+    if (new_r.name == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    read_nic_record (&new_r);
+
+    pthread_mutex_lock (&inventory_mutex);
+    r = find_nic_record (name);
+    if (r != NULL)
+      free_nic_record (&new_r);
+    else {
+      nic_records = realloc (nic_records,
+                             (nr_nic_records + 1) *
+                             sizeof (struct nic_record));
+      if (nic_records == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+      nic_records[nr_nic_records++] = new_r;
+      qsort (nic_records, nr_nic_records, sizeof (struct nic_record),
+             compare_nic_records);
+      r = find_nic_record (name);
+    }
+  }
+
+  return r;
+}
+
+static char *
+dup_or_null (const char *str)
+{
+  char *ret;
+
+  if (str == NULL)
+    return NULL;
+  ret = strdup (str);
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  return ret;
+}
+
+/**
+ * Return the size of a disk in GB.  See C<get_blockdev_size>.
+ */
+uint64_t
+inventory_disk_size (const char *name)
+{
+  uint64_t ret;
+
+  ret = lock_disk_record (name)->size;
+  pthread_mutex_unlock (&inventory_mutex);
+  return ret;
+}
+
+/**
+ * Return the model of a disk, or C<NULL>.  See C<get_blockdev_model>.
+ */
+char *
+inventory_disk_model (const char *name)
+{
+  char *ret;
+
+  ret = dup_or_null (lock_disk_record (name)->model);
+  pthread_mutex_unlock (&inventory_mutex);
+  return ret;
+}
+
+/**
+ * Return the serial number of a disk, or C<NULL>.  See
+ * C<get_blockdev_serial>.
+ */
+char *
+inventory_disk_serial (const char *name)
+{
+  char *ret;
+
+  ret = dup_or_null (lock_disk_record (name)->serial);
+  pthread_mutex_unlock (&inventory_mutex);
+  return ret;
+}
+
+/**
+ * Return the MAC address of a network interface, or C<NULL>.  See
+ * C<get_if_addr>.
+ */
+char *
+inventory_if_addr (const char *if_name)
+{
+  char *ret;
+
+  ret = dup_or_null (lock_nic_record (if_name)->addr);
+  pthread_mutex_unlock (&inventory_mutex);
+  return ret;
+}
+
+/**
+ * Return the PCI vendor of a network interface, or C<NULL>.  If
+ * C<truncate> E<gt> 0 then the name is truncated to that many
+ * characters.  See C<get_if_vendor>.
+ */
+char *
+inventory_if_vendor (const char *if_name, int truncate)
+{
+  char *ret;
+
+  ret = dup_or_null (lock_nic_record (if_name)->vendor);
+  pthread_mutex_unlock (&inventory_mutex);
+
+  if (ret && truncate > 0 && strlen (ret) > (size_t) truncate)
+    ret[truncate] = '\0';
+  return ret;
+}
+
+/**
+ * Return the PCI device name of a network interface, or C<NULL>.
+ * See C<inventory_if_vendor> and C<get_if_device>.
+ */
+char *
+inventory_if_device (const char *if_name, int truncate)
+{
+  char *ret;
+
+  ret = dup_or_null (lock_nic_record (if_name)->device);
+  pthread_mutex_unlock (&inventory_mutex);
+
+  if (ret && truncate > 0 && strlen (ret) > (size_t) truncate)
+    ret[truncate] = '\0';
+  return ret;
+}
@@ -44,6 +44,8 @@ void
 kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
 {
   const char *p;
+  size_t phase;
+  int r;
 
   /* Pre-conversion command. */
   p = get_cmdline_key (cmdline, "p2v.pre");
@@ -53,7 +55,10 @@ kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
   /* Connect to and interrogate virt-v2v on the conversion server. */
   p = get_cmdline_key (cmdline, "p2v.skip_test_connection");
   if (!p) {
+    phase = timeline_begin ("wait_network_online");
     wait_network_online (config);
+    timeline_end (phase);
+    phase = timeline_begin ("test_connection");
     if (test_connection (config) == -1) {
       const char *err = get_ssh_error ();
 
@@ -61,6 +66,7 @@ kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
              "error opening control connection to %s:%d: %s",
              config->remote.server, config->remote.port, err);
     }
+    timeline_end (phase);
   }
 
   /* Some disks must have been specified for conversion. */
@@ -70,8 +76,37 @@ kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
            "virt-p2v looked in /sys/block and in p2v.disks on the kernel command line.\n"
            "This is a fatal error and virt-p2v cannot continue.");
 
+  /* From here on the console output is written by a separate thread,
+   * so that a slow console doesn't hold up the conversion.  The
+   * messages are built in memory first, where the ansi_* macros can't
+   * tell that they are going to stdout, so decide about colours now.
+   */
+  if (isatty (STDOUT_FILENO))
+    force_colour = 1;
+  start_console_writer ();
+
+  /* Estimate how long the conversion will take. */
+  p = get_cmdline_key (cmdline, "p2v.benchmark");
+  if (p) {
+    CLEANUP_FREE char *report = measure_conversion (config, notify_ui_callback);
+
+    flush_console ();
+    if (report == NULL)
+      fprintf (stderr, "%s: could not estimate the conversion time: %s\n",
+               g_get_prgname (), get_measure_error ());
+    else {
+      fputs (report, stdout);
+      fflush (stdout);
+    }
+
+    if (STREQ (p, "only"))
+      exit (report ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
   /* Perform the conversion in text mode. */
-  if (start_conversion (config, notify_ui_callback) == -1) {
+  r = start_conversion (config, notify_ui_callback);
+  flush_console ();
+  if (r == -1) {
     const char *err = get_conversion_error ();
 
     fprintf (stderr, "%s: error during conversion: %s\n",
@@ -101,36 +136,50 @@ kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
 static void
 notify_ui_callback (int type, const char *data)
 {
+  CLEANUP_FREE char *msg = NULL;
+  size_t len;
+  FILE *fp;
+  int console_type = CONSOLE_OUTPUT;
+
+  if (type == NOTIFY_REMOTE_MESSAGE) {
+    console_write (CONSOLE_OUTPUT, data);
+    return;
+  }
+
+  /* Build the message, so that it is queued in one piece. */
+  fp = open_memstream (&msg, &len);
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "open_memstream");
+
   switch (type) {
   case NOTIFY_LOG_DIR:
-    ansi_magenta (stdout);
-    printf ("%s: remote log directory location: ", g_get_prgname ());
-    ansi_red (stdout);
-    fputs (data, stdout);
-    ansi_restore (stdout);
-    putchar ('\n');
-    break;
-
-  case NOTIFY_REMOTE_MESSAGE:
-    printf ("%s", data);
+    ansi_magenta (fp);
+    fprintf (fp, "%s: remote log directory location: ", g_get_prgname ());
+    ansi_red (fp);
+    fputs (data, fp);
+    ansi_restore (fp);
+    fputc ('\n', fp);
     break;
 
   case NOTIFY_STATUS:
-    ansi_magenta (stdout);
-    printf ("%s: %s", g_get_prgname (), data);
-    ansi_restore (stdout);
-    putchar ('\n');
+    ansi_magenta (fp);
+    fprintf (fp, "%s: %s", g_get_prgname (), data);
+    ansi_restore (fp);
+    fputc ('\n', fp);
+    console_type = CONSOLE_STATUS;
     break;
 
   default:
-    ansi_red (stdout);
-    printf ("%s: unknown message during conversion: type=%d data=%s",
-            g_get_prgname (), type, data);
-    ansi_restore (stdout);
-    putchar ('\n');
+    ansi_red (fp);
+    fprintf (fp, "%s: unknown message during conversion: type=%d data=%s",
+             g_get_prgname (), type, data);
+    ansi_restore (fp);
+    fputc ('\n', fp);
   }
 
-  fflush (stdout);
+  if (fclose (fp) == EOF)
+    error (EXIT_FAILURE, errno, "fclose");
+  console_write (console_type, msg);
 }
 
 static void
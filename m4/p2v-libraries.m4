@@ -36,6 +36,15 @@ dnl Check for the Glib 2 and Gtk 3 libraries, used by virt-p2v (required).
 PKG_CHECK_MODULES([GLIB2], [glib-2.0 >= 2.56])
 PKG_CHECK_MODULES([GTK3], [gtk+-3.0 >= 3.22])
 
+dnl zlib is an optional dependency of virt-p2v, used by p2v.compress.
+PKG_CHECK_MODULES([ZLIB], [zlib], [
+    AC_SUBST([ZLIB_CFLAGS])
+    AC_SUBST([ZLIB_LIBS])
+    AC_DEFINE([HAVE_ZLIB],[1],[zlib found at compile time.])
+],[
+    AC_MSG_WARN([zlib not found, virt-p2v will not be able to compress the data it sends (p2v.compress)])
+])
+
 dnl D-Bus is an optional dependency of virt-p2v.
 PKG_CHECK_MODULES([DBUS], [dbus-1], [
     AC_SUBST([DBUS_CFLAGS])
@@ -66,6 +66,8 @@ static const struct option long_options[] = {
   { "long-options", 0, 0, 0 },
   { "short-options", 0, 0, 0 },
   { "test-disk", 1, 0, 0 },
+  { "test-pci-ids", 1, 0, 0 },
+  { "timeline", 0, 0, 0 },
   { "verbose", 0, 0, 'v' },
   { "version", 0, 0, 'V' },
   { 0, 0, 0, 0 }
@@ -88,6 +90,8 @@ usage (int status)
               " --colors|--colours      Use ANSI colour sequences even if not tty\n"
               " --iso                   Running in the ISO environment\n"
               " --test-disk=DISK.IMG    For testing, use disk as /dev/sda\n"
+              " --test-pci-ids=PCI.IDS  For testing, look up PCI IDs from stdin\n"
+              " --timeline              Print how long each phase takes\n"
               "  -v|--verbose           Verbose messages\n"
               "  -V|--version           Display version and exit\n"
               "For more information, see the manpage %s(1).\n"),
@@ -121,6 +125,39 @@ display_long_options (const struct option *long_options_p)
   exit (EXIT_SUCCESS);
 }
 
+/* For --test-pci-ids.  Read lines of "VENDOR" or "VENDOR DEVICE" (in
+ * hex) from stdin, and print the name of each, or "-" if it is not
+ * in pci.ids.
+ */
+static void
+test_pci_ids (const char *filename)
+{
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0;
+  size_t phase;
+
+  set_pci_ids_file (filename);
+
+  phase = timeline_begin ("PCI ID lookups");
+  while (getline (&line, &len, stdin) != -1) {
+    CLEANUP_FREE char *name = NULL;
+    unsigned vendor, device;
+
+    switch (sscanf (line, "%x %x", &vendor, &device)) {
+    case 1:
+      name = get_pci_vendor (vendor, 0);
+      break;
+    case 2:
+      name = get_pci_device (vendor, device, 0);
+      break;
+    default:
+      error (EXIT_FAILURE, 0, "--test-pci-ids: cannot parse: %s", line);
+    }
+    printf ("%s\n", name ? name : "-");
+  }
+  timeline_end (phase);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -131,7 +168,11 @@ main (int argc, char *argv[])
   int cmdline_source = 0;
   struct config *config = new_config ();
   const char *test_disk = NULL;
+  const char *test_pci_ids_file = NULL;
   char **disks, **removable;
+  size_t phase;
+
+  timeline_mark ("main");
 
   setlocale (LC_ALL, "");
   bindtextdomain (PACKAGE, LOCALEBASEDIR);
@@ -140,14 +181,9 @@ main (int argc, char *argv[])
   /* We may use random(3) in this program. */
   srandom (time (NULL) + getpid ());
 
-  /* There is some raciness between slow devices being discovered by
-   * the kernel and udev and virt-p2v running.  This is a partial
-   * workaround, but a real fix involves handling hotplug events
-   * (possible in GUI mode, not easy in kernel mode).
-   */
-  udevadm_settle ();
-
+  phase = timeline_begin ("gtk_init_check");
   gui_possible = gtk_init_check (&argc, &argv);
+  timeline_end (phase);
 
   for (;;) {
     c = getopt_long (argc, argv, options, long_options, &option_index);
@@ -183,6 +219,12 @@ main (int argc, char *argv[])
                  _("--test-disk must be an absolute path"));
         test_disk = optarg;
       }
+      else if (STREQ (long_options[option_index].name, "test-pci-ids")) {
+        test_pci_ids_file = optarg;
+      }
+      else if (STREQ (long_options[option_index].name, "timeline")) {
+        enable_timeline ();
+      }
       else
         error (EXIT_FAILURE, 0,
                _("unknown long option: %s (%d)"),
@@ -213,9 +255,64 @@ main (int argc, char *argv[])
     usage (EXIT_FAILURE);
   }
 
-  test_nbd_server ();
+  if (test_pci_ids_file) {
+    test_pci_ids (test_pci_ids_file);
+    exit (EXIT_SUCCESS);
+  }
+
+  /* Find out what nbdkit can do in the background, while we wait for
+   * udev and look for disks.  This is checked by test_nbd_server
+   * below.
+   */
+  start_probing_nbd_server ();
+
+  /* Parse /proc/cmdline (if it exists) or use the --cmdline parameter
+   * to initialize the configuration.  This allows defaults to be pass
+   * using the kernel command line, with additional GUI configuration
+   * later.
+   */
+  if (cmdline == NULL) {
+    cmdline = parse_proc_cmdline ();
+    if (cmdline != NULL)
+      cmdline_source = CMDLINE_SOURCE_PROC_CMDLINE;
+  }
+
+  if (cmdline && get_cmdline_key (cmdline, "p2v.timeline") != NULL)
+    enable_timeline ();
+
+  if (cmdline) {
+    const char *p = get_cmdline_key (cmdline, "p2v.metrics_port");
+    if (p != NULL) {
+      int port;
+
+      if (sscanf (p, "%d", &port) != 1 || port <= 0 || port > 65535)
+        error (EXIT_FAILURE, 0,
+               "cannot parse p2v.metrics_port from kernel command line");
+      ignore_value (start_metrics_server (port));
+    }
+  }
+
+  /* There is some raciness between slow devices being discovered by
+   * the kernel and udev and virt-p2v running.  The GUI handles this by
+   * listening for hotplug events, so it can start straight away.  In
+   * kernel mode there is no user to add a late disk, so wait for udev
+   * to settle before looking.
+   */
+  if (cmdline &&
+      (get_cmdline_key (cmdline, "p2v.server") != NULL ||
+       get_cmdline_key (cmdline, "p2v.remote.server") != NULL)) {
+    phase = timeline_begin ("udevadm settle");
+    udevadm_settle ();
+    timeline_end (phase);
+  }
+
+  /* Start collecting dmesg, lspci etc in the background.  These are
+   * copied to the conversion server once the conversion has started.
+   */
+  start_collecting_system_data ();
 
   /* Find all block devices in the system. */
+  phase = timeline_begin ("find disks");
   if (test_disk) {
     /* For testing and debugging purposes, you can use
      * --test-disk=/path/to/disk.img
@@ -231,19 +328,22 @@ main (int argc, char *argv[])
     removable = NULL;
   } else
     find_all_disks (&disks, &removable);
+  timeline_end (phase);
 
+  phase = timeline_begin ("set_config_defaults");
   set_config_defaults (config, (const char **)disks, (const char **)removable);
+  timeline_end (phase);
 
-  /* Parse /proc/cmdline (if it exists) or use the --cmdline parameter
-   * to initialize the configuration.  This allows defaults to be pass
-   * using the kernel command line, with additional GUI configuration
-   * later.
+  /* Read the attributes of all the disks and network interfaces in
+   * parallel, once, for the GUI and the physical machine XML.
    */
-  if (cmdline == NULL) {
-    cmdline = parse_proc_cmdline ();
-    if (cmdline != NULL)
-      cmdline_source = CMDLINE_SOURCE_PROC_CMDLINE;
-  }
+  phase = timeline_begin ("update_inventory");
+  update_inventory ((const char **)disks, (const char **)all_interfaces);
+  timeline_end (phase);
+
+  phase = timeline_begin ("test_nbd_server");
+  test_nbd_server ();
+  timeline_end (phase);
 
   if (cmdline)
     update_config_from_kernel_cmdline (config, cmdline);
@@ -258,7 +358,8 @@ main (int argc, char *argv[])
       error (EXIT_FAILURE, 0,
              _("gtk_init_check returned false, indicating that\n"
                "a GUI is not possible on this host.  Check X11, $DISPLAY etc."));
-    gui_conversion (config, (const char **)disks, (const char **)removable);
+    gui_conversion (config, (const char **)disks, (const char **)removable,
+                    test_disk == NULL);
   }
 
   guestfs_int_free_string_list (cmdline);
@@ -390,15 +491,7 @@ find_all_interfaces (void)
     d = readdir (dir);
     if (!d) break;
 
-    /* For systemd predictable names, see:
-     * http://cgit.freedesktop.org/systemd/systemd/tree/src/udev/udev-builtin-net_id.c#n20
-     * biosdevname is also a possibility here.
-     * Ignore PPP, SLIP, WWAN, bridges, etc.
-     */
-    if (STRPREFIX (d->d_name, "em") ||
-        STRPREFIX (d->d_name, "en") ||
-        STRPREFIX (d->d_name, "eth") ||
-        STRPREFIX (d->d_name, "wl")) {
+    if (is_network_interface (d->d_name)) {
       nr_interfaces++;
       all_interfaces =
         realloc (all_interfaces, sizeof (char *) * (nr_interfaces + 1));
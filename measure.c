@@ -0,0 +1,455 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Estimate how long a conversion will take before starting it.
+ *
+ * For each disk selected for conversion we sample sequential and
+ * random read throughput.  The disk is read in exactly the same way
+ * as L<nbdkit-file-plugin(1)> reads it during conversion, ie. using
+ * L<pread(2)> on the block device opened read-only.  The random
+ * samples are also used to estimate how much of the disk contains
+ * data (non-zero blocks).
+ *
+ * We then probe the link to the conversion server by uploading a
+ * small file of random data using L<scp(1)>, and combine the numbers
+ * into an estimated total transfer time.
+ *
+ * This is only ever an estimate: virt-v2v trims free space in guest
+ * filesystems before copying, so the real amount of data copied is
+ * usually somewhere between the "allocated" figure and the size of
+ * the disk.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+/* Sequential reads: SEQ_RUNS runs of SEQ_RUN_SIZE bytes, spread out
+ * evenly over the disk, read in chunks of SEQ_CHUNK_SIZE.
+ */
+#define SEQ_RUNS 4
+#define SEQ_RUN_SIZE (32 * 1024 * 1024)
+#define SEQ_CHUNK_SIZE (1024 * 1024)
+
+/* Random reads: RANDOM_SAMPLES reads of RANDOM_SAMPLE_SIZE bytes. */
+#define RANDOM_SAMPLES 256
+#define RANDOM_SAMPLE_SIZE (64 * 1024)
+
+/* Size of the file uploaded to probe the link to the server. */
+#define LINK_PROBE_SIZE (8 * 1024 * 1024)
+
+struct disk_measurement {
+  uint64_t size;                /* size of the disk in bytes */
+  double seq_rate;              /* sequential read rate (bytes/sec) */
+  double random_rate;           /* random read rate (bytes/sec) */
+  double allocated;             /* fraction of non-zero samples, 0..1 */
+  uint64_t skipped;             /* bytes sent as zeroes, see skip.c */
+};
+
+static char *measure_error;
+
+static void set_measure_error (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+
+static void
+set_measure_error (const char *fs, ...)
+{
+  va_list args;
+  char *msg;
+  int len;
+
+  va_start (args, fs);
+  len = vasprintf (&msg, fs, args);
+  va_end (args);
+
+  if (len < 0)
+    error (EXIT_FAILURE, errno,
+           "vasprintf (original error format string: %s)", fs);
+
+  free (measure_error);
+  measure_error = msg;
+}
+
+const char *
+get_measure_error (void)
+{
+  return measure_error;
+}
+
+static double
+elapsed (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+    (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+is_zero (const char *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; ++i)
+    if (buf[i] != 0)
+      return 0;
+  return 1;
+}
+
+/**
+ * Read C<len> bytes at C<offset>, first dropping that range from the
+ * page cache so that we measure the disk and not memory.
+ */
+static int
+read_range (int fd, char *buf, size_t len, uint64_t offset)
+{
+  ssize_t r;
+
+  ignore_value (posix_fadvise (fd, offset, len, POSIX_FADV_DONTNEED));
+
+  while (len > 0) {
+    r = pread (fd, buf, len, offset);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
+    buf += r;
+    len -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/**
+ * Sample the read throughput of a single disk.
+ */
+static int
+measure_disk (const char *device, struct disk_measurement *m)
+{
+  int fd;
+  char *buf;
+  size_t i, j, nr_runs, nonzero = 0;
+  uint64_t offset, total;
+  struct timespec start;
+  double t;
+
+  memset (m, 0, sizeof *m);
+
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    set_measure_error ("open: %s: %m", device);
+    return -1;
+  }
+
+  if (ioctl (fd, BLKGETSIZE64, &m->size) == -1) {
+    struct stat statbuf;
+
+    /* Not a block device, eg. --test-disk. */
+    if (fstat (fd, &statbuf) == -1) {
+      set_measure_error ("fstat: %s: %m", device);
+      close (fd);
+      return -1;
+    }
+    m->size = statbuf.st_size;
+  }
+
+  if (m->size < RANDOM_SAMPLE_SIZE) {
+    set_measure_error (_("%s: disk is too small to measure"), device);
+    close (fd);
+    return -1;
+  }
+
+  buf = malloc (SEQ_CHUNK_SIZE);
+  if (buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  /* Sequential reads. */
+  nr_runs = m->size >= (uint64_t) SEQ_RUNS * SEQ_RUN_SIZE ? SEQ_RUNS : 1;
+  total = 0;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nr_runs; ++i) {
+    offset = m->size / nr_runs * i;
+    offset &= ~(uint64_t) (SEQ_CHUNK_SIZE - 1);
+    for (j = 0; j < SEQ_RUN_SIZE / SEQ_CHUNK_SIZE; ++j) {
+      size_t n = SEQ_CHUNK_SIZE;
+
+      if (offset >= m->size)
+        break;
+      if (offset + n > m->size)
+        n = m->size - offset;
+      if (read_range (fd, buf, n, offset) == -1) {
+        set_measure_error ("pread: %s: %m", device);
+        goto error;
+      }
+      offset += n;
+      total += n;
+    }
+  }
+  t = elapsed (&start);
+  m->seq_rate = t > 0 ? total / t : 0;
+
+  /* Random reads, also used to estimate the allocated fraction. */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < RANDOM_SAMPLES; ++i) {
+    offset = (((uint64_t) random () << 31) | random ()) %
+      (m->size / RANDOM_SAMPLE_SIZE);
+    offset *= RANDOM_SAMPLE_SIZE;
+    if (read_range (fd, buf, RANDOM_SAMPLE_SIZE, offset) == -1) {
+      set_measure_error ("pread: %s: %m", device);
+      goto error;
+    }
+    if (!is_zero (buf, RANDOM_SAMPLE_SIZE))
+      nonzero++;
+  }
+  t = elapsed (&start);
+  m->random_rate = t > 0 ? (double) RANDOM_SAMPLES * RANDOM_SAMPLE_SIZE / t : 0;
+  m->allocated = (double) nonzero / RANDOM_SAMPLES;
+
+  free (buf);
+  close (fd);
+  return 0;
+
+ error:
+  free (buf);
+  close (fd);
+  return -1;
+}
+
+/**
+ * Probe the link to the conversion server.
+ *
+ * We time two uploads to F</dev/null> on the server, one tiny and
+ * one of C<LINK_PROBE_SIZE> bytes of random (ie. incompressible)
+ * data.  The difference between the two takes out the cost of the
+ * ssh handshake.
+ *
+ * Returns the rate in bytes/sec, C<0> if the link was too fast to
+ * measure, or C<-1> on error.
+ */
+static double
+measure_link (const struct config *config)
+{
+  char tmpdir[] = "/tmp/p2v.XXXXXX";
+  CLEANUP_FREE char *small_file = NULL, *large_file = NULL;
+  CLEANUP_FREE char *cmd = NULL;
+  struct timespec start;
+  double t_small, t_large, ret = -1;
+
+  if (mkdtemp (tmpdir) == NULL) {
+    set_measure_error ("mkdtemp: %m");
+    return -1;
+  }
+  if (asprintf (&small_file, "%s/small", tmpdir) == -1 ||
+      asprintf (&large_file, "%s/large", tmpdir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (asprintf (&cmd,
+                "echo > %s && "
+                "head -c %d /dev/urandom > %s",
+                small_file, LINK_PROBE_SIZE, large_file) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (system (cmd) != 0) {
+    set_measure_error (_("could not create link probe files in %s"), tmpdir);
+    goto out;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (scp_file (config, "/dev/null", small_file, NULL) == -1) {
+    set_measure_error ("scp: %s", get_ssh_error ());
+    goto out;
+  }
+  t_small = elapsed (&start);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (scp_file (config, "/dev/null", large_file, NULL) == -1) {
+    set_measure_error ("scp: %s", get_ssh_error ());
+    goto out;
+  }
+  t_large = elapsed (&start);
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: link probe: %.3fs (handshake), %.3fs (%d bytes)\n",
+           g_get_prgname (), t_small, t_large, LINK_PROBE_SIZE);
+#endif
+
+  ret = t_large > t_small ? LINK_PROBE_SIZE / (t_large - t_small) : 0;
+
+ out:
+  unlink (small_file);
+  unlink (large_file);
+  rmdir (tmpdir);
+  return ret;
+}
+
+/**
+ * Format a number of seconds in a way that is easy to read.
+ */
+static char *
+format_duration (double secs)
+{
+  char *ret;
+  const uint64_t s = secs + 0.5;
+
+  if (s < 60) {
+    if (asprintf (&ret, _("%" PRIu64 " seconds"), s) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else if (s < 3600) {
+    if (asprintf (&ret, _("%" PRIu64 " minutes"), (s + 30) / 60) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else {
+    if (asprintf (&ret, _("%" PRIu64 "h %02" PRIu64 "m"),
+                  s / 3600, (s % 3600) / 60) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  return ret;
+}
+
+#define MB(bytes) ((double) (bytes) / 1024 / 1024)
+
+/**
+ * Measure the disks selected in C<config-E<gt>disks> and the link to
+ * the conversion server, and return a human-readable report
+ * containing the estimated transfer time.  Progress is reported
+ * through C<notify_ui> using C<NOTIFY_STATUS>.
+ *
+ * The caller must free the returned string.  On error this returns
+ * C<NULL> and the error can be retrieved using C<get_measure_error>.
+ */
+char *
+measure_conversion (const struct config *config,
+                    void (*notify_ui) (int type, const char *data))
+{
+  const size_t nr_disks = guestfs_int_count_strings (config->disks);
+  CLEANUP_FREE struct disk_measurement *m = NULL;
+  CLEANUP_FREE char *min_str = NULL, *max_str = NULL;
+  char *report = NULL;
+  size_t report_len = 0;
+  FILE *fp;
+  size_t i;
+  double link_rate, min_secs = 0, max_secs = 0;
+  struct skip_list *skip;
+
+  if (nr_disks == 0) {
+    set_measure_error (_("no disks were selected for conversion"));
+    return NULL;
+  }
+
+  m = calloc (nr_disks, sizeof (struct disk_measurement));
+  if (m == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  for (i = 0; config->disks[i] != NULL; ++i) {
+    CLEANUP_FREE char *device = NULL;
+
+    if (config->disks[i][0] == '/') {
+      device = strdup (config->disks[i]);
+      if (device == NULL)
+        error (EXIT_FAILURE, errno, "strdup");
+    }
+    else if (asprintf (&device, "/dev/%s", config->disks[i]) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+
+    if (notify_ui) {
+      CLEANUP_FREE char *msg;
+      if (asprintf (&msg, _("Measuring read throughput of %s ..."),
+                    config->disks[i]) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      notify_ui (NOTIFY_STATUS, msg);
+    }
+
+    if (measure_disk (device, &m[i]) == -1)
+      return NULL;
+
+    /* Excluded partitions and swap are not sent at all. */
+    skip = find_skip_extents (device, !config->copy_swap,
+                              config->exclude_partitions);
+    m[i].skipped = skip->total;
+    free_skip_list (skip);
+  }
+
+  if (notify_ui)
+    notify_ui (NOTIFY_STATUS,
+               _("Measuring the link to the conversion server ..."));
+
+  link_rate = measure_link (config);
+  if (link_rate == -1)
+    return NULL;
+
+  fp = open_memstream (&report, &report_len);
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "open_memstream");
+
+  for (i = 0; i < nr_disks; ++i) {
+    const uint64_t copied = m[i].size - m[i].skipped;
+    double rate = m[i].seq_rate;
+
+    if (link_rate > 0 && link_rate < rate)
+      rate = link_rate;
+    if (rate > 0) {
+      min_secs += copied * m[i].allocated / rate;
+      max_secs += copied / rate;
+    }
+
+    fprintf (fp,
+             _("%s: %.0f MB, sequential read %.1f MB/s, "
+               "random read %.1f MB/s, about %.0f%% allocated\n"),
+             config->disks[i], MB (m[i].size),
+             MB (m[i].seq_rate), MB (m[i].random_rate),
+             m[i].allocated * 100);
+    if (m[i].skipped > 0)
+      fprintf (fp, _("%s: %.0f MB of swap and excluded partitions "
+                     "not copied\n"),
+               config->disks[i], MB (m[i].skipped));
+  }
+
+  if (link_rate > 0)
+    fprintf (fp, _("Link to the conversion server: %.1f MB/s\n"),
+             MB (link_rate));
+  else
+    fprintf (fp, _("Link to the conversion server: too fast to measure\n"));
+
+  min_str = format_duration (min_secs);
+  max_str = format_duration (max_secs);
+  fprintf (fp,
+           _("Estimated transfer time: %s (allocated data only) "
+             "to %s (whole disks)\n"),
+           min_str, max_str);
+
+  fclose (fp);
+  return report;
+}
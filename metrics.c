@@ -0,0 +1,441 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Live metrics about the conversion: the current stage, how many
+ * bytes have been read from each disk, the throughput, the CPU used
+ * by nbdkit and ssh, and the number of errors.
+ *
+ * The metrics are updated by F<conversion.c> while the conversion
+ * runs.  They are sent periodically over the control connection as a
+ * compact JSON record (see C<format_metrics_record>), which the
+ * wrapper script saves in F<p2v-metrics.json> in the remote
+ * directory.  If C<p2v.metrics_port> is given on the kernel command
+ * line, they are also served read-only in the Prometheus text format
+ * on that port (see C<start_metrics_server>).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <pthread.h>
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *stage;
+static unsigned errors;
+static size_t nr_disks;
+static char **disk_names;
+static uint64_t *disk_bytes;
+static double throughput;       /* bytes per second */
+static double nbdkit_cpu;       /* seconds */
+static double ssh_cpu;          /* seconds */
+
+/* Used to calculate the throughput between samples. */
+static uint64_t last_total_bytes;
+static double last_sample_time;
+
+/**
+ * Set the current stage of the conversion, such as
+ * C<"data connections"> or C<"conversion">.
+ */
+void
+set_metrics_stage (const char *new_stage)
+{
+  pthread_mutex_lock (&metrics_lock);
+  free (stage);
+  stage = strdup (new_stage);
+  if (stage == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  pthread_mutex_unlock (&metrics_lock);
+}
+
+void
+count_metrics_error (void)
+{
+  pthread_mutex_lock (&metrics_lock);
+  errors++;
+  pthread_mutex_unlock (&metrics_lock);
+}
+
+/**
+ * Start counting bytes for a new set of disks.  This resets the
+ * per-disk counters, throughput and CPU usage.
+ */
+void
+set_metrics_disks (char **disks)
+{
+  pthread_mutex_lock (&metrics_lock);
+  guestfs_int_free_string_list (disk_names);
+  free (disk_bytes);
+  nr_disks = guestfs_int_count_strings (disks);
+  disk_names = guestfs_int_copy_string_list (disks);
+  disk_bytes = calloc (nr_disks, sizeof (uint64_t));
+  if (disk_names == NULL || (nr_disks > 0 && disk_bytes == NULL))
+    error (EXIT_FAILURE, errno, "malloc");
+  throughput = nbdkit_cpu = ssh_cpu = 0;
+  last_total_bytes = 0;
+  last_sample_time = timeline_now ();
+  pthread_mutex_unlock (&metrics_lock);
+}
+
+/**
+ * Set the number of bytes which have been read from disk C<i> (an
+ * index into the list passed to C<set_metrics_disks>).
+ */
+void
+update_metrics_disk (size_t i, uint64_t bytes)
+{
+  pthread_mutex_lock (&metrics_lock);
+  if (i < nr_disks)
+    disk_bytes[i] = bytes;
+  pthread_mutex_unlock (&metrics_lock);
+}
+
+/**
+ * Record the CPU time used so far by nbdkit and ssh, and recalculate
+ * the throughput since the last call.  This should be called about
+ * once a second.
+ */
+void
+update_metrics_sample (double new_nbdkit_cpu, double new_ssh_cpu)
+{
+  const double now = timeline_now ();
+  uint64_t total = 0;
+  size_t i;
+
+  pthread_mutex_lock (&metrics_lock);
+  for (i = 0; i < nr_disks; ++i)
+    total += disk_bytes[i];
+  if (now > last_sample_time)
+    throughput = (total - last_total_bytes) / (now - last_sample_time);
+  last_total_bytes = total;
+  last_sample_time = now;
+  nbdkit_cpu = new_nbdkit_cpu;
+  ssh_cpu = new_ssh_cpu;
+  pthread_mutex_unlock (&metrics_lock);
+}
+
+/**
+ * Return the metrics as a single line of JSON (without a trailing
+ * newline), for example:
+ *
+ *  {"time":1560000000,"stage":"conversion","errors":0,
+ *   "bytes":1073741824,"bytes_per_second":52428800,
+ *   "nbdkit_cpu_seconds":1.25,"ssh_cpu_seconds":9.50,
+ *   "disks":{"sda":1073741824}}
+ *
+ * The line never contains control characters, so it is safe to send
+ * over the control connection.  The caller must free the string.
+ */
+char *
+format_metrics_record (void)
+{
+  char *ret = NULL;
+  size_t len = 0;
+  FILE *fp;
+  uint64_t total = 0;
+  size_t i;
+
+  fp = open_memstream (&ret, &len);
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "open_memstream");
+
+  pthread_mutex_lock (&metrics_lock);
+  for (i = 0; i < nr_disks; ++i)
+    total += disk_bytes[i];
+  fprintf (fp, "{\"time\":%lld,\"stage\":", (long long) time (NULL));
+  print_json_string (fp, stage ? stage : "idle");
+  fprintf (fp, ",\"errors\":%u,\"bytes\":%" PRIu64
+           ",\"bytes_per_second\":%.0f"
+           ",\"nbdkit_cpu_seconds\":%.2f,\"ssh_cpu_seconds\":%.2f"
+           ",\"disks\":{",
+           errors, total, throughput, nbdkit_cpu, ssh_cpu);
+  for (i = 0; i < nr_disks; ++i) {
+    if (i > 0)
+      fputc (',', fp);
+    print_json_string (fp, disk_names[i]);
+    fprintf (fp, ":%" PRIu64, disk_bytes[i]);
+  }
+  fprintf (fp, "}}");
+  pthread_mutex_unlock (&metrics_lock);
+
+  if (fclose (fp) == EOF)
+    error (EXIT_FAILURE, errno, "fclose");
+  return ret;
+}
+
+static void
+print_prometheus_label (FILE *fp, const char *str)
+{
+  fputc ('"', fp);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      fprintf (fp, "\\%c", *str);
+    else if (*str == '\n')
+      fprintf (fp, "\\n");
+    else
+      fputc (*str, fp);
+  }
+  fputc ('"', fp);
+}
+
+/**
+ * Return the metrics in the Prometheus text exposition format.  The
+ * caller must free the string.
+ */
+static char *
+format_metrics_prometheus (void)
+{
+  char *ret = NULL;
+  size_t len = 0;
+  FILE *fp;
+  size_t i;
+
+  fp = open_memstream (&ret, &len);
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "open_memstream");
+
+  pthread_mutex_lock (&metrics_lock);
+  fprintf (fp, "# HELP p2v_stage Current stage of the conversion.\n");
+  fprintf (fp, "# TYPE p2v_stage gauge\n");
+  fprintf (fp, "p2v_stage{stage=");
+  print_prometheus_label (fp, stage ? stage : "idle");
+  fprintf (fp, "} 1\n");
+  fprintf (fp, "# HELP p2v_errors_total Number of conversion errors.\n");
+  fprintf (fp, "# TYPE p2v_errors_total counter\n");
+  fprintf (fp, "p2v_errors_total %u\n", errors);
+  fprintf (fp, "# HELP p2v_disk_read_bytes_total Bytes read from each disk by the NBD server.\n");
+  fprintf (fp, "# TYPE p2v_disk_read_bytes_total counter\n");
+  for (i = 0; i < nr_disks; ++i) {
+    fprintf (fp, "p2v_disk_read_bytes_total{disk=");
+    print_prometheus_label (fp, disk_names[i]);
+    fprintf (fp, "} %" PRIu64 "\n", disk_bytes[i]);
+  }
+  fprintf (fp, "# HELP p2v_throughput_bytes_per_second Recent transfer rate.\n");
+  fprintf (fp, "# TYPE p2v_throughput_bytes_per_second gauge\n");
+  fprintf (fp, "p2v_throughput_bytes_per_second %.0f\n", throughput);
+  fprintf (fp, "# HELP p2v_cpu_seconds_total CPU time used by helper processes.\n");
+  fprintf (fp, "# TYPE p2v_cpu_seconds_total counter\n");
+  fprintf (fp, "p2v_cpu_seconds_total{process=\"nbdkit\"} %.2f\n", nbdkit_cpu);
+  fprintf (fp, "p2v_cpu_seconds_total{process=\"ssh\"} %.2f\n", ssh_cpu);
+  pthread_mutex_unlock (&metrics_lock);
+
+  if (fclose (fp) == EOF)
+    error (EXIT_FAILURE, errno, "fclose");
+  return ret;
+}
+
+/* MSG_NOSIGNAL, because a scraper which goes away in the middle of a
+ * reply must not kill virt-p2v with SIGPIPE.
+ */
+static void
+write_all (int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    const ssize_t r = send (fd, buf, len, MSG_NOSIGNAL);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return;
+    buf += r;
+    len -= r;
+  }
+}
+
+/**
+ * Answer one HTTP request.  Only C<GET /metrics> is supported, and
+ * the request body (if any) is ignored.
+ */
+static void
+serve_metrics_request (int fd)
+{
+  char req[1024];
+  ssize_t r;
+  CLEANUP_FREE char *body = NULL;
+  CLEANUP_FREE char *header = NULL;
+  const struct timeval tv = { .tv_sec = 5 };
+
+  ignore_value (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv));
+  r = read (fd, req, sizeof req - 1);
+  if (r <= 0)
+    return;
+  req[r] = '\0';
+
+  if (!STRPREFIX (req, "GET /metrics ") && !STRPREFIX (req, "GET / ")) {
+    const char *msg =
+      "HTTP/1.0 404 Not Found\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "Not found.\n";
+    write_all (fd, msg, strlen (msg));
+    return;
+  }
+
+  body = format_metrics_prometheus ();
+  if (asprintf (&header,
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n"
+                "\r\n",
+                strlen (body)) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  write_all (fd, header, strlen (header));
+  write_all (fd, body, strlen (body));
+}
+
+static void *
+metrics_server_thread (void *data)
+{
+  const int sock = *(int *) data;
+
+  free (data);
+
+  for (;;) {
+    const int fd = accept4 (sock, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror ("accept");
+      break;
+    }
+    serve_metrics_request (fd);
+    close (fd);
+  }
+
+  close (sock);
+  return NULL;
+}
+
+/* Open the listening socket for C<port> on all interfaces.  This is
+ * an IPv6 socket which accepts IPv4 too, or an IPv4 socket if IPv6
+ * is disabled.  Returns the socket, or C<-1> with errno set.
+ */
+static int
+open_metrics_socket (int port)
+{
+  struct sockaddr_in6 addr6;
+  struct sockaddr_in addr4;
+  int sock, opt, saved_errno;
+
+  sock = socket (AF_INET6, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (sock >= 0) {
+    opt = 1;
+    ignore_value (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR,
+                              &opt, sizeof opt));
+    opt = 0;                    /* accept IPv4 too */
+    ignore_value (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                              &opt, sizeof opt));
+
+    memset (&addr6, 0, sizeof addr6);
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_addr = in6addr_any;
+    addr6.sin6_port = htons (port);
+    if (bind (sock, (struct sockaddr *) &addr6, sizeof addr6) == 0 &&
+        listen (sock, SOMAXCONN) == 0)
+      return sock;
+    saved_errno = errno;
+    close (sock);
+    /* Only fall back to IPv4 if IPv6 is not available at all. */
+    if (saved_errno != EADDRNOTAVAIL && saved_errno != EAFNOSUPPORT) {
+      errno = saved_errno;
+      return -1;
+    }
+  }
+
+  sock = socket (AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (sock == -1)
+    return -1;
+  opt = 1;
+  ignore_value (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR,
+                            &opt, sizeof opt));
+
+  memset (&addr4, 0, sizeof addr4);
+  addr4.sin_family = AF_INET;
+  addr4.sin_addr.s_addr = htonl (INADDR_ANY);
+  addr4.sin_port = htons (port);
+  if (bind (sock, (struct sockaddr *) &addr4, sizeof addr4) == -1 ||
+      listen (sock, SOMAXCONN) == -1) {
+    saved_errno = errno;
+    close (sock);
+    errno = saved_errno;
+    return -1;
+  }
+  return sock;
+}
+
+/**
+ * Serve the metrics in the Prometheus text format on TCP C<port> on
+ * all interfaces, in a background thread.  Requests are answered one
+ * at a time.
+ *
+ * Returns C<0> on success or C<-1> on error (which is not fatal).
+ */
+int
+start_metrics_server (int port)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  int sock, err;
+  int *sockp;
+
+  sock = open_metrics_socket (port);
+  if (sock == -1) {
+    fprintf (stderr, "%s: metrics: port %d: %m\n", g_get_prgname (), port);
+    return -1;
+  }
+
+  sockp = malloc (sizeof (int));
+  if (sockp == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  *sockp = sock;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attr, metrics_server_thread, sockp);
+  pthread_attr_destroy (&attr);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    free (sockp);
+    close (sock);
+    return -1;
+  }
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: serving metrics on port %d\n", g_get_prgname (), port);
+#endif
+
+  return 0;
+}
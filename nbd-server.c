@@ -0,0 +1,1626 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A read-only NBD server built into virt-p2v, used instead of
+ * L<nbdkit(1)> with C<p2v.nbd_server=builtin>, or when nbdkit is not
+ * installed.
+ *
+ * The server runs in a child process forked from virt-p2v (without
+ * exec), so it is stopped, health-checked and measured in exactly the
+ * same way as nbdkit.  The main thread of the child accepts
+ * connections and starts a thread for each, which does the handshake
+ * and then reads requests and queues them for a pool of worker
+ * threads.  So several requests on one connection are served at once,
+ * and the replies may be sent out of order.
+ *
+ * It implements the fixed newstyle handshake, structured replies and
+ * the C<base:allocation> metadata context for C<NBD_CMD_BLOCK_STATUS>,
+ * and it advertises multi-conn, which is safe because the disk is
+ * never written.  With structured replies, reads are sent using
+ * L<sendfile(2)> straight from the page cache to the socket, after
+ * the worker has started readahead on the range, so that the disk
+ * reads of different requests overlap.
+ *
+ * Swap and similar files which are not copied (see F<skip.c>) are
+ * read as zeroes, and reported as holes by C<NBD_CMD_BLOCK_STATUS>.
+ *
+ * The protocol is described in
+ * L<https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <endian.h>
+#include <errno.h>
+#include <error.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+/* Magic numbers and constants from the NBD protocol. */
+#define NBD_MAGIC                  UINT64_C(0x4e42444d41474943)
+#define NBD_IHAVEOPT               UINT64_C(0x49484156454f5054)
+#define NBD_REP_MAGIC              UINT64_C(0x0003e889045565a9)
+#define NBD_REQUEST_MAGIC          0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC     0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_FLAG_FIXED_NEWSTYLE    (1 << 0)
+#define NBD_FLAG_NO_ZEROES         (1 << 1)
+#define NBD_FLAG_C_NO_ZEROES       (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS         (1 << 0)
+#define NBD_FLAG_READ_ONLY         (1 << 1)
+#define NBD_FLAG_SEND_FLUSH        (1 << 2)
+#define NBD_FLAG_SEND_DF           (1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN    (1 << 8)
+#define NBD_FLAG_SEND_CACHE        (1 << 10)
+
+#define NBD_OPT_EXPORT_NAME        1
+#define NBD_OPT_ABORT              2
+#define NBD_OPT_LIST               3
+#define NBD_OPT_INFO               6
+#define NBD_OPT_GO                 7
+#define NBD_OPT_STRUCTURED_REPLY   8
+#define NBD_OPT_LIST_META_CONTEXT  9
+#define NBD_OPT_SET_META_CONTEXT   10
+
+#define NBD_REP_ACK                1
+#define NBD_REP_SERVER             2
+#define NBD_REP_INFO               3
+#define NBD_REP_META_CONTEXT       4
+#define NBD_REP_ERR_UNSUP          UINT32_C(0x80000001)
+#define NBD_REP_ERR_INVALID        UINT32_C(0x80000003)
+#define NBD_REP_ERR_TOO_BIG        UINT32_C(0x80000009)
+
+#define NBD_INFO_EXPORT            0
+#define NBD_INFO_BLOCK_SIZE        3
+
+#define NBD_CMD_READ               0
+#define NBD_CMD_WRITE              1
+#define NBD_CMD_DISC               2
+#define NBD_CMD_FLUSH              3
+#define NBD_CMD_CACHE              5
+#define NBD_CMD_BLOCK_STATUS       7
+
+#define NBD_CMD_FLAG_REQ_ONE       (1 << 3)
+
+#define NBD_REPLY_FLAG_DONE        (1 << 0)
+#define NBD_REPLY_TYPE_NONE        0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR       32769
+
+#define NBD_STATE_HOLE             (1 << 0)
+#define NBD_STATE_ZERO             (1 << 1)
+
+/* Error numbers on the wire, which are not necessarily the same as
+ * the local errno values.
+ */
+#define NBD_SUCCESS                0
+#define NBD_EPERM                  1
+#define NBD_EIO                    5
+#define NBD_EINVAL                 22
+
+/* The largest read we accept, which is also advertised as the
+ * maximum block size.
+ */
+#define MAX_REQUEST_SIZE (32 * 1024 * 1024)
+
+/* The longest option we accept during the handshake. */
+#define MAX_OPTION_SIZE 4096
+
+/* The most extents returned by one block status request. */
+#define MAX_EXTENTS 1024
+
+/* The ID we give to the base:allocation metadata context. */
+#define BASE_ALLOCATION_ID 1
+
+/* The number of worker threads is the number of CPUs, but within
+ * these limits, since the workers mostly wait for the disk.
+ */
+#define MIN_WORKERS 4
+#define MAX_WORKERS 16
+
+/* With compression (p2v.compress), everything sent to the client is
+ * wrapped in frames, each with an 8 byte header: the length of the
+ * payload, with FRAME_COMPRESSED set if it is compressed with zlib,
+ * then the uncompressed length.  Frames are independent, so the
+ * workers compress in parallel.  Messages smaller than
+ * MIN_COMPRESS_SIZE, or which don't compress, are sent as they are.
+ */
+#define FRAME_COMPRESSED UINT32_C(0x80000000)
+#define MIN_COMPRESS_SIZE 512
+
+/* The zlib compression level starts at the lowest, and is adapted
+ * between these limits every ADAPT_INTERVAL frames (see
+ * adapt_compress_level).
+ */
+#define MIN_COMPRESS_LEVEL 1
+#define MAX_COMPRESS_LEVEL 6
+#define ADAPT_INTERVAL 64
+
+/* With deduplication (p2v.dedup), a read is answered with a
+ * p2v_dedup_reply message instead of the data: the hash of each
+ * DEDUP_CHUNK_SIZE chunk of the range, followed by the NBD reply
+ * header which would have been sent.  Chunks are aligned to the
+ * disk, so the same data at the same place on different machines
+ * gives the same hashes.  The p2v-decompress helper on the conversion
+ * server takes the chunks it already has from its block cache, and
+ * reads the others with P2V_CMD_FLAG_DATA set.  The reply to those is
+ * the same message followed by the data, so the cache is filled using
+ * the hashes of the data which was actually sent, even if the disk
+ * changed in between.
+ *
+ * Each hash is the SHA-256 of the chunk.  The block cache is shared
+ * by all the machines converted on the server, so p2v-decompress
+ * hashes the data it receives itself before adding it to the cache,
+ * and checks the hash of every chunk it takes from the cache.
+ */
+#define P2V_DEDUP_MAGIC            0x70326464
+#define P2V_CMD_FLAG_DATA          (1 << 15)
+#define DEDUP_CHUNK_SIZE           (64 * 1024)
+#define DEDUP_HASH_SIZE            32
+#define MAX_DEDUP_CHUNKS (MAX_REQUEST_SIZE / DEDUP_CHUNK_SIZE + 1)
+
+/* Room in front of the data of a read for the reply header, or for
+ * the whole p2v_dedup_reply message.
+ */
+#define MAX_REPLY_HEADER 32
+#define READ_HEADER_ROOM \
+  (sizeof (struct p2v_dedup_reply) + MAX_REPLY_HEADER + \
+   MAX_DEDUP_CHUNKS * DEDUP_HASH_SIZE)
+
+struct connection {
+  int sock;
+  pthread_mutex_t write_lock;   /* held while a whole reply is sent */
+  bool structured_replies;
+  bool base_allocation;         /* base:allocation was negotiated */
+  bool failed;                  /* a reply could not be sent */
+  unsigned refs;                /* reader + queued requests, queue_lock */
+  bool framed;                  /* send frames, see FRAME_COMPRESSED */
+  bool dedup;                   /* see P2V_DEDUP_MAGIC */
+  char *out;                    /* message being collected, see conn_send */
+  size_t out_len, out_size;
+};
+
+struct request {
+  struct request *next;
+  struct connection *conn;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t handle;
+  uint64_t offset;
+  uint32_t count;
+};
+
+/* Buffers of each worker thread, allocated on first use. */
+struct buffers {
+  char *data;                   /* READ_HEADER_ROOM + MAX_REQUEST_SIZE */
+  char *frame;                  /* compressed frame */
+  size_t frame_size;
+  GChecksum *sha256;            /* for p2v.dedup */
+};
+
+struct frame {
+  uint32_t hdr[2];
+  const char *payload;
+  size_t len;
+};
+
+struct nbd_option_header {
+  uint64_t magic;
+  uint32_t option;
+  uint32_t len;
+} __attribute__((packed));
+
+struct nbd_option_reply {
+  uint64_t magic;
+  uint32_t option;
+  uint32_t reply;
+  uint32_t len;
+} __attribute__((packed));
+
+struct nbd_request {
+  uint32_t magic;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t handle;
+  uint64_t offset;
+  uint32_t count;
+} __attribute__((packed));
+
+struct nbd_simple_reply {
+  uint32_t magic;
+  uint32_t error;
+  uint64_t handle;
+} __attribute__((packed));
+
+struct nbd_structured_reply {
+  uint32_t magic;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t handle;
+  uint32_t len;
+} __attribute__((packed));
+
+/* See P2V_DEDUP_MAGIC. */
+struct p2v_dedup_reply {
+  uint32_t magic;
+  uint32_t hdrlen;              /* length of the NBD reply header */
+  uint64_t handle;
+  uint64_t offset;
+  uint32_t count;
+  uint32_t chunk_size;
+  /* followed by the NBD reply header, the hashes, and maybe the data */
+} __attribute__((packed));
+
+/* These are only set in the server process. */
+static int disk_fd = -1;
+static uint64_t disk_size;
+static bool use_sendfile = true;
+static bool use_compression;
+static bool use_dedup;
+static const struct skip_list *skip_list;
+static long nr_cpus;
+
+static pthread_mutex_t level_lock = PTHREAD_MUTEX_INITIALIZER;
+static int compress_level = MIN_COMPRESS_LEVEL;
+static unsigned level_frames;
+static double level_compress_secs, level_send_secs;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct request *queue_head, *queue_tail;
+
+static char *nbd_server_error;
+
+static void set_nbd_server_error (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+
+static void
+set_nbd_server_error (const char *fs, ...)
+{
+  va_list args;
+  char *msg;
+  int len;
+
+  va_start (args, fs);
+  len = vasprintf (&msg, fs, args);
+  va_end (args);
+
+  if (len < 0)
+    error (EXIT_FAILURE, errno,
+           "vasprintf (original error format string: %s)", fs);
+
+  free (nbd_server_error);
+  nbd_server_error = msg;
+}
+
+const char *
+get_nbd_server_error (void)
+{
+  return nbd_server_error;
+}
+
+/* Print a message in the server process.  The server is forked from
+ * a multithreaded program without exec, and another thread may have
+ * held the lock of stderr at that moment, so stdio must not be used
+ * there.  If C<err> is not zero its description is appended.
+ */
+static void server_message (int err, const char *fs, ...)
+  __attribute__((format(printf,2,3)));
+
+static void
+server_message (int err, const char *fs, ...)
+{
+  va_list args;
+  char msg[192], buf[256];
+  int len;
+
+  va_start (args, fs);
+  vsnprintf (msg, sizeof msg, fs, args);
+  va_end (args);
+
+  len = snprintf (buf, sizeof buf, "%s%s%s\n", msg,
+                  err != 0 ? ": " : "", err != 0 ? strerror (err) : "");
+  if (len < 0)
+    return;
+  if ((size_t) len >= sizeof buf) {
+    len = sizeof buf - 1;
+    buf[len-1] = '\n';
+  }
+  ignore_value (write (STDERR_FILENO, buf, len));
+}
+
+static int
+recv_full (int sock, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0) {
+    const ssize_t r = recv (sock, p, len, 0);
+
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int
+send_full (int sock, const void *buf, size_t len, int flags)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    const ssize_t r = send (sock, p, len, flags | MSG_NOSIGNAL);
+
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Read and throw away the payload of a request or option we don't
+ * want.
+ */
+static int
+recv_discard (int sock, uint64_t len)
+{
+  char buf[4096];
+
+  while (len > 0) {
+    const size_t n = len < sizeof buf ? len : sizeof buf;
+
+    if (recv_full (sock, buf, n) == -1)
+      return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Make a frame which sends C<len> bytes at C<msg>, compressed at
+ * C<level> if that helps.  The frame points into C<msg> or
+ * C<b-E<gt>frame>.  Returns C<-1> if out of memory.
+ */
+static int
+make_frame (const char *msg, size_t len, int level, struct buffers *b,
+            struct frame *f)
+{
+  f->hdr[0] = htobe32 (len);
+  f->hdr[1] = htobe32 (len);
+  f->payload = msg;
+  f->len = len;
+
+#ifdef HAVE_ZLIB
+  if (level > 0 && len >= MIN_COMPRESS_SIZE) {
+    uLongf clen = compressBound (len);
+
+    if (b->frame_size < clen) {
+      char *p = realloc (b->frame, clen);
+
+      if (p == NULL)
+        return -1;
+      b->frame = p;
+      b->frame_size = clen;
+    }
+    if (compress2 ((Bytef *) b->frame, &clen, (const Bytef *) msg, len,
+                   level) == Z_OK &&
+        clen < len - len / 32) {
+      f->hdr[0] = htobe32 (clen | FRAME_COMPRESSED);
+      f->payload = b->frame;
+      f->len = clen;
+    }
+  }
+#endif
+
+  return 0;
+}
+
+static int
+send_frame (int sock, const struct frame *f)
+{
+  if (send_full (sock, f->hdr, sizeof f->hdr, MSG_MORE) == -1 ||
+      send_full (sock, f->payload, f->len, 0) == -1)
+    return -1;
+  return 0;
+}
+
+/**
+ * Send data to the client.  Callers use C<MSG_MORE> to mark the parts
+ * of a message which are not the last.  With frames, the parts
+ * are collected in C<conn-E<gt>out> and the whole message is sent as
+ * one frame, without compressing it, since apart from reads (see
+ * C<reply_read_framed>) messages are small.
+ */
+static int
+conn_send (struct connection *conn, const void *buf, size_t len, int flags)
+{
+  struct frame f;
+  int r;
+
+  if (!conn->framed)
+    return send_full (conn->sock, buf, len, flags);
+
+  if (conn->out_len + len > conn->out_size) {
+    char *p = realloc (conn->out, conn->out_len + len);
+
+    if (p == NULL)
+      return -1;
+    conn->out = p;
+    conn->out_size = conn->out_len + len;
+  }
+  memcpy (conn->out + conn->out_len, buf, len);
+  conn->out_len += len;
+  if (flags & MSG_MORE)
+    return 0;
+
+  make_frame (conn->out, conn->out_len, 0, NULL, &f);
+  r = send_frame (conn->sock, &f);
+  conn->out_len = 0;
+  return r;
+}
+
+static uint16_t
+transmission_flags (const struct connection *conn)
+{
+  uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY |
+    NBD_FLAG_SEND_FLUSH | NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_SEND_CACHE;
+
+  if (conn->structured_replies)
+    flags |= NBD_FLAG_SEND_DF;
+  return flags;
+}
+
+static int
+send_option_reply (struct connection *conn, uint32_t option, uint32_t reply,
+                   const void *payload, uint32_t len)
+{
+  struct nbd_option_reply hdr;
+
+  hdr.magic = htobe64 (NBD_REP_MAGIC);
+  hdr.option = htobe32 (option);
+  hdr.reply = htobe32 (reply);
+  hdr.len = htobe32 (len);
+  if (conn_send (conn, &hdr, sizeof hdr, len > 0 ? MSG_MORE : 0) == -1)
+    return -1;
+  if (len > 0 && conn_send (conn, payload, len, 0) == -1)
+    return -1;
+  return 0;
+}
+
+/* Reply to NBD_OPT_INFO and NBD_OPT_GO.  The export name is ignored,
+ * since there is only one export.  Returns C<1> if the option was
+ * acknowledged, C<0> if it was rejected, or C<-1> on a socket error.
+ */
+static int
+send_export_info (struct connection *conn, uint32_t option,
+                  const char *data, uint32_t len)
+{
+  struct {
+    uint16_t type;
+    uint64_t size;
+    uint16_t flags;
+  } __attribute__((packed)) export;
+  struct {
+    uint16_t type;
+    uint32_t minimum;
+    uint32_t preferred;
+    uint32_t maximum;
+  } __attribute__((packed)) block_size;
+  uint32_t namelen;
+  uint16_t nr_info, i;
+  bool want_block_size = false;
+
+  if (len < 6)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID,
+                              NULL, 0) == -1 ? -1 : 0;
+  memcpy (&namelen, data, 4);
+  namelen = be32toh (namelen);
+  if (namelen > len - 6)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID,
+                              NULL, 0) == -1 ? -1 : 0;
+  memcpy (&nr_info, &data[4 + namelen], 2);
+  nr_info = be16toh (nr_info);
+  if (len != 4 + namelen + 2 + 2 * (uint32_t) nr_info)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID,
+                              NULL, 0) == -1 ? -1 : 0;
+
+  for (i = 0; i < nr_info; ++i) {
+    uint16_t type;
+
+    memcpy (&type, &data[4 + namelen + 2 + 2 * i], 2);
+    if (be16toh (type) == NBD_INFO_BLOCK_SIZE)
+      want_block_size = true;
+  }
+
+  export.type = htobe16 (NBD_INFO_EXPORT);
+  export.size = htobe64 (disk_size);
+  export.flags = htobe16 (transmission_flags (conn));
+  if (send_option_reply (conn, option, NBD_REP_INFO,
+                         &export, sizeof export) == -1)
+    return -1;
+
+  /* Only send the block size constraints if the client asked for
+   * them, since otherwise it might not follow them.
+   */
+  if (want_block_size) {
+    block_size.type = htobe16 (NBD_INFO_BLOCK_SIZE);
+    block_size.minimum = htobe32 (1);
+    block_size.preferred = htobe32 (4096);
+    block_size.maximum = htobe32 (MAX_REQUEST_SIZE);
+    if (send_option_reply (conn, option, NBD_REP_INFO,
+                           &block_size, sizeof block_size) == -1)
+      return -1;
+  }
+
+  if (send_option_reply (conn, option, NBD_REP_ACK, NULL, 0) == -1)
+    return -1;
+  return 1;
+}
+
+/* Reply to NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.
+ * The only context is base:allocation.
+ */
+static int
+send_meta_contexts (struct connection *conn, uint32_t option,
+                    const char *data, uint32_t len)
+{
+  const bool list = option == NBD_OPT_LIST_META_CONTEXT;
+  uint32_t namelen, nr_queries, i, pos;
+  bool match;
+
+  if (!list && !conn->structured_replies)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+  if (len < 8)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+  memcpy (&namelen, data, 4);
+  namelen = be32toh (namelen);
+  if (namelen > len - 8)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+  memcpy (&nr_queries, &data[4 + namelen], 4);
+  nr_queries = be32toh (nr_queries);
+
+  /* Listing with no queries means list everything. */
+  match = list && nr_queries == 0;
+  for (i = 0, pos = 4 + namelen + 4; i < nr_queries; ++i) {
+    uint32_t qlen;
+    const char *query;
+
+    if (len - pos < 4)
+      return send_option_reply (conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+    memcpy (&qlen, &data[pos], 4);
+    qlen = be32toh (qlen);
+    pos += 4;
+    if (qlen > len - pos)
+      return send_option_reply (conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+    query = &data[pos];
+    pos += qlen;
+
+    if ((qlen == 15 && memcmp (query, "base:allocation", 15) == 0) ||
+        (list && qlen == 5 && memcmp (query, "base:", 5) == 0))
+      match = true;
+  }
+  if (pos != len)
+    return send_option_reply (conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+  if (!list)
+    conn->base_allocation = match;
+
+  if (match) {
+    struct {
+      uint32_t id;
+      char name[15];
+    } __attribute__((packed)) context;
+
+    context.id = htobe32 (BASE_ALLOCATION_ID);
+    memcpy (context.name, "base:allocation", 15);
+    if (send_option_reply (conn, option, NBD_REP_META_CONTEXT,
+                           &context, sizeof context) == -1)
+      return -1;
+  }
+
+  return send_option_reply (conn, option, NBD_REP_ACK, NULL, 0);
+}
+
+/**
+ * Do the fixed newstyle handshake.  Returns C<0> when the client has
+ * moved to the transmission phase, or C<-1> if the connection should
+ * be closed.
+ */
+static int
+negotiate (struct connection *conn)
+{
+  struct {
+    uint64_t magic;
+    uint64_t ihaveopt;
+    uint16_t flags;
+  } __attribute__((packed)) greeting;
+  uint32_t client_flags;
+  char data[MAX_OPTION_SIZE];
+  int r;
+
+  greeting.magic = htobe64 (NBD_MAGIC);
+  greeting.ihaveopt = htobe64 (NBD_IHAVEOPT);
+  greeting.flags = htobe16 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  if (conn_send (conn, &greeting, sizeof greeting, 0) == -1 ||
+      recv_full (conn->sock, &client_flags, sizeof client_flags) == -1)
+    return -1;
+  client_flags = be32toh (client_flags);
+
+  for (;;) {
+    struct nbd_option_header opt;
+    uint32_t option, len;
+
+    if (recv_full (conn->sock, &opt, sizeof opt) == -1 ||
+        be64toh (opt.magic) != NBD_IHAVEOPT)
+      return -1;
+    option = be32toh (opt.option);
+    len = be32toh (opt.len);
+
+    if (len > MAX_OPTION_SIZE) {
+      if (option == NBD_OPT_EXPORT_NAME ||
+          recv_discard (conn->sock, len) == -1 ||
+          send_option_reply (conn, option, NBD_REP_ERR_TOO_BIG,
+                             NULL, 0) == -1)
+        return -1;
+      continue;
+    }
+    if (recv_full (conn->sock, data, len) == -1)
+      return -1;
+
+    switch (option) {
+    case NBD_OPT_EXPORT_NAME: {
+      struct {
+        uint64_t size;
+        uint16_t flags;
+        char zeroes[124];
+      } __attribute__((packed)) export;
+
+      memset (&export, 0, sizeof export);
+      export.size = htobe64 (disk_size);
+      export.flags = htobe16 (transmission_flags (conn));
+      if (conn_send (conn, &export,
+                     client_flags & NBD_FLAG_C_NO_ZEROES ?
+                     offsetof (typeof (export), zeroes) : sizeof export,
+                     0) == -1)
+        return -1;
+      return 0;
+    }
+
+    case NBD_OPT_ABORT:
+      send_option_reply (conn, option, NBD_REP_ACK, NULL, 0);
+      return -1;
+
+    case NBD_OPT_LIST: {
+      const uint32_t no_name = 0;
+
+      if (len != 0) {
+        if (send_option_reply (conn, option, NBD_REP_ERR_INVALID,
+                               NULL, 0) == -1)
+          return -1;
+        break;
+      }
+      if (send_option_reply (conn, option, NBD_REP_SERVER,
+                             &no_name, sizeof no_name) == -1 ||
+          send_option_reply (conn, option, NBD_REP_ACK, NULL, 0) == -1)
+        return -1;
+      break;
+    }
+
+    case NBD_OPT_STRUCTURED_REPLY:
+      if (len != 0) {
+        if (send_option_reply (conn, option, NBD_REP_ERR_INVALID,
+                               NULL, 0) == -1)
+          return -1;
+        break;
+      }
+      conn->structured_replies = true;
+      if (send_option_reply (conn, option, NBD_REP_ACK, NULL, 0) == -1)
+        return -1;
+      break;
+
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO:
+      r = send_export_info (conn, option, data, len);
+      if (r == -1)
+        return -1;
+      if (r == 1 && option == NBD_OPT_GO)
+        return 0;
+      break;
+
+    case NBD_OPT_LIST_META_CONTEXT:
+    case NBD_OPT_SET_META_CONTEXT:
+      if (send_meta_contexts (conn, option, data, len) == -1)
+        return -1;
+      break;
+
+    default:
+      if (send_option_reply (conn, option, NBD_REP_ERR_UNSUP, NULL, 0) == -1)
+        return -1;
+    }
+  }
+}
+
+static void
+put_connection (struct connection *conn)
+{
+  bool last;
+
+  pthread_mutex_lock (&queue_lock);
+  last = --conn->refs == 0;
+  pthread_mutex_unlock (&queue_lock);
+
+  if (last) {
+    close (conn->sock);
+    pthread_mutex_destroy (&conn->write_lock);
+    free (conn->out);
+    free (conn);
+  }
+}
+
+/* A reply could not be sent completely, so the client cannot make
+ * sense of anything else on this connection.  Caller must hold
+ * conn->write_lock.
+ */
+static void
+fail_connection (struct connection *conn)
+{
+  conn->failed = true;
+  shutdown (conn->sock, SHUT_RDWR);
+}
+
+/* Send a reply with no data.  Caller must hold conn->write_lock. */
+static int
+send_status_reply (struct connection *conn, const struct request *req,
+                   uint32_t error)
+{
+  if (conn->structured_replies) {
+    struct nbd_structured_reply hdr;
+    struct {
+      uint32_t error;
+      uint16_t len;
+    } __attribute__((packed)) payload;
+
+    hdr.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    hdr.flags = htobe16 (NBD_REPLY_FLAG_DONE);
+    hdr.type = htobe16 (error ? NBD_REPLY_TYPE_ERROR : NBD_REPLY_TYPE_NONE);
+    hdr.handle = req->handle;   /* opaque, so not byte swapped */
+    hdr.len = htobe32 (error ? sizeof payload : 0);
+    if (!error)
+      return conn_send (conn, &hdr, sizeof hdr, 0);
+    payload.error = htobe32 (error);
+    payload.len = 0;
+    if (conn_send (conn, &hdr, sizeof hdr, MSG_MORE) == -1 ||
+        conn_send (conn, &payload, sizeof payload, 0) == -1)
+      return -1;
+    return 0;
+  }
+  else {
+    struct nbd_simple_reply hdr;
+
+    hdr.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+    hdr.error = htobe32 (error);
+    hdr.handle = req->handle;
+    return conn_send (conn, &hdr, sizeof hdr, 0);
+  }
+}
+
+static void
+reply_status (struct connection *conn, const struct request *req,
+              uint32_t error)
+{
+  pthread_mutex_lock (&conn->write_lock);
+  if (!conn->failed && send_status_reply (conn, req, error) == -1)
+    fail_connection (conn);
+  pthread_mutex_unlock (&conn->write_lock);
+}
+
+static int
+alloc_data_buffer (struct buffers *b)
+{
+  if (b->data == NULL) {
+    b->data = malloc (READ_HEADER_ROOM + MAX_REQUEST_SIZE);
+    if (b->data == NULL)
+      return -1;
+  }
+  return 0;
+}
+
+static int
+pread_full (char *buf, uint64_t offset, size_t len)
+{
+  while (len > 0) {
+    const ssize_t r = skip_pread (skip_list, disk_fd, buf, len, offset);
+
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;              /* the disk shrank */
+      return -1;
+    }
+    buf += r;
+    offset += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Send C<len> bytes of the disk at C<offset> to the socket.  Caller
+ * must hold conn->write_lock.
+ */
+static int
+send_disk_data (struct connection *conn, uint64_t offset, size_t len,
+                struct buffers *b)
+{
+  const struct skip_extent *e = next_skip_extent (skip_list, offset);
+  /* Skipped extents are read into the buffer as zeroes instead. */
+  const bool skipping = e != NULL && e->offset < offset + len;
+
+  while (len > 0 && use_sendfile && !skipping) {
+    off_t off = offset;
+    const ssize_t r = sendfile (conn->sock, disk_fd, &off, len);
+
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS) {
+        use_sendfile = false;   /* fall back to pread below */
+        break;
+      }
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    offset += r;
+    len -= r;
+  }
+
+  if (len > 0) {
+    if (alloc_data_buffer (b) == -1 ||
+        pread_full (b->data, offset, len) == -1 ||
+        conn_send (conn, b->data, len, 0) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Every C<ADAPT_INTERVAL> frames, compare the time spent compressing
+ * with the time spent sending, and change the compression level.
+ * Compression runs on all the CPUs at once but sending is limited by
+ * the link, so if sending takes longer than compressing divided by
+ * the number of CPUs there is CPU to spare to compress harder, and if
+ * it takes less, compression is slowing the copy down.
+ */
+static void
+adapt_compress_level (double compress_secs, double send_secs)
+{
+  pthread_mutex_lock (&level_lock);
+  level_compress_secs += compress_secs;
+  level_send_secs += send_secs;
+  if (++level_frames >= ADAPT_INTERVAL) {
+    const double cpu_secs = level_compress_secs / nr_cpus;
+
+    if (level_send_secs > 2 * cpu_secs &&
+        compress_level < MAX_COMPRESS_LEVEL)
+      compress_level++;
+    else if (cpu_secs > level_send_secs &&
+             compress_level > MIN_COMPRESS_LEVEL)
+      compress_level--;
+#if DEBUG_STDERR
+    server_message (0, "nbd-server: compressing %.3fs, sending %.3fs, "
+                    "compression level %d",
+                    cpu_secs, level_send_secs, compress_level);
+#endif
+    level_frames = 0;
+    level_compress_secs = level_send_secs = 0;
+  }
+  pthread_mutex_unlock (&level_lock);
+}
+
+/* Write the NBD reply header which comes before the data of a read
+ * into C<buf> (at least C<MAX_REPLY_HEADER> bytes), and return its
+ * length.
+ */
+static size_t
+read_reply_header (const struct connection *conn, const struct request *req,
+                   char *buf)
+{
+  if (conn->structured_replies) {
+    struct nbd_structured_reply hdr;
+    const uint64_t offset = htobe64 (req->offset);
+
+    hdr.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    hdr.flags = htobe16 (NBD_REPLY_FLAG_DONE);
+    hdr.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
+    hdr.handle = req->handle;
+    hdr.len = htobe32 (sizeof offset + req->count);
+    memcpy (buf, &hdr, sizeof hdr);
+    memcpy (buf + sizeof hdr, &offset, sizeof offset);
+    return sizeof hdr + sizeof offset;
+  }
+  else {
+    struct nbd_simple_reply hdr;
+
+    hdr.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+    hdr.error = htobe32 (NBD_SUCCESS);
+    hdr.handle = req->handle;
+    memcpy (buf, &hdr, sizeof hdr);
+    return sizeof hdr;
+  }
+}
+
+/* Put the p2v_dedup_reply message for a read in front of its data,
+ * which is at C<data>, and return the start of the message.  The
+ * length of the message is returned in C<*len>, which includes the
+ * data only if the client asked for it with C<P2V_CMD_FLAG_DATA>.
+ */
+static char *
+make_dedup_reply (const struct connection *conn, const struct request *req,
+                  const char *data, struct buffers *b, size_t *len)
+{
+  struct p2v_dedup_reply reply;
+  char hdr[MAX_REPLY_HEADER];
+  const size_t hdrlen = read_reply_header (conn, req, hdr);
+  const uint64_t end = req->offset + req->count;
+  const size_t nr_chunks =
+    (end - 1) / DEDUP_CHUNK_SIZE - req->offset / DEDUP_CHUNK_SIZE + 1;
+  const size_t hashes_len = nr_chunks * DEDUP_HASH_SIZE;
+  char *msg = (char *) data - sizeof reply - hdrlen - hashes_len;
+  char *p = msg + sizeof reply + hdrlen;
+  uint64_t offset;
+
+  if (b->sha256 == NULL)
+    b->sha256 = g_checksum_new (G_CHECKSUM_SHA256);
+
+  reply.magic = htobe32 (P2V_DEDUP_MAGIC);
+  reply.hdrlen = htobe32 (hdrlen);
+  reply.handle = req->handle;
+  reply.offset = htobe64 (req->offset);
+  reply.count = htobe32 (req->count);
+  reply.chunk_size = htobe32 (DEDUP_CHUNK_SIZE);
+  memcpy (msg, &reply, sizeof reply);
+  memcpy (msg + sizeof reply, hdr, hdrlen);
+
+  for (offset = req->offset; offset < end; ) {
+    uint64_t next = (offset / DEDUP_CHUNK_SIZE + 1) * DEDUP_CHUNK_SIZE;
+    const char *chunk = data + (offset - req->offset);
+    gsize digest_len = DEDUP_HASH_SIZE;
+
+    if (next > end)
+      next = end;
+    g_checksum_reset (b->sha256);
+    g_checksum_update (b->sha256, (const guchar *) chunk, next - offset);
+    g_checksum_get_digest (b->sha256, (guint8 *) p, &digest_len);
+    p += DEDUP_HASH_SIZE;
+    offset = next;
+  }
+
+  *len = sizeof reply + hdrlen + hashes_len;
+  if (req->flags & P2V_CMD_FLAG_DATA)
+    *len += req->count;
+  return msg;
+}
+
+/* Reply to a read with frames (p2v.compress or p2v.dedup).  The
+ * message is put together in front of the data in b->data and
+ * compressed into one frame before taking the lock, so several
+ * workers compress at once.
+ */
+static void
+reply_read_framed (struct connection *conn, const struct request *req,
+                   struct buffers *b)
+{
+  char *data, *msg;
+  size_t len;
+  struct frame f;
+  double t0, t1, t2;
+  int level = 0;
+
+  if (alloc_data_buffer (b) == -1) {
+    reply_status (conn, req, NBD_EIO);
+    return;
+  }
+
+  data = b->data + READ_HEADER_ROOM;
+  if (pread_full (data, req->offset, req->count) == -1) {
+    reply_status (conn, req, NBD_EIO);
+    return;
+  }
+
+  if (conn->dedup)
+    msg = make_dedup_reply (conn, req, data, b, &len);
+  else {
+    char hdr[MAX_REPLY_HEADER];
+    const size_t hdrlen = read_reply_header (conn, req, hdr);
+
+    msg = data - hdrlen;
+    memcpy (msg, hdr, hdrlen);
+    len = hdrlen + req->count;
+  }
+
+  if (use_compression) {
+    pthread_mutex_lock (&level_lock);
+    level = compress_level;
+    pthread_mutex_unlock (&level_lock);
+  }
+
+  t0 = timeline_now ();
+  if (make_frame (msg, len, level, b, &f) == -1) {
+    reply_status (conn, req, NBD_EIO);
+    return;
+  }
+  t1 = timeline_now ();
+
+  pthread_mutex_lock (&conn->write_lock);
+  t2 = timeline_now ();
+  if (!conn->failed && send_frame (conn->sock, &f) == -1)
+    fail_connection (conn);
+  t2 = timeline_now () - t2;
+  pthread_mutex_unlock (&conn->write_lock);
+
+  if (use_compression)
+    adapt_compress_level (t1 - t0, t2);
+}
+
+static void
+reply_read (struct connection *conn, const struct request *req,
+            struct buffers *b)
+{
+  if (conn->framed) {
+    reply_read_framed (conn, req, b);
+    return;
+  }
+
+  if (conn->structured_replies) {
+    struct nbd_structured_reply hdr;
+    uint64_t offset;
+
+    /* Start reading the disk before waiting for the socket, so that
+     * the reads of the requests queued behind the lock overlap.
+     */
+    posix_fadvise (disk_fd, req->offset, req->count, POSIX_FADV_WILLNEED);
+
+    hdr.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    hdr.flags = htobe16 (NBD_REPLY_FLAG_DONE);
+    hdr.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
+    hdr.handle = req->handle;
+    hdr.len = htobe32 (sizeof offset + req->count);
+    offset = htobe64 (req->offset);
+
+    /* Once the header has been sent there is no way to report an
+     * error in the middle of the data, so a read error here closes
+     * the connection.
+     */
+    pthread_mutex_lock (&conn->write_lock);
+    if (!conn->failed &&
+        (conn_send (conn, &hdr, sizeof hdr, MSG_MORE) == -1 ||
+         conn_send (conn, &offset, sizeof offset, MSG_MORE) == -1 ||
+         send_disk_data (conn, req->offset, req->count, b) == -1)) {
+#if DEBUG_STDERR
+      server_message (errno, "nbd-server: read");
+#endif
+      fail_connection (conn);
+    }
+    pthread_mutex_unlock (&conn->write_lock);
+  }
+  else {
+    struct nbd_simple_reply hdr;
+
+    /* Simple replies send the error before the data, so the data
+     * must be read first.
+     */
+    if (alloc_data_buffer (b) == -1 ||
+        pread_full (b->data, req->offset, req->count) == -1) {
+      reply_status (conn, req, NBD_EIO);
+      return;
+    }
+
+    hdr.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+    hdr.error = htobe32 (NBD_SUCCESS);
+    hdr.handle = req->handle;
+    pthread_mutex_lock (&conn->write_lock);
+    if (!conn->failed &&
+        (conn_send (conn, &hdr, sizeof hdr, MSG_MORE) == -1 ||
+         conn_send (conn, b->data, req->count, 0) == -1))
+      fail_connection (conn);
+    pthread_mutex_unlock (&conn->write_lock);
+  }
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS using SEEK_DATA and SEEK_HOLE.  Block
+ * devices report that they are all data, but files (--test-disk) and
+ * sparse devices may have holes, which the client need not copy.  The
+ * skipped extents are holes too.
+ */
+static void
+reply_block_status (struct connection *conn, const struct request *req)
+{
+  struct nbd_structured_reply hdr;
+  struct {
+    uint32_t id;
+    struct {
+      uint32_t length;
+      uint32_t flags;
+    } extents[MAX_EXTENTS];
+  } __attribute__((packed)) payload;
+  const size_t max = req->flags & NBD_CMD_FLAG_REQ_ONE ? 1 : MAX_EXTENTS;
+  const uint64_t end = req->offset + req->count;
+  uint64_t offset = req->offset;
+  size_t n = 0;
+
+  while (offset < end && n < max) {
+    const struct skip_extent *e = next_skip_extent (skip_list, offset);
+    off_t data, next;
+    uint32_t flags;
+
+    if (e && e->offset <= offset) {
+      next = e->offset + e->length;
+      if ((uint64_t) next > end)
+        next = end;
+      payload.extents[n].length = htobe32 (next - offset);
+      payload.extents[n].flags = htobe32 (NBD_STATE_HOLE | NBD_STATE_ZERO);
+      n++;
+      offset = next;
+      continue;
+    }
+
+    data = lseek (disk_fd, offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO)
+      data = disk_size;         /* a hole up to the end of the disk */
+    else if (data == -1)
+      data = offset;            /* SEEK_DATA is not supported */
+
+    if ((uint64_t) data > offset) {
+      flags = NBD_STATE_HOLE | NBD_STATE_ZERO;
+      next = data;
+    }
+    else {
+      flags = 0;
+      next = lseek (disk_fd, offset, SEEK_HOLE);
+      if (next == -1 || (uint64_t) next <= offset)
+        next = end;
+    }
+    if ((uint64_t) next > end)
+      next = end;
+    if (e && (uint64_t) next > e->offset)
+      next = e->offset;
+
+    payload.extents[n].length = htobe32 (next - offset);
+    payload.extents[n].flags = htobe32 (flags);
+    n++;
+    offset = next;
+  }
+
+  payload.id = htobe32 (BASE_ALLOCATION_ID);
+  hdr.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+  hdr.flags = htobe16 (NBD_REPLY_FLAG_DONE);
+  hdr.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
+  hdr.handle = req->handle;
+  hdr.len = htobe32 (sizeof payload.id + n * sizeof payload.extents[0]);
+
+  pthread_mutex_lock (&conn->write_lock);
+  if (!conn->failed &&
+      (conn_send (conn, &hdr, sizeof hdr, MSG_MORE) == -1 ||
+       conn_send (conn, &payload,
+                  sizeof payload.id + n * sizeof payload.extents[0],
+                  0) == -1))
+    fail_connection (conn);
+  pthread_mutex_unlock (&conn->write_lock);
+}
+
+static bool
+valid_range (const struct request *req)
+{
+  return req->count > 0 &&
+    req->offset <= disk_size && req->count <= disk_size - req->offset;
+}
+
+static void
+handle_request (const struct request *req, struct buffers *b)
+{
+  struct connection *conn = req->conn;
+
+  switch (req->type) {
+  case NBD_CMD_READ:
+    if (!valid_range (req) || req->count > MAX_REQUEST_SIZE)
+      reply_status (conn, req, NBD_EINVAL);
+    else
+      reply_read (conn, req, b);
+    break;
+
+  case NBD_CMD_FLUSH:
+    reply_status (conn, req, NBD_SUCCESS);
+    break;
+
+  case NBD_CMD_CACHE:
+    if (!valid_range (req))
+      reply_status (conn, req, NBD_EINVAL);
+    else {
+      posix_fadvise (disk_fd, req->offset, req->count, POSIX_FADV_WILLNEED);
+      reply_status (conn, req, NBD_SUCCESS);
+    }
+    break;
+
+  case NBD_CMD_BLOCK_STATUS:
+    if (!conn->base_allocation || !valid_range (req))
+      reply_status (conn, req, NBD_EINVAL);
+    else
+      reply_block_status (conn, req);
+    break;
+
+  default:
+    reply_status (conn, req, NBD_EINVAL);
+  }
+}
+
+static void *
+worker_thread (void *arg)
+{
+  struct buffers b = { .data = NULL };
+
+  for (;;) {
+    struct request *req;
+
+    pthread_mutex_lock (&queue_lock);
+    while (queue_head == NULL)
+      pthread_cond_wait (&queue_cond, &queue_lock);
+    req = queue_head;
+    queue_head = req->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    pthread_mutex_unlock (&queue_lock);
+
+    handle_request (req, &b);
+    put_connection (req->conn);
+    free (req);
+  }
+
+  /*NOTREACHED*/
+  return NULL;
+}
+
+/* Read requests from one connection and queue them for the workers. */
+static void *
+connection_thread (void *arg)
+{
+  struct connection *conn = arg;
+
+  /* If a reply fails the socket is shut down, so the next recv fails
+   * and this loop ends.
+   */
+  if (negotiate (conn) == 0) {
+    for (;;) {
+      struct nbd_request nreq;
+      struct request *req;
+
+      if (recv_full (conn->sock, &nreq, sizeof nreq) == -1 ||
+          be32toh (nreq.magic) != NBD_REQUEST_MAGIC)
+        break;
+
+      req = malloc (sizeof *req);
+      if (req == NULL)
+        break;
+      req->next = NULL;
+      req->conn = conn;
+      req->flags = be16toh (nreq.flags);
+      req->type = be16toh (nreq.type);
+      req->handle = nreq.handle;
+      req->offset = be64toh (nreq.offset);
+      req->count = be32toh (nreq.count);
+
+      if (req->type == NBD_CMD_DISC) {
+        free (req);
+        break;
+      }
+
+      /* We never advertise writes, but the payload still has to be
+       * skipped to stay in step with the client.
+       */
+      if (req->type == NBD_CMD_WRITE) {
+        if (req->count > MAX_REQUEST_SIZE ||
+            recv_discard (conn->sock, req->count) == -1) {
+          free (req);
+          break;
+        }
+        reply_status (conn, req, NBD_EPERM);
+        free (req);
+        continue;
+      }
+
+      pthread_mutex_lock (&queue_lock);
+      conn->refs++;
+      if (queue_tail)
+        queue_tail->next = req;
+      else
+        queue_head = req;
+      queue_tail = req;
+      pthread_cond_signal (&queue_cond);
+      pthread_mutex_unlock (&queue_lock);
+    }
+  }
+
+  /* The socket is closed when the last queued request is done. */
+  put_connection (conn);
+  return NULL;
+}
+
+static void start_threads (void *(*fn) (void *), void *arg);
+
+/* The main loop of the server process, which never returns. */
+static void __attribute__((noreturn))
+serve (int *fds, size_t nr_fds)
+{
+  struct pollfd pfds[nr_fds];
+  long nr_workers;
+  size_t i;
+
+  nr_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nr_cpus < 1)
+    nr_cpus = 1;
+  nr_workers = nr_cpus;
+  if (nr_workers < MIN_WORKERS)
+    nr_workers = MIN_WORKERS;
+  if (nr_workers > MAX_WORKERS)
+    nr_workers = MAX_WORKERS;
+  while (nr_workers-- > 0)
+    start_threads (worker_thread, NULL);
+
+  for (i = 0; i < nr_fds; ++i) {
+    pfds[i].fd = fds[i];
+    pfds[i].events = POLLIN;
+  }
+
+  for (;;) {
+    if (poll (pfds, nr_fds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      server_message (errno, "nbd-server: poll");
+      _exit (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nr_fds; ++i) {
+      struct connection *conn;
+      int sock;
+
+      if (!(pfds[i].revents & POLLIN))
+        continue;
+      sock = accept4 (fds[i], NULL, NULL, SOCK_CLOEXEC);
+      if (sock == -1)
+        continue;
+
+      conn = calloc (1, sizeof *conn);
+      if (conn == NULL) {
+        close (sock);
+        continue;
+      }
+      conn->sock = sock;
+      conn->refs = 1;
+      conn->framed = use_compression || use_dedup;
+      conn->dedup = use_dedup;
+      pthread_mutex_init (&conn->write_lock, NULL);
+      start_threads (connection_thread, conn);
+    }
+  }
+}
+
+static void
+start_threads (void *(*fn) (void *), void *arg)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int err;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attr, fn, arg);
+  pthread_attr_destroy (&attr);
+  if (err != 0) {
+    server_message (err, "nbd-server: pthread_create");
+    _exit (EXIT_FAILURE);
+  }
+}
+
+/* Close every file descriptor inherited from virt-p2v except stdin,
+ * stdout, stderr, the disk and the listening sockets.  Otherwise the
+ * server would keep open whatever virt-p2v had open when it was
+ * forked, such as the pty of the control connection, so that the
+ * other end never sees it closed.
+ */
+static void
+close_inherited_fds (int disk, const int *fds, size_t nr_fds)
+{
+  struct rlimit rl;
+  unsigned max = 1024;
+  unsigned fd;
+  size_t i;
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    max = rl.rlim_cur;
+
+  for (fd = 3; fd < max; ++fd) {
+    bool keep = (int) fd == disk;
+
+    for (i = 0; !keep && i < nr_fds; ++i)
+      keep = (int) fd == fds[i];
+    if (keep)
+      continue;
+
+#ifdef SYS_close_range
+    /* Close everything up to the next fd to keep in one go. */
+    {
+      unsigned next = max;
+
+      if ((unsigned) disk > fd && (unsigned) disk < next)
+        next = disk;
+      for (i = 0; i < nr_fds; ++i)
+        if ((unsigned) fds[i] > fd && (unsigned) fds[i] < next)
+          next = fds[i];
+      if (syscall (SYS_close_range, fd, next - 1, 0) == 0) {
+        fd = next - 1;
+        continue;
+      }
+    }
+#endif
+    close (fd);
+  }
+}
+
+/**
+ * Start the built-in NBD server for C<device>, serving connections
+ * on the listening sockets C<fds>.  The disk is opened read-only, and
+ * the server exits when the thread which started it exits, in the
+ * same way as nbdkit I<--exit-with-parent>.
+ *
+ * If C<compress_replies> or C<dedup_replies> is true, everything sent
+ * to the client is wrapped in frames (see C<FRAME_COMPRESSED>), which
+ * the F<p2v-decompress> helper on the conversion server unwraps.
+ * C<compress_replies> compresses them, and C<dedup_replies> sends the
+ * hashes of the data of reads instead of the data (see
+ * C<P2V_DEDUP_MAGIC>).
+ *
+ * The extents in C<skip> (which may be C<NULL>) read as zeroes.  It
+ * is only used in the child, so the caller may free it after this
+ * returns.
+ *
+ * Returns the process ID (E<gt> 0) or C<0> if there is an error.
+ */
+pid_t
+start_builtin_nbd_server (const char *device, int *fds, size_t nr_fds,
+                          bool compress_replies, bool dedup_replies,
+                          const struct skip_list *skip)
+{
+  const pid_t parent = getpid ();
+  uint64_t size;
+  pid_t pid;
+  int fd;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "starting the built-in NBD server for %s%s%s\n", device,
+           compress_replies ? " with compression" : "",
+           dedup_replies ? " with deduplication" : "");
+#endif
+
+#ifndef HAVE_ZLIB
+  if (compress_replies) {
+    set_nbd_server_error (_("virt-p2v was built without zlib, so p2v.compress cannot be used"));
+    return 0;
+  }
+#endif
+
+  /* Open the disk here, so that errors are reported to the caller. */
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    set_nbd_server_error ("open: %s: %m", device);
+    return 0;
+  }
+  if (ioctl (fd, BLKGETSIZE64, &size) == -1) {
+    struct stat statbuf;
+
+    /* Not a block device, eg. --test-disk. */
+    if (fstat (fd, &statbuf) == -1) {
+      set_nbd_server_error ("fstat: %s: %m", device);
+      close (fd);
+      return 0;
+    }
+    size = statbuf.st_size;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    set_nbd_server_error ("fork: %m");
+    close (fd);
+    return 0;
+  }
+
+  if (pid == 0) {               /* Child. */
+    close_inherited_fds (fd, fds, nr_fds);
+    close (0);
+    if (open ("/dev/null", O_RDONLY) == -1) {
+      server_message (errno, "open: /dev/null");
+      _exit (EXIT_FAILURE);
+    }
+
+    prctl (PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid () != parent)
+      _exit (EXIT_FAILURE);
+    prctl (PR_SET_NAME, "p2v-nbd-server");
+    signal (SIGPIPE, SIG_IGN);
+
+    disk_fd = fd;
+    disk_size = size;
+    use_compression = compress_replies;
+    use_dedup = dedup_replies;
+    skip_list = skip;
+    posix_fadvise (disk_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    serve (fds, nr_fds);
+  }
+
+  /* Parent. */
+  close (fd);
+  return pid;
+}
@@ -15,7 +15,9 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-/* This file handles running L<nbdkit(1)>. */
+/* This file handles running L<nbdkit(1)>, or the built-in NBD server
+ * in F<nbd-server.c>.
+ */
 
 #include <config.h>
 
@@ -32,24 +34,39 @@
 #include <libintl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #include "p2v.h"
 
 /* How long to wait for nbdkit to start (seconds). */
 #define WAIT_NBD_TIMEOUT 10
 
+/* Bump this if the format of the capabilities cache changes. */
+#define NBDKIT_CAPS_CACHE_VERSION 1
+
 /* The local port that nbdkit listens on (incremented for each server which is
- * started).
+ * started).  C<0> means let the kernel choose a free port.
  */
 static int nbd_local_port;
 
-/* Whether nbdkit recognizes "--exit-with-parent". */
-static bool nbd_exit_with_parent;
+/* What nbdkit can do.  This is probed in a background thread started
+ * by C<start_probing_nbd_server>, and is only valid once
+ * C<get_nbdkit_caps> has returned.
+ */
+static struct nbdkit_caps nbdkit_caps;
+static pthread_t probe_thread;
+static bool probe_started = false;
+static bool probe_joined = false;
 
 static pid_t start_nbdkit (const char *device, int *fds, size_t nr_fds);
 static int open_listening_socket (int **fds, size_t *nr_fds);
-static int bind_tcpip_socket (const char *port, int **fds, size_t *nr_fds);
+static int bind_tcpip_socket (const char *port, int **fds, size_t *nr_fds, int *port_rtn);
 
 static char *nbd_error;
 
@@ -82,12 +99,414 @@ get_nbd_error (void)
 }
 
 /**
- * Check for nbdkit.
+ * Search C<$PATH> for the nbdkit binary.
+ *
+ * Returns the path, or C<NULL> if it is not found.  The caller must
+ * free the returned string.
+ */
+static char *
+find_nbdkit (void)
+{
+  const char *path = getenv ("PATH");
+  const char *p, *end;
+  char *ret;
+
+  if (path == NULL)
+    path = "/usr/local/bin:/usr/bin:/bin:/usr/local/sbin:/usr/sbin:/sbin";
+
+  for (p = path; *p; p = end + (*end == ':')) {
+    end = strchrnul (p, ':');
+    if (asprintf (&ret, "%.*s/nbdkit",
+                  end > p ? (int) (end - p) : 1,
+                  end > p ? p : ".") == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (access (ret, X_OK) == 0)
+      return ret;
+    free (ret);
+  }
+
+  return NULL;
+}
+
+/**
+ * Return the name of the capabilities cache file, or C<NULL> if
+ * there is nowhere to put it.  The caller must free the returned
+ * string.
+ */
+static char *
+nbdkit_caps_cache_file (void)
+{
+  const char *dir = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  char *ret;
+
+  if (dir && *dir) {
+    if (asprintf (&ret, "%s/virt-p2v/nbdkit-caps", dir) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else if (home && *home) {
+    if (asprintf (&ret, "%s/.cache/virt-p2v/nbdkit-caps", home) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else
+    return NULL;
+
+  return ret;
+}
+
+/**
+ * Set the capability C<key> to C<value>.  This is used when parsing
+ * both the output of nbdkit and the cache file.  Unknown keys are
+ * ignored.
+ */
+static void
+set_nbdkit_cap (struct nbdkit_caps *caps, const char *key, const char *value)
+{
+  if (STREQ (key, "version_major"))
+    caps->version_major = atoi (value);
+  else if (STREQ (key, "version_minor"))
+    caps->version_minor = atoi (value);
+  else if (STREQ (key, "exit_with_parent"))
+    caps->exit_with_parent = STREQ (value, "yes") || STREQ (value, "1");
+  else if (STREQ (key, "has_can_multi_conn"))
+    caps->multi_conn = STREQ (value, "1");
+  else if (STREQ (key, "filterdir")) {
+    free (caps->filterdir);
+    caps->filterdir = strdup (value);
+    if (caps->filterdir == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+  }
+  else if (STREQ (key, "filters")) {
+    guestfs_int_free_string_list (caps->filters);
+    caps->filters = guestfs_int_split_string (',', value);
+    if (caps->filters == NULL)
+      error (EXIT_FAILURE, errno, "guestfs_int_split_string");
+  }
+}
+
+/**
+ * Read C<key=value> lines from C<fp> into C<caps>.
+ *
+ * If C<stat> is not C<NULL>, this is the cache file and the lines
+ * describing the nbdkit binary must match C<stat>, else this returns
+ * C<-1>.
+ */
+static int
+parse_nbdkit_caps (FILE *fp, struct nbdkit_caps *caps,
+                   const struct stat *statbuf)
+{
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+  unsigned matched = 0;
+
+  while ((n = getline (&line, &len, fp)) != -1) {
+    char *value;
+
+    if (n > 0 && line[n-1] == '\n')
+      line[n-1] = '\0';
+    value = strchr (line, '=');
+    if (value == NULL)
+      continue;
+    *value++ = '\0';
+
+    if (statbuf) {
+      if (STREQ (line, "cache_version")) {
+        if (atoi (value) != NBDKIT_CAPS_CACHE_VERSION) return -1;
+        matched |= 1;
+        continue;
+      }
+      else if (STREQ (line, "dev")) {
+        if (strtoull (value, NULL, 10) != (unsigned long long) statbuf->st_dev)
+          return -1;
+        matched |= 2;
+        continue;
+      }
+      else if (STREQ (line, "ino")) {
+        if (strtoull (value, NULL, 10) != (unsigned long long) statbuf->st_ino)
+          return -1;
+        matched |= 4;
+        continue;
+      }
+      else if (STREQ (line, "mtime")) {
+        long long sec;
+        long nsec;
+
+        if (sscanf (value, "%lld.%ld", &sec, &nsec) != 2 ||
+            sec != (long long) statbuf->st_mtim.tv_sec ||
+            nsec != statbuf->st_mtim.tv_nsec)
+          return -1;
+        matched |= 8;
+        continue;
+      }
+    }
+
+    set_nbdkit_cap (caps, line, value);
+  }
+
+  if (statbuf && matched != 15)
+    return -1;
+  return 0;
+}
+
+/**
+ * Run C<cmd> and parse its C<key=value> output into C<caps>.
+ *
+ * Returns the exit status of the command, or C<-1> if it could not
+ * be run.
+ */
+static int
+run_nbdkit_probe (const char *cmd, struct nbdkit_caps *caps)
+{
+  FILE *fp;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: running: %s\n", g_get_prgname (), cmd);
+#endif
+
+  fp = popen (cmd, "r");
+  if (fp == NULL) {
+    perror (cmd);
+    return -1;
+  }
+  parse_nbdkit_caps (fp, caps, NULL);
+  return pclose (fp);
+}
+
+/**
+ * List the filters installed in C<caps-E<gt>filterdir>.
+ */
+static void
+find_nbdkit_filters (struct nbdkit_caps *caps)
+{
+  DIR *dir;
+  struct dirent *d;
+  size_t n = 0;
+
+  caps->filters = calloc (1, sizeof (char *));
+  if (caps->filters == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  if (caps->filterdir == NULL)
+    return;
+  dir = opendir (caps->filterdir);
+  if (dir == NULL)
+    return;
+
+  while ((d = readdir (dir)) != NULL) {
+    size_t len = strlen (d->d_name);
+    char *name;
+
+    /* nbdkit-NAME-filter.so */
+    if (!STRPREFIX (d->d_name, "nbdkit-") || len <= 7 + 10 ||
+        !STREQ (&d->d_name[len-10], "-filter.so"))
+      continue;
+    name = strndup (&d->d_name[7], len - 7 - 10);
+    if (name == NULL)
+      error (EXIT_FAILURE, errno, "strndup");
+    caps->filters = realloc (caps->filters, (n + 2) * sizeof (char *));
+    if (caps->filters == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    caps->filters[n++] = name;
+    caps->filters[n] = NULL;
+  }
+  closedir (dir);
+
+  qsort (caps->filters, n, sizeof (char *), compare_strings);
+}
+
+/**
+ * Save the capabilities to the cache file.  Errors are ignored, we
+ * will just probe nbdkit again next time.
+ */
+static void
+write_nbdkit_caps_cache (const struct nbdkit_caps *caps,
+                         const struct stat *statbuf)
+{
+  CLEANUP_FREE char *filename = nbdkit_caps_cache_file ();
+  CLEANUP_FREE char *tmpfile = NULL;
+  CLEANUP_FREE char *filters = NULL;
+  char *p;
+  FILE *fp;
+
+  if (filename == NULL)
+    return;
+
+  /* Create the parent directories. */
+  for (p = strchr (filename + 1, '/'); p != NULL; p = strchr (p + 1, '/')) {
+    *p = '\0';
+    mkdir (filename, 0755);
+    *p = '/';
+  }
+
+  if (asprintf (&tmpfile, "%s.%d", filename, (int) getpid ()) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  fp = fopen (tmpfile, "w");
+  if (fp == NULL)
+    return;
+
+  filters = guestfs_int_join_strings (",", caps->filters);
+  if (filters == NULL)
+    error (EXIT_FAILURE, errno, "guestfs_int_join_strings");
+
+  fprintf (fp, "cache_version=%d\n", NBDKIT_CAPS_CACHE_VERSION);
+  fprintf (fp, "dev=%llu\n", (unsigned long long) statbuf->st_dev);
+  fprintf (fp, "ino=%llu\n", (unsigned long long) statbuf->st_ino);
+  fprintf (fp, "mtime=%lld.%09ld\n",
+           (long long) statbuf->st_mtim.tv_sec, statbuf->st_mtim.tv_nsec);
+  fprintf (fp, "version_major=%d\n", caps->version_major);
+  fprintf (fp, "version_minor=%d\n", caps->version_minor);
+  fprintf (fp, "exit_with_parent=%s\n", caps->exit_with_parent ? "yes" : "no");
+  fprintf (fp, "has_can_multi_conn=%d\n", caps->multi_conn ? 1 : 0);
+  if (caps->filterdir)
+    fprintf (fp, "filterdir=%s\n", caps->filterdir);
+  fprintf (fp, "filters=%s\n", filters);
+
+  if (fclose (fp) == EOF || rename (tmpfile, filename) == -1)
+    unlink (tmpfile);
+}
+
+/**
+ * Find out what nbdkit can do.
+ *
+ * Running nbdkit several times takes a noticable fraction of the
+ * startup time, so the results are cached in
+ * F<$XDG_CACHE_HOME/virt-p2v/nbdkit-caps> (or F<~/.cache/...>),
+ * keyed by the device, inode and modification time of the nbdkit
+ * binary.  If nbdkit is upgraded the cache is ignored.
+ */
+static void *
+probe_nbdkit_thread (void *data)
+{
+  struct nbdkit_caps *caps = &nbdkit_caps;
+  CLEANUP_FREE char *nbdkit = NULL;
+  CLEANUP_FREE char *cache_file = NULL;
+  struct stat statbuf;
+  FILE *fp;
+  int r;
+
+  nbdkit = find_nbdkit ();
+  if (nbdkit == NULL || stat (nbdkit, &statbuf) == -1)
+    return NULL;
+
+  cache_file = nbdkit_caps_cache_file ();
+  if (cache_file) {
+    fp = fopen (cache_file, "r");
+    if (fp) {
+      r = parse_nbdkit_caps (fp, caps, &statbuf);
+      fclose (fp);
+      if (r == 0 && caps->filters != NULL) {
+#if DEBUG_STDERR
+        fprintf (stderr, "%s: using cached nbdkit capabilities from %s\n",
+                 g_get_prgname (), cache_file);
+#endif
+        caps->found = true;
+        return NULL;
+      }
+      free_nbdkit_caps (caps);
+    }
+  }
+
+  /* The file plugin is always installed with nbdkit, but check it
+   * anyway, and at the same time find out if it supports multi-conn.
+   */
+  r = run_nbdkit_probe ("nbdkit file --dump-plugin"
+#ifndef DEBUG_STDERR
+                        " 2>/dev/null"
+#endif
+                        , caps);
+  if (r != 0)
+    return NULL;
+
+  /* Very old nbdkit doesn't have --dump-config, or doesn't list
+   * exit_with_parent there, so fall back to trying the option.
+   */
+  r = run_nbdkit_probe ("nbdkit --dump-config"
+#ifndef DEBUG_STDERR
+                        " 2>/dev/null"
+#endif
+                        , caps);
+  if (r != 0 || !caps->exit_with_parent) {
+    r = system ("nbdkit --exit-with-parent --version"
+#ifndef DEBUG_STDERR
+                " >/dev/null 2>&1"
+#endif
+                );
+    caps->exit_with_parent = r == 0;
+  }
+
+  find_nbdkit_filters (caps);
+  caps->found = true;
+
+  write_nbdkit_caps_cache (caps, &statbuf);
+  return NULL;
+}
+
+void
+free_nbdkit_caps (struct nbdkit_caps *caps)
+{
+  free (caps->filterdir);
+  guestfs_int_free_string_list (caps->filters);
+  memset (caps, 0, sizeof *caps);
+}
+
+static bool
+nbdkit_version_ge (const struct nbdkit_caps *caps, int major, int minor)
+{
+  return caps->version_major > major ||
+    (caps->version_major == major && caps->version_minor >= minor);
+}
+
+/**
+ * Start finding out what nbdkit can do in the background.  This
+ * should be called once, early, from the main thread.
+ */
+void
+start_probing_nbd_server (void)
+{
+  int err;
+
+  if (probe_started)
+    return;
+  probe_started = true;
+
+  err = pthread_create (&probe_thread, NULL, probe_nbdkit_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    probe_nbdkit_thread (NULL);
+    probe_joined = true;
+  }
+}
+
+/**
+ * Return the capabilities of nbdkit, waiting for the probe started
+ * by C<start_probing_nbd_server> if necessary.
+ *
+ * This must first be called from the main thread (which
+ * C<test_nbd_server> does).
+ */
+const struct nbdkit_caps *
+get_nbdkit_caps (void)
+{
+  start_probing_nbd_server ();
+
+  if (!probe_joined) {
+    pthread_join (probe_thread, NULL);
+    probe_joined = true;
+  }
+
+  return &nbdkit_caps;
+}
+
+/**
+ * Check for nbdkit.  If it is not installed the built-in NBD server
+ * is used instead.
  */
 void
 test_nbd_server (void)
 {
-  int r;
+  const struct nbdkit_caps *caps;
 
   /* Initialize nbd_local_port. */
   if (is_iso_environment)
@@ -99,57 +518,81 @@ test_nbd_server (void)
      */
     nbd_local_port = 50123;
   else
-    /* When testing on the local machine, choose a random port. */
-    nbd_local_port = 50000 + (random () % 10000);
+    /* When testing on the local machine, let the kernel choose a free
+     * port.
+     */
+    nbd_local_port = 0;
 
 #if DEBUG_STDERR
   fprintf (stderr, "checking for nbdkit ...\n");
 #endif
 
-  r = system ("nbdkit file --version"
-#ifndef DEBUG_STDERR
-              " >/dev/null 2>&1"
+  caps = get_nbdkit_caps ();
+  if (!caps->found) {
+#if DEBUG_STDERR
+    fprintf (stderr, "nbdkit was not found, using the built-in NBD server\n");
 #endif
-              );
-  if (r != 0) {
-    fprintf (stderr, _("%s: nbdkit was not found, cannot continue.\n"),
-             g_get_prgname ());
-    exit (EXIT_FAILURE);
+    return;
   }
 
-  r = system ("nbdkit --exit-with-parent --version"
-#ifndef DEBUG_STDERR
-              " >/dev/null 2>&1"
-#endif
-              );
-  nbd_exit_with_parent = (r == 0);
-
 #if DEBUG_STDERR
-  fprintf (stderr, "found nbdkit (%s exit with parent)\n",
-           nbd_exit_with_parent ? "can" : "cannot");
+  fprintf (stderr, "found nbdkit %d.%d (%s exit with parent, %s multi-conn, "
+           "%zu filters)\n",
+           caps->version_major, caps->version_minor,
+           caps->exit_with_parent ? "can" : "cannot",
+           caps->multi_conn ? "can" : "cannot",
+           guestfs_int_count_strings (caps->filters));
 #endif
 }
 
 /**
- * Start nbdkit.
+ * Start nbdkit, or the built-in NBD server if that was chosen with
+ * C<p2v.nbd_server=builtin>, if the data is compressed or deduplicated
+ * (C<p2v.compress>, C<p2v.dedup>), if there is swap or an excluded
+ * partition on the disk which is not copied (see F<skip.c>), or if
+ * nbdkit is not installed.
  *
  * We previously tested nbdkit (see C<test_nbd_server>).
  *
+ * The number of bytes of the disk which are not copied is returned
+ * in C<*skipped>, and how many of those are in excluded partitions
+ * in C<*excluded>.
+ *
  * Returns the process ID (E<gt> 0) or C<0> if there is an error.
  */
 pid_t
-start_nbd_server (int *port, const char *device)
+start_nbd_server (const struct config *config, int *port, const char *device,
+                  uint64_t *skipped, uint64_t *excluded)
 {
+  struct skip_list *skip;
   int *fds = NULL;
   size_t i, nr_fds;
   pid_t pid;
 
+  skip = find_skip_extents (device, !config->copy_swap,
+                            config->exclude_partitions);
+  *skipped = skip->total;
+  *excluded = skip->excluded;
+
   *port = open_listening_socket (&fds, &nr_fds);
-  if (*port == -1) return -1;
-  pid = start_nbdkit (device, fds, nr_fds);
+  if (*port == -1) {
+    free_skip_list (skip);
+    return -1;
+  }
+  if (config->nbd_server == NBD_SERVER_BUILTIN ||
+      config->compress || config->dedup || *skipped > 0 ||
+      !get_nbdkit_caps ()->found) {
+    pid = start_builtin_nbd_server (device, fds, nr_fds,
+                                    config->compress, config->dedup, skip);
+    if (pid == 0)
+      set_nbd_error ("%s", get_nbd_server_error ());
+  }
+  else
+    pid = start_nbdkit (device, fds, nr_fds);
   for (i = 0; i < nr_fds; ++i)
     close (fds[i]);
   free (fds);
+  free_skip_list (skip);
   return pid;
 }
 
@@ -196,6 +639,7 @@ socket_activation (int *fds, size_t nr_fds)
 static pid_t
 start_nbdkit (const char *device, int *fds, size_t nr_fds)
 {
+  const struct nbdkit_caps *caps = get_nbdkit_caps ();
   pid_t pid;
   CLEANUP_FREE char *file_str = NULL;
 
@@ -214,6 +658,7 @@ start_nbdkit (const char *device, int *fds, size_t nr_fds)
 
   if (pid == 0) {               /* Child. */
     const char *nofork_opt;
+    const char *fadvise_opt;
 
     close (0);
     if (open ("/dev/null", O_RDONLY) == -1) {
@@ -223,17 +668,25 @@ start_nbdkit (const char *device, int *fds, size_t nr_fds)
 
     socket_activation (fds, nr_fds);
 
-    nofork_opt = nbd_exit_with_parent ?
+    nofork_opt = caps->exit_with_parent ?
                  "--exit-with-parent" : /* don't fork, and exit when the parent
                                          * thread does */
                  "-f";                  /* don't fork */
 
+    /* virt-v2v mostly reads the disk sequentially, so ask the kernel
+     * for more readahead if this version of the file plugin supports
+     * it (nbdkit >= 1.22).
+     */
+    fadvise_opt = nbdkit_version_ge (caps, 1, 22) ?
+                  "fadvise=sequential" : NULL;
+
     execlp ("nbdkit",
             "nbdkit",
             "-r",             /* readonly (vital!) */
             nofork_opt,
             "file",           /* file plugin */
             file_str,         /* a device like file=/dev/sda */
+            fadvise_opt,
             NULL);
     perror ("nbdkit");
     _exit (EXIT_FAILURE);
@@ -257,13 +710,21 @@ open_listening_socket (int **fds, size_t *nr_fds)
   int port;
   char port_str[16];
 
+  /* Let the kernel choose the port. */
+  if (nbd_local_port == 0) {
+    if (bind_tcpip_socket ("0", fds, nr_fds, &port) == 0)
+      return port;
+    set_nbd_error ("cannot find a free local port");
+    return -1;
+  }
+
   /* This just ensures we don't try the port we previously bound to. */
   port = nbd_local_port;
 
   /* Search for a free port. */
   for (; port < 60000; ++port) {
     snprintf (port_str, sizeof port_str, "%d", port);
-    if (bind_tcpip_socket (port_str, fds, nr_fds) == 0) {
+    if (bind_tcpip_socket (port_str, fds, nr_fds, NULL) == 0) {
       /* See above. */
       nbd_local_port = port + 1;
       return port;
@@ -274,8 +735,16 @@ open_listening_socket (int **fds, size_t *nr_fds)
   return -1;
 }
 
+/**
+ * Bind to C<port> on all the addresses of C<localhost>.
+ *
+ * If C<port> is C<"0"> then the kernel chooses a free port for the
+ * first address, and the same port is used for the other addresses.
+ * The chosen port is returned in C<*port_rtn>.
+ */
 static int
-bind_tcpip_socket (const char *port, int **fds_rtn, size_t *nr_fds_rtn)
+bind_tcpip_socket (const char *port, int **fds_rtn, size_t *nr_fds_rtn,
+                   int *port_rtn)
 {
   struct addrinfo *ai = NULL;
   struct addrinfo hints;
@@ -284,6 +753,7 @@ bind_tcpip_socket (const char *port, int **fds_rtn, size_t *nr_fds_rtn)
   int *fds = NULL;
   size_t nr_fds;
   int addr_in_use = 0;
+  int chosen_port = 0;
 
   memset (&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC;
@@ -319,6 +789,13 @@ bind_tcpip_socket (const char *port, int **fds_rtn, size_t *nr_fds_rtn)
     }
 #endif
 
+    if (chosen_port > 0) {
+      if (a->ai_family == AF_INET)
+        ((struct sockaddr_in *) a->ai_addr)->sin_port = htons (chosen_port);
+      else if (a->ai_family == AF_INET6)
+        ((struct sockaddr_in6 *) a->ai_addr)->sin6_port = htons (chosen_port);
+    }
+
     if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
       if (errno == EADDRINUSE) {
         addr_in_use = 1;
@@ -336,6 +813,18 @@ bind_tcpip_socket (const char *port, int **fds_rtn, size_t *nr_fds_rtn)
       continue;
     }
 
+    if (port_rtn && chosen_port == 0) {
+      struct sockaddr_storage addr;
+      socklen_t addrlen = sizeof addr;
+
+      if (getsockname (sock, (struct sockaddr *) &addr, &addrlen) == -1)
+        error (EXIT_FAILURE, errno, "getsockname");
+      if (addr.ss_family == AF_INET)
+        chosen_port = ntohs (((struct sockaddr_in *) &addr)->sin_port);
+      else
+        chosen_port = ntohs (((struct sockaddr_in6 *) &addr)->sin6_port);
+    }
+
     nr_fds++;
     fds = realloc (fds, sizeof (int) * nr_fds);
     if (!fds)
@@ -353,9 +842,15 @@ bind_tcpip_socket (const char *port, int **fds_rtn, size_t *nr_fds_rtn)
     return -1;
   }
 
+  if (port_rtn) {
+    if (nr_fds == 0)
+      return -1;
+    *port_rtn = chosen_port;
+  }
+
 #if DEBUG_STDERR
-  fprintf (stderr, "%s: bound to localhost:%s (%zu socket(s))\n",
-           g_get_prgname (), port, nr_fds);
+  fprintf (stderr, "%s: bound to localhost:%d (%zu socket(s))\n",
+           g_get_prgname (), port_rtn ? chosen_port : atoi (port), nr_fds);
 #endif
 
   *fds_rtn = fds;
@@ -0,0 +1,90 @@
+#!/bin/bash -
+# virt-p2v
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Show the latest metrics of the virt-p2v conversions running on this
+# conversion server, one line per conversion.  Run this on the
+# conversion server.
+#
+# Usage: p2v-metrics.sh [-a] [-w SECONDS] [REMOTE_DIR ...]
+#
+#   -a          Include finished conversions.
+#   -w SECONDS  Refresh every SECONDS seconds until interrupted.
+#
+# If no directories are given, all /tmp/virt-p2v-* directories are
+# shown.
+
+all=no
+wait=
+
+while getopts "aw:" opt; do
+    case "$opt" in
+        a) all=yes ;;
+        w) wait="$OPTARG" ;;
+        *) echo "usage: $0 [-a] [-w SECONDS] [REMOTE_DIR ...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+# Print the value of a top-level number or string field in the
+# compact JSON record written by virt-p2v.
+field ()
+{
+    sed -n -e 's/.*"'"$1"'":"\([^"]*\)".*/\1/p' \
+           -e 't' \
+           -e 's/.*"'"$1"'":\([0-9.]*\).*/\1/p' <<< "$2"
+}
+
+show ()
+{
+    local dir rec status now age
+
+    printf "%-36s %-18s %10s %9s %8s %8s %6s %5s\n" \
+           DIRECTORY STAGE "READ MB" "MB/S" "NBDKIT" "SSH" ERRORS AGE
+    now=$(date +%s)
+    for dir in "$@"; do
+        [ -f "$dir/p2v-metrics.json" ] || continue
+        status="$(cat "$dir/status" 2>/dev/null)"
+        if [ "$all" = "no" ] && [ -n "$status" ] && [ "$status" != 99 ]; then
+            continue
+        fi
+        rec="$(< "$dir/p2v-metrics.json")"
+        age=$(( now - $(field time "$rec") ))
+        printf "%-36s %-18s %10.1f %9.1f %7.1fs %7.1fs %6d %4ds\n" \
+               "$dir" \
+               "$(field stage "$rec")" \
+               "$(awk -v b="$(field bytes "$rec")" 'BEGIN { print b / 1048576 }')" \
+               "$(awk -v b="$(field bytes_per_second "$rec")" 'BEGIN { print b / 1048576 }')" \
+               "$(field nbdkit_cpu_seconds "$rec")" \
+               "$(field ssh_cpu_seconds "$rec")" \
+               "$(field errors "$rec")" \
+               "$age"
+    done
+}
+
+if [ $# -eq 0 ]; then
+    set -- /tmp/virt-p2v-*
+fi
+
+if [ -z "$wait" ]; then
+    show "$@"
+else
+    while :; do
+        clear
+        show "$@"
+        sleep "$wait"
+    done
+fi
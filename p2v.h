@@ -60,14 +60,53 @@ extern int force_colour;
 /* cpuid.c */
 struct cpu_topo {
   unsigned sockets;
-  unsigned cores;
-  unsigned threads;
+  unsigned cores;               /* per socket */
+  unsigned threads;             /* per core */
+  unsigned nr_cpus;             /* online logical CPUs */
+  unsigned numa_nodes;
+  unsigned l1d_kb, l1i_kb, l2_kb, l3_kb; /* cache sizes, 0 if unknown */
+  unsigned performance_cpus;    /* hybrid CPUs only, else 0 */
+  unsigned efficiency_cpus;
 };
 extern void get_cpu_topology (struct cpu_topo *topo);
 extern void get_cpu_config (struct cpu_config *);
 
 /* disks.c */
+enum disk_type {
+  DISK_TYPE_OTHER,              /* ignored */
+  DISK_TYPE_FIXED,              /* hard disk, can be converted */
+  DISK_TYPE_REMOVABLE,          /* CD-ROM etc. */
+};
+struct disk_mirror {
+  char **members;               /* disks with the same data, eg. sda sdb */
+  char *arrays;                 /* the arrays they are in, eg. "md126 md127" */
+};
+extern enum disk_type get_disk_type (const char *name);
 extern void find_all_disks (char ***disks, char ***removable);
+extern const struct disk_mirror *get_disk_mirror (const char *disk);
+extern char **get_disk_partitions (const char *disk);
+extern uint64_t get_partition_size (const char *partition);
+
+/* inventory.c */
+extern void update_inventory (const char * const *disks, const char * const *interfaces);
+extern void forget_inventory_device (const char *name);
+extern uint64_t inventory_disk_size (const char *name);
+extern char *inventory_disk_model (const char *name);
+extern char *inventory_disk_serial (const char *name);
+extern char *inventory_if_addr (const char *if_name);
+extern char *inventory_if_vendor (const char *if_name, int truncate);
+extern char *inventory_if_device (const char *if_name, int truncate);
+
+/* uevent.c */
+struct uevent {
+  char action[16];              /* "add", "remove", "move", ... */
+  char subsystem[32];           /* "block", "net", ... */
+  char devtype[16];             /* "disk", "partition", ... */
+  char name[64];                /* DEVNAME or INTERFACE */
+  char old_name[64];            /* previous name, for "move" events */
+};
+extern int open_uevent_socket (void);
+extern int read_uevent (int fd, struct uevent *ev);
 
 /* rtc.c */
 extern void get_rtc_config (struct rtc_config *);
@@ -86,52 +125,157 @@ extern void update_config_from_kernel_cmdline (struct config *config, char **cmd
 /* kernel.c */
 extern void kernel_conversion (struct config *, char **cmdline, int cmdline_source);
 
+/* console.c */
+#define CONSOLE_OUTPUT 1        /* output from the conversion server */
+#define CONSOLE_STATUS 2        /* a status line, may be superseded */
+extern void start_console_writer (void);
+extern void console_write (int type, const char *data);
+extern void flush_console (void);
+
 /* gui.c */
 extern void gui_conversion (struct config *config,
                             const char * const *disks,
-                            const char * const *removable);
+                            const char * const *removable,
+                            bool disk_hotplug);
 
 /* conversion.c */
 struct data_conn {          /* Data per NBD connection / physical disk. */
   mexp_h *h;                /* miniexpect handle to ssh */
   pid_t nbd_pid;            /* NBD server PID */
   int nbd_remote_port;      /* remote NBD port on conversion server */
+  uint64_t skipped;         /* bytes of swap etc. which are not copied */
+  uint64_t excluded;        /* of which in excluded partitions */
 };
 
-extern int start_conversion (struct config *, void (*notify_ui) (int type, const char *data));
+extern int start_conversion (const struct config *, void (*notify_ui) (int type, const char *data));
 #define NOTIFY_LOG_DIR        1  /* location of remote log directory */
 #define NOTIFY_REMOTE_MESSAGE 2  /* log message from remote virt-v2v */
 #define NOTIFY_STATUS         3  /* stage in conversion process */
 extern const char *get_conversion_error (void);
 extern void cancel_conversion (void);
 extern int conversion_is_running (void);
+extern void warm_up_data_conns (const struct config *);
+extern void discard_warm_data_conns (void);
+
+/* measure.c */
+extern char *measure_conversion (const struct config *, void (*notify_ui) (int type, const char *data));
+extern const char *get_measure_error (void);
+
+/* timeline.c */
+extern void enable_timeline (void);
+extern bool timeline_is_enabled (void);
+extern double timeline_now (void);
+extern size_t timeline_begin (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+extern void timeline_end (size_t handle);
+extern void timeline_mark (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+extern void timeline_add (double start, double end, const char *fs, ...)
+  __attribute__((format(printf,3,4)));
+extern int write_timeline (const char *filename);
+extern int write_timeline_trace (const char *filename);
+
+/* metrics.c */
+extern void set_metrics_stage (const char *stage);
+extern void count_metrics_error (void);
+extern void set_metrics_disks (char **disks);
+extern void update_metrics_disk (size_t i, uint64_t bytes);
+extern void update_metrics_sample (double nbdkit_cpu, double ssh_cpu);
+extern char *format_metrics_record (void);
+extern int start_metrics_server (int port);
+
+/* hash.c */
+struct xxh64_state {
+  uint64_t total_len;
+  uint64_t seed;
+  uint64_t v[4];
+  unsigned char mem[32];
+  size_t memsize;
+};
+extern uint64_t xxh64 (const void *data, size_t len, uint64_t seed);
+extern void xxh64_init (struct xxh64_state *state, uint64_t seed);
+extern void xxh64_update (struct xxh64_state *state, const void *data, size_t len);
+extern uint64_t xxh64_digest (const struct xxh64_state *state);
+
+/* skip.c */
+struct skip_extent {
+  uint64_t offset;              /* bytes from the start of the disk */
+  uint64_t length;
+};
+struct skip_list {
+  struct skip_extent *extents;  /* sorted, not overlapping */
+  size_t nr_extents;
+  uint64_t total;               /* bytes skipped */
+  uint64_t excluded;            /* of which in excluded partitions */
+};
+extern struct skip_list *find_skip_extents (const char *device, bool swap, char * const *exclude);
+extern void free_skip_list (struct skip_list *list);
+extern const struct skip_extent *next_skip_extent (const struct skip_list *list, uint64_t offset);
+extern ssize_t skip_pread (const struct skip_list *list, int fd, void *buf, size_t len, uint64_t offset);
+
+/* precopy.c */
+#define PRECOPY_BLOCK_SIZE (1024 * 1024)
+#define PRECOPY_EXTENT_SIZE (64 * 1024 * 1024)
+#define PRECOPY_SEGMENT_SIZE (1024 * 1024 * 1024)
+extern char *get_precopy_dir (const struct config *);
+extern char *get_precopy_disk_name (const char *disk);
+extern int stream_block_maps (const struct config *, const char *dir, bool sums, int (*segment_done) (size_t disk, uint64_t segment, const char *filename, void *opaque), void *opaque, int (*is_cancelled) (void));
+extern int write_extent_sums (const struct config *, const char *dir, int (*is_cancelled) (void));
+extern const char *get_precopy_error (void);
+
+/* sysdata.c */
+extern void start_collecting_system_data (void);
+extern void upload_system_data (const struct config *, const char *remote_dir);
 
 /* physical-xml.c */
-extern void generate_physical_xml (struct config *, struct data_conn *, const char *filename);
+extern void generate_physical_xml (const struct config *, struct data_conn *, const char *filename);
 
 /* inhibit.c */
 extern int inhibit_power_saving (void);
 
 /* ssh.c */
-extern int test_connection (struct config *);
-extern mexp_h *open_data_connection (struct config *, int local_port, int *remote_port);
-extern mexp_h *start_remote_connection (struct config *, const char *remote_dir);
+extern int test_connection (const struct config *);
+extern mexp_h *open_data_connection (const struct config *, int local_port, int *remote_port);
+extern mexp_h *start_remote_connection (const struct config *, const char *remote_dir);
 extern const char *get_ssh_error (void);
-extern int scp_file (struct config *config, const char *target, const char *local, ...) __attribute__((sentinel));
+extern int scp_file (const struct config *config, const char *target, const char *local, ...) __attribute__((sentinel));
+extern void forget_ssh_identity (void);
 
 /* nbd.c */
+struct nbdkit_caps {
+  bool found;               /* nbdkit and the file plugin were found */
+  int version_major;
+  int version_minor;
+  bool exit_with_parent;    /* supports --exit-with-parent */
+  bool multi_conn;          /* file plugin supports multi-conn */
+  char *filterdir;
+  char **filters;           /* names of installed filters, sorted */
+};
+extern void start_probing_nbd_server (void);
+extern const struct nbdkit_caps *get_nbdkit_caps (void);
+extern void free_nbdkit_caps (struct nbdkit_caps *caps);
 extern void test_nbd_server (void);
-extern pid_t start_nbd_server (int *port, const char *device);
+extern pid_t start_nbd_server (const struct config *config, int *port, const char *device, uint64_t *skipped, uint64_t *excluded);
 const char *get_nbd_error (void);
 
+/* nbd-server.c */
+extern pid_t start_builtin_nbd_server (const char *device, int *fds, size_t nr_fds, bool compress, bool dedup, const struct skip_list *skip);
+extern const char *get_nbd_server_error (void);
+
 /* utils.c */
 extern uint64_t get_blockdev_size (const char *dev);
 extern char *get_blockdev_model (const char *dev);
 extern char *get_blockdev_serial (const char *dev);
 extern char *get_if_addr (const char *if_name);
+extern void set_pci_ids_file (const char *filename);
+extern char *get_pci_vendor (unsigned vendor, int truncate);
+extern char *get_pci_device (unsigned vendor, unsigned device, int truncate);
 extern char *get_if_vendor (const char *if_name, int truncate);
+extern char *get_if_device (const char *if_name, int truncate);
+extern bool is_network_interface (const char *if_name);
 extern void wait_network_online (const struct config *);
 extern int compare_strings (const void *vp1, const void *vp2);
+extern void print_json_string (FILE *fp, const char *str);
 
 /* virt-v2v version and features (read from remote). */
 extern char *v2v_version;
@@ -46,7 +46,7 @@
          "%s:%d: error constructing XML near call to \"%s\"",   \
          __FILE__, __LINE__, (fn));
 
-static const char *map_interface_to_network (struct config *, const char *interface);
+static const char *map_interface_to_network (const struct config *, const char *interface);
 
 /**
  * Write the libvirt XML for this physical machine.
@@ -56,7 +56,7 @@ static const char *map_interface_to_network (struct config *, const char *interf
  * generate the final libvirt XML.
  */
 void
-generate_physical_xml (struct config *config, struct data_conn *data_conns,
+generate_physical_xml (const struct config *config, struct data_conn *data_conns,
                        const char *filename)
 {
   uint64_t memkb;
@@ -90,6 +90,17 @@ generate_physical_xml (struct config *config, struct data_conn *data_conns,
      "\n"
      "  TL;DR: Don't try to load this XML into libvirt. ");
 
+  /* The host CPU details which cannot be expressed in the XML are
+   * still useful when reading the conversion log.
+   */
+  get_cpu_topology (&topo);
+  comment (" physical CPUs: %u logical, %u NUMA nodes, "
+           "L1d %uK L1i %uK L2 %uK L3 %uK%s ",
+           topo.nr_cpus, topo.numa_nodes,
+           topo.l1d_kb, topo.l1i_kb, topo.l2_kb, topo.l3_kb,
+           topo.performance_cpus || topo.efficiency_cpus
+           ? ", hybrid" : "");
+
   start_element ("domain") {
     attribute ("type", "physical");
 
@@ -186,6 +197,31 @@ generate_physical_xml (struct config *config, struct data_conn *data_conns,
             goto target_sd;
         }
 
+        /* In the final pass of a warm migration virt-v2v converts
+         * the copies of the disks on the conversion server, which
+         * the wrapper script has brought up to date.  See precopy.c.
+         */
+        if (config->precopy == PRECOPY_FINAL) {
+          CLEANUP_FREE char *precopy_dir = get_precopy_dir (config);
+          CLEANUP_FREE char *name = get_precopy_disk_name (config->disks[i]);
+
+          start_element ("disk") {
+            attribute ("type", "file");
+            attribute ("device", "disk");
+            start_element ("driver") {
+              attribute ("name", "qemu");
+              attribute ("type", "raw");
+            } end_element ();
+            start_element ("source") {
+              attribute_format ("file", "%s/%s.img", precopy_dir, name);
+            } end_element ();
+            start_element ("target") {
+              attribute ("dev", target_dev);
+            } end_element ();
+          } end_element ();
+          continue;
+        }
+
         start_element ("disk") {
           attribute ("type", "network");
           attribute ("device", "disk");
@@ -226,21 +262,12 @@ generate_physical_xml (struct config *config, struct data_conn *data_conns,
       if (config->interfaces) {
         for (i = 0; config->interfaces[i] != NULL; ++i) {
           const char *target_network;
-          CLEANUP_FREE char *mac_filename = NULL;
           CLEANUP_FREE char *mac = NULL;
 
           target_network =
             map_interface_to_network (config, config->interfaces[i]);
 
-          if (asprintf (&mac_filename, "/sys/class/net/%s/address",
-                        config->interfaces[i]) == -1)
-            error (EXIT_FAILURE, errno, "asprintf");
-          if (g_file_get_contents (mac_filename, &mac, NULL, NULL)) {
-            const size_t len = strlen (mac);
-
-            if (len > 0 && mac[len-1] == '\n')
-              mac[len-1] = '\0';
-          }
+          mac = inventory_if_addr (config->interfaces[i]);
 
           start_element ("interface") {
             attribute ("type", "network");
@@ -277,7 +304,7 @@ generate_physical_xml (struct config *config, struct data_conn *data_conns,
  * C<config-E<gt>network_map> is not freed.
  */
 static const char *
-map_interface_to_network (struct config *config, const char *interface)
+map_interface_to_network (const struct config *config, const char *interface)
 {
   size_t i, len;
 
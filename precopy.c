@@ -0,0 +1,663 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Warm migration (C<p2v.precopy>).
+ *
+ * The disks are copied to the conversion server in two passes.  The
+ * bulk pass (C<p2v.precopy=bulk>) runs while the physical machine is
+ * still running its usual operating system, and copies the whole of
+ * each disk into F</var/tmp/virt-p2v-precopy/GUESTNAME> on the
+ * server.  The final pass (C<p2v.precopy=final>) runs after booting
+ * into virt-p2v, copies only the blocks which have changed since the
+ * bulk pass, then runs virt-v2v on the copies.
+ *
+ * To find the changed blocks, the final pass reads every disk locally
+ * and writes a "block map" containing the hash of each
+ * C<PRECOPY_BLOCK_SIZE> block.  The wrapper script on the server
+ * compares it with the block map kept from the previous pass (see
+ * F<conversion.c>).
+ *
+ * The block map kept from the bulk pass is made on the server, by
+ * hashing the copy once it is complete.  The disks are in use during
+ * the bulk pass, so a block may change while it is copied, or even
+ * change and then change back.  A map made on the physical machine
+ * would then record something the server does not have, and the
+ * final pass would not copy that block again.
+ *
+ * In the final pass nothing else writes to the disks, so its own map
+ * matches what is copied, and it is kept for any later final pass.
+ * The block map is sent in C<PRECOPY_SEGMENT_SIZE> segments as they
+ * are hashed (see C<stream_block_maps>), and the server copies the
+ * changed blocks of each segment while the following ones are still
+ * being read.  The downtime depends mostly on how much of the disk
+ * changed.
+ *
+ * The block map is a text file.  The first line is
+ * S<C<p2v-block-map 1 xxh64 SIZE BLOCKSIZE>>, followed by the hash
+ * of each block in hex, one per line.
+ *
+ * The same code writes the extent sums used by C<p2v.verify> (see
+ * C<write_extent_sums>), with or without warm migration.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+/* How often the main thread checks for cancellation while the disks
+ * are read (milliseconds).
+ */
+#define PROGRESS_INTERVAL_MS 1000
+
+/* Upper limit on the number of hashing threads. */
+#define MAX_THREADS 64
+
+#define EXTENTS_PER_SEGMENT (PRECOPY_SEGMENT_SIZE / PRECOPY_EXTENT_SIZE)
+#define BLOCKS_PER_SEGMENT (PRECOPY_SEGMENT_SIZE / PRECOPY_BLOCK_SIZE)
+
+struct block_map_job {          /* One per disk. */
+  char *device;
+  char *map_file;
+  char *sums_file;
+  int fd;
+  struct skip_list *skip;       /* read as zeroes, see skip.c */
+  uint64_t size;
+  uint64_t nr_blocks;
+  uint64_t nr_extents;
+  uint64_t next_extent;         /* next extent to hash */
+  uint64_t *hashes;             /* hash of each block, or NULL */
+  uint64_t *sums;               /* hash of each extent, or NULL */
+  uint64_t nr_segments;
+  unsigned *segment_left;       /* extents left in each segment, or NULL */
+  uint64_t next_segment;        /* next segment to pass on */
+};
+
+struct block_map_pool {
+  struct block_map_job *jobs;
+  size_t nr_jobs;
+  size_t next_job;              /* first disk with extents left */
+  uint64_t done;                /* bytes hashed so far */
+  uint64_t segments_done;       /* segments completely hashed so far */
+  char *error;                  /* first error from any thread */
+};
+
+static pthread_mutex_t precopy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t precopy_cond = PTHREAD_COND_INITIALIZER;
+static volatile bool precopy_cancelled;
+
+static char *precopy_error;
+
+static void set_precopy_error (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+
+static void
+set_precopy_error (const char *fs, ...)
+{
+  va_list args;
+  char *msg;
+  int len;
+
+  va_start (args, fs);
+  len = vasprintf (&msg, fs, args);
+  va_end (args);
+
+  if (len < 0)
+    error (EXIT_FAILURE, errno,
+           "vasprintf (original error format string: %s)", fs);
+
+  free (precopy_error);
+  precopy_error = msg;
+}
+
+const char *
+get_precopy_error (void)
+{
+  return precopy_error;
+}
+
+static void set_pool_error (struct block_map_pool *pool, const char *fs, ...)
+  __attribute__((format(printf,2,3)));
+
+/* Record the first error from any of the hashing threads, and stop
+ * the others.
+ */
+static void
+set_pool_error (struct block_map_pool *pool, const char *fs, ...)
+{
+  va_list args;
+  char *msg;
+
+  va_start (args, fs);
+  if (vasprintf (&msg, fs, args) == -1)
+    error (EXIT_FAILURE, errno,
+           "vasprintf (original error format string: %s)", fs);
+  va_end (args);
+
+  pthread_mutex_lock (&precopy_lock);
+  if (pool->error == NULL)
+    pool->error = msg;
+  else
+    free (msg);
+  precopy_cancelled = true;
+  pthread_cond_broadcast (&precopy_cond);
+  pthread_mutex_unlock (&precopy_lock);
+}
+
+/* Replace any characters which are not safe in an unquoted shell
+ * word or a file name.
+ */
+static char *
+safe_name (const char *s)
+{
+  char *ret, *p;
+
+  /* Avoid hidden files, and "." and "..". */
+  if (asprintf (&ret, "%s%s", s[0] == '.' || s[0] == '\0' ? "_" : "", s) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  for (p = ret; *p; ++p) {
+    if (!g_ascii_isalnum (*p) && *p != '-' && *p != '.' && *p != '_')
+      *p = '_';
+  }
+  return ret;
+}
+
+/**
+ * Return the directory on the conversion server where the copies of
+ * the disks are kept between the bulk and final passes.  This never
+ * needs shell quoting.  The caller must free the returned string.
+ */
+char *
+get_precopy_dir (const struct config *config)
+{
+  CLEANUP_FREE char *name = safe_name (config->guestname);
+  char *ret;
+
+  if (asprintf (&ret, "/var/tmp/virt-p2v-precopy/%s", name) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  return ret;
+}
+
+/**
+ * Return the name used for C<disk> (an entry in C<config-E<gt>disks>)
+ * in the precopy directory, such as C<sda> or C<_dev_mapper_root>.
+ * This never needs shell quoting.  The caller must free the returned
+ * string.
+ */
+char *
+get_precopy_disk_name (const char *disk)
+{
+  return safe_name (disk);
+}
+
+/* Return the size of a disk, or of a file for --test-disk. */
+static int
+get_disk_size (int fd, const char *device, uint64_t *size)
+{
+  if (ioctl (fd, BLKGETSIZE64, size) == -1) {
+    struct stat statbuf;
+
+    if (fstat (fd, &statbuf) == -1) {
+      set_precopy_error ("fstat: %s: %m", device);
+      return -1;
+    }
+    *size = statbuf.st_size;
+  }
+  return 0;
+}
+
+/* Read and hash one extent of a disk.  Caller must not hold
+ * precopy_lock.  Returns 0 or -1 with pool->error set.
+ */
+static int
+hash_extent (struct block_map_pool *pool, struct block_map_job *job,
+             uint64_t extent, char *buf)
+{
+  const uint64_t start = extent * PRECOPY_EXTENT_SIZE;
+  uint64_t end = start + PRECOPY_EXTENT_SIZE;
+  uint64_t offset;
+  struct xxh64_state state;
+
+  if (end > job->size)
+    end = job->size;
+  xxh64_init (&state, 0);
+
+  for (offset = start; offset < end && !precopy_cancelled; ) {
+    const size_t n = end - offset < PRECOPY_BLOCK_SIZE ?
+      end - offset : PRECOPY_BLOCK_SIZE;
+    size_t got = 0;
+
+    while (got < n) {
+      const ssize_t r = skip_pread (job->skip, job->fd,
+                                    buf + got, n - got, offset + got);
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+        set_pool_error (pool, "pread: %s: %m", job->device);
+        return -1;
+      }
+      if (r == 0) {
+        set_pool_error (pool, _("%s: unexpected end of disk"), job->device);
+        return -1;
+      }
+      got += r;
+    }
+    if (job->hashes)
+      job->hashes[offset / PRECOPY_BLOCK_SIZE] = xxh64 (buf, n, 0);
+    if (job->sums)
+      xxh64_update (&state, buf, n);
+    offset += n;
+
+    pthread_mutex_lock (&precopy_lock);
+    pool->done += n;
+    pthread_mutex_unlock (&precopy_lock);
+  }
+
+  if (precopy_cancelled)
+    return 0;
+  if (job->sums)
+    job->sums[extent] = xxh64_digest (&state);
+
+  if (job->segment_left) {
+    pthread_mutex_lock (&precopy_lock);
+    if (--job->segment_left[extent / EXTENTS_PER_SEGMENT] == 0) {
+      pool->segments_done++;
+      pthread_cond_broadcast (&precopy_cond);
+    }
+    pthread_mutex_unlock (&precopy_lock);
+  }
+  return 0;
+}
+
+/* Each thread takes the next extent of any disk until there are none
+ * left, so that all the cores are used even for a single disk.
+ */
+static void *
+block_map_thread (void *poolv)
+{
+  struct block_map_pool *pool = poolv;
+  char *buf;
+
+  buf = malloc (PRECOPY_BLOCK_SIZE);
+  if (buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  while (!precopy_cancelled) {
+    struct block_map_job *job = NULL;
+    uint64_t extent = 0;
+
+    pthread_mutex_lock (&precopy_lock);
+    while (pool->next_job < pool->nr_jobs) {
+      struct block_map_job *j = &pool->jobs[pool->next_job];
+
+      if (j->next_extent < j->nr_extents) {
+        job = j;
+        extent = j->next_extent++;
+        break;
+      }
+      pool->next_job++;
+    }
+    pthread_mutex_unlock (&precopy_lock);
+
+    if (job == NULL || hash_extent (pool, job, extent, buf) == -1)
+      break;
+  }
+
+  free (buf);
+  return NULL;
+}
+
+/* Write a file with a header line (unless C<header> is C<NULL>), then
+ * one hash per line.
+ */
+static int
+write_hash_file (const char *filename, const char *header, uint64_t size,
+                 int unit, const uint64_t *hashes, uint64_t nr)
+{
+  FILE *fp;
+  uint64_t i;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    set_precopy_error ("fopen: %s: %m", filename);
+    return -1;
+  }
+  if (header)
+    fprintf (fp, "%s 1 xxh64 %" PRIu64 " %d\n", header, size, unit);
+  for (i = 0; i < nr; ++i)
+    fprintf (fp, "%016" PRIx64 "\n", hashes[i]);
+  if (fclose (fp) == EOF) {
+    set_precopy_error ("%s: %m", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/* Write each segment of the block maps which has been completely
+ * hashed to F<DIR/NAME.map.K>, in order, and pass it to
+ * C<segment_done>.  Caller must not hold precopy_lock.
+ */
+static int
+emit_segments (struct block_map_pool *pool,
+               int (*segment_done) (size_t disk, uint64_t segment,
+                                    const char *filename, void *opaque),
+               void *opaque)
+{
+  size_t i;
+
+  for (i = 0; i < pool->nr_jobs; ++i) {
+    struct block_map_job *job = &pool->jobs[i];
+
+    for (;;) {
+      const uint64_t k = job->next_segment;
+      const uint64_t first = k * BLOCKS_PER_SEGMENT;
+      CLEANUP_FREE char *filename = NULL;
+      uint64_t n;
+      bool ready;
+
+      pthread_mutex_lock (&precopy_lock);
+      ready = k < job->nr_segments && job->segment_left[k] == 0;
+      pthread_mutex_unlock (&precopy_lock);
+      if (!ready)
+        break;
+
+      n = job->nr_blocks - first;
+      if (n > BLOCKS_PER_SEGMENT)
+        n = BLOCKS_PER_SEGMENT;
+      if (asprintf (&filename, "%s.%" PRIu64, job->map_file, k) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      /* The header goes at the start of the first segment, so that
+       * joining the segments gives the whole block map.
+       */
+      if (write_hash_file (filename, k == 0 ? "p2v-block-map" : NULL,
+                           job->size, PRECOPY_BLOCK_SIZE,
+                           &job->hashes[first], n) == -1)
+        return -1;
+      if (segment_done (i, k, filename, opaque) == -1) {
+        set_precopy_error (_("%s: the block map could not be sent"),
+                           job->device);
+        return -1;
+      }
+      job->next_segment++;
+    }
+  }
+  return 0;
+}
+
+/* Read every disk in C<config-E<gt>disks>, and write its block map
+ * in segments (if C<maps>) and its extent sums (if C<sums>) into
+ * C<dir>.  See C<stream_block_maps> and C<write_extent_sums>.
+ */
+static int
+read_disks (const struct config *config, const char *dir, bool maps, bool sums,
+            int (*segment_done) (size_t disk, uint64_t segment,
+                                 const char *filename, void *opaque),
+            void *opaque, int (*is_cancelled) (void))
+{
+  struct block_map_pool pool = { .nr_jobs = 0 };
+  size_t i, nr_threads, nr_started = 0;
+  pthread_t *threads = NULL;
+  uint64_t total = 0;
+  long ncpus;
+  int ret = -1;
+
+  pool.nr_jobs = guestfs_int_count_strings (config->disks);
+  pool.jobs = calloc (pool.nr_jobs, sizeof (struct block_map_job));
+  if (pool.jobs == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < pool.nr_jobs; ++i)
+    pool.jobs[i].fd = -1;
+
+  precopy_cancelled = false;
+
+  for (i = 0; i < pool.nr_jobs; ++i) {
+    struct block_map_job *job = &pool.jobs[i];
+    CLEANUP_FREE char *name = get_precopy_disk_name (config->disks[i]);
+
+    if (config->disks[i][0] == '/') {
+      job->device = strdup (config->disks[i]);
+      if (job->device == NULL)
+        error (EXIT_FAILURE, errno, "strdup");
+    }
+    else if (asprintf (&job->device, "/dev/%s", config->disks[i]) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (asprintf (&job->map_file, "%s/%s.map", dir, name) == -1 ||
+        asprintf (&job->sums_file, "%s/%s.sums", dir, name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+
+    job->fd = open (job->device, O_RDONLY|O_CLOEXEC);
+    if (job->fd == -1) {
+      set_precopy_error ("open: %s: %m", job->device);
+      goto out;
+    }
+    if (get_disk_size (job->fd, job->device, &job->size) == -1)
+      goto out;
+    /* The NBD server sends these extents as zeroes, so they must be
+     * hashed as zeroes.
+     */
+    job->skip = find_skip_extents (job->device, !config->copy_swap,
+                                   config->exclude_partitions);
+    posix_fadvise (job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    job->nr_blocks =
+      (job->size + PRECOPY_BLOCK_SIZE - 1) / PRECOPY_BLOCK_SIZE;
+    job->nr_extents =
+      (job->size + PRECOPY_EXTENT_SIZE - 1) / PRECOPY_EXTENT_SIZE;
+    if (maps) {
+      job->hashes = calloc (job->nr_blocks + 1, sizeof (uint64_t));
+      if (job->hashes == NULL)
+        error (EXIT_FAILURE, errno, "calloc");
+    }
+    if (maps) {
+      uint64_t j;
+
+      /* An empty disk still has one (empty) segment. */
+      job->nr_segments =
+        (job->nr_extents + EXTENTS_PER_SEGMENT - 1) / EXTENTS_PER_SEGMENT;
+      if (job->nr_segments == 0)
+        job->nr_segments = 1;
+      job->segment_left = calloc (job->nr_segments, sizeof (unsigned));
+      if (job->segment_left == NULL)
+        error (EXIT_FAILURE, errno, "calloc");
+      for (j = 0; j < job->nr_extents; ++j)
+        job->segment_left[j / EXTENTS_PER_SEGMENT]++;
+    }
+    if (sums) {
+      job->sums = calloc (job->nr_extents + 1, sizeof (uint64_t));
+      if (job->sums == NULL)
+        error (EXIT_FAILURE, errno, "calloc");
+    }
+    total += job->size;
+  }
+
+  ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  nr_threads = ncpus > 0 ? ncpus : 1;
+  if (nr_threads > MAX_THREADS)
+    nr_threads = MAX_THREADS;
+  threads = malloc (nr_threads * sizeof (pthread_t));
+  if (threads == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  for (i = 0; i < nr_threads; ++i) {
+    const int err = pthread_create (&threads[i], NULL,
+                                    block_map_thread, &pool);
+    if (err != 0) {
+      errno = err;
+      set_precopy_error ("pthread_create: %m");
+      precopy_cancelled = true;
+      goto out;
+    }
+    nr_started++;
+  }
+
+  /* Pass on the segments of the block maps as they are finished,
+   * until all the extents have been hashed.
+   */
+  for (;;) {
+    struct timespec ts;
+    uint64_t done, segments_done;
+    bool failed;
+
+    pthread_mutex_lock (&precopy_lock);
+    done = pool.done;
+    segments_done = pool.segments_done;
+    failed = pool.error != NULL;
+    pthread_mutex_unlock (&precopy_lock);
+    if (maps && !failed &&
+        emit_segments (&pool, segment_done, opaque) == -1) {
+      set_pool_error (&pool, "%s", get_precopy_error ());
+      break;
+    }
+    if (done >= total || failed)
+      break;
+
+    if (is_cancelled && is_cancelled ()) {
+      precopy_cancelled = true;
+      set_pool_error (&pool, _("cancelled by user"));
+      break;
+    }
+
+    /* Wait until the next report is due, or a segment is finished. */
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += PROGRESS_INTERVAL_MS / 1000;
+    ts.tv_nsec += (PROGRESS_INTERVAL_MS % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock (&precopy_lock);
+    if (pool.segments_done == segments_done && pool.error == NULL)
+      pthread_cond_timedwait (&precopy_cond, &precopy_lock, &ts);
+    pthread_mutex_unlock (&precopy_lock);
+  }
+
+  for (i = 0; i < nr_started; ++i)
+    pthread_join (threads[i], NULL);
+  nr_started = 0;
+
+  if (pool.error) {
+    set_precopy_error ("%s", pool.error);
+    goto out;
+  }
+
+  if (maps && emit_segments (&pool, segment_done, opaque) == -1)
+    goto out;
+  for (i = 0; i < pool.nr_jobs; ++i) {
+    struct block_map_job *job = &pool.jobs[i];
+
+    if (sums &&
+        write_hash_file (job->sums_file, "p2v-extent-sums", job->size,
+                         PRECOPY_EXTENT_SIZE, job->sums,
+                         job->nr_extents) == -1)
+      goto out;
+  }
+  ret = 0;
+
+ out:
+  precopy_cancelled = true;
+  for (i = 0; i < nr_started; ++i)
+    pthread_join (threads[i], NULL);
+  free (threads);
+  for (i = 0; i < pool.nr_jobs; ++i) {
+    struct block_map_job *job = &pool.jobs[i];
+
+    if (job->fd >= 0)
+      close (job->fd);
+    free (job->device);
+    free (job->map_file);
+    free (job->sums_file);
+    free (job->hashes);
+    free (job->sums);
+    free (job->segment_left);
+    free_skip_list (job->skip);
+  }
+  free (pool.jobs);
+  free (pool.error);
+  return ret;
+}
+
+/**
+ * Write the block map of each disk in C<config-E<gt>disks> in
+ * C<PRECOPY_SEGMENT_SIZE> segments, so that the changed blocks can
+ * be copied while the rest of the disk is still being read.  This is
+ * used in the final pass, where nothing else writes to the disks.
+ *
+ * Segment C<K> of disk C<I> is written to F<DIR/NAME.map.K> as soon
+ * as it is complete, and C<segment_done> is called with C<I>, C<K>
+ * and the file name.  The segments of each disk are passed in order.
+ * The first segment starts with the header line of the block map, so
+ * joining the segments gives the whole block map.  If
+ * C<segment_done> returns C<-1>, reading stops.
+ *
+ * If C<sums> is true the extent sums are also written, from the same
+ * reads (see C<write_extent_sums>).
+ *
+ * Returns C<0> on success.  On error this returns C<-1> and the error
+ * can be retrieved using C<get_precopy_error>.
+ */
+int
+stream_block_maps (const struct config *config, const char *dir, bool sums,
+                   int (*segment_done) (size_t disk, uint64_t segment,
+                                        const char *filename, void *opaque),
+                   void *opaque, int (*is_cancelled) (void))
+{
+  return read_disks (config, dir, true, sums, segment_done, opaque,
+                     is_cancelled);
+}
+
+/**
+ * Write the XXH64 hash of each C<PRECOPY_EXTENT_SIZE> extent of each
+ * disk in C<config-E<gt>disks> to F<DIR/NAME.sums>, which is used to
+ * verify what the conversion server received (C<p2v.verify>).  The
+ * file has a header line S<C<p2v-extent-sums 1 xxh64 SIZE EXTENTSIZE>>,
+ * then one hash per extent.
+ *
+ * This is called in a background thread while the disks are being
+ * copied, so that it does not add to the downtime.  The blocks are
+ * left in the page cache, where the NBD server may find them.
+ *
+ * Only one of C<stream_block_maps> and C<write_extent_sums> can run at
+ * a time.
+ *
+ * Returns C<0> on success.  On error this returns C<-1> and the error
+ * can be retrieved using C<get_precopy_error>.
+ */
+int
+write_extent_sums (const struct config *config, const char *dir,
+                   int (*is_cancelled) (void))
+{
+  return read_disks (config, dir, false, true, NULL, NULL, is_cancelled);
+}
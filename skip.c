@@ -0,0 +1,1530 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Find the parts of a disk which do not need to be copied.
+ *
+ * Swap partitions, Linux swap files and the Windows F<pagefile.sys>,
+ * F<hiberfil.sys> and F<swapfile.sys> are often tens of GB, but
+ * nothing in them is of any use to the converted guest.  This reads
+ * the partition table and filesystem metadata of a disk to find
+ * where they are, and returns the list of extents of the disk which
+ * they occupy.  The built-in NBD server (F<nbd-server.c>) then reads
+ * those extents as zeroes and reports them as holes, so they are not
+ * sent at all, and the block maps of warm migration (F<precopy.c>)
+ * hash them as zeroes to match.
+ *
+ * The first C<SKIP_KEEP> bytes of each are always copied, so that the
+ * guest still finds the swap signature (with its UUID and label), and
+ * virt-v2v can still tell whether Windows was hibernated.
+ *
+ * This understands:
+ *
+ * =over 4
+ *
+ * =item *
+ *
+ * MBR (including logical partitions) and GPT partition tables, or a
+ * filesystem on the whole disk.
+ *
+ * =item *
+ *
+ * Linux swap partitions, and swap LVs or swap on RAID 1, if the
+ * volume group or array is active.  Swap which contains a hibernation
+ * image is copied.
+ *
+ * =item *
+ *
+ * F<pagefile.sys>, F<hiberfil.sys> and F<swapfile.sys> in the root
+ * directory of NTFS filesystems which are not marked dirty.
+ *
+ * =item *
+ *
+ * F</swapfile> and F</swap.img> on clean ext4 filesystems, if they
+ * start with a swap signature.
+ *
+ * =back
+ *
+ * Anything else, or anything which looks inconsistent, is copied as
+ * usual.
+ *
+ * The partitions which the user chose not to copy
+ * (C<p2v.exclude_partitions>) are found from the same partition
+ * tables, numbered the way the kernel numbers them, and are skipped
+ * completely.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/dm-ioctl.h>
+
+#if MAJOR_IN_MKDEV
+#include <sys/mkdev.h>
+#elif MAJOR_IN_SYSMACROS
+#include <sys/sysmacros.h>
+/* else it's in sys/types.h, included above */
+#endif
+
+#include "p2v.h"
+
+/* How much of each swap area or file is copied anyway. */
+#define SKIP_KEEP 65536
+
+/* The largest page size which a swap header can be for. */
+#define MAX_SWAP_PAGE 65536
+
+/* Limits on the metadata read, so that a corrupt filesystem cannot
+ * make this take a long time.
+ */
+#define MAX_LOGICAL_PARTITIONS 128
+#define MAX_GPT_ENTRIES 1024
+#define MAX_RUNS 65536
+#define MAX_DIR_SIZE (16 * 1024 * 1024)
+
+struct disk {
+  const char *device;
+  bool swap;                    /* look for swap etc. */
+  char * const *exclude;        /* partitions to exclude, or NULL */
+  int fd;
+  uint64_t size;
+  unsigned sector_size;
+  struct skip_list *list;
+  size_t alloc;
+};
+
+/* An extent of a file, or of a non-resident NTFS attribute.  Extents
+ * which are not allocated (holes) have C<start == -1>.
+ */
+struct run {
+  uint64_t pos;                 /* bytes from the start of the file */
+  uint64_t len;
+  int64_t start;                /* bytes from the start of the partition */
+};
+
+struct runs {
+  struct run *runs;
+  size_t nr;
+};
+
+static void
+free_runs (struct runs *r)
+{
+  free (r->runs);
+  r->runs = NULL;
+  r->nr = 0;
+}
+
+static int
+add_run (struct runs *r, uint64_t pos, uint64_t len, int64_t start)
+{
+  if (r->nr >= MAX_RUNS)
+    return -1;
+  r->runs = realloc (r->runs, (r->nr + 1) * sizeof (struct run));
+  if (r->runs == NULL)
+    error (EXIT_FAILURE, errno, "realloc");
+  r->runs[r->nr].pos = pos;
+  r->runs[r->nr].len = len;
+  r->runs[r->nr].start = start;
+  r->nr++;
+  return 0;
+}
+
+static inline uint16_t
+le16 (const unsigned char *p)
+{
+  uint16_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le16toh (v);
+}
+
+static inline uint32_t
+le32 (const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le32toh (v);
+}
+
+static inline uint64_t
+le64 (const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le64toh (v);
+}
+
+/* Read exactly C<len> bytes at C<offset> on the disk. */
+static int
+read_at (const struct disk *d, void *buf, size_t len, uint64_t offset)
+{
+  char *p = buf;
+
+  if (offset > d->size || len > d->size - offset)
+    return -1;
+  while (len > 0) {
+    const ssize_t r = pread (d->fd, p, len, offset);
+
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    offset += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static void
+add_extent (struct disk *d, uint64_t offset, uint64_t length,
+            const char *what)
+{
+  if (offset >= d->size || length == 0)
+    return;
+  if (length > d->size - offset)
+    length = d->size - offset;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: not copying %s at %" PRIu64 " (%" PRIu64 " bytes)\n",
+           d->device, what, offset, length);
+#endif
+
+  if (d->list->nr_extents >= d->alloc) {
+    d->alloc = d->alloc ? d->alloc * 2 : 16;
+    d->list->extents = realloc (d->list->extents,
+                                d->alloc * sizeof (struct skip_extent));
+    if (d->list->extents == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+  }
+  d->list->extents[d->list->nr_extents].offset = offset;
+  d->list->extents[d->list->nr_extents].length = length;
+  d->list->nr_extents++;
+}
+
+/* Skip the parts of a file after the first C<SKIP_KEEP> bytes.  The
+ * runs must all lie inside the partition at C<start>, C<size>.
+ */
+static void
+skip_runs (struct disk *d, const struct runs *r, uint64_t start,
+           uint64_t size, uint64_t file_size, const char *what)
+{
+  size_t i;
+
+  for (i = 0; i < r->nr; ++i) {
+    const struct run *run = &r->runs[i];
+
+    if (run->start >= 0 &&
+        ((uint64_t) run->start > size || run->len > size - run->start))
+      return;
+  }
+
+  for (i = 0; i < r->nr; ++i) {
+    const struct run *run = &r->runs[i];
+    uint64_t from = run->pos, to = run->pos + run->len;
+
+    if (run->start < 0)
+      continue;
+    if (from < SKIP_KEEP)
+      from = SKIP_KEEP;
+    if (to > file_size)
+      to = file_size;
+    if (from < to)
+      add_extent (d, start + run->start + (from - run->pos), to - from, what);
+  }
+}
+
+/* If there is a Linux swap header at C<offset>, return true.  Swap
+ * which holds a hibernation image has a different signature, and is
+ * not skipped.
+ */
+static bool
+is_swap (const struct disk *d, uint64_t offset, uint64_t size)
+{
+  CLEANUP_FREE unsigned char *buf = NULL;
+  size_t len = size < MAX_SWAP_PAGE ? size : MAX_SWAP_PAGE;
+  size_t page;
+
+  buf = malloc (len);
+  if (buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  if (read_at (d, buf, len, offset) == -1)
+    return false;
+
+  for (page = 4096; page <= len; page *= 2) {
+    if (memcmp (buf + page - 10, "SWAPSPACE2", 10) == 0 ||
+        memcmp (buf + page - 10, "SWAP-SPACE", 10) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*----------------------------------------------------------------------
+ * NTFS.
+ */
+
+#define NTFS_AT_ATTRIBUTE_LIST    0x20
+#define NTFS_AT_FILE_NAME         0x30
+#define NTFS_AT_VOLUME_INFORMATION 0x70
+#define NTFS_AT_DATA              0x80
+#define NTFS_AT_INDEX_ROOT        0x90
+#define NTFS_AT_INDEX_ALLOCATION  0xa0
+#define NTFS_AT_END               0xffffffff
+
+#define NTFS_ATTR_COMPRESSED      0x0001
+#define NTFS_ATTR_ENCRYPTED       0x4000
+
+#define NTFS_RECORD_IN_USE        0x0001
+#define NTFS_RECORD_DIRECTORY     0x0002
+
+#define NTFS_INDEX_ENTRY_LAST     0x0002
+
+#define NTFS_VOLUME_IS_DIRTY      0x0001
+
+#define NTFS_MFT_RECORD           0
+#define NTFS_VOLUME_RECORD        3
+#define NTFS_ROOT_RECORD          5
+
+struct ntfs {
+  struct disk *d;
+  uint64_t start;               /* of the partition */
+  uint64_t size;
+  uint32_t cluster_size;
+  uint32_t record_size;
+  uint32_t index_size;
+  uint64_t mft_offset;          /* of the first records of $MFT */
+  struct runs mft;              /* runs of $MFT */
+};
+
+/* The size of an MFT record or index block from the boot sector: a
+ * number of clusters, or if negative, a power of two.
+ */
+static uint32_t
+ntfs_record_size (int8_t v, uint32_t cluster_size)
+{
+  if (v < 0)
+    return v >= -31 ? UINT32_C(1) << -v : 0;
+  return v * cluster_size;
+}
+
+/* Apply the "update sequence" fixups to a multi-sector record. */
+static int
+ntfs_fixup (unsigned char *rec, size_t len, const char *magic)
+{
+  uint16_t usa_ofs, usa_count, i;
+
+  if (len < 512 || memcmp (rec, magic, 4) != 0)
+    return -1;
+  usa_ofs = le16 (rec + 4);
+  usa_count = le16 (rec + 6);
+  if (usa_count != len / 512 + 1 || usa_ofs + 2 * usa_count > 512)
+    return -1;
+  for (i = 1; i < usa_count; ++i) {
+    unsigned char *end = rec + i * 512 - 2;
+
+    if (memcmp (end, rec + usa_ofs, 2) != 0)
+      return -1;
+    memcpy (end, rec + usa_ofs + 2 * i, 2);
+  }
+  return 0;
+}
+
+/* Read from a non-resident attribute given its runs. */
+static int
+ntfs_read_runs (struct ntfs *fs, const struct runs *r, void *buf,
+                size_t len, uint64_t pos)
+{
+  char *p = buf;
+  size_t i;
+
+  for (i = 0; i < r->nr && len > 0; ++i) {
+    const struct run *run = &r->runs[i];
+    uint64_t n;
+
+    if (pos < run->pos || pos >= run->pos + run->len)
+      continue;
+    n = run->pos + run->len - pos;
+    if (n > len)
+      n = len;
+    if (run->start < 0)
+      memset (p, 0, n);
+    else if ((uint64_t) run->start + (pos - run->pos) + n > fs->size ||
+             read_at (fs->d, p, n,
+                      fs->start + run->start + (pos - run->pos)) == -1)
+      return -1;
+    p += n;
+    pos += n;
+    len -= n;
+  }
+  return len == 0 ? 0 : -1;
+}
+
+/* Decode the mapping pairs of a non-resident attribute. */
+static int
+ntfs_decode_runs (struct ntfs *fs, const unsigned char *attr, size_t attr_len,
+                  struct runs *r)
+{
+  const unsigned char *p, *end = attr + attr_len;
+  uint64_t vcn;
+  int64_t lcn = 0;
+
+  if (attr_len < 64)
+    return -1;
+  vcn = le64 (attr + 16);
+  p = attr + le16 (attr + 32);
+  if (p >= end)
+    return -1;
+
+  while (p < end && *p != 0) {
+    const unsigned len_size = *p & 0xf, lcn_size = *p >> 4;
+    uint64_t len = 0;
+    int64_t delta = 0;
+    unsigned i;
+
+    if (len_size == 0 || len_size > 8 || lcn_size > 8 ||
+        p + 1 + len_size + lcn_size > end)
+      return -1;
+    for (i = 0; i < len_size; ++i)
+      len |= (uint64_t) p[1 + i] << (8 * i);
+    for (i = 0; i < lcn_size; ++i)
+      delta |= (uint64_t) p[1 + len_size + i] << (8 * i);
+    if (lcn_size > 0 && lcn_size < 8 &&
+        (p[len_size + lcn_size] & 0x80))
+      delta -= (int64_t) 1 << (8 * lcn_size); /* sign extend */
+    p += 1 + len_size + lcn_size;
+
+    if (len == 0 || len > fs->size / fs->cluster_size)
+      return -1;
+    if (lcn_size == 0) {        /* sparse */
+      if (add_run (r, vcn * fs->cluster_size, len * fs->cluster_size,
+                   -1) == -1)
+        return -1;
+    }
+    else {
+      lcn += delta;
+      if (lcn < 0 ||
+          add_run (r, vcn * fs->cluster_size, len * fs->cluster_size,
+                   lcn * fs->cluster_size) == -1)
+        return -1;
+    }
+    vcn += len;
+  }
+  return 0;
+}
+
+/* Read MFT record C<nr> into C<rec> (C<fs-E<gt>record_size> bytes). */
+static int
+ntfs_read_record (struct ntfs *fs, uint64_t nr, unsigned char *rec)
+{
+  int r;
+
+  if (fs->mft.nr == 0)          /* reading the record of $MFT itself */
+    r = read_at (fs->d, rec, fs->record_size,
+                 fs->start + fs->mft_offset + nr * fs->record_size);
+  else
+    r = ntfs_read_runs (fs, &fs->mft, rec, fs->record_size,
+                        nr * fs->record_size);
+  if (r == -1 || ntfs_fixup (rec, fs->record_size, "FILE") == -1)
+    return -1;
+  if (!(le16 (rec + 0x16) & NTFS_RECORD_IN_USE))
+    return -1;
+  return 0;
+}
+
+/* Find the first attribute of C<type> and name length C<name_len>. */
+static const unsigned char *
+ntfs_find_attr (const struct ntfs *fs, const unsigned char *rec,
+                uint32_t type, unsigned name_len, uint32_t *len_rtn)
+{
+  uint32_t pos = le16 (rec + 0x14);
+
+  while (pos + 16 <= fs->record_size) {
+    const unsigned char *attr = rec + pos;
+    const uint32_t atype = le32 (attr), len = le32 (attr + 4);
+
+    if (atype == NTFS_AT_END || len < 16 || pos + len > fs->record_size)
+      return NULL;
+    if (atype == type && attr[9] == name_len) {
+      *len_rtn = len;
+      return attr;
+    }
+    pos += len;
+  }
+  return NULL;
+}
+
+/* Return the value of a resident attribute. */
+static const unsigned char *
+ntfs_resident_value (const unsigned char *attr, uint32_t attr_len,
+                     uint32_t *len_rtn)
+{
+  uint32_t len, ofs;
+
+  if (attr[8] != 0 || attr_len < 24)
+    return NULL;
+  len = le32 (attr + 16);
+  ofs = le16 (attr + 20);
+  if (ofs > attr_len || len > attr_len - ofs)
+    return NULL;
+  *len_rtn = len;
+  return attr + ofs;
+}
+
+/* Is the name in an index entry key (a $FILE_NAME) C<name>? */
+static bool
+ntfs_name_is (const unsigned char *key, size_t key_len, const char *name)
+{
+  const size_t n = strlen (name);
+  size_t i;
+
+  if (key_len < 0x42 || key[0x40] != n || key_len < 0x42 + 2 * n)
+    return false;
+  for (i = 0; i < n; ++i) {
+    const uint16_t c = le16 (key + 0x42 + 2 * i);
+
+    if (c > 0x7f || tolower (c) != name[i])
+      return false;
+  }
+  return true;
+}
+
+static const char *ntfs_skip_files[] = {
+  "pagefile.sys", "hiberfil.sys", "swapfile.sys", NULL
+};
+
+/* Skip the unnamed $DATA attribute of MFT record C<ref>. */
+static void
+ntfs_skip_file (struct ntfs *fs, uint64_t ref, const char *name)
+{
+  CLEANUP_FREE unsigned char *rec = malloc (fs->record_size);
+  const unsigned char *attr;
+  uint32_t attr_len;
+  struct runs r = { .nr = 0 };
+
+  if (rec == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  if (ntfs_read_record (fs, ref & UINT64_C(0xffffffffffff), rec) == -1)
+    return;
+
+  /* The index entry may be stale, so check it is the same file. */
+  if (le16 (rec + 0x10) != ref >> 48 ||
+      (le16 (rec + 0x16) & NTFS_RECORD_DIRECTORY))
+    return;
+
+  /* The $DATA of a very fragmented file may be spread over several
+   * MFT records, which is not handled.
+   */
+  if (ntfs_find_attr (fs, rec, NTFS_AT_ATTRIBUTE_LIST, 0, &attr_len))
+    return;
+  attr = ntfs_find_attr (fs, rec, NTFS_AT_DATA, 0, &attr_len);
+  if (attr == NULL || attr[8] == 0 || attr_len < 64 ||
+      (le16 (attr + 12) & (NTFS_ATTR_COMPRESSED|NTFS_ATTR_ENCRYPTED)) ||
+      le64 (attr + 16) != 0)
+    return;
+
+  if (ntfs_decode_runs (fs, attr, attr_len, &r) == 0)
+    skip_runs (fs->d, &r, fs->start, fs->size, le64 (attr + 40), name);
+  free_runs (&r);
+}
+
+/* Look through the index entries in C<buf> for the files to skip. */
+static void
+ntfs_scan_index (struct ntfs *fs, const unsigned char *buf, size_t len)
+{
+  uint32_t pos, end;
+
+  if (len < 16)
+    return;
+  pos = le32 (buf);
+  end = le32 (buf + 4);
+  if (end > len)
+    end = len;
+
+  while (pos + 16 <= end) {
+    const unsigned char *e = buf + pos;
+    const uint16_t elen = le16 (e + 8), klen = le16 (e + 10);
+    size_t i;
+
+    if (le16 (e + 12) & NTFS_INDEX_ENTRY_LAST)
+      break;
+    if (elen < 16 || pos + elen > end || 16 + klen > elen)
+      break;
+    for (i = 0; ntfs_skip_files[i] != NULL; ++i) {
+      if (ntfs_name_is (e + 16, klen, ntfs_skip_files[i]) &&
+          (le64 (e + 16) & UINT64_C(0xffffffffffff)) == NTFS_ROOT_RECORD)
+        ntfs_skip_file (fs, le64 (e), ntfs_skip_files[i]);
+    }
+    pos += elen;
+  }
+}
+
+/* Is the dirty bit set in $Volume? */
+static bool
+ntfs_is_dirty (struct ntfs *fs, unsigned char *rec)
+{
+  const unsigned char *attr, *value;
+  uint32_t attr_len, len;
+
+  if (ntfs_read_record (fs, NTFS_VOLUME_RECORD, rec) == -1)
+    return true;
+  attr = ntfs_find_attr (fs, rec, NTFS_AT_VOLUME_INFORMATION, 0, &attr_len);
+  if (attr == NULL)
+    return true;
+  value = ntfs_resident_value (attr, attr_len, &len);
+  if (value == NULL || len < 12)
+    return true;
+  return (le16 (value + 10) & NTFS_VOLUME_IS_DIRTY) != 0;
+}
+
+static void
+find_ntfs_files (struct disk *d, uint64_t start, uint64_t size,
+                 const unsigned char *boot)
+{
+  struct ntfs fs = { .d = d, .start = start, .size = size };
+  CLEANUP_FREE unsigned char *rec = NULL, *indx = NULL;
+  const unsigned char *attr, *value;
+  uint32_t attr_len, len, sector_size, spc;
+  struct runs r = { .nr = 0 };
+  uint64_t pos, alloc_size;
+
+  sector_size = le16 (boot + 0x0b);
+  spc = boot[0x0d];
+  if (spc > 0x80)
+    spc = spc <= 0xe0 ? UINT32_C(1) << (256 - spc) : 0;
+  fs.cluster_size = sector_size * spc;
+  if (sector_size < 256 || sector_size > 4096 ||
+      (sector_size & (sector_size - 1)) != 0 || spc == 0 ||
+      fs.cluster_size > 2 * 1024 * 1024)
+    return;
+  fs.record_size = ntfs_record_size (boot[0x40], fs.cluster_size);
+  fs.index_size = ntfs_record_size (boot[0x44], fs.cluster_size);
+  if (fs.record_size < 1024 || fs.record_size > 65536 ||
+      fs.index_size < 512 || fs.index_size > 65536)
+    return;
+
+  rec = malloc (fs.record_size);
+  if (rec == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  /* Find the runs of $MFT itself, from its first record. */
+  fs.mft_offset = le64 (boot + 0x30) * fs.cluster_size;
+  if (fs.mft_offset > size ||
+      ntfs_read_record (&fs, NTFS_MFT_RECORD, rec) == -1)
+    return;
+  attr = ntfs_find_attr (&fs, rec, NTFS_AT_DATA, 0, &attr_len);
+  if (attr == NULL || attr[8] == 0 ||
+      ntfs_decode_runs (&fs, attr, attr_len, &fs.mft) == -1 ||
+      fs.mft.nr == 0)
+    goto out;
+
+  /* If the volume is dirty the MFT may not be up to date. */
+  if (ntfs_is_dirty (&fs, rec))
+    goto out;
+
+  /* The root directory is an index: small ones fit in $INDEX_ROOT,
+   * larger ones have index blocks in $INDEX_ALLOCATION.  All the
+   * blocks are scanned, without following the B-tree, since the
+   * entries found are checked against the MFT anyway.
+   */
+  if (ntfs_read_record (&fs, NTFS_ROOT_RECORD, rec) == -1)
+    goto out;
+  attr = ntfs_find_attr (&fs, rec, NTFS_AT_INDEX_ROOT, 4, &attr_len);
+  if (attr == NULL)
+    goto out;
+  value = ntfs_resident_value (attr, attr_len, &len);
+  if (value == NULL || len < 32)
+    goto out;
+  ntfs_scan_index (&fs, value + 16, len - 16);
+
+  attr = ntfs_find_attr (&fs, rec, NTFS_AT_INDEX_ALLOCATION, 4, &attr_len);
+  if (attr == NULL || attr[8] == 0 || attr_len < 64 ||
+      ntfs_decode_runs (&fs, attr, attr_len, &r) == -1)
+    goto out;
+  alloc_size = le64 (attr + 40);
+  if (alloc_size > MAX_DIR_SIZE)
+    goto out;
+
+  indx = malloc (fs.index_size);
+  if (indx == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  for (pos = 0; pos + fs.index_size <= alloc_size; pos += fs.index_size) {
+    if (ntfs_read_runs (&fs, &r, indx, fs.index_size, pos) == 0 &&
+        ntfs_fixup (indx, fs.index_size, "INDX") == 0)
+      ntfs_scan_index (&fs, indx + 0x18, fs.index_size - 0x18);
+  }
+
+ out:
+  free_runs (&r);
+  free_runs (&fs.mft);
+}
+
+/*----------------------------------------------------------------------
+ * ext4.
+ */
+
+#define EXT2_SUPER_MAGIC          0xef53
+#define EXT2_VALID_FS             0x0001
+#define EXT3_FEATURE_INCOMPAT_RECOVER 0x0004
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT   0x0080
+#define EXT4_EXTENTS_FL           0x00080000
+#define EXT4_INLINE_DATA_FL       0x10000000
+#define EXT4_EXT_MAGIC            0xf30a
+#define EXT4_MAX_DEPTH            5
+#define EXT2_ROOT_INO             2
+#define S_IFMT_EXT                0170000
+#define S_IFREG_EXT               0100000
+#define S_IFDIR_EXT               0040000
+
+struct ext4 {
+  struct disk *d;
+  uint64_t start;               /* of the partition */
+  uint64_t size;
+  uint32_t block_size;
+  uint32_t inodes_per_group;
+  uint32_t inode_size;
+  uint32_t desc_size;
+  uint64_t desc_block;          /* of the group descriptor table */
+  uint32_t nr_inodes;
+  bool is_64bit;
+};
+
+struct ext4_inode {
+  uint16_t mode;
+  uint64_t size;
+  struct runs runs;
+};
+
+/* Add the extents in an extent tree node (the inode's C<i_block>, or
+ * a block of the tree) to C<r>.
+ */
+static int
+ext4_walk_extents (struct ext4 *fs, const unsigned char *node, size_t len,
+                   struct runs *r)
+{
+  uint16_t entries, i;
+
+  if (len < 12 || le16 (node) != EXT4_EXT_MAGIC ||
+      le16 (node + 6) > EXT4_MAX_DEPTH)
+    return -1;
+  entries = le16 (node + 2);
+  if (12 + (size_t) entries * 12 > len)
+    return -1;
+
+  for (i = 0; i < entries; ++i) {
+    const unsigned char *e = node + 12 + i * 12;
+
+    if (le16 (node + 6) == 0) { /* leaf */
+      uint32_t elen = le16 (e + 4);
+      const uint64_t pblk = ((uint64_t) le16 (e + 6) << 32) | le32 (e + 8);
+
+      if (elen > 32768)         /* unwritten extent */
+        elen -= 32768;
+      if (add_run (r, (uint64_t) le32 (e) * fs->block_size,
+                   (uint64_t) elen * fs->block_size,
+                   pblk * fs->block_size) == -1)
+        return -1;
+    }
+    else {                      /* index */
+      CLEANUP_FREE unsigned char *child = malloc (fs->block_size);
+      const uint64_t leaf = ((uint64_t) le16 (e + 8) << 32) | le32 (e + 4);
+
+      if (child == NULL)
+        error (EXIT_FAILURE, errno, "malloc");
+      if (leaf * fs->block_size + fs->block_size > fs->size ||
+          read_at (fs->d, child, fs->block_size,
+                   fs->start + leaf * fs->block_size) == -1 ||
+          le16 (child + 6) + 1 != le16 (node + 6) ||
+          ext4_walk_extents (fs, child, fs->block_size, r) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static int
+ext4_read_inode (struct ext4 *fs, uint32_t ino, struct ext4_inode *inode)
+{
+  unsigned char gd[64], raw[128];
+  uint32_t group, index;
+  uint64_t table;
+
+  if (ino == 0 || ino > fs->nr_inodes)
+    return -1;
+  group = (ino - 1) / fs->inodes_per_group;
+  index = (ino - 1) % fs->inodes_per_group;
+
+  if (read_at (fs->d, gd, fs->desc_size,
+               fs->start + fs->desc_block * fs->block_size +
+               (uint64_t) group * fs->desc_size) == -1)
+    return -1;
+  table = le32 (gd + 8);
+  if (fs->is_64bit && fs->desc_size >= 64)
+    table |= (uint64_t) le32 (gd + 0x28) << 32;
+
+  if (table * fs->block_size > fs->size ||
+      read_at (fs->d, raw, sizeof raw,
+               fs->start + table * fs->block_size +
+               (uint64_t) index * fs->inode_size) == -1)
+    return -1;
+
+  inode->mode = le16 (raw);
+  inode->size = le32 (raw + 4) | ((uint64_t) le32 (raw + 108) << 32);
+  inode->runs.runs = NULL;
+  inode->runs.nr = 0;
+
+  if ((le32 (raw + 32) & (EXT4_EXTENTS_FL|EXT4_INLINE_DATA_FL)) !=
+      EXT4_EXTENTS_FL)
+    return -1;
+  if (ext4_walk_extents (fs, raw + 40, 60, &inode->runs) == -1) {
+    free_runs (&inode->runs);
+    return -1;
+  }
+  return 0;
+}
+
+/* Read the start of an ext4 file, which must be allocated. */
+static int
+ext4_read_file (struct ext4 *fs, const struct ext4_inode *inode,
+                void *buf, size_t len)
+{
+  char *p = buf;
+  uint64_t pos = 0;
+  size_t i;
+
+  for (i = 0; i < inode->runs.nr && pos < len; ++i) {
+    const struct run *run = &inode->runs.runs[i];
+    uint64_t n;
+
+    if (run->pos != pos)
+      return -1;
+    n = run->len < len - pos ? run->len : len - pos;
+    if (run->start + n > fs->size ||
+        read_at (fs->d, p + pos, n, fs->start + run->start) == -1)
+      return -1;
+    pos += n;
+  }
+  return pos == len ? 0 : -1;
+}
+
+static const char *ext4_swap_files[] = { "swapfile", "swap.img", NULL };
+
+static void
+ext4_skip_file (struct ext4 *fs, uint32_t ino, const char *name)
+{
+  struct ext4_inode inode;
+  CLEANUP_FREE unsigned char *buf = NULL;
+
+  if (ext4_read_inode (fs, ino, &inode) == -1)
+    return;
+  if ((inode.mode & S_IFMT_EXT) != S_IFREG_EXT ||
+      inode.size < 2 * MAX_SWAP_PAGE)
+    goto out;
+
+  /* Check it really is a swap file. */
+  buf = malloc (MAX_SWAP_PAGE);
+  if (buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  if (ext4_read_file (fs, &inode, buf, MAX_SWAP_PAGE) == -1)
+    goto out;
+  {
+    size_t page;
+    bool found = false;
+
+    for (page = 4096; page <= MAX_SWAP_PAGE; page *= 2)
+      if (memcmp (buf + page - 10, "SWAPSPACE2", 10) == 0)
+        found = true;
+    if (!found)
+      goto out;
+  }
+
+  skip_runs (fs->d, &inode.runs, fs->start, fs->size, inode.size, name);
+ out:
+  free_runs (&inode.runs);
+}
+
+static void
+find_ext4_files (struct disk *d, uint64_t start, uint64_t size,
+                 const unsigned char *sb)
+{
+  struct ext4 fs = { .d = d, .start = start, .size = size };
+  struct ext4_inode root;
+  CLEANUP_FREE unsigned char *block = NULL;
+  uint32_t incompat, log_block_size;
+  size_t i;
+
+  incompat = le32 (sb + 96);
+  log_block_size = le32 (sb + 24);
+  if (log_block_size > 6)
+    return;
+  fs.block_size = UINT32_C(1024) << log_block_size;
+  fs.inodes_per_group = le32 (sb + 40);
+  fs.nr_inodes = le32 (sb);
+  fs.inode_size = le32 (sb + 76) >= 1 ? le16 (sb + 88) : 128;
+  fs.is_64bit = (incompat & EXT4_FEATURE_INCOMPAT_64BIT) != 0;
+  fs.desc_size = fs.is_64bit ? le16 (sb + 254) : 32;
+  fs.desc_block = le32 (sb + 20) + 1;
+
+  /* Only clean filesystems, so that the metadata is up to date. */
+  if (!(le16 (sb + 58) & EXT2_VALID_FS) ||
+      (incompat & (EXT3_FEATURE_INCOMPAT_RECOVER |
+                   EXT4_FEATURE_INCOMPAT_META_BG)))
+    return;
+  if (fs.inodes_per_group == 0 || fs.inode_size < 128 ||
+      fs.desc_size < 32 || fs.desc_size > 64)
+    return;
+
+  if (ext4_read_inode (&fs, EXT2_ROOT_INO, &root) == -1)
+    return;
+  if ((root.mode & S_IFMT_EXT) != S_IFDIR_EXT || root.size > MAX_DIR_SIZE)
+    goto out;
+
+  block = malloc (fs.block_size);
+  if (block == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  /* The blocks of an indexed directory still hold ordinary
+   * directory entries, so they can all be scanned in order.
+   */
+  for (i = 0; i < root.runs.nr; ++i) {
+    const struct run *run = &root.runs.runs[i];
+    uint64_t b;
+
+    for (b = 0; b < run->len && run->pos + b < root.size;
+         b += fs.block_size) {
+      uint32_t pos = 0;
+
+      if (run->start + b + fs.block_size > size ||
+          read_at (d, block, fs.block_size, start + run->start + b) == -1)
+        goto out;
+
+      while (pos + 8 <= fs.block_size) {
+        const unsigned char *de = block + pos;
+        const uint32_t ino = le32 (de);
+        const uint16_t rec_len = le16 (de + 4);
+        const uint8_t name_len = de[6];
+        size_t j;
+
+        if (rec_len < 8 || pos + rec_len > fs.block_size ||
+            8 + name_len > rec_len)
+          break;
+        for (j = 0; ino != 0 && ext4_swap_files[j] != NULL; ++j) {
+          if (name_len == strlen (ext4_swap_files[j]) &&
+              memcmp (de + 8, ext4_swap_files[j], name_len) == 0)
+            ext4_skip_file (&fs, ino, ext4_swap_files[j]);
+        }
+        pos += rec_len;
+      }
+    }
+  }
+
+ out:
+  free_runs (&root.runs);
+}
+
+/*----------------------------------------------------------------------
+ * Partitions.
+ */
+
+/* Is partition number C<nr> of the disk in C<d-E<gt>exclude>?
+ * Partitions are named as the kernel names them, eg. F<sda3> or
+ * F<nvme0n1p3>, with or without a directory, so that F<disk.img3> is
+ * the third partition of an image file.
+ */
+static bool
+is_excluded (const struct disk *d, unsigned nr)
+{
+  const char *disk = strrchr (d->device, '/');
+  const size_t len = strlen (disk ? ++disk : (disk = d->device));
+  CLEANUP_FREE char *name = NULL;
+  size_t i;
+
+  if (d->exclude == NULL || nr == 0)
+    return false;
+  if (asprintf (&name, "%s%s%u", disk,
+                len > 0 && g_ascii_isdigit (disk[len-1]) ? "p" : "", nr) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  for (i = 0; d->exclude[i] != NULL; ++i) {
+    const char *p = strrchr (d->exclude[i], '/');
+
+    if (STREQ (p ? p + 1 : d->exclude[i], name))
+      return true;
+  }
+  return false;
+}
+
+/* Look for things to skip in partition number C<nr> (or C<0> for the
+ * whole disk) at C<start>, C<size>.  Returns true if it contains
+ * something which was recognised.
+ */
+static bool
+probe_partition (struct disk *d, unsigned nr, uint64_t start, uint64_t size)
+{
+  unsigned char buf[2048];
+
+  if (is_excluded (d, nr)) {
+    if (start < d->size) {
+      const uint64_t len = size < d->size - start ? size : d->size - start;
+
+      add_extent (d, start, len, "excluded partition");
+      d->list->excluded += len;
+    }
+    return true;
+  }
+
+  if (!d->swap || size < sizeof buf ||
+      read_at (d, buf, sizeof buf, start) == -1)
+    return false;
+
+  if (is_swap (d, start, size)) {
+    if (size > SKIP_KEEP)
+      add_extent (d, start + SKIP_KEEP, size - SKIP_KEEP, "swap partition");
+    return true;
+  }
+  if (memcmp (buf + 3, "NTFS    ", 8) == 0) {
+    find_ntfs_files (d, start, size, buf);
+    return true;
+  }
+  if (le16 (buf + 1024 + 56) == EXT2_SUPER_MAGIC) {
+    find_ext4_files (d, start, size, buf + 1024);
+    return true;
+  }
+  return false;
+}
+
+static void
+probe_gpt (struct disk *d)
+{
+  unsigned char hdr[512];
+  CLEANUP_FREE unsigned char *entries = NULL;
+  uint64_t entries_lba;
+  uint32_t nr_entries, entry_size, i;
+  static const unsigned char unused[16];
+
+  /* The header is in the second sector, which for an image file
+   * (where the sector size is not known) may be 512 or 4096 bytes.
+   */
+  if (read_at (d, hdr, sizeof hdr, d->sector_size) == -1 ||
+      memcmp (hdr, "EFI PART", 8) != 0) {
+    if (d->sector_size != 512 ||
+        read_at (d, hdr, sizeof hdr, 4096) == -1 ||
+        memcmp (hdr, "EFI PART", 8) != 0)
+      return;
+    d->sector_size = 4096;
+  }
+
+  entries_lba = le64 (hdr + 72);
+  nr_entries = le32 (hdr + 80);
+  entry_size = le32 (hdr + 84);
+  if (nr_entries > MAX_GPT_ENTRIES || entry_size < 128 || entry_size > 4096)
+    return;
+
+  entries = malloc ((size_t) nr_entries * entry_size);
+  if (entries == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  if (read_at (d, entries, (size_t) nr_entries * entry_size,
+               entries_lba * d->sector_size) == -1)
+    return;
+
+  for (i = 0; i < nr_entries; ++i) {
+    const unsigned char *e = entries + (size_t) i * entry_size;
+    const uint64_t first = le64 (e + 32), last = le64 (e + 40);
+
+    if (memcmp (e, unused, 16) == 0 || last < first ||
+        last >= d->size / d->sector_size)
+      continue;
+    probe_partition (d, i + 1, first * d->sector_size,
+                     (last - first + 1) * d->sector_size);
+  }
+}
+
+static bool
+is_extended (uint8_t type)
+{
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static void
+probe_mbr (struct disk *d, const unsigned char *mbr)
+{
+  size_t i;
+  unsigned logical = 5;         /* numbered like the kernel does */
+
+  for (i = 0; i < 4; ++i) {
+    const unsigned char *e = mbr + 446 + i * 16;
+
+    if (e[4] == 0xee) {
+      probe_gpt (d);
+      return;
+    }
+  }
+
+  for (i = 0; i < 4; ++i) {
+    const unsigned char *e = mbr + 446 + i * 16;
+    const uint8_t type = e[4];
+    const uint64_t first = le32 (e + 8), count = le32 (e + 12);
+
+    if (type == 0 || count == 0)
+      continue;
+    if (is_extended (type)) {
+      /* Follow the chain of extended boot records.  The logical
+       * partition in each is relative to that EBR, and the link to
+       * the next EBR is relative to the start of the extended
+       * partition.
+       */
+      uint64_t ebr = first;
+      size_t n;
+
+      for (n = 0; n < MAX_LOGICAL_PARTITIONS; ++n) {
+        unsigned char buf[512];
+        uint64_t next;
+
+        if (read_at (d, buf, sizeof buf, ebr * d->sector_size) == -1 ||
+            buf[510] != 0x55 || buf[511] != 0xaa)
+          break;
+        if (!is_extended (buf[446 + 4]) && le32 (buf + 446 + 12) != 0)
+          probe_partition (d, logical++,
+                           (ebr + le32 (buf + 446 + 8)) * d->sector_size,
+                           (uint64_t) le32 (buf + 446 + 12) * d->sector_size);
+        next = le32 (buf + 462 + 8);
+        if (!is_extended (buf[462 + 4]) || next == 0)
+          break;
+        ebr = first + next;
+      }
+    }
+    else
+      probe_partition (d, i + 1,
+                       first * d->sector_size, count * d->sector_size);
+  }
+}
+
+/*----------------------------------------------------------------------
+ * Swap on LVM and RAID 1.
+ */
+
+/* A segment of a device-mapper or md device, mapped to the disk. */
+struct segment {
+  uint64_t start;               /* bytes from the start of the holder */
+  uint64_t len;
+  uint64_t disk_offset;         /* bytes from the start of the disk */
+};
+
+#define MAX_SEGMENTS 64
+
+static FILE *open_sysfs (const char *fs, ...)
+  __attribute__((format(printf,1,2)));
+
+static FILE *
+open_sysfs (const char *fs, ...)
+{
+  va_list args;
+  CLEANUP_FREE char *path = NULL;
+
+  va_start (args, fs);
+  if (vasprintf (&path, fs, args) == -1)
+    error (EXIT_FAILURE, errno, "vasprintf");
+  va_end (args);
+
+  return fopen (path, "r");
+}
+
+/* If C<dev> is the disk or one of its partitions, return the offset
+ * of it on the disk in C<*offset>.
+ */
+static bool
+on_disk (const char *disk, dev_t disk_dev, dev_t dev, uint64_t *offset)
+{
+  CLEANUP_FREE char *path = NULL, *real = NULL;
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  const size_t len = strlen (disk);
+  char *p;
+
+  if (dev == disk_dev) {
+    *offset = 0;
+    return true;
+  }
+
+  /* A partition is F</sys/devices/.../block/DISK/PARTITION>. */
+  if (asprintf (&path, "/sys/dev/block/%ju:%ju",
+                (uintmax_t) major (dev), (uintmax_t) minor (dev)) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  real = realpath (path, NULL);
+  if (real == NULL)
+    return false;
+  p = strrchr (real, '/');
+  if (p == NULL || (size_t) (p - real) < len + 1 ||
+      p[-len-1] != '/' || strncmp (p - len, disk, len) != 0)
+    return false;
+
+  fp = open_sysfs ("%s/start", real);
+  if (fp == NULL || fscanf (fp, "%" SCNu64, offset) != 1)
+    return false;
+  *offset *= 512;
+  return true;
+}
+
+/* Get the linear segments of a device-mapper device which are on the
+ * disk, using the C<DM_TABLE_STATUS> ioctl.
+ */
+static size_t
+get_dm_segments (const char *disk, dev_t disk_dev, dev_t dm_dev,
+                 struct segment *segs)
+{
+  CLEANUP_FREE char *buf = NULL;
+  size_t size = 16384, n = 0;
+  struct dm_ioctl *io;
+  uint32_t i, pos;
+  int fd, r;
+
+  fd = open ("/dev/mapper/control", O_RDWR|O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  for (;;) {
+    buf = realloc (buf, size);
+    if (buf == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    memset (buf, 0, size);
+    io = (struct dm_ioctl *) buf;
+    io->version[0] = DM_VERSION_MAJOR;
+    io->data_size = size;
+    io->data_start = sizeof *io;
+    io->dev = dm_dev;
+    io->flags = DM_STATUS_TABLE_FLAG;
+    r = ioctl (fd, DM_TABLE_STATUS, io);
+    if (r == -1 || !(io->flags & DM_BUFFER_FULL_FLAG) || size >= 1024 * 1024)
+      break;
+    size *= 2;
+  }
+  close (fd);
+  if (r == -1 || (io->flags & DM_BUFFER_FULL_FLAG))
+    return 0;
+
+  /* The C<next> field of each target is relative to the first. */
+  pos = io->data_start;
+  for (i = 0; i < io->target_count && n < MAX_SEGMENTS; ++i) {
+    const struct dm_target_spec *spec;
+    unsigned maj, min;
+    uint64_t sector, offset;
+
+    if (pos + sizeof *spec >= io->data_size)
+      break;
+    spec = (const struct dm_target_spec *) (buf + pos);
+    if (STREQ (spec->target_type, "linear") &&
+        sscanf ((const char *) (spec + 1), "%u:%u %" SCNu64,
+                &maj, &min, &sector) == 3 &&
+        on_disk (disk, disk_dev, makedev (maj, min), &offset)) {
+      segs[n].start = spec->sector_start * 512;
+      segs[n].len = spec->length * 512;
+      segs[n].disk_offset = offset + sector * 512;
+      n++;
+    }
+    if (spec->next == 0)
+      break;
+    pos = io->data_start + spec->next;
+  }
+  return n;
+}
+
+/* Get the members of a RAID 1 array which are on the disk.  Each
+ * member holds the whole array, starting at its data offset.
+ */
+static size_t
+get_md_segments (const char *disk, dev_t disk_dev, const char *md,
+                 uint64_t md_size, struct segment *segs)
+{
+  CLEANUP_FREE char *path = NULL;
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  char level[16];
+  DIR *dir;
+  struct dirent *ent;
+  size_t n = 0;
+
+  fp = open_sysfs ("/sys/block/%s/md/level", md);
+  if (fp == NULL || fscanf (fp, "%15s", level) != 1 || STRNEQ (level, "raid1"))
+    return 0;
+
+  if (asprintf (&path, "/sys/block/%s/md", md) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  dir = opendir (path);
+  if (dir == NULL)
+    return 0;
+  while ((ent = readdir (dir)) != NULL && n < MAX_SEGMENTS) {
+    CLEANUP_FCLOSE FILE *dev_fp = NULL, *offset_fp = NULL;
+    unsigned maj, min;
+    uint64_t part_offset, data_offset;
+
+    if (!STRPREFIX (ent->d_name, "dev-"))
+      continue;
+    dev_fp = open_sysfs ("%s/%s/block/dev", path, ent->d_name);
+    offset_fp = open_sysfs ("%s/%s/offset", path, ent->d_name);
+    if (dev_fp == NULL || fscanf (dev_fp, "%u:%u", &maj, &min) != 2 ||
+        offset_fp == NULL ||
+        fscanf (offset_fp, "%" SCNu64, &data_offset) != 1 ||
+        !on_disk (disk, disk_dev, makedev (maj, min), &part_offset))
+      continue;
+    segs[n].start = 0;
+    segs[n].len = md_size;
+    segs[n].disk_offset = part_offset + data_offset * 512;
+    n++;
+  }
+  closedir (dir);
+  return n;
+}
+
+/* Look for swap on the LVs and RAID 1 arrays which are on the disk.
+ * Only active LVs and assembled arrays are seen, since they are
+ * found in F</sys/block>.
+ */
+static void
+probe_holders (struct disk *d, const char *disk, dev_t disk_dev)
+{
+  DIR *dir;
+  struct dirent *ent;
+
+  dir = opendir ("/sys/block");
+  if (dir == NULL)
+    return;
+  while ((ent = readdir (dir)) != NULL) {
+    CLEANUP_FCLOSE FILE *dev_fp = NULL, *size_fp = NULL;
+    CLEANUP_FREE char *path = NULL;
+    struct segment segs[MAX_SEGMENTS];
+    struct disk holder = { .sector_size = 512 };
+    unsigned maj, min;
+    uint64_t sectors;
+    size_t i, n;
+    bool swap;
+
+    if (!STRPREFIX (ent->d_name, "dm-") && !STRPREFIX (ent->d_name, "md"))
+      continue;
+    dev_fp = open_sysfs ("/sys/block/%s/dev", ent->d_name);
+    size_fp = open_sysfs ("/sys/block/%s/size", ent->d_name);
+    if (dev_fp == NULL || fscanf (dev_fp, "%u:%u", &maj, &min) != 2 ||
+        size_fp == NULL || fscanf (size_fp, "%" SCNu64, &sectors) != 1)
+      continue;
+    holder.size = sectors * 512;
+
+    if (STRPREFIX (ent->d_name, "dm-"))
+      n = get_dm_segments (disk, disk_dev, makedev (maj, min), segs);
+    else
+      n = get_md_segments (disk, disk_dev, ent->d_name, holder.size, segs);
+    if (n == 0)
+      continue;
+
+    /* Is there swap on it? */
+    if (asprintf (&path, "/dev/%s", ent->d_name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    holder.device = path;
+    holder.fd = open (path, O_RDONLY|O_CLOEXEC);
+    if (holder.fd == -1)
+      continue;
+    swap = is_swap (&holder, 0, holder.size);
+    close (holder.fd);
+    if (!swap)
+      continue;
+
+    for (i = 0; i < n; ++i) {
+      uint64_t from = segs[i].start, to = segs[i].start + segs[i].len;
+
+      if (from < SKIP_KEEP)
+        from = SKIP_KEEP;
+      if (to > holder.size)
+        to = holder.size;
+      if (from < to)
+        add_extent (d, segs[i].disk_offset + (from - segs[i].start),
+                    to - from, ent->d_name);
+    }
+  }
+  closedir (dir);
+}
+
+/*----------------------------------------------------------------------
+ * The list of extents.
+ */
+
+static int
+compare_extents (const void *vp1, const void *vp2)
+{
+  const struct skip_extent *e1 = vp1, *e2 = vp2;
+
+  return e1->offset < e2->offset ? -1 : e1->offset > e2->offset;
+}
+
+/* Sort the extents, and merge any which overlap. */
+static void
+sort_extents (struct skip_list *list)
+{
+  size_t i, n = 0;
+
+  if (list->nr_extents == 0)
+    return;
+  qsort (list->extents, list->nr_extents, sizeof (struct skip_extent),
+         compare_extents);
+  for (i = 0; i < list->nr_extents; ++i) {
+    struct skip_extent *e = &list->extents[i];
+
+    if (n > 0 &&
+        e->offset <= list->extents[n-1].offset + list->extents[n-1].length) {
+      struct skip_extent *prev = &list->extents[n-1];
+
+      if (e->offset + e->length > prev->offset + prev->length)
+        prev->length = e->offset + e->length - prev->offset;
+    }
+    else
+      list->extents[n++] = *e;
+  }
+  list->nr_extents = n;
+
+  list->total = 0;
+  for (i = 0; i < n; ++i)
+    list->total += list->extents[i].length;
+}
+
+/**
+ * Find the extents of C<device> (eg. F</dev/sda>, or an image file
+ * for C<--test-disk>) which need not be copied: swap and so on if
+ * C<swap> is true, and the partitions of the disk named in
+ * C<exclude> (see C<p2v.exclude_partitions>), which may be C<NULL>.
+ *
+ * This always returns a list, which may be empty.  It must be freed
+ * with C<free_skip_list>.  Errors reading the disk are not reported,
+ * they just mean that less is skipped.
+ */
+struct skip_list *
+find_skip_extents (const char *device, bool swap, char * const *exclude)
+{
+  struct disk d = { .device = device, .swap = swap, .exclude = exclude,
+                    .sector_size = 512 };
+  unsigned char mbr[512];
+  struct stat statbuf;
+  int sector_size;
+
+  d.list = calloc (1, sizeof (struct skip_list));
+  if (d.list == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  if (!swap && (exclude == NULL || exclude[0] == NULL))
+    return d.list;
+
+  d.fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (d.fd == -1)
+    return d.list;
+  if (fstat (d.fd, &statbuf) == -1)
+    goto out;
+  if (S_ISBLK (statbuf.st_mode)) {
+    if (ioctl (d.fd, BLKGETSIZE64, &d.size) == -1)
+      goto out;
+    if (ioctl (d.fd, BLKSSZGET, &sector_size) == 0 && sector_size >= 512)
+      d.sector_size = sector_size;
+  }
+  else
+    d.size = statbuf.st_size;
+
+  /* A filesystem or swap on the whole disk, else a partition table. */
+  if (read_at (&d, mbr, sizeof mbr, 0) == -1)
+    goto out;
+  if (memcmp (mbr + 3, "NTFS    ", 8) == 0 || is_swap (&d, 0, d.size))
+    probe_partition (&d, 0, 0, d.size);
+  else if (mbr[510] == 0x55 && mbr[511] == 0xaa)
+    probe_mbr (&d, mbr);
+  else
+    probe_partition (&d, 0, 0, d.size);
+
+  if (swap && S_ISBLK (statbuf.st_mode) && STRPREFIX (device, "/dev/"))
+    probe_holders (&d, device + 5, statbuf.st_rdev);
+
+  sort_extents (d.list);
+
+ out:
+  close (d.fd);
+  return d.list;
+}
+
+void
+free_skip_list (struct skip_list *list)
+{
+  if (list) {
+    free (list->extents);
+    free (list);
+  }
+}
+
+/**
+ * Return the first extent in C<list> which ends after C<offset>, or
+ * C<NULL> if there is none.  C<list> may be C<NULL>.
+ */
+const struct skip_extent *
+next_skip_extent (const struct skip_list *list, uint64_t offset)
+{
+  size_t lo = 0, hi;
+
+  if (list == NULL)
+    return NULL;
+  hi = list->nr_extents;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const struct skip_extent *e = &list->extents[mid];
+
+    if (e->offset + e->length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < list->nr_extents ? &list->extents[lo] : NULL;
+}
+
+/**
+ * Like L<pread(2)>, but the extents in C<list> read as zeroes without
+ * reading the disk.  Like C<pread> this may return less than C<len>
+ * bytes, so it should be called in a loop.
+ */
+ssize_t
+skip_pread (const struct skip_list *list, int fd, void *buf, size_t len,
+            uint64_t offset)
+{
+  const struct skip_extent *e = next_skip_extent (list, offset);
+
+  if (e && e->offset <= offset) {
+    uint64_t n = e->offset + e->length - offset;
+
+    if (n > len)
+      n = len;
+    memset (buf, 0, n);
+    return n;
+  }
+  if (e && e->offset - offset < len)
+    len = e->offset - offset;
+  return pread (fd, buf, len, offset);
+}
@@ -53,6 +53,8 @@
 #include <sys/wait.h>
 #include <signal.h>
 
+#include <pthread.h>
+
 #include "ignore-value.h"
 
 #include "miniexpect.h"
@@ -64,14 +66,31 @@ char *v2v_version = NULL;
 char **input_drivers = NULL;
 char **output_drivers = NULL;
 
+/* The identity (private key) downloaded from C<auth.identity.url>.
+ * This is kept here and not in the config, because the config is a
+ * read-only snapshot shared by several threads.
+ */
+static pthread_mutex_t identity_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *identity_url;      /* URL which identity_file came from */
+static char *identity_file;
+
 static void free_globals (void) __attribute__((destructor));
 static void
 free_globals (void)
 {
   pcre2_substring_free ((PCRE2_UCHAR *)v2v_version);
+  free (identity_url);
+  /* Don't leave a copy of the private key behind. */
+  if (identity_file)
+    unlink (identity_file);
+  free (identity_file);
 }
 
-static char *ssh_error;
+/* The error is per-thread, because ssh connections are made from
+ * several threads at once (for example the data connections which
+ * are started in the background by warm_up_data_conns).
+ */
+static __thread char *ssh_error;
 
 static void set_ssh_error (const char *fs, ...)
   __attribute__((format(printf,1,2)));
@@ -259,37 +278,76 @@ curl_download (const char *url, const char *local_file)
 }
 
 /**
- * Re-cache the C<config-E<gt>identity.url> if needed.
+ * Download C<config-E<gt>auth.identity.url> if it has not been
+ * downloaded already, and return the name of the local copy in
+ * C<*identity_rtn> (the caller must free it).  C<*identity_rtn> is set
+ * to C<NULL> if password authentication is used.
  */
 static int
-cache_ssh_identity (struct config *config)
+cache_ssh_identity (const struct config *config, char **identity_rtn)
 {
-  int fd;
+  int fd, r = 0;
 
-  /* If it doesn't need downloading, return. */
-  if (config->auth.identity.url == NULL ||
-      !config->auth.identity.file_needs_update)
+  *identity_rtn = NULL;
+  if (config->auth.identity.url == NULL)
     return 0;
 
-  /* Generate a random filename. */
-  free (config->auth.identity.file);
-  config->auth.identity.file = strdup ("/tmp/id.XXXXXX");
-  if (config->auth.identity.file == NULL)
-    error (EXIT_FAILURE, errno, "strdup");
-  fd = mkstemp (config->auth.identity.file);
-  if (fd == -1)
-    error (EXIT_FAILURE, errno, "mkstemp");
-  close (fd);
-
-  /* Curl download URL to file. */
-  if (curl_download (config->auth.identity.url, config->auth.identity.file) == -1) {
-    free (config->auth.identity.file);
-    config->auth.identity.file = NULL;
-    config->auth.identity.file_needs_update = 1;
-    return -1;
+  pthread_mutex_lock (&identity_lock);
+
+  if (identity_url == NULL ||
+      STRNEQ (identity_url, config->auth.identity.url)) {
+    free (identity_url);
+    identity_url = NULL;
+
+    /* Remove the copy of the previous key, then generate a random
+     * filename for the new one.
+     */
+    if (identity_file) {
+      unlink (identity_file);
+      free (identity_file);
+    }
+    identity_file = strdup ("/tmp/id.XXXXXX");
+    if (identity_file == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    fd = mkstemp (identity_file);
+    if (fd == -1)
+      error (EXIT_FAILURE, errno, "mkstemp");
+    close (fd);
+
+    /* Curl download URL to file. */
+    if (curl_download (config->auth.identity.url, identity_file) == -1) {
+      unlink (identity_file);
+      free (identity_file);
+      identity_file = NULL;
+      r = -1;
+      goto out;
+    }
+
+    identity_url = strdup (config->auth.identity.url);
+    if (identity_url == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
   }
 
-  return 0;
+  *identity_rtn = strdup (identity_file);
+  if (*identity_rtn == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+ out:
+  pthread_mutex_unlock (&identity_lock);
+  return r;
+}
+
+/**
+ * Make the next connection download C<auth.identity.url> again, in
+ * case the file it points to has changed.
+ */
+void
+forget_ssh_identity (void)
+{
+  pthread_mutex_lock (&identity_lock);
+  free (identity_url);
+  identity_url = NULL;
+  pthread_mutex_unlock (&identity_lock);
 }
 
 /* GCC complains about the argv array in the next function which it
@@ -306,8 +364,8 @@ cache_ssh_identity (struct config *config)
  * optional arguments.  Also handles authentication.
  */
 static mexp_h *
-start_ssh (unsigned spawn_flags, struct config *config,
-           char **extra_args, int wait_prompt)
+start_ssh_and_login (unsigned spawn_flags, const struct config *config,
+                     char **extra_args, int wait_prompt)
 {
   size_t i = 0;
   const size_t MAX_ARGS =
@@ -320,13 +378,14 @@ start_ssh (unsigned spawn_flags, struct config *config,
     pcre2_match_data_create (4, NULL);
   int saved_timeout;
   int using_password_auth;
+  CLEANUP_FREE char *identity = NULL;
   size_t count;
 
-  if (cache_ssh_identity (config) == -1)
+  if (cache_ssh_identity (config, &identity) == -1)
     return NULL;
 
   /* Are we using password or identity authentication? */
-  using_password_auth = config->auth.identity.file == NULL;
+  using_password_auth = identity == NULL;
 
   ADD_ARG (argv, i, "ssh");
   ADD_ARG (argv, i, "-p");      /* Port. */
@@ -354,7 +413,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
     ADD_ARG (argv, i, "-o");
     ADD_ARG (argv, i, "PreferredAuthentications=publickey");
     ADD_ARG (argv, i, "-i");
-    ADD_ARG (argv, i, config->auth.identity.file);
+    ADD_ARG (argv, i, identity);
   }
   if (extra_args != NULL) {
     for (size_t j = 0; extra_args[j] != NULL; ++j)
@@ -562,6 +621,22 @@ start_ssh (unsigned spawn_flags, struct config *config,
 #pragma GCC diagnostic pop
 #endif
 
+/**
+ * Wrapper around C<start_ssh_and_login> which records how long the
+ * ssh handshake took in the timeline.
+ */
+static mexp_h *
+start_ssh (unsigned spawn_flags, const struct config *config,
+           char **extra_args, int wait_prompt)
+{
+  const size_t phase = timeline_begin ("ssh handshake");
+  mexp_h *h;
+
+  h = start_ssh_and_login (spawn_flags, config, extra_args, wait_prompt);
+  timeline_end (phase);
+  return h;
+}
+
 /**
  * Upload file(s) to remote using L<scp(1)>.
  *
@@ -571,7 +646,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
  * This is a simplified version of L</start_ssh> above.
  */
 int
-scp_file (struct config *config, const char *target, const char *local, ...)
+scp_file (const struct config *config, const char *target, const char *local, ...)
 {
   size_t i = 0;
   va_list args;
@@ -584,12 +659,13 @@ scp_file (struct config *config, const char *target, const char *local, ...)
   CLEANUP_PCRE2_MATCH_DATA pcre2_match_data *match_data =
     pcre2_match_data_create (4, NULL);
   int using_password_auth;
+  CLEANUP_FREE char *identity = NULL;
 
-  if (cache_ssh_identity (config) == -1)
+  if (cache_ssh_identity (config, &identity) == -1)
     return -1;
 
   /* Are we using password or identity authentication? */
-  using_password_auth = config->auth.identity.file == NULL;
+  using_password_auth = identity == NULL;
 
   ADD_ARG (argv, i, "scp");
   ADD_ARG (argv, i, "-P");      /* Port. */
@@ -611,7 +687,7 @@ scp_file (struct config *config, const char *target, const char *local, ...)
     ADD_ARG (argv, i, "-o");
     ADD_ARG (argv, i, "PreferredAuthentications=publickey");
     ADD_ARG (argv, i, "-i");
-    ADD_ARG (argv, i, config->auth.identity.file);
+    ADD_ARG (argv, i, identity);
   }
 
   /* Source files or directories.
@@ -756,7 +832,7 @@ static int compatible_version (const char *v2v_version_p);
 #pragma GCC diagnostic ignored "-Wsuggest-attribute=noreturn" /* WTF? */
 #endif
 int
-test_connection (struct config *config)
+test_connection (const struct config *config)
 {
   mexp_h *h;
   int feature_libguestfs_rewrite = 0;
@@ -1058,7 +1134,7 @@ compatible_version (const char *v2v_version_p)
 }
 
 mexp_h *
-open_data_connection (struct config *config, int local_port, int *remote_port)
+open_data_connection (const struct config *config, int local_port, int *remote_port)
 {
   mexp_h *h;
   char remote_arg[32];
@@ -1160,7 +1236,7 @@ wait_for_prompt (mexp_h *h)
 }
 
 mexp_h *
-start_remote_connection (struct config *config, const char *remote_dir)
+start_remote_connection (const struct config *config, const char *remote_dir)
 {
   mexp_h *h;
 
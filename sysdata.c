@@ -0,0 +1,276 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Collect data about the system running virt-p2v such as the dmesg
+ * output and lists of PCI devices.  This is useful for diagnosis when
+ * things go wrong.
+ *
+ * Some of these commands (notably C<lspci -vvv> and C<lsusb -v>) can
+ * take several seconds on large servers, so they are all started in
+ * parallel as soon as virt-p2v starts, each with a time limit, and
+ * the output is copied to the conversion server in the background
+ * once virt-v2v is running.
+ *
+ * If any command fails, this is non-fatal.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <pthread.h>
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+struct tool {
+  const char *filename;         /* output file, in the remote dir too */
+  const char *argv[3];
+  unsigned budget;              /* time limit in seconds */
+};
+
+static const struct tool tools[] = {
+  { "dmesg",  { "dmesg", NULL },          10 },
+  { "lscpu",  { "lscpu", NULL },          10 },
+  { "lspci",  { "lspci", "-vvv", NULL },  30 },
+  { "lsscsi", { "lsscsi", "-v", NULL },   30 },
+  { "lsusb",  { "lsusb", "-v", NULL },    30 },
+};
+#define NR_TOOLS (sizeof tools / sizeof tools[0])
+
+static pthread_mutex_t sysdata_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sysdata_cond = PTHREAD_COND_INITIALIZER;
+static bool sysdata_started = false;
+static bool sysdata_done = false;
+static bool sysdata_dir_ok = false;
+static char sysdata_dir[] = "/tmp/p2v-sysdata.XXXXXX";
+static pid_t pids[NR_TOOLS];
+
+/**
+ * Run a single tool with its stdout and stderr going to a file in
+ * C<sysdata_dir>.  Returns the PID, or C<-1> on error.
+ *
+ * The time limit is enforced by L<alarm(2)>, which is preserved
+ * across L<execvp(3)>, so the tool is killed by C<SIGALRM> if it
+ * overruns.
+ */
+static pid_t
+run_tool (const struct tool *tool)
+{
+  CLEANUP_FREE char *path = NULL;
+  pid_t pid;
+  int fd;
+
+  if (asprintf (&path, "%s/%s", sysdata_dir, tool->filename) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  fd = open (path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC|O_NOCTTY, 0644);
+  if (fd == -1) {
+    perror (path);
+    return -1;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    close (fd);
+    return -1;
+  }
+  if (pid == 0) {               /* Child. */
+    int nullfd = open ("/dev/null", O_RDONLY);
+
+    if (nullfd >= 0) {
+      dup2 (nullfd, 0);
+      close (nullfd);
+    }
+    dup2 (fd, 1);
+    dup2 (fd, 2);
+    alarm (tool->budget);
+    execvp (tool->argv[0], (char **) tool->argv);
+    perror (tool->argv[0]);
+    _exit (EXIT_FAILURE);
+  }
+
+  close (fd);
+  return pid;
+}
+
+/**
+ * Write a file containing the version of virt-p2v.
+ *
+ * The version of virt-v2v is contained in the conversion log.
+ */
+static void
+generate_p2v_version_file (void)
+{
+  CLEANUP_FREE char *path = NULL;
+  FILE *fp;
+
+  if (asprintf (&path, "%s/p2v-version", sysdata_dir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  fp = fopen (path, "w");
+  if (fp == NULL) {
+    perror (path);
+    return;                     /* non-fatal */
+  }
+  fprintf (fp, "%s %s\n",
+           g_get_prgname (), PACKAGE_VERSION_FULL);
+  fclose (fp);
+}
+
+/**
+ * Wait for all the tools to exit, then wake up anyone waiting in
+ * C<upload_system_data>.
+ */
+static void *
+reap_tools_thread (void *data)
+{
+  size_t i;
+
+  for (i = 0; i < NR_TOOLS; ++i) {
+    int status;
+
+    if (pids[i] <= 0)
+      continue;
+    if (waitpid (pids[i], &status, 0) == -1)
+      continue;
+#if DEBUG_STDERR
+    if (WIFSIGNALED (status) && WTERMSIG (status) == SIGALRM)
+      fprintf (stderr, "%s: %s: killed after %u seconds\n",
+               g_get_prgname (), tools[i].argv[0], tools[i].budget);
+#endif
+  }
+
+  pthread_mutex_lock (&sysdata_lock);
+  sysdata_done = true;
+  pthread_cond_broadcast (&sysdata_cond);
+  pthread_mutex_unlock (&sysdata_lock);
+
+  return NULL;
+}
+
+/**
+ * Start collecting the system data in the background.  This should
+ * be called once, early, from the main thread.
+ */
+void
+start_collecting_system_data (void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  size_t i;
+  int err;
+
+  pthread_mutex_lock (&sysdata_lock);
+  if (sysdata_started) {
+    pthread_mutex_unlock (&sysdata_lock);
+    return;
+  }
+  sysdata_started = true;
+  pthread_mutex_unlock (&sysdata_lock);
+
+  if (mkdtemp (sysdata_dir) == NULL) {
+    perror ("mkdtemp");
+    goto done;
+  }
+  sysdata_dir_ok = true;
+
+  generate_p2v_version_file ();
+
+  for (i = 0; i < NR_TOOLS; ++i)
+    pids[i] = run_tool (&tools[i]);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attr, reap_tools_thread, NULL);
+  pthread_attr_destroy (&attr);
+  if (err == 0)
+    return;
+
+  errno = err;
+  perror ("pthread_create");
+  reap_tools_thread (NULL);
+  return;
+
+ done:
+  pthread_mutex_lock (&sysdata_lock);
+  sysdata_done = true;
+  pthread_mutex_unlock (&sysdata_lock);
+}
+
+/**
+ * Copy the system data to C<remote_dir> on the conversion server,
+ * first waiting for any tools which are still running.
+ *
+ * Errors are ignored since these files are not essential.
+ */
+void
+upload_system_data (const struct config *config, const char *remote_dir)
+{
+  char *files[NR_TOOLS + 2];
+  size_t i, phase;
+
+  start_collecting_system_data ();
+
+  pthread_mutex_lock (&sysdata_lock);
+  while (!sysdata_done)
+    pthread_cond_wait (&sysdata_cond, &sysdata_lock);
+  pthread_mutex_unlock (&sysdata_lock);
+
+  if (!sysdata_dir_ok)
+    return;
+
+  for (i = 0; i < NR_TOOLS; ++i) {
+    if (asprintf (&files[i], "%s/%s", sysdata_dir, tools[i].filename) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  if (asprintf (&files[NR_TOOLS], "%s/p2v-version", sysdata_dir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  files[NR_TOOLS+1] = NULL;
+  if (timeline_is_enabled ()) {
+    if (asprintf (&files[NR_TOOLS+1], "%s/p2v-timeline", sysdata_dir) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (write_timeline (files[NR_TOOLS+1]) == -1) {
+      free (files[NR_TOOLS+1]);
+      files[NR_TOOLS+1] = NULL;
+    }
+  }
+
+  /* If you change the tools[] table, change this call too. */
+  assert (NR_TOOLS == 5);
+  phase = timeline_begin ("scp system data");
+  ignore_value (scp_file (config, remote_dir,
+                          files[0], files[1], files[2], files[3], files[4],
+                          files[5], files[6], NULL));
+  timeline_end (phase);
+
+  for (i = 0; i < NR_TOOLS + 2; ++i)
+    free (files[i]);
+}
@@ -0,0 +1,67 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Compare the built-in NBD server with nbdkit.  This is run by
+# 'make check-bench'.
+#
+# test-virt-p2v-bench-throughput.sh is run once with each server, on
+# the same kinds of disk, and the throughput of each disk and the CPU
+# used by each server are written as JSON to
+# test-virt-p2v-bench-nbd-server.json.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_unless nbdkit file --version
+skip_unless nbdcopy --version
+skip_unless nbdinfo --version
+
+report=test-virt-p2v-bench-nbd-server.json
+
+for server in nbdkit builtin; do
+    BENCH_NBD_SERVER=$server "$abs_srcdir/test-virt-p2v-bench-throughput.sh"
+done
+
+nbdkit_json=test-virt-p2v-bench-throughput.json
+builtin_json=test-virt-p2v-bench-throughput-builtin.json
+
+# Print a number from one of the reports, eg. 'get FILE random mb_per_second'.
+get ()
+{
+    awk -v k="\"$2\"" -v f="\"$3\":" '
+        index($0, k) { for (i = 1; i <= NF; ++i) if ($i == f) { v = $(i+1); sub(/,$/, "", v); print v; exit } }
+    ' $1
+}
+
+{
+    echo "{"
+    echo "  \"disks\": {"
+    i=0
+    for k in sparse zero random mixed; do
+        a="$(get $nbdkit_json $k mb_per_second)"
+        b="$(get $builtin_json $k mb_per_second)"
+        i=$((i + 1))
+        sep=,; [ $i -eq 4 ] && sep=
+        echo "    \"$k\": { \"nbdkit_mb_per_second\": $a, \"builtin_mb_per_second\": $b, \"speedup\": $(awk -v a=$a -v b=$b 'BEGIN { printf "%.2f", (a > 0 ? b / a : 0) }') }$sep"
+    done
+    echo "  },"
+    echo "  \"server_cpu_seconds\": { \"nbdkit\": $(get $nbdkit_json nbdkit cpu_seconds), \"builtin\": $(get $builtin_json nbdkit cpu_seconds) }"
+    echo "}"
+} > $report
+
+cat $report
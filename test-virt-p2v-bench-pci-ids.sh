@@ -0,0 +1,92 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Benchmark looking up the PCI vendor and device names of 256 network
+# interfaces in a synthetic pci.ids about the size of the real one.
+# This is run by 'make check-bench'.
+#
+# It reports two times, both from the "PCI ID lookups" phase of the
+# timeline printed by virt-p2v --test-pci-ids:
+#
+#  - indexed: all the lookups in one process, which reads pci.ids
+#    once into a sorted index and then uses bsearch.
+#
+#  - one scan per interface: each lookup in a separate process, so
+#    that pci.ids is read once per interface, as the old linear scan
+#    did.  Process startup is not included.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+
+d=test-virt-p2v-bench-pci-ids.d
+rm -rf $d
+mkdir $d
+
+# 8192 vendors with 4 devices each, about 1.3 MB.
+awk 'BEGIN {
+    for (v = 0; v < 8192; v++) {
+        printf "%04x  Vendor %d of the synthetic pci.ids\n", v * 8 + 1, v
+        for (i = 0; i < 4; i++)
+            printf "\t%04x  Device %d of vendor %d\n", i * 4099 % 65536, i, v
+    }
+}' > $d/pci.ids
+ls -l $d/pci.ids
+
+# 256 interfaces, as "VENDOR DEVICE".  The vendor name and the device
+# name are looked up for each.
+awk 'BEGIN {
+    srand (1)
+    for (n = 0; n < 256; n++) {
+        v = int (rand () * 8192); i = int (rand () * 4)
+        printf "%04x %04x\n", v * 8 + 1, i * 4099 % 65536
+    }
+}' > $d/interfaces
+lookups ()
+{
+    awk '{ print $1; print $1, $2 }'
+}
+
+# Print the duration in milliseconds of the lookups in a timeline log.
+lookup_ms ()
+{
+    awk '$2 == "timeline:" && $3 == "PCI" && $4 == "ID" && $5 == "lookups" {
+        printf "%.1f\n", $NF * 1000 }' "$1"
+}
+
+$VG virt-p2v --timeline --test-pci-ids=$d/pci.ids \
+    < <(lookups < $d/interfaces) > $d/names 2> $d/indexed.log
+if grep -q '^-$' $d/names; then
+    echo "$0: some names were not found"
+    exit 1
+fi
+indexed="$(lookup_ms $d/indexed.log)"
+
+total=0
+while read -r line; do
+    echo "$line" | lookups |
+    $VG virt-p2v --timeline --test-pci-ids=$d/pci.ids \
+        > /dev/null 2> $d/scan.log
+    total="$(awk -v t=$total -v ms="$(lookup_ms $d/scan.log)" \
+                 'BEGIN { printf "%.1f\n", t + ms }')"
+done < $d/interfaces
+
+echo "bench: pci-ids: indexed: $indexed ms"
+echo "bench: pci-ids: one scan per interface: $total ms"
+
+rm -r $d
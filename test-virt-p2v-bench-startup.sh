@@ -0,0 +1,106 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Benchmark how long virt-p2v takes to start up, using the timeline
+# which it prints with --timeline.  This is run by 'make check-bench'.
+#
+# It reports two latencies:
+#
+#  - main to GUI ready: from virt-p2v starting to the GUI main loop
+#    first being idle (only if xvfb-run is available).
+#
+#  - main to first byte: from virt-p2v starting to virt-v2v being
+#    started on the conversion server, in non-GUI (kernel command
+#    line) mode.  This is when the first disk data can be copied.
+#
+# Start times in the timeline are measured from boot, so when this is
+# run on the virt-p2v ISO the "main" line also shows the boot time.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_if_backend uml
+skip_unless nbdkit file --version
+skip_unless test -f fedora.img
+
+f1="$abs_builddir/fedora.img"
+
+d=test-virt-p2v-bench-startup.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh' or 'scp'.
+# They won't work.  Therefore create dummy 'ssh' and 'scp' binaries.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+popd
+export PATH=$d:$PATH
+
+# Print the start time of a phase from a timeline log.
+phase_start ()
+{
+    awk -v phase="$2" '
+        $2 == "timeline:" {
+            name = $3; for (i = 4; i <= NF-2; ++i) name = name " " $i
+            if (name == phase) { print $(NF-1); exit }
+        }' "$1"
+}
+
+# Print the difference in milliseconds between two phases.
+latency ()
+{
+    local start end
+    start="$(phase_start "$1" "$2")"
+    end="$(phase_start "$1" "$3")"
+    test -n "$start" -a -n "$end" || return 1
+    awk -v s="$start" -v e="$end" 'BEGIN { printf "%.1f\n", (e - s) * 1000 }'
+}
+
+# GUI mode.  virt-p2v doesn't exit by itself, so kill it once the GUI
+# is ready.
+if xvfb-run --help >/dev/null 2>&1; then
+    xvfb-run -a virt-p2v --timeline --test-disk="$f1" 2>$d/gui.log &
+    pid=$!
+    for i in $(seq 1 300); do
+        if grep -q "timeline: GUI ready" $d/gui.log; then break; fi
+        sleep 0.1
+    done
+    kill $pid 2>/dev/null ||:
+    wait $pid ||:
+    cat $d/gui.log
+    if ms="$(latency $d/gui.log main "GUI ready")"; then
+        echo "bench: startup: main to GUI ready: $ms ms"
+    else
+        echo "$0: GUI did not become ready"
+        exit 1
+    fi
+else
+    echo "$0: xvfb-run not found, skipping GUI startup benchmark"
+fi
+
+# Kernel command line mode.
+cmdline="p2v.server=localhost p2v.name=fedora p2v.disks=$f1 p2v.o=local p2v.os=$(pwd)/$d p2v.network=em1:wired,other p2v.post= p2v.timeline"
+
+$VG virt-p2v --cmdline="$cmdline" 2>$d/cmdline.log
+cat $d/cmdline.log
+ms="$(latency $d/cmdline.log main "virt-v2v started")"
+echo "bench: startup: main to first byte: $ms ms"
+echo "bench: startup: boot to main: $(phase_start $d/cmdline.log main) s"
+
+rm -r $d
@@ -0,0 +1,151 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Benchmark the data path of virt-p2v end to end.  This is run by
+# 'make check-bench'.
+#
+# Synthetic disks of different kinds are copied through the real
+# conversion path (nbdkit, data connections, control connection and
+# wrapper script), but with fake ssh and scp, and a fake virt-v2v
+# (test-virt-p2v-bench-v2v.sh) which just copies each disk to nowhere.
+#
+# The size of each disk can be set with BENCH_DISK_SIZE (in MB, the
+# default is 1024), and the NBD server with BENCH_NBD_SERVER (nbdkit
+# or builtin, the default is nbdkit).  The report is written as JSON
+# to test-virt-p2v-bench-throughput.json, or
+# test-virt-p2v-bench-throughput-builtin.json for the built-in NBD
+# server, which is kept for comparison with later runs.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+nbd_server=${BENCH_NBD_SERVER:-nbdkit}
+if [ "$nbd_server" = "nbdkit" ]; then
+    skip_unless nbdkit file --version
+fi
+skip_unless nbdcopy --version
+skip_unless nbdinfo --version
+
+size_mb=${BENCH_DISK_SIZE:-1024}
+report=test-virt-p2v-bench-throughput.json
+if [ "$nbd_server" != "nbdkit" ]; then
+    report=test-virt-p2v-bench-throughput-$nbd_server.json
+fi
+
+d=test-virt-p2v-bench-throughput-$nbd_server.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh', 'scp' or
+# 'virt-v2v'.  Therefore create dummy binaries.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/test-virt-p2v-bench-v2v.sh" virt-v2v
+popd
+export PATH=$d:$PATH
+
+# Generate the disks.
+#  - sparse: all holes
+#  - zero: allocated, all zeroes
+#  - random: allocated, incompressible data
+#  - mixed: 1/4 random, 1/4 zeroes, 1/2 holes, in 64 MB stripes
+truncate -s ${size_mb}M $d/sparse.img
+dd if=/dev/zero of=$d/zero.img bs=1M count=$size_mb status=none
+dd if=/dev/urandom of=$d/random.img bs=1M count=$size_mb status=none
+truncate -s ${size_mb}M $d/mixed.img
+stripe ()
+{
+    local n=$(( size_mb - $2 < 64 ? size_mb - $2 : 64 ))
+    if [ $n -gt 0 ]; then
+        dd if=$1 of=$d/mixed.img bs=1M seek=$2 count=$n \
+           conv=notrunc status=none
+    fi
+}
+for (( off = 0; off < size_mb; off += 256 )); do
+    stripe /dev/urandom $off
+    stripe /dev/zero $((off + 64))
+done
+sync
+
+kinds="sparse zero random mixed"
+disks=
+for k in $kinds; do disks="$disks${disks:+,}$(pwd)/$d/$k.img"; done
+
+export P2V_BENCH_RESULTS="$(pwd)/$d/results"
+rm -f $P2V_BENCH_RESULTS
+
+# The Linux kernel command line.
+cmdline="p2v.server=localhost p2v.name=bench p2v.disks=$disks p2v.o=null p2v.network=em1:wired,other p2v.post= p2v.timeline p2v.nbd_server=$nbd_server"
+
+$VG virt-p2v --cmdline="$cmdline" 2>$d/virt-p2v.log
+
+# Setup latency is from virt-p2v starting to virt-v2v starting.
+setup="$(awk '
+    $2 == "timeline:" && $3 == "main" { s = $(NF-1) }
+    $2 == "timeline:" && $3 == "virt-v2v" && $4 == "started" { e = $(NF-1) }
+    END { if (s != "" && e != "") printf "%.3f", e - s }' $d/virt-p2v.log)"
+
+result ()
+{
+    awk -F= -v k="$1" '$1 == k { print $2 }' $P2V_BENCH_RESULTS
+}
+
+# Disks are named sda, sdb, ... in the same order as p2v.disks.
+total_bytes="$(result total.bytes)"
+cpu_total=0
+for p in virt-p2v nbdkit ssh; do
+    cpu_total="$(awk -v a=$cpu_total -v b="$(result process.$p.cpu_seconds)" \
+                     'BEGIN { print a + b }')"
+done
+
+{
+    echo "{"
+    echo "  \"disk_size_mb\": $size_mb,"
+    echo "  \"nbd_server\": \"$nbd_server\","
+    echo "  \"setup_seconds\": ${setup:-null},"
+    echo "  \"disks\": {"
+    letters=abcd
+    i=0
+    for k in $kinds; do
+        dev="sd${letters:$i:1}"
+        bytes="$(result disk.$dev.bytes)"
+        secs="$(result disk.$dev.seconds)"
+        mbps="$(awk -v b=$bytes -v s=$secs \
+                    'BEGIN { printf "%.1f", (s > 0 ? b / s / 1048576 : 0) }')"
+        i=$((i + 1))
+        sep=,; [ $i -eq 4 ] && sep=
+        echo "    \"$k\": { \"bytes\": $bytes, \"seconds\": $secs, \"mb_per_second\": $mbps }$sep"
+    done
+    echo "  },"
+    echo "  \"processes\": {"
+    i=0
+    for p in virt-p2v nbdkit ssh; do
+        i=$((i + 1))
+        sep=,; [ $i -eq 3 ] && sep=
+        echo "    \"$p\": { \"cpu_seconds\": $(result process.$p.cpu_seconds), \"peak_rss_kb\": $(result process.$p.peak_rss_kb) }$sep"
+    done
+    echo "  },"
+    echo "  \"cpu_ns_per_byte\": $(awk -v c=$cpu_total -v b=$total_bytes \
+                                     'BEGIN { printf "%.3f", (b > 0 ? c * 1e9 / b : 0) }')"
+    echo "}"
+} > $report
+
+cat $report
+
+rm -r $d
@@ -0,0 +1,114 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# This is a virt-v2v substitute used by test-virt-p2v-bench-throughput.sh.
+#
+# Instead of converting the guest it copies each disk from the NBD
+# server to nowhere using nbdcopy, timing each copy, and measures the
+# CPU time and peak RSS of virt-p2v and its NBD server and ssh
+# children.
+# The results are written as key=value lines to $P2V_BENCH_RESULTS.
+
+case "$1" in
+    --version)
+        echo "virt-v2v 1.42.0"
+        exit 0
+        ;;
+    --machine-readable)
+        echo "virt-v2v"
+        echo "libguestfs-rewrite"
+        echo "input:libvirtxml"
+        echo "output:local"
+        echo "output:null"
+        exit 0
+        ;;
+esac
+
+# The last argument is the physical machine XML.
+xml="${@: -1}"
+results="${P2V_BENCH_RESULTS:-/dev/null}"
+
+# Print the sum of utime and stime (in seconds) and VmHWM (in kB) of
+# a process.
+proc_usage ()
+{
+    local ticks hwm
+    ticks="$(awk '{ sub(/.*\) /, ""); print $12 + $13 }' /proc/$1/stat 2>/dev/null)"
+    hwm="$(awk '/^VmHWM:/ { print $2 }' /proc/$1/status 2>/dev/null)"
+    echo "$(awk -v t="${ticks:-0}" -v hz="$(getconf CLK_TCK)" \
+                'BEGIN { printf "%.3f", t / hz }') ${hwm:-0}"
+}
+
+# Find the virt-p2v process by walking up from this process.
+p2v_pid=
+pid=$$
+while [ "$pid" -gt 1 ]; do
+    comm="$(cat /proc/$pid/comm 2>/dev/null)"
+    case "$comm" in
+        virt-p2v|lt-virt-p2v) p2v_pid=$pid; break ;;
+    esac
+    pid="$(awk '{ sub(/.*\) /, ""); print $2 }' /proc/$pid/stat)"
+done
+
+# Pairs of "port dev" for each disk in the XML.
+disks="$(awk '
+    /<source protocol="nbd"/ { insrc = 1 }
+    insrc && match($0, /port="[0-9]+"/) {
+        port = substr($0, RSTART+6, RLENGTH-7); insrc = 0
+    }
+    port != "" && match($0, /<target dev="[^"]+"/) {
+        print port, substr($0, RSTART+13, RLENGTH-14); port = ""
+    }' "$xml")"
+
+total_bytes=0
+while read port dev; do
+    [ -n "$port" ] || continue
+    size="$(nbdinfo --size "nbd://localhost:$port")"
+    start="$(date +%s.%N)"
+    nbdcopy "nbd://localhost:$port" null:
+    end="$(date +%s.%N)"
+    secs="$(awk -v s=$start -v e=$end 'BEGIN { printf "%.3f", e - s }')"
+    echo "disk.$dev.bytes=$size" >> "$results"
+    echo "disk.$dev.seconds=$secs" >> "$results"
+    echo "$dev: copied $size bytes in $secs seconds"
+    total_bytes=$((total_bytes + size))
+done <<< "$disks"
+echo "total.bytes=$total_bytes" >> "$results"
+
+# Measure before virt-p2v closes the data connections.
+if [ -n "$p2v_pid" ]; then
+    read cpu rss <<< "$(proc_usage $p2v_pid)"
+    echo "process.virt-p2v.cpu_seconds=$cpu" >> "$results"
+    echo "process.virt-p2v.peak_rss_kb=$rss" >> "$results"
+    nbdkit_cpu=0 nbdkit_rss=0 ssh_cpu=0 ssh_rss=0
+    for child in $(pgrep -P $p2v_pid); do
+        read cpu rss <<< "$(proc_usage $child)"
+        # The built-in NBD server is a forked copy of virt-p2v.
+        comm="$(cat /proc/$child/comm 2>/dev/null)"
+        if [ "$comm" = "nbdkit" ] || [ "$comm" = "p2v-nbd-server" ]; then
+            nbdkit_cpu="$(awk -v a=$nbdkit_cpu -v b=$cpu 'BEGIN { print a + b }')"
+            [ "$rss" -gt "$nbdkit_rss" ] && nbdkit_rss=$rss
+        else
+            ssh_cpu="$(awk -v a=$ssh_cpu -v b=$cpu 'BEGIN { print a + b }')"
+            [ "$rss" -gt "$ssh_rss" ] && ssh_rss=$rss
+        fi
+    done
+    echo "process.nbdkit.cpu_seconds=$nbdkit_cpu" >> "$results"
+    echo "process.nbdkit.peak_rss_kb=$nbdkit_rss" >> "$results"
+    echo "process.ssh.cpu_seconds=$ssh_cpu" >> "$results"
+    echo "process.ssh.peak_rss_kb=$ssh_rss" >> "$results"
+fi
@@ -0,0 +1,125 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Benchmark the cost of p2v.verify.  This is run by 'make check-bench'.
+#
+# A synthetic disk is copied with p2v.precopy=bulk, then the final
+# pass is run with and without p2v.verify=report.  The extent sums
+# are computed from the same reads of the disk as the block map,
+# which run in the background while the changed blocks are copied,
+# so the time spent reading the disk should be about the same in both
+# cases.  The report is written as JSON to
+# test-virt-p2v-bench-verify.json.
+#
+# The size of the disk can be set with BENCH_DISK_SIZE (in MB, the
+# default is 1024).
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_unless nbdkit file --version
+skip_unless nbdkit --filter=extentlist null extentlist=/dev/null --version
+skip_unless nbdkit nbd --version
+skip_unless nbdcopy --version
+skip_unless xxhsum -H1 /dev/null
+
+size_mb=${BENCH_DISK_SIZE:-1024}
+report=test-virt-p2v-bench-verify.json
+
+name=test-virt-p2v-bench-verify-$$
+d=$name.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh', 'scp' or
+# 'virt-v2v'.  Therefore create dummy binaries.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/test-virt-p2v-bench-v2v.sh" virt-v2v
+popd
+export PATH=$d:$PATH
+
+cleanup ()
+{
+    rm -rf /var/tmp/virt-p2v-precopy/$name
+}
+trap cleanup INT QUIT TERM EXIT
+
+dd if=/dev/urandom of=$d/disk.img bs=1M count=$size_mb status=none
+sync
+
+cmdline="p2v.server=localhost p2v.name=$name p2v.disks=$(pwd)/$d/disk.img p2v.o=null p2v.network=em1:wired,other p2v.post= p2v.timeline"
+
+$VG virt-p2v --cmdline="$cmdline p2v.precopy=bulk" 2>$d/bulk.log
+
+# Prints the duration of a phase from the timeline.
+phase ()
+{
+    awk -v p="$1" '
+        $2 == "timeline:" {
+          n = $3; for (i = 4; i <= NF-2; ++i) n = n " " $i
+          if (n == p) d = $NF
+        }
+        END { print (d != "" ? d : "null") }' $2
+}
+
+# The disk is read once by each pass, so drop it from the page cache
+# first where we can, otherwise both passes read it from memory.
+drop_caches ()
+{
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null ||:
+}
+
+drop_caches
+$VG virt-p2v --cmdline="$cmdline p2v.precopy=final" 2>$d/none.log
+drop_caches
+$VG virt-p2v --cmdline="$cmdline p2v.precopy=final p2v.verify=report" \
+    2>$d/report.log
+
+none="$(phase "read disks" $d/none.log)"
+verify="$(phase "read disks" $d/report.log)"
+conv_none="$(phase "conversion" $d/none.log)"
+conv_verify="$(phase "conversion" $d/report.log)"
+
+mbps ()
+{
+    awk -v s=$1 -v m=$size_mb \
+        'BEGIN { printf "%.1f", (s > 0 ? m / s : 0) }'
+}
+
+{
+    echo "{"
+    echo "  \"disk_size_mb\": $size_mb,"
+    echo "  \"read_disks\": {"
+    echo "    \"verify_none\": { \"seconds\": $none, \"mb_per_second\": $(mbps $none) },"
+    echo "    \"verify_report\": { \"seconds\": $verify, \"mb_per_second\": $(mbps $verify) }"
+    echo "  },"
+    echo "  \"conversion\": {"
+    echo "    \"verify_none\": { \"seconds\": $conv_none },"
+    echo "    \"verify_report\": { \"seconds\": $conv_verify }"
+    echo "  },"
+    echo "  \"verify_overhead_percent\": $(awk -v a=$conv_none -v b=$conv_verify \
+                                             'BEGIN { printf "%.1f", (a > 0 ? (b - a) * 100 / a : 0) }')"
+    echo "}"
+} > $report
+
+cat $report
+
+rm -r $d
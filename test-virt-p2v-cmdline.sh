@@ -29,6 +29,7 @@ rm -f $out
 P2V_OPTS=(
   p2v.server=localhost
   p2v.port=123
+  p2v.server_slots=2
   p2v.username=user
   p2v.password=secret
   p2v.skip_test_connection
@@ -36,6 +37,7 @@ P2V_OPTS=(
   p2v.vcpu.cores=4
   p2v.memory=1G
   p2v.disks=sda,sdb,sdc
+  p2v.exclude_partitions=sda3,sdb1
   p2v.removable=sdd
   p2v.interfaces=eth0,eth1
   p2v.o=local
@@ -45,6 +47,11 @@ P2V_OPTS=(
   p2v.os=/var/tmp
   p2v.oo=opt1=val1,opt2=val2
   p2v.network=em1:wired,other
+  p2v.nbd_server=builtin
+  p2v.compress
+  p2v.dedup
+  p2v.dedup_cache=/var/tmp/cache
+  p2v.copy_swap
   p2v.dump_config_and_exit
 )
 $VG virt-p2v --cmdline="${P2V_OPTS[*]}" > $out
@@ -55,6 +62,7 @@ cat $out
 # Check the output contains what we expect.
 grep "^remote\.server.*localhost" $out
 grep "^remote\.port.*123" $out
+grep "^remote\.slots.*2" $out
 grep "^auth\.username.*user" $out
 grep "^auth\.sudo.*false" $out
 grep "^guestname.*test" $out
@@ -62,9 +70,15 @@ grep "^vcpu.phys_topo.*false" $out
 grep "^vcpu.cores.*4" $out
 grep "^memory.*"$((1024*1024*1024)) $out
 grep "^disks.*sda sdb sdc" $out
+grep "^exclude_partitions.*sda3 sdb1" $out
 grep "^removable.*sdd" $out
 grep "^interfaces.*eth0 eth1" $out
 grep "^network_map.*em1:wired other" $out
+grep "^nbd_server.*builtin" $out
+grep "^compress.*true" $out
+grep "^dedup.*true" $out
+grep "^remote\.dedup_cache.*/var/tmp/cache" $out
+grep "^copy_swap.*true" $out
 grep "^output\.type.*local" $out
 grep "^output\.allocation.*sparse" $out
 grep "^output\.connection.*qemu:///session" $out
@@ -0,0 +1,76 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test deduplication (p2v.dedup).  Two similar disks are converted one
+# after the other, sharing a block cache, and the second conversion
+# must take the blocks which the disks have in common from the cache
+# instead of copying them again.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_unless nbdcopy --version
+skip_unless python3 -c 'import zlib'
+
+d=test-virt-p2v-dedup.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh', 'scp' or
+# 'virt-v2v'.  Therefore create dummy binaries.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/test-virt-p2v-v2v.sh" virt-v2v
+popd
+export PATH=$d:$PATH
+export P2V_TEST_DIR="$(pwd)/$d"
+export P2V_TEST_V2V=copy
+
+# The second disk is the same as the first except for 2 MB.
+dd if=/dev/urandom of=$d/first.img bs=1M count=16 status=none
+cp $d/first.img $d/second.img
+dd if=/dev/urandom of=$d/second.img bs=1M seek=4 count=2 \
+   conv=notrunc status=none
+
+# Print the bytes taken from the block cache and copied in the last
+# conversion, added up over the data connections.
+dedup_stats ()
+{
+    awk '/^p2v-decompress: .* from the block cache/ { c += $4; s += $10 }
+         END { print c + 0, s + 0 }' \
+        "$(< $d/remote_dir)/virt-v2v-conversion-log.txt"
+}
+
+cmdline="p2v.server=localhost p2v.name=test p2v.o=null p2v.network=em1:wired,other p2v.post= p2v.dedup p2v.dedup_cache=$(pwd)/$d/cache"
+
+$VG virt-p2v --cmdline="$cmdline p2v.disks=$(pwd)/$d/first.img"
+cmp $d/first.img $d/sda.copy
+read cached copied < <(dedup_stats)
+echo "first conversion: $cached bytes from the cache, $copied bytes copied"
+test $copied -ge $(( 16 * 1024 * 1024 ))
+
+rm $d/sda.copy
+$VG virt-p2v --cmdline="$cmdline p2v.disks=$(pwd)/$d/second.img p2v.compress"
+cmp $d/second.img $d/sda.copy
+read cached copied < <(dedup_stats)
+echo "second conversion: $cached bytes from the cache, $copied bytes copied"
+test $cached -ge $(( 14 * 1024 * 1024 ))
+test $copied -lt $(( 4 * 1024 * 1024 ))
+
+rm -r $d
@@ -0,0 +1,76 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test the built-in NBD server (p2v.nbd_server=builtin).  A fake
+# virt-v2v copies each disk using nbdcopy, which uses multi-conn,
+# structured replies and block status, and the copies must be the
+# same as the disks.  Then do it again with the data connections
+# compressed (p2v.compress).
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_unless nbdcopy --version
+skip_unless nbdinfo --version
+
+d=test-virt-p2v-nbd-server.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh', 'scp' or
+# 'virt-v2v'.  Therefore create dummy binaries.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/test-virt-p2v-v2v.sh" virt-v2v
+popd
+export PATH=$d:$PATH
+export P2V_TEST_DIR="$(pwd)/$d"
+export P2V_TEST_V2V=map
+
+# A sparse disk with data in the middle and a partial sector at the
+# end, and a small fully allocated disk.
+truncate -s $(( 64 * 1024 * 1024 + 777 )) $d/sparse.img
+dd if=/dev/urandom of=$d/sparse.img bs=1M seek=20 count=3 \
+   conv=notrunc status=none
+dd if=/dev/urandom of=$d/sparse.img bs=1 seek=$(( 64 * 1024 * 1024 )) \
+   count=777 conv=notrunc status=none
+dd if=/dev/urandom of=$d/full.img bs=1M count=5 status=none
+
+cmdline="p2v.server=localhost p2v.name=test p2v.disks=$(pwd)/$d/sparse.img,$(pwd)/$d/full.img p2v.o=null p2v.network=em1:wired,other p2v.post= p2v.nbd_server=builtin"
+
+$VG virt-p2v --cmdline="$cmdline"
+
+cmp $d/sparse.img $d/sda.copy
+cmp $d/full.img $d/sdb.copy
+
+# The holes in the sparse disk must be reported.
+cat $d/sda.map
+grep -q hole $d/sda.map
+
+# The decompressor on the conversion server needs python3.
+if python3 -c 'import zlib' 2>/dev/null; then
+    rm $d/sda.copy $d/sdb.copy $d/sda.map
+    $VG virt-p2v --cmdline="$cmdline p2v.compress"
+
+    cmp $d/sparse.img $d/sda.copy
+    cmp $d/full.img $d/sdb.copy
+    grep -q hole $d/sda.map
+fi
+
+rm -r $d
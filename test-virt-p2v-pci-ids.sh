@@ -0,0 +1,76 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test the lookup of PCI vendor and device names in pci.ids.  Vendors
+# 0x1004 and 0x9004 differ only in the top bit, so they must not be
+# confused.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+
+d=test-virt-p2v-pci-ids.d
+rm -rf $d
+mkdir $d
+
+# Deliberately not sorted, and with comments, subsystems and device
+# classes, like the real file.
+printf '%s\n' \
+    '# pci.ids for testing' \
+    '9005  Adaptec' \
+    '	1005  Adaptec device 1005' \
+    '		9005 0001  Adaptec subsystem' \
+    '1004  VLSI Technology Inc' \
+    '	0005  82C592-FC1' \
+    '	1005  VLSI device 1005' \
+    '9004  Adaptec Legacy' \
+    '	1005  Adaptec Legacy device 1005' \
+    '' \
+    '1005  Avance Logic Inc. [ALI]' \
+    '	9004  Avance device 9004' \
+    'ffff  Illegal Vendor ID' \
+    'C 02  Network controller' \
+    '	00  Ethernet controller' > $d/pci.ids
+
+printf '%s\n' \
+    1004 9004 1005 9005 ffff 8086 \
+    '1004 1005' '9004 1005' '9005 1005' '1005 9004' '1004 0005' \
+    '1004 9005' '9005 0001' '0002 0000' > $d/lookups
+
+$VG virt-p2v --test-pci-ids=$d/pci.ids < $d/lookups > $d/names
+
+cat > $d/expected <<'EOF2'
+VLSI Technology Inc
+Adaptec Legacy
+Avance Logic Inc. [ALI]
+Adaptec
+Illegal Vendor ID
+-
+VLSI device 1005
+Adaptec Legacy device 1005
+Adaptec device 1005
+Avance device 9004
+82C592-FC1
+-
+-
+-
+EOF2
+
+diff -u $d/expected $d/names
+
+rm -r $d
@@ -0,0 +1,131 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test warm migration (p2v.precopy) end to end, using a loop device
+# with a device-mapper device on top as the physical disk.  The bulk
+# pass copies the disk, then some blocks are changed, and the final
+# pass must copy only those blocks and leave an exact copy of the
+# disk on the "conversion server" (which is localhost).
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+if [ "$(id -u)" -ne 0 ]; then
+    echo "$0: test skipped because it must be run as root"
+    exit 77
+fi
+skip_unless losetup --version
+skip_unless dmsetup --version
+skip_unless nbdkit file --version
+skip_unless nbdkit --filter=extentlist null extentlist=/dev/null --version
+skip_unless nbdkit nbd --version
+skip_unless nbdcopy --version
+
+name=test-virt-p2v-precopy-$$
+d=$name.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh', 'scp' or
+# 'virt-v2v'.  Therefore create dummy binaries.  The fake virt-v2v
+# saves its physical machine XML and the remote directory.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/test-virt-p2v-v2v.sh" virt-v2v
+popd
+export PATH=$d:$PATH
+export P2V_TEST_DIR="$(pwd)/$d"
+
+# A 64 MB disk, with a partial block at the end.
+size=$(( 64 * 1024 * 1024 + 4096 ))
+dd if=/dev/urandom of=$d/disk.img bs=1M count=64 status=none
+truncate -s $size $d/disk.img
+loop="$(losetup -f --show $d/disk.img)"
+dmsetup create $name --table "0 $(( size / 512 )) linear $loop 0"
+cleanup ()
+{
+    dmsetup remove $name ||:
+    losetup -d $loop ||:
+    rm -rf /var/tmp/virt-p2v-precopy/$name
+}
+trap cleanup INT QUIT TERM EXIT
+disk=/dev/mapper/$name
+copy=/var/tmp/virt-p2v-precopy/$name/_dev_mapper_$name.img
+
+cmdline="p2v.server=localhost p2v.name=$name p2v.disks=$disk p2v.o=null p2v.network=em1:wired,other p2v.post="
+
+# Bulk pass.
+$VG virt-p2v --cmdline="$cmdline p2v.precopy=bulk"
+cmp $disk $copy
+test ! -f $d/physical.xml
+
+# Change 3 MB in the middle, and the partial block at the end.
+dd if=/dev/urandom of=$disk bs=1M seek=10 count=3 conv=notrunc status=none
+dd if=/dev/urandom of=$disk bs=4096 seek=$(( 64 * 256 )) count=1 \
+   conv=notrunc status=none
+sync
+
+# Final pass.
+$VG virt-p2v --cmdline="$cmdline p2v.precopy=final"
+cmp $disk $copy
+grep "Copied $(( 3 * 1024 * 1024 + 4096 )) bytes" \
+     "$(< $d/remote_dir)/virt-v2v-conversion-log.txt"
+grep "<source file=\"$copy\"/>" $d/physical.xml
+
+# Damage the copy behind virt-p2v's back.  Another final pass does
+# not see the change from the block maps, but p2v.verify=resend must
+# find it and copy that extent again.
+if xxhsum -H1 /dev/null >/dev/null 2>&1; then
+    dd if=/dev/urandom of=$copy bs=4096 seek=100 count=1 \
+       conv=notrunc status=none
+    $VG virt-p2v --cmdline="$cmdline p2v.precopy=final p2v.verify=resend"
+    cmp $disk $copy
+    grep "The copy of _dev_mapper_$name differs at offset 0," \
+         "$(< $d/remote_dir)/virt-v2v-conversion-log.txt"
+fi
+
+# A block which changes while the bulk pass copies it, and then changes
+# back, must still be copied again by the final pass.  The block map
+# kept from the bulk pass is made from the copy on the server, which
+# needs xxhsum.
+if xxhsum -H1 /dev/null >/dev/null 2>&1; then
+    rm -rf /var/tmp/virt-p2v-precopy/$name
+    mkdir $d/flip
+    cat > $d/flip/nbdcopy <<EOF
+#!/bin/bash -
+dd if=$disk of=$(pwd)/$d/block bs=1M skip=20 count=1 status=none
+dd if=/dev/urandom of=$disk bs=1M seek=20 count=1 conv=notrunc status=none
+$(command -v nbdcopy) "\$@"
+r=\$?
+dd if=$(pwd)/$d/block of=$disk bs=1M seek=20 conv=notrunc status=none
+exit \$r
+EOF
+    chmod +x $d/flip/nbdcopy
+    PATH=$(pwd)/$d/flip:$PATH $VG virt-p2v --cmdline="$cmdline p2v.precopy=bulk"
+    if cmp -s $disk $copy; then
+        echo "$0: the block did not change during the bulk pass"
+        exit 1
+    fi
+    $VG virt-p2v --cmdline="$cmdline p2v.precopy=final"
+    cmp $disk $copy
+    grep "Copied $(( 1024 * 1024 )) bytes" \
+         "$(< $d/remote_dir)/virt-v2v-conversion-log.txt"
+fi
+
+rm -r $d
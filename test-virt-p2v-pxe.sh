@@ -22,8 +22,12 @@
 # * launch-virt-p2v
 # * networking
 # * virt-p2v in kernel command-line mode
+#
+# It also reports how long it took from boot until the conversion
+# server first read the disk, using the timeline (p2v.timeline).
 
 set -e
+set -o pipefail
 
 $TEST_FUNCTIONS
 slow_test
@@ -67,7 +71,7 @@ username="$(id -un)"
 os="$(cd $d; pwd)"
 
 # The Linux kernel command line.
-cmdline="root=/dev/sda4 ro console=ttyS0 printk.time=1 p2v.server=10.0.2.2 p2v.port=$port p2v.username=$username p2v.identity=file:///var/tmp/id_rsa p2v.name=fedora p2v.o=local p2v.os=$os"
+cmdline="root=/dev/sda4 ro console=ttyS0 printk.time=1 p2v.server=10.0.2.2 p2v.port=$port p2v.username=$username p2v.identity=file:///var/tmp/id_rsa p2v.name=fedora p2v.o=local p2v.os=$os p2v.timeline"
 
 # Run virt-p2v inside qemu.
 $qemu \
@@ -86,10 +90,30 @@ $qemu \
     -device scsi-hd,drive=hd1 \
     -netdev user,id=usernet \
     -device virtio-net-pci,netdev=usernet \
-    -serial stdio
+    -serial stdio |
+    tee $d/console
 
 # Test the libvirt XML metadata and a disk was created.
 test -f $d/fedora.xml
 test -f $d/fedora-sda
 
+# Timeline start times are measured from when the guest booted.
+phase_start ()
+{
+    tr -d '\r' < $d/console |
+    awk -v phase="$1" '
+        $2 == "timeline:" {
+            name = $3; for (i = 4; i <= NF-2; ++i) name = name " " $i
+            if (name == phase) { print $(NF-1); exit }
+        }'
+}
+main="$(phase_start main)"
+first_read="$(phase_start "first NBD read")"
+if [ -z "$main" ] || [ -z "$first_read" ]; then
+    echo "$0: the timeline was not found in the console output"
+    exit 1
+fi
+echo "bench: pxe: boot to main: $main s"
+echo "bench: pxe: boot to first NBD read: $first_read s"
+
 rm -r $d
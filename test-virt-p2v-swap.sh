@@ -0,0 +1,109 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test that swap is not copied.  The disk has a swap partition and an
+# ext4 filesystem with a swap file, which must be copied as zeroes
+# after their first 64 KB, while everything else is copied as usual.
+# With p2v.copy_swap the copy must be exact, and with
+# p2v.exclude_partitions the excluded partition must be all zeroes.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_unless nbdcopy --version
+skip_unless sfdisk --version
+skip_unless mkswap --version
+skip_unless mkfs.ext4 -V
+skip_unless debugfs -V
+
+d=test-virt-p2v-swap.d
+rm -rf $d
+mkdir $d
+
+# We don't want the program under test to run real 'ssh', 'scp' or
+# 'virt-v2v'.  Therefore create dummy binaries.
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/test-virt-p2v-v2v.sh" virt-v2v
+popd
+export PATH=$d:$PATH
+export P2V_TEST_DIR="$(pwd)/$d"
+export P2V_TEST_V2V=copy
+
+MB=$(( 1024 * 1024 ))
+KEEP=65536
+
+# Fill everything with random data, so that zeroes stand out.
+dd if=/dev/urandom of=$d/disk.img bs=1M count=100 status=none
+sfdisk -q $d/disk.img <<EOF
+label: dos
+start=1MiB, size=32MiB, type=82
+start=33MiB, size=64MiB, type=83
+EOF
+
+dd if=/dev/urandom of=$d/swap.img bs=1M count=32 status=none
+mkswap -q $d/swap.img
+dd if=$d/swap.img of=$d/disk.img bs=1M seek=1 conv=notrunc status=none
+
+mkdir $d/root
+dd if=/dev/urandom of=$d/root/swapfile bs=1M count=8 status=none
+chmod 0600 $d/root/swapfile
+mkswap -q $d/root/swapfile
+dd if=/dev/urandom of=$d/root/data bs=1M count=4 status=none
+truncate -s 64M $d/ext4.img
+mkfs.ext4 -q -b 4096 -d $d/root $d/ext4.img
+dd if=$d/ext4.img of=$d/disk.img bs=1M seek=33 conv=notrunc status=none
+
+cmdline="p2v.server=localhost p2v.name=test p2v.disks=$(pwd)/$d/disk.img p2v.o=null p2v.network=em1:wired,other p2v.post="
+
+$VG virt-p2v --cmdline="$cmdline" | tee $d/out
+grep "not copying" $d/out
+
+# The swap partition keeps its signature, and the rest is zeroes.
+dd if=$d/sda.copy of=$d/swap.copy bs=1M skip=1 count=32 status=none
+cmp -n $KEEP $d/swap.img $d/swap.copy
+cmp -n $(( 32 * MB - KEEP )) -i $KEEP:0 $d/swap.copy /dev/zero
+
+# The filesystem is unchanged apart from the swap file.
+dd if=$d/sda.copy of=$d/ext4.copy bs=1M skip=33 count=64 status=none
+e2fsck -fn $d/ext4.copy
+debugfs -R "cat /data" $d/ext4.copy > $d/data.copy
+cmp $d/root/data $d/data.copy
+debugfs -R "cat /swapfile" $d/ext4.copy > $d/swapfile.copy
+cmp -n $KEEP $d/root/swapfile $d/swapfile.copy
+cmp -n $(( 8 * MB - KEEP )) -i $KEEP:0 $d/swapfile.copy /dev/zero
+
+# The partition table and the end of the disk are copied.
+cmp -n $MB $d/disk.img $d/sda.copy
+cmp -i $(( 97 * MB )) $d/disk.img $d/sda.copy
+
+rm $d/sda.copy
+$VG virt-p2v --cmdline="$cmdline p2v.copy_swap"
+cmp $d/disk.img $d/sda.copy
+
+# Partitions of an image file are named after the file.
+rm $d/sda.copy
+$VG virt-p2v --cmdline="$cmdline p2v.copy_swap p2v.exclude_partitions=disk.img2" |
+    tee $d/out
+grep "not copying.*excluded partitions" $d/out
+cmp -n $(( 33 * MB )) $d/disk.img $d/sda.copy
+cmp -n $(( 64 * MB )) -i $(( 33 * MB )):0 $d/sda.copy /dev/zero
+cmp -i $(( 97 * MB )) $d/disk.img $d/sda.copy
+
+rm -r $d
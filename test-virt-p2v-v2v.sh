@@ -0,0 +1,78 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# This is a virt-v2v substitute used by the tests which run a whole
+# conversion.
+#
+# Instead of converting the guest it saves the physical machine XML
+# and the remote directory in $P2V_TEST_DIR, then does whatever
+# $P2V_TEST_V2V names:
+#
+#   copy  Copy each disk from the NBD server to $P2V_TEST_DIR/DEV.copy,
+#         where DEV is the target device (sda, sdb, ...).
+#   map   The same, and also check that the NBD server allows
+#         multi-conn, and save its extents in $P2V_TEST_DIR/DEV.map.
+#
+# If $P2V_TEST_V2V is not set, nothing else is done.
+
+case "$1" in
+    --version)
+        echo "virt-v2v 1.42.0"
+        exit 0
+        ;;
+    --machine-readable)
+        echo "virt-v2v"
+        echo "libguestfs-rewrite"
+        echo "input:libvirtxml"
+        echo "output:null"
+        exit 0
+        ;;
+esac
+
+# The last argument is the physical machine XML.
+xml="${@: -1}"
+
+cp "$xml" "$P2V_TEST_DIR/physical.xml"
+pwd > "$P2V_TEST_DIR/remote_dir"
+
+case "$P2V_TEST_V2V" in
+    "") exit 0 ;;
+    copy|map) ;;
+    *)
+        echo "$0: unknown P2V_TEST_V2V action: $P2V_TEST_V2V" >&2
+        exit 1
+        ;;
+esac
+
+# Pairs of "port dev" for each disk in the XML.
+awk '
+    /<source protocol="nbd"/ { insrc = 1 }
+    insrc && match($0, /port="[0-9]+"/) {
+        port = substr($0, RSTART+6, RLENGTH-7); insrc = 0
+    }
+    port != "" && match($0, /<target dev="[^"]+"/) {
+        print port, substr($0, RSTART+13, RLENGTH-14); port = ""
+    }' "$xml" |
+while read port dev; do
+    uri="nbd://localhost:$port"
+    if [ "$P2V_TEST_V2V" = map ]; then
+        nbdinfo --can multi-conn "$uri" || exit 1
+        nbdinfo --map "$uri" > "$P2V_TEST_DIR/$dev.map" || exit 1
+    fi
+    nbdcopy --connections=4 --requests=16 "$uri" "$P2V_TEST_DIR/$dev.copy" ||
+        exit 1
+done
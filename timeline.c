@@ -0,0 +1,308 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Record how long each phase of startup and conversion takes.
+ *
+ * Phases are always recorded (it is cheap), but they are only printed
+ * if the timeline has been enabled with the I<--timeline> option or
+ * C<p2v.timeline> on the kernel command line.  Start times are
+ * measured from when the machine booted (C<CLOCK_BOOTTIME>), so the
+ * timeline also shows how long the boot took before virt-p2v ran.
+ *
+ * The timeline is printed on stderr as each phase ends, and copied
+ * to the conversion server as F<p2v-timeline> (see F<sysdata.c>).
+ *
+ * At the end of conversion the same phases are also written in the
+ * Chrome trace event format (see C<write_timeline_trace>) and copied
+ * to the conversion server as F<p2v-trace.json>, whether or not the
+ * timeline was enabled.  This can be loaded into
+ * L<https://ui.perfetto.dev> or C<chrome://tracing>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/syscall.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+struct phase {
+  char *name;
+  double start;                 /* seconds since boot */
+  double duration;              /* seconds, or -1 if not ended */
+  bool instant;                 /* a milestone, see timeline_mark */
+  pid_t tid;                    /* thread which recorded the phase */
+};
+
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool enabled = false;
+static struct phase *phases;
+static size_t nr_phases;
+
+/**
+ * Return the current time in seconds since boot, the same clock which
+ * is used for the timeline.
+ */
+double
+timeline_now (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_BOOTTIME, &ts) == -1)
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Caller must hold timeline_lock. */
+static void
+print_phase (FILE *fp, const struct phase *phase)
+{
+  fprintf (fp, "%s: timeline: %-32s %10.3f %10.3f\n",
+           g_get_prgname (), phase->name, phase->start, phase->duration);
+}
+
+/* Caller must hold timeline_lock.  This takes ownership of name. */
+static size_t
+add_phase (char *name, double start, double duration)
+{
+  phases = realloc (phases, (nr_phases + 1) * sizeof (struct phase));
+  if (phases == NULL)
+    error (EXIT_FAILURE, errno, "realloc");
+  phases[nr_phases].name = name;
+  phases[nr_phases].start = start;
+  phases[nr_phases].duration = duration;
+  phases[nr_phases].instant = false;
+  phases[nr_phases].tid = syscall (SYS_gettid);
+  return nr_phases++;
+}
+
+static char *
+format_name (const char *fs, va_list args)
+{
+  char *name;
+
+  if (vasprintf (&name, fs, args) == -1)
+    error (EXIT_FAILURE, errno, "vasprintf");
+  return name;
+}
+
+/**
+ * Start printing the timeline.  Any phases which have already ended
+ * are printed straight away.
+ */
+void
+enable_timeline (void)
+{
+  size_t i;
+
+  pthread_mutex_lock (&timeline_lock);
+  if (!enabled) {
+    enabled = true;
+    fprintf (stderr, "%s: timeline: %-32s %10s %10s\n",
+             g_get_prgname (), "phase", "start", "duration");
+    for (i = 0; i < nr_phases; ++i)
+      if (phases[i].duration >= 0)
+        print_phase (stderr, &phases[i]);
+  }
+  pthread_mutex_unlock (&timeline_lock);
+}
+
+bool
+timeline_is_enabled (void)
+{
+  bool ret;
+
+  pthread_mutex_lock (&timeline_lock);
+  ret = enabled;
+  pthread_mutex_unlock (&timeline_lock);
+  return ret;
+}
+
+/**
+ * Start timing a phase.  The name is a printf-style format string.
+ * Pass the returned handle to C<timeline_end>.
+ */
+size_t
+timeline_begin (const char *fs, ...)
+{
+  va_list args;
+  char *name;
+  size_t ret;
+
+  va_start (args, fs);
+  name = format_name (fs, args);
+  va_end (args);
+
+  pthread_mutex_lock (&timeline_lock);
+  ret = add_phase (name, timeline_now (), -1);
+  pthread_mutex_unlock (&timeline_lock);
+  return ret;
+}
+
+void
+timeline_end (size_t handle)
+{
+  pthread_mutex_lock (&timeline_lock);
+  if (handle < nr_phases && phases[handle].duration < 0) {
+    phases[handle].duration = timeline_now () - phases[handle].start;
+    if (enabled)
+      print_phase (stderr, &phases[handle]);
+  }
+  pthread_mutex_unlock (&timeline_lock);
+}
+
+/**
+ * Record a milestone, such as the GUI becoming ready.  This is a
+ * phase with zero duration.
+ */
+void
+timeline_mark (const char *fs, ...)
+{
+  va_list args;
+  char *name;
+  size_t i;
+
+  va_start (args, fs);
+  name = format_name (fs, args);
+  va_end (args);
+
+  pthread_mutex_lock (&timeline_lock);
+  i = add_phase (name, timeline_now (), 0);
+  phases[i].instant = true;
+  if (enabled)
+    print_phase (stderr, &phases[i]);
+  pthread_mutex_unlock (&timeline_lock);
+}
+
+/**
+ * Record a phase which has already finished, where C<start> and
+ * C<end> come from C<timeline_now>.  This is for phases which are not
+ * bracketed by code in virt-p2v, such as the transfer of a disk.
+ */
+void
+timeline_add (double start, double end, const char *fs, ...)
+{
+  va_list args;
+  char *name;
+  size_t i;
+
+  va_start (args, fs);
+  name = format_name (fs, args);
+  va_end (args);
+
+  pthread_mutex_lock (&timeline_lock);
+  i = add_phase (name, start, end - start);
+  if (enabled)
+    print_phase (stderr, &phases[i]);
+  pthread_mutex_unlock (&timeline_lock);
+}
+
+/**
+ * Write all the phases recorded so far to C<filename>, as
+ * tab-separated C<phase start duration> lines.  Phases which have
+ * not ended have a duration of C<-1>.
+ *
+ * Returns C<0> on success or C<-1> on error.
+ */
+int
+write_timeline (const char *filename)
+{
+  FILE *fp;
+  size_t i;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    perror (filename);
+    return -1;
+  }
+
+  pthread_mutex_lock (&timeline_lock);
+  for (i = 0; i < nr_phases; ++i)
+    fprintf (fp, "%s\t%.6f\t%.6f\n",
+             phases[i].name, phases[i].start, phases[i].duration);
+  pthread_mutex_unlock (&timeline_lock);
+
+  if (fclose (fp) == EOF) {
+    perror (filename);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write all the phases recorded so far to C<filename> in the Chrome
+ * trace event format.  Timestamps are in microseconds since boot.
+ * Phases which have not ended are written as begin events with no
+ * end, which trace viewers show as running until the end of the
+ * trace.
+ *
+ * Returns C<0> on success or C<-1> on error.
+ */
+int
+write_timeline_trace (const char *filename)
+{
+  FILE *fp;
+  size_t i;
+  const int pid = getpid ();
+
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    perror (filename);
+    return -1;
+  }
+
+  fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf (fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"args\":{\"name\":", pid);
+  print_json_string (fp, g_get_prgname ());
+  fprintf (fp, "}}");
+
+  pthread_mutex_lock (&timeline_lock);
+  for (i = 0; i < nr_phases; ++i) {
+    const struct phase *phase = &phases[i];
+
+    fprintf (fp, ",\n{\"name\":");
+    print_json_string (fp, phase->name);
+    fprintf (fp, ",\"cat\":\"p2v\",\"pid\":%d,\"tid\":%d,\"ts\":%.0f",
+             pid, (int) phase->tid, phase->start * 1e6);
+    if (phase->instant)
+      fprintf (fp, ",\"ph\":\"i\",\"s\":\"p\"}");
+    else if (phase->duration < 0)
+      fprintf (fp, ",\"ph\":\"B\"}");
+    else
+      fprintf (fp, ",\"ph\":\"X\",\"dur\":%.0f}", phase->duration * 1e6);
+  }
+  pthread_mutex_unlock (&timeline_lock);
+
+  fprintf (fp, "\n]}\n");
+
+  if (fclose (fp) == EOF) {
+    perror (filename);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,154 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Listen for hotplug events ("uevents") on a netlink socket.
+ *
+ * This lets the GUI start without waiting for L<udevadm(8)> to
+ * settle: disks and network interfaces which the kernel finds (or
+ * loses, or renames) after virt-p2v has started are added to or
+ * removed from the conversion dialog as they are reported.
+ *
+ * We subscribe to the kernel's own multicast group, not the one that
+ * udev rebroadcasts on.  The kernel messages are simple text, and
+ * since we only read attributes from sysfs we do not need to wait for
+ * udev to process the event.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "p2v.h"
+
+/* Kernel uevent multicast group.  (udev uses group 2.) */
+#define UEVENT_KERNEL_GROUP 1
+
+/**
+ * Open a non-blocking netlink socket which receives uevents.
+ *
+ * Returns the file descriptor, or C<-1> if this is not possible (for
+ * example if running in a container).  This is not a fatal error:
+ * the caller just won't get hotplug events.
+ */
+int
+open_uevent_socket (void)
+{
+  int fd;
+  struct sockaddr_nl addr;
+
+  fd = socket (AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,
+               NETLINK_KOBJECT_UEVENT);
+  if (fd == -1) {
+    perror ("socket: NETLINK_KOBJECT_UEVENT");
+    return -1;
+  }
+
+  memset (&addr, 0, sizeof addr);
+  addr.nl_family = AF_NETLINK;
+  addr.nl_pid = 0;              /* let the kernel choose */
+  addr.nl_groups = UEVENT_KERNEL_GROUP;
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror ("bind: NETLINK_KOBJECT_UEVENT");
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+copy_value (char *dest, size_t len, const char *value)
+{
+  snprintf (dest, len, "%s", value);
+}
+
+/**
+ * Read the next uevent from the socket into C<ev>.
+ *
+ * Returns C<1> if an event was read, C<0> if there are no more
+ * events waiting, or C<-1> on error.
+ */
+int
+read_uevent (int fd, struct uevent *ev)
+{
+  char buf[8192];
+  struct sockaddr_nl addr;
+  struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf - 1 };
+  struct msghdr msg = {
+    .msg_name = &addr, .msg_namelen = sizeof addr,
+    .msg_iov = &iov, .msg_iovlen = 1,
+  };
+  ssize_t r;
+  const char *p;
+
+ again:
+  r = recvmsg (fd, &msg, 0);
+  if (r == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    if (errno == EINTR || errno == ENOBUFS)
+      goto again;
+    return -1;
+  }
+
+  /* Only trust messages sent by the kernel. */
+  if (addr.nl_pid != 0)
+    goto again;
+
+  buf[r] = '\0';
+  memset (ev, 0, sizeof *ev);
+
+  /* The message is "ACTION@DEVPATH\0KEY=VALUE\0KEY=VALUE\0...". */
+  for (p = buf; p < buf + r; p += strlen (p) + 1) {
+    if (STRPREFIX (p, "ACTION="))
+      copy_value (ev->action, sizeof ev->action, p + 7);
+    else if (STRPREFIX (p, "SUBSYSTEM="))
+      copy_value (ev->subsystem, sizeof ev->subsystem, p + 10);
+    else if (STRPREFIX (p, "DEVTYPE="))
+      copy_value (ev->devtype, sizeof ev->devtype, p + 8);
+    else if (STRPREFIX (p, "DEVNAME="))
+      copy_value (ev->name, sizeof ev->name, p + 8);
+    else if (STRPREFIX (p, "INTERFACE="))
+      copy_value (ev->name, sizeof ev->name, p + 10);
+    else if (STRPREFIX (p, "DEVPATH_OLD=")) {
+      /* For renamed devices we only want the old name. */
+      const char *q = strrchr (p, '/');
+      copy_value (ev->old_name, sizeof ev->old_name, q ? q + 1 : p + 12);
+    }
+  }
+
+  if (ev->action[0] == '\0' || ev->subsystem[0] == '\0')
+    goto again;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: uevent: %s %s %s %s%s%s\n",
+           g_get_prgname (), ev->action, ev->subsystem, ev->devtype,
+           ev->name,
+           ev->old_name[0] ? " was " : "", ev->old_name);
+#endif
+
+  return 1;
+}
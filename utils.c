@@ -23,10 +23,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <error.h>
 #include <locale.h>
 #include <libintl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
 
 #include "ignore-value.h"
 
@@ -162,76 +167,290 @@ get_if_addr (const char *if_name)
   return content;
 }
 
+#define PCI_IDS_FILE "/usr/share/hwdata/pci.ids"
+
 /**
- * Return contents of F</sys/class/net/I<if_name>/device/vendor> (if
- * found), mapped to the PCI vendor.  See:
- * L<http://pjwelsh.blogspot.co.uk/2011/11/howto-get-network-card-vendor-device-or.html>
+ * An entry in the index of F<pci.ids>.  C<key> comes from
+ * C<pci_id_key>.  The name points into the mapped file and is not
+ * C<\0>-terminated.
+ */
+struct pci_id {
+  uint64_t key;
+  uint32_t len;
+  const char *name;
+};
+
+static pthread_once_t pci_ids_once = PTHREAD_ONCE_INIT;
+static const char *pci_ids_file = PCI_IDS_FILE;
+static struct pci_id *pci_ids;
+static size_t nr_pci_ids;
+
+/* The key is S<C<vendor E<lt>E<lt> 17>> for vendors, and
+ * S<C<vendor E<lt>E<lt> 17 | 1 E<lt>E<lt> 16 | device>> for devices,
+ * so that sorting by key puts each vendor before its devices.  It
+ * needs 33 bits.
+ */
+static uint64_t
+pci_id_key (unsigned vendor, bool is_device, unsigned device)
+{
+  return (uint64_t) vendor << 17 | (uint64_t) is_device << 16 | device;
+}
+
+/**
+ * Use C<filename> instead of F</usr/share/hwdata/pci.ids>.  This is
+ * for testing, and must be called before any name is looked up.
+ */
+void
+set_pci_ids_file (const char *filename)
+{
+  pci_ids_file = filename;
+}
+
+static int
+compare_pci_ids (const void *vp1, const void *vp2)
+{
+  const struct pci_id *id1 = vp1;
+  const struct pci_id *id2 = vp2;
+
+  return id1->key < id2->key ? -1 : id1->key > id2->key ? 1 : 0;
+}
+
+/* Parse exactly 4 hex digits followed by whitespace. */
+static int
+parse_pci_id (const char *p, const char *end, unsigned *ret)
+{
+  size_t i;
+
+  if (end - p < 5)
+    return -1;
+  for (i = 0; i < 4; ++i)
+    if (!isxdigit ((unsigned char) p[i]))
+      return -1;
+  if (p[4] != ' ' && p[4] != '\t')
+    return -1;
+  *ret = strtoul (p, NULL, 16);
+  return 0;
+}
+
+/**
+ * Map F<pci.ids> into memory and build a sorted index of the vendor
+ * and device lines.  This is called once, the first time a vendor or
+ * device name is looked up.  The file is never unmapped.
+ */
+static void
+load_pci_ids (void)
+{
+  int fd;
+  struct stat statbuf;
+  const char *data, *p, *end;
+  size_t alloc = 0;
+  unsigned vendor = 0;
+  bool in_vendor = false;
+
+  fd = open (pci_ids_file, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    perror (pci_ids_file);
+    return;
+  }
+  if (fstat (fd, &statbuf) == -1 || statbuf.st_size == 0) {
+    perror (pci_ids_file);
+    close (fd);
+    return;
+  }
+  data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED) {
+    fprintf (stderr, "mmap: %s: %m\n", pci_ids_file);
+    return;
+  }
+
+  end = data + statbuf.st_size;
+  for (p = data; p < end; ) {
+    const char *eol = memchr (p, '\n', end - p);
+    const char *q;
+    unsigned id;
+    uint64_t key;
+
+    if (eol == NULL)
+      eol = end;
+
+    /* Vendor lines are "vvvv  name", devices are "\tdddd  name".
+     * Subsystem lines ("\t\t...") and the device class list at the
+     * end of the file ("C cc  name") are ignored.
+     */
+    q = p;
+    if (*q == '\t') {
+      q++;
+      if (!in_vendor || parse_pci_id (q, eol, &id) == -1)
+        goto next;
+      key = pci_id_key (vendor, true, id);
+    }
+    else if (parse_pci_id (q, eol, &id) == 0) {
+      vendor = id;
+      in_vendor = true;
+      key = pci_id_key (vendor, false, 0);
+    }
+    else {
+      if (*p != '#' && p != eol)
+        in_vendor = false;
+      goto next;
+    }
+
+    q += 4;
+    while (q < eol && isspace ((unsigned char) *q))
+      q++;
+
+    if (nr_pci_ids >= alloc) {
+      alloc = alloc ? alloc * 2 : 4096;
+      pci_ids = realloc (pci_ids, alloc * sizeof (struct pci_id));
+      if (pci_ids == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+    }
+    pci_ids[nr_pci_ids].key = key;
+    pci_ids[nr_pci_ids].name = q;
+    pci_ids[nr_pci_ids].len = eol - q;
+    nr_pci_ids++;
+
+  next:
+    p = eol + 1;
+  }
+
+  /* The file is sorted already, but don't rely on it. */
+  qsort (pci_ids, nr_pci_ids, sizeof (struct pci_id), compare_pci_ids);
+}
+
+static char *
+lookup_pci_id (uint64_t key, int truncate)
+{
+  const struct pci_id k = { .key = key };
+  const struct pci_id *id;
+  size_t len;
+  char *ret;
+
+  pthread_once (&pci_ids_once, load_pci_ids);
+  if (nr_pci_ids == 0)
+    return NULL;
+
+  id = bsearch (&k, pci_ids, nr_pci_ids, sizeof (struct pci_id),
+                compare_pci_ids);
+  if (id == NULL)
+    return NULL;
+
+  len = id->len;
+  if (truncate > 0 && len > (size_t) truncate)
+    len = truncate;
+
+  ret = strndup (id->name, len);
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "strndup");
+  return ret;
+}
+
+/**
+ * Return the name of PCI vendor C<vendor> from F<pci.ids>, or C<NULL>
+ * if it is not found.  If C<truncate> E<gt> 0 the name is cut to that
+ * many bytes.  The caller must free the returned string.
  */
 char *
-get_if_vendor (const char *if_name, int truncate)
+get_pci_vendor (unsigned vendor, int truncate)
+{
+  return lookup_pci_id (pci_id_key (vendor, false, 0), truncate);
+}
+
+/**
+ * Return the name of device C<device> of PCI vendor C<vendor> from
+ * F<pci.ids>, or C<NULL>.  See C<get_pci_vendor>.
+ */
+char *
+get_pci_device (unsigned vendor, unsigned device, int truncate)
+{
+  return lookup_pci_id (pci_id_key (vendor, true, device), truncate);
+}
+
+/**
+ * Read a 16 bit PCI ID such as C<"0x8086"> from
+ * F</sys/class/net/I<if_name>/device/I<attr>>.
+ */
+static int
+get_if_pci_id (const char *if_name, const char *attr, unsigned *ret)
 {
   CLEANUP_FCLOSE FILE *fp = NULL;
   CLEANUP_FREE char *path = NULL;
-  char *line = NULL;
+  CLEANUP_FREE char *line = NULL;
   size_t len = 0;
   ssize_t n;
-  char vendor[5];
 
-  if (asprintf (&path, "/sys/class/net/%s/device/vendor", if_name) == -1)
+  if (asprintf (&path, "/sys/class/net/%s/device/%s", if_name, attr) == -1)
     error (EXIT_FAILURE, errno, "asprintf");
   fp = fopen (path, "r");
   if (fp == NULL) {
     perror (path);
-    return NULL;
+    return -1;
   }
   if ((n = getline (&line, &len, fp)) == -1) {
     perror (path);
-    free (line);
-    return NULL;
+    return -1;
   }
 
-  /* Vendor is (always?) a 16 bit quantity (as defined by PCI),
-   * something like "0x8086" (for Intel Corp).
-   */
+  /* IDs are (always?) 16 bit quantities (as defined by PCI). */
   CHOMP (line, n);
-  if (line[0] != '0' || line[1] != 'x' || strlen (&line[2]) != 4) {
-    free (line);
-    return NULL;
-  }
+  if (line[0] != '0' || line[1] != 'x' || strlen (&line[2]) != 4 ||
+      strspn (&line[2], "0123456789abcdefABCDEF") != 4)
+    return -1;
+  *ret = strtoul (&line[2], NULL, 16);
 
-  strcpy (vendor, &line[2]);
+  return 0;
+}
 
-  fclose (fp);
-  fp = fopen ("/usr/share/hwdata/pci.ids", "r");
-  if (fp == NULL) {
-    perror ("/usr/share/hwdata/pci.ids");
-    free (line);
+/**
+ * Return contents of F</sys/class/net/I<if_name>/device/vendor> (if
+ * found), mapped to the PCI vendor.  See:
+ * L<http://pjwelsh.blogspot.co.uk/2011/11/howto-get-network-card-vendor-device-or.html>
+ */
+char *
+get_if_vendor (const char *if_name, int truncate)
+{
+  unsigned vendor;
+
+  if (get_if_pci_id (if_name, "vendor", &vendor) == -1)
     return NULL;
-  }
-  while ((n = getline (&line, &len, fp)) != -1) {
-    CHOMP (line, n);
-    if (STRPREFIX (line, vendor)) {
-      /* Find the start of the name after the vendor ID and whitespace. */
-      size_t i = 4;
-      n -= 4;
 
-      while (n > 0 && isspace (line[i])) {
-        i++;
-        n--;
-      }
+  return get_pci_vendor (vendor, truncate);
+}
 
-      memmove (&line[0], &line[i], n+1 /* copy trailing \0 */);
+/**
+ * Return the PCI device name of the network interface, from the
+ * F<vendor> and F<device> files in F</sys/class/net/I<if_name>/device>
+ * (if found).
+ */
+char *
+get_if_device (const char *if_name, int truncate)
+{
+  unsigned vendor, device;
 
-      /* Truncate? */
-      if (truncate > 0 && n > truncate)
-        line[n] = '\0';
+  if (get_if_pci_id (if_name, "vendor", &vendor) == -1 ||
+      get_if_pci_id (if_name, "device", &device) == -1)
+    return NULL;
 
-      return line;
-    }
-  }
+  return get_pci_device (vendor, device, truncate);
+}
 
-  free (line);
-  return NULL;
+/**
+ * Return true if C<if_name> looks like a physical network interface
+ * which the user might want to map to a network on the target.
+ *
+ * For systemd predictable names, see:
+ * http://cgit.freedesktop.org/systemd/systemd/tree/src/udev/udev-builtin-net_id.c#n20
+ * biosdevname is also a possibility here.
+ * Ignore PPP, SLIP, WWAN, bridges, etc.
+ */
+bool
+is_network_interface (const char *if_name)
+{
+  return STRPREFIX (if_name, "em") ||
+    STRPREFIX (if_name, "en") ||
+    STRPREFIX (if_name, "eth") ||
+    STRPREFIX (if_name, "wl");
 }
 
 /* XXX We could make this configurable. */
@@ -261,3 +480,22 @@ compare_strings (const void *vp1, const void *vp2)
   char * const *p2 = (char * const *) vp2;
   return strcmp (*p1, *p2);
 }
+
+/**
+ * Print C<str> to C<fp> as a JSON string, with quotes.  Control
+ * characters are escaped, so the output is always a single line.
+ */
+void
+print_json_string (FILE *fp, const char *str)
+{
+  fputc ('"', fp);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      fprintf (fp, "\\%c", *str);
+    else if ((unsigned char) *str < 0x20 || *str == 0x7f)
+      fprintf (fp, "\\u%04x", (unsigned char) *str);
+    else
+      fputc (*str, fp);
+  }
+  fputc ('"', fp);
+}